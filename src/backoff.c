@@ -0,0 +1,61 @@
+#include <time.h>
+
+#include "backoff.h"
+
+
+static inline uint64_t
+timeval_to_us(const struct timeval *const tv) {
+  return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+
+// xorshift64*, which is plenty for jitter and keeps the state per backoff rather than global.
+static uint64_t
+next_random(struct backoff *const backoff) {
+  uint64_t x = backoff->rng_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  backoff->rng_state = x;
+  return x * UINT64_C(2685821657736338717);
+}
+
+
+void
+backoff_init(struct backoff *const backoff, const struct timeval *const initial, const struct timeval *const max) {
+  backoff->initial = *initial;
+  backoff->max = *max;
+  backoff->current = *initial;
+  backoff->rng_state = ((uint64_t)time(NULL) << 32) ^ (uint64_t)(uintptr_t)backoff ^ UINT64_C(0x9e3779b97f4a7c15);
+  if (backoff->rng_state == 0) {
+    backoff->rng_state = 1;
+  }
+}
+
+
+void
+backoff_reset(struct backoff *const backoff) {
+  backoff->current = backoff->initial;
+}
+
+
+/**
+ * Returns the delay before the next attempt, chosen uniformly from the upper half of the current
+ * delay so that clients which failed together don't retry together. The current delay doubles
+ * after each attempt, up to the maximum.
+ **/
+void
+backoff_next(struct backoff *const backoff, struct timeval *const delay) {
+  const uint64_t current_us = timeval_to_us(&backoff->current);
+  const uint64_t half_us = current_us / 2;
+  const uint64_t delay_us = half_us + ((half_us == 0) ? 0 : next_random(backoff) % (half_us + 1));
+  delay->tv_sec = (time_t)(delay_us / 1000000);
+  delay->tv_usec = (suseconds_t)(delay_us % 1000000);
+
+  uint64_t next_us = 2 * current_us;
+  if (next_us > timeval_to_us(&backoff->max)) {
+    next_us = timeval_to_us(&backoff->max);
+  }
+  backoff->current.tv_sec = (time_t)(next_us / 1000000);
+  backoff->current.tv_usec = (suseconds_t)(next_us % 1000000);
+}
@@ -0,0 +1,20 @@
+/**
+ * Exponential backoff with jitter, for spacing out reconnection attempts.
+ **/
+#pragma once
+
+#include <stdint.h>
+#include <sys/time.h>
+
+
+struct backoff {
+  struct timeval initial;
+  struct timeval max;
+  struct timeval current;
+  uint64_t rng_state;
+};
+
+
+void backoff_init(struct backoff *backoff, const struct timeval *initial, const struct timeval *max);
+void backoff_reset(struct backoff *backoff);
+void backoff_next(struct backoff *backoff, struct timeval *delay);
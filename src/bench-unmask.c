@@ -0,0 +1,89 @@
+/**
+ * Measures unmasking frame payloads into an evbuffer, comparing the old approach of XORing 4 bytes
+ * at a time and adding each quad with `evbuffer_add` against `unmask` writing straight into
+ * reserved space.
+ **/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+
+#include "unmask.h"
+
+// Roughly how many payload bytes are unmasked for each payload size and approach.
+#define TARGET_NBYTES (256 * 1024 * 1024)
+
+static const size_t PAYLOAD_NBYTES[] = {16, 1024, 64 * 1024, 16 * 1024 * 1024};
+static const uint8_t MASKING_KEY[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+unmask_quads(struct evbuffer *const out, const uint8_t *const src, const size_t nbytes) {
+  uint32_t key, quad;
+  memcpy(&key, MASKING_KEY, 4);
+  for (size_t i = 0; i < nbytes; i += 4) {
+    const size_t slice = (nbytes - i >= 4) ? 4 : nbytes - i;
+    memcpy(&quad, src + i, slice);
+    quad ^= key;
+    evbuffer_add(out, &quad, slice);
+  }
+}
+
+
+static void
+unmask_reserved(struct evbuffer *const out, const uint8_t *const src, const size_t nbytes) {
+  struct evbuffer_iovec space;
+  if (evbuffer_reserve_space(out, nbytes, &space, 1) != 1) {
+    abort();
+  }
+  unmask(space.iov_base, src, nbytes, MASKING_KEY, 0);
+  space.iov_len = nbytes;
+  evbuffer_commit_space(out, &space, 1);
+}
+
+
+int
+main(void) {
+  typedef void (*approach_t)(struct evbuffer *out, const uint8_t *src, size_t nbytes);
+  static const approach_t APPROACHES[] = {&unmask_quads, &unmask_reserved};
+  static const char *const NAMES[] = {"evbuffer_add quads", "reserved space"};
+
+  printf("unmask kernel: %s\n", unmask_kernel_name());
+  for (size_t i = 0; i != sizeof(PAYLOAD_NBYTES) / sizeof(PAYLOAD_NBYTES[0]); ++i) {
+    const size_t nbytes = PAYLOAD_NBYTES[i];
+    const size_t niterations = (TARGET_NBYTES / nbytes < 4) ? 4 : TARGET_NBYTES / nbytes;
+    uint8_t *const src = malloc(nbytes);
+    struct evbuffer *const out = evbuffer_new();
+    if (src == NULL || out == NULL) {
+      return 1;
+    }
+    for (size_t j = 0; j != nbytes; ++j) {
+      src[j] = (uint8_t)j;
+    }
+
+    for (size_t k = 0; k != sizeof(APPROACHES) / sizeof(APPROACHES[0]); ++k) {
+      const double start = now();
+      for (size_t j = 0; j != niterations; ++j) {
+        APPROACHES[k](out, src, nbytes);
+        evbuffer_drain(out, nbytes);
+      }
+      const double elapsed = now() - start;
+      printf("%9zu bytes  %-18s  %10.1f ns/frame  %8.2f GB/s\n", nbytes, NAMES[k], elapsed * 1e9 / niterations, (double)nbytes * niterations / elapsed / 1e9);
+    }
+
+    evbuffer_free(out);
+    free(src);
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * The interface between a worker's pubsub_manager and whatever carries messages between publishers
+ * and subscribers. Each worker has its own broker, which the manager attaches itself to when it is
+ * created. The manager only tells the broker when a channel gains its first local subscriber or
+ * loses its last one, and the broker hands messages back with `pubsub_manager_deliver`, or with
+ * `pubsub_manager_deliver_now` from the manager's own thread.
+ *
+ * An implementation embeds `struct broker` as its first member. Channel and pattern names are always
+ * NUL terminated, even where their length is also given. Published messages carry the ID of the
+ * websocket that published them, or 0, which brokers pass on in `pubsub_payload.publisher` where
+ * they can.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "status.h"
+#include "streams.h"
+
+// Forward declarations.
+struct broker;
+struct pubsub_manager;
+
+// Called with the entries read by `read_range`, which are only valid during the call.
+typedef void (*broker_range_t)(const struct stream_entry *entries, size_t nentries, enum status status, void *arg);
+
+
+struct broker_ops {
+  enum status (*attach)(struct broker *broker, struct pubsub_manager *mgr);
+  enum status (*destroy)(struct broker *broker);
+  enum status (*publish)(struct broker *broker, const char *channel, size_t channel_nbytes, const char *message, size_t message_nbytes, uint64_t publisher);
+  enum status (*subscribe)(struct broker *broker, const char *name, bool is_pattern);
+  enum status (*unsubscribe)(struct broker *broker, const char *name, bool is_pattern);
+
+  // Reads up to `max_nentries` of a channel's messages after `after`. `fn` is called exactly once
+  // unless an error is returned. NULL unless the broker's messages have stream IDs.
+  enum status (*read_range)(struct broker *broker, const char *channel, size_t channel_nbytes, const struct stream_id *after, size_t max_nentries, broker_range_t fn, void *arg);
+};
+
+
+struct broker {
+  const struct broker_ops *ops;
+  bool has_patterns;  // Whether pattern subscriptions are supported.
+};
+
+
+static inline enum status
+broker_destroy(struct broker *const broker) {
+  return (broker == NULL) ? STATUS_EINVAL : broker->ops->destroy(broker);
+}
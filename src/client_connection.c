@@ -19,7 +19,12 @@
 #include "websocket.h"
 
 
-static struct client_connection *clients = NULL;
+// The HTTP `Upgrade` request is ended by an empty line, and can be no larger than this.
+static const char HTTP_REQUEST_END[] = "\r\n\r\n";
+static const size_t MAX_HTTP_REQUEST_NBYTES = 4096;
+
+// Each worker thread keeps its own list of connected clients.
+static _Thread_local struct client_connection *clients = NULL;
 
 
 // ================================================================================================
@@ -51,13 +56,13 @@ client_connection_onevent(struct bufferevent *const bev, const short events, voi
 
 
 static void
-on_read_initial(struct client_connection *const client, const uint8_t *const buf, const size_t nbytes) {
+on_read_initial(struct client_connection *const client, const char *const buf, const size_t nbytes) {
   struct lexer lex;
   enum status status;
   struct http_header *header;
 
   // Initialise our required data structures.
-  if (!lexer_init(&lex, (const char *)&buf[0], (const char *)&buf[0] + nbytes)) {
+  if (!lexer_init(&lex, buf, buf + nbytes)) {
     ERROR0("failed to construct lexer instance (`lexer_init` failed)\n");
     return;
   }
@@ -101,8 +106,8 @@ on_read_initial(struct client_connection *const client, const uint8_t *const buf
 
 
 static void
-on_read_websocket(struct client_connection *const client, const uint8_t *const buf, const size_t nbytes) {
-  enum status status = websocket_consume(client->ws, buf, nbytes);
+on_read_websocket(struct client_connection *const client, struct evbuffer *const in) {
+  enum status status = websocket_consume(client->ws, in);
   if (status != STATUS_OK) {
     WARNING("websocket_consume failed. status=%d\n", status);
   }
@@ -114,30 +119,33 @@ on_read_websocket(struct client_connection *const client, const uint8_t *const b
 
 static void
 on_read(struct bufferevent *const bev, void *const arg) {
-  (void)bev;
-  static uint8_t buf[4096];
   struct client_connection *const client = (struct client_connection *)arg;
-
-  // Read the data.
-  const size_t nbytes = bufferevent_read(bev, buf, sizeof(buf));
-  if (nbytes == 0) {
-    return;
-  }
+  struct evbuffer *const in = bufferevent_get_input(bev);
 
   // If the client hasn't tried to establish a websocket connection yet, this must be the inital
   // HTTP `Upgrade` request.
   if (client->ws->in_state == WS_NEEDS_HTTP_UPGRADE) {
-    on_read_initial(client, buf, nbytes);
+    // Wait until the whole request has arrived, which is ended by an empty line.
+    const struct evbuffer_ptr end = evbuffer_search(in, HTTP_REQUEST_END, sizeof(HTTP_REQUEST_END) - 1, NULL);
+    if (end.pos == -1 && evbuffer_get_length(in) < MAX_HTTP_REQUEST_NBYTES) {
+      return;
+    }
+    else if (end.pos != -1 && end.pos + sizeof(HTTP_REQUEST_END) - 1 <= MAX_HTTP_REQUEST_NBYTES) {
+      const size_t nbytes = end.pos + sizeof(HTTP_REQUEST_END) - 1;
+      on_read_initial(client, (const char *)evbuffer_pullup(in, nbytes), nbytes);
+      evbuffer_drain(in, nbytes);
+    }
     // If we failed to process the HTTP request as a websocket establishing connection, drop the client.
     if (client->ws->in_state == WS_NEEDS_HTTP_UPGRADE) {
       WARNING("Failed to upgrade to websocket. Aborting connection on client=%p fd=%d\n", (void *)client, client->fd);
       client->needs_shutdown = true;
       client_connection_destroy(client);
+      return;
     }
   }
-  else {
-    on_read_websocket(client, buf, nbytes);
-  }
+
+  // Frames which arrived along with the upgrade request are consumed straight away.
+  on_read_websocket(client, in);
 }
 
 
@@ -152,7 +160,7 @@ on_write(struct bufferevent *const bev, void *const arg) {
 
 
 struct client_connection *
-client_connection_create(struct event_base *const event_loop, SSL_CTX *const ssl_ctx, const int fd, struct pubsub_manager *const pubsub_mgr, websocket_message_callback in_message_cb) {
+client_connection_create(struct event_base *const event_loop, struct websocket_flusher *const flusher, SSL_CTX *const ssl_ctx, const int fd, struct pubsub_manager *const pubsub_mgr, websocket_message_callback in_message_cb) {
   // Construct the client connection object.
   struct client_connection *const client = malloc(sizeof(struct client_connection));
   if (client == NULL) {
@@ -167,6 +175,7 @@ client_connection_create(struct event_base *const event_loop, SSL_CTX *const ssl
   client->response = http_response_init();
   client->ws = websocket_init(client, in_message_cb);
   client->event_loop = event_loop;
+  client->flusher = flusher;
   if (ssl_ctx == NULL) {
     client->bev = bufferevent_socket_new(event_loop, fd, BEV_OPT_CLOSE_ON_FREE);
   }
@@ -30,6 +30,7 @@ struct client_connection {
 
   // State from the server.
   struct event_base *event_loop;
+  struct websocket_flusher *flusher;
   SSL *ssl;
 
   // The libevent bufferevent for the socket.
@@ -43,7 +44,7 @@ struct client_connection {
 };
 
 
-struct client_connection *client_connection_create(struct event_base *event_loop, SSL_CTX *ssl_ctx, int fd, struct pubsub_manager *pubsub_mgr, websocket_message_callback in_message_cb);
+struct client_connection *client_connection_create(struct event_base *event_loop, struct websocket_flusher *flusher, SSL_CTX *ssl_ctx, int fd, struct pubsub_manager *pubsub_mgr, websocket_message_callback in_message_cb);
 void                      client_connection_destroy(struct client_connection *client);
 void                      client_connection_destroy_all(void);
 enum status               client_connection_shutdown(struct client_connection *client);
@@ -0,0 +1,200 @@
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "cluster_slots.h"
+#include "shard_ring.h"
+
+#define HASHTAG_OPEN '{'
+#define HASHTAG_CLOSE '}'
+
+
+// CRC16-CCITT (XMODEM), as used by redis to hash keys to slots.
+static const uint16_t CRC16_TABLE[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+
+/**
+ * Returns the hash slot of a key or channel. Only the part between the first '{' and the next '}'
+ * is hashed if it isn't empty, so that related channels can be kept on the same node.
+ **/
+uint16_t
+cluster_key_slot(const char *const key, const size_t key_nbytes) {
+  const char *start = key, *end = key + key_nbytes;
+
+  const char *const open = memchr(key, HASHTAG_OPEN, key_nbytes);
+  if (open != NULL) {
+    const char *const close = memchr(open + 1, HASHTAG_CLOSE, (size_t)(end - open - 1));
+    if (close != NULL && close != open + 1) {
+      start = open + 1;
+      end = close;
+    }
+  }
+
+  uint16_t crc = 0;
+  for (const char *c = start; c != end; ++c) {
+    crc = (uint16_t)(crc << 8) ^ CRC16_TABLE[((crc >> 8) ^ (uint8_t)*c) & 0xff];
+  }
+  return crc & (CLUSTER_NSLOTS - 1);
+}
+
+
+/**
+ * Parses a `MOVED <slot> <host>:<port>` or `ASK <slot> <host>:<port>` error. `host` must have
+ * room for SHARD_RING_NAME_MAX_NBYTES bytes.
+ **/
+enum status
+cluster_parse_redirect(const char *const error, const size_t error_nbytes, uint16_t *const slot, char *const host, uint16_t *const port) {
+  char endpoint[SHARD_RING_NAME_MAX_NBYTES];
+  const char *upto;
+
+  if (error_nbytes > 6 && memcmp(error, "MOVED ", 6) == 0) {
+    upto = error + 6;
+  }
+  else if (error_nbytes > 4 && memcmp(error, "ASK ", 4) == 0) {
+    upto = error + 4;
+  }
+  else {
+    return STATUS_EINVAL;
+  }
+
+  const char *const end = error + error_nbytes;
+  unsigned long value = 0;
+  const char *const digits = upto;
+  for ( ; upto != end && *upto >= '0' && *upto <= '9' && value < CLUSTER_NSLOTS; ++upto) {
+    value = 10 * value + (unsigned long)(*upto - '0');
+  }
+  if (upto == digits || value >= CLUSTER_NSLOTS || upto == end || *upto != ' ') {
+    return STATUS_EINVAL;
+  }
+  ++upto;
+
+  const size_t endpoint_nbytes = (size_t)(end - upto);
+  if (endpoint_nbytes >= sizeof(endpoint)) {
+    return STATUS_EINVAL;
+  }
+  memcpy(endpoint, upto, endpoint_nbytes);
+  endpoint[endpoint_nbytes] = '\0';
+  if (shard_ring_parse_name(endpoint, host, port) != STATUS_OK) {
+    return STATUS_EINVAL;
+  }
+  *slot = (uint16_t)value;
+  return STATUS_OK;
+}
+
+
+// Returns the value following `name` in a flat array of names and values, or NULL.
+static const redisReply *
+field_of(const redisReply *const reply, const char *const name) {
+  const size_t name_nbytes = strlen(name);
+  if (reply->type != REDIS_REPLY_ARRAY) {
+    return NULL;
+  }
+  for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+    const redisReply *const field = reply->element[i];
+    if (field->type == REDIS_REPLY_STRING && field->len == name_nbytes && memcmp(field->str, name, name_nbytes) == 0) {
+      return reply->element[i + 1];
+    }
+  }
+  return NULL;
+}
+
+
+static bool
+is_string(const redisReply *const reply, const char *const str) {
+  return reply != NULL && reply->type == REDIS_REPLY_STRING && reply->len == strlen(str) && memcmp(reply->str, str, reply->len) == 0;
+}
+
+
+// Finds the online primary of a shard's nodes, and where to connect to it.
+static bool
+find_primary(const redisReply *const nodes, const char **const host, uint16_t *const port) {
+  for (size_t i = 0; i != nodes->elements; ++i) {
+    const redisReply *const node = nodes->element[i];
+    if (!is_string(field_of(node, "role"), "master") || !is_string(field_of(node, "health"), "online")) {
+      continue;
+    }
+
+    // The endpoint is what the cluster advertises to clients, or "?" if it doesn't know.
+    const redisReply *address = field_of(node, "endpoint");
+    if (address == NULL || address->type != REDIS_REPLY_STRING || address->len == 0 || is_string(address, "?")) {
+      address = field_of(node, "ip");
+    }
+    const redisReply *const port_reply = field_of(node, "port");
+    if (address == NULL || address->type != REDIS_REPLY_STRING || port_reply == NULL || port_reply->type != REDIS_REPLY_INTEGER || port_reply->integer <= 0 || port_reply->integer > 65535) {
+      continue;
+    }
+    *host = address->str;
+    *port = (uint16_t)port_reply->integer;
+    return true;
+  }
+  return false;
+}
+
+
+/**
+ * Parses a CLUSTER SHARDS reply, calling `fn` with each range of slots and the primary that owns
+ * it. Shards without an online primary are skipped, so their slots keep whichever owner they had.
+ **/
+enum status
+cluster_parse_shards(const struct redisReply *const reply, const cluster_range_t fn, void *const arg) {
+  const char *host;
+  uint16_t port;
+
+  if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+    return STATUS_BAD;
+  }
+
+  for (size_t i = 0; i != reply->elements; ++i) {
+    const redisReply *const shard = reply->element[i];
+    const redisReply *const slots = field_of(shard, "slots");
+    const redisReply *const nodes = field_of(shard, "nodes");
+    if (slots == NULL || slots->type != REDIS_REPLY_ARRAY || slots->elements % 2 != 0 || nodes == NULL || nodes->type != REDIS_REPLY_ARRAY) {
+      return STATUS_BAD;
+    }
+    if (!find_primary(nodes, &host, &port)) {
+      continue;
+    }
+    for (size_t j = 0; j != slots->elements; j += 2) {
+      const redisReply *const start = slots->element[j];
+      const redisReply *const end = slots->element[j + 1];
+      if (start->type != REDIS_REPLY_INTEGER || end->type != REDIS_REPLY_INTEGER || start->integer < 0 || start->integer > end->integer || end->integer >= CLUSTER_NSLOTS) {
+        return STATUS_BAD;
+      }
+      fn((uint16_t)start->integer, (uint16_t)end->integer, host, port, arg);
+    }
+  }
+  return STATUS_OK;
+}
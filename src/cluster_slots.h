@@ -0,0 +1,29 @@
+/**
+ * Helpers for the redis Cluster backend, in which each channel is a shard channel. A shard channel
+ * lives on the primary which owns its hash slot, and is only SSUBSCRIBEd to and SPUBLISHed to
+ * there, so the pubsub traffic scales out with the number of primaries rather than being broadcast
+ * to every node as PUBLISH is.
+ *
+ * Slot ownership is learned from CLUSTER SHARDS, and corrected by the `-MOVED` redirections that a
+ * node replies with when it is sent a command for a slot which it no longer owns.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "status.h"
+
+#define CLUSTER_NSLOTS (16384)
+
+// Forward declaration.
+struct redisReply;
+
+// Called with each range of slots owned by a primary. `host` is only valid during the call.
+typedef void (*cluster_range_t)(uint16_t start, uint16_t end, const char *host, uint16_t port, void *arg);
+
+
+uint16_t    cluster_key_slot(const char *key, size_t key_nbytes);
+enum status cluster_parse_redirect(const char *error, size_t error_nbytes, uint16_t *slot, char *host, uint16_t *port);
+enum status cluster_parse_shards(const struct redisReply *reply, cluster_range_t fn, void *arg);
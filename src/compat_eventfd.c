@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <sys/eventfd.h>
+#endif
+
+#include "compat_eventfd.h"
+#include "logging.h"
+
+
+enum status
+compat_eventfd_open(struct compat_eventfd *const efd) {
+  if (efd == NULL) {
+    return STATUS_EINVAL;
+  }
+
+#ifdef __linux__
+  efd->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd->read_fd == -1) {
+    ERROR("eventfd failed: %s\n", strerror(errno));
+    return STATUS_BAD;
+  }
+  efd->write_fd = efd->read_fd;
+#else
+  int fds[2];
+  if (pipe(fds) == -1) {
+    ERROR("pipe failed: %s\n", strerror(errno));
+    return STATUS_BAD;
+  }
+  for (size_t i = 0; i != 2; ++i) {
+    const int flags = fcntl(fds[i], F_GETFL);
+    if (flags == -1 || fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+      ERROR("fcntl failed: %s\n", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      return STATUS_BAD;
+    }
+  }
+  efd->read_fd = fds[0];
+  efd->write_fd = fds[1];
+#endif  // __linux__
+
+  return STATUS_OK;
+}
+
+
+void
+compat_eventfd_close(struct compat_eventfd *const efd) {
+  if (efd->write_fd != efd->read_fd) {
+    close(efd->write_fd);
+  }
+  close(efd->read_fd);
+  efd->read_fd = -1;
+  efd->write_fd = -1;
+}
+
+
+void
+compat_eventfd_signal(struct compat_eventfd *const efd) {
+  const uint64_t one = 1;
+  // A full pipe or a saturated eventfd already means there is a pending wakeup.
+  if (write(efd->write_fd, &one, efd->write_fd == efd->read_fd ? sizeof(one) : 1) == -1 && errno != EAGAIN) {
+    ERROR("write to wakeup fd=%d failed: %s\n", efd->write_fd, strerror(errno));
+  }
+}
+
+
+void
+compat_eventfd_drain(struct compat_eventfd *const efd) {
+  uint64_t buf[8];
+  while (read(efd->read_fd, buf, sizeof(buf)) > 0) {
+  }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "status.h"
+
+
+// A wakeup file descriptor. An eventfd on Linux and a non-blocking pipe elsewhere.
+struct compat_eventfd {
+  int read_fd;
+  int write_fd;
+};
+
+
+enum status compat_eventfd_open(struct compat_eventfd *efd);
+void        compat_eventfd_close(struct compat_eventfd *efd);
+void        compat_eventfd_signal(struct compat_eventfd *efd);
+void        compat_eventfd_drain(struct compat_eventfd *efd);
@@ -0,0 +1,302 @@
+/**
+ * Values are kept in a power-of-two array of slots using Robin Hood insertion and backward-shift
+ * deletion, so a probe can stop as soon as it reaches a slot that is closer to its home than the
+ * probe is.
+ *
+ * When the table fills up, a table of twice the size becomes `current` and the old one becomes
+ * `previous`. Every subsequent insert and remove moves a few values across from `previous`, so
+ * growing never stalls the caller for a full rehash. Lookups check both tables until the move has
+ * completed. Values are only ever removed from `previous` (by migration or by the caller), never
+ * added to it.
+ **/
+#include <string.h>
+
+#include "hashtable.h"
+#include "logging.h"
+
+#define INITIAL_NSLOTS (16)
+#define MAX_LOAD_NUMERATOR (7)  // Grow when more than 7/8ths full.
+#define MAX_LOAD_DENOMINATOR (8)
+#define MIGRATE_NSTEPS (16)     // How many slots of `previous` to process per insert or remove.
+
+
+struct slot {
+  uint64_t hash;
+  void *value;  // NULL when the slot is empty.
+};
+
+
+struct slots {
+  struct slot *slots;
+  size_t mask;
+  size_t nvalues;
+};
+
+
+struct hashtable {
+  hashtable_matches_t matches;
+  struct slots current;
+  struct slots previous;   // Only non-empty while growing.
+  size_t migrate_upto;     // The next slot of `previous` to move across.
+};
+
+
+static inline size_t
+probe_distance(const struct slots *const slots, const size_t index, const uint64_t hash) {
+  return (index - (size_t)hash) & slots->mask;
+}
+
+
+static enum status
+slots_init(struct slots *const slots, const size_t nslots) {
+  slots->slots = calloc(nslots, sizeof(struct slot));
+  if (slots->slots == NULL) {
+    ERROR0("calloc failed.\n");
+    return STATUS_ENOMEM;
+  }
+  slots->mask = nslots - 1;
+  slots->nvalues = 0;
+  return STATUS_OK;
+}
+
+
+static void
+slots_insert(struct slots *const slots, uint64_t hash, void *value) {
+  size_t distance = 0;
+  for (size_t i = (size_t)hash & slots->mask; ; i = (i + 1) & slots->mask, ++distance) {
+    struct slot *const slot = &slots->slots[i];
+    if (slot->value == NULL) {
+      slot->hash = hash;
+      slot->value = value;
+      ++slots->nvalues;
+      return;
+    }
+
+    // Take the slot from values which are closer to their home than we are, and keep going with
+    // the displaced value instead.
+    const size_t slot_distance = probe_distance(slots, i, slot->hash);
+    if (slot_distance < distance) {
+      const struct slot displaced = *slot;
+      slot->hash = hash;
+      slot->value = value;
+      hash = displaced.hash;
+      value = displaced.value;
+      distance = slot_distance;
+    }
+  }
+}
+
+
+static size_t
+slots_find(const struct slots *const slots, const hashtable_matches_t matches, const uint64_t hash, const void *const key) {
+  if (slots->slots == NULL || slots->nvalues == 0) {
+    return SIZE_MAX;
+  }
+
+  size_t distance = 0;
+  for (size_t i = (size_t)hash & slots->mask; ; i = (i + 1) & slots->mask, ++distance) {
+    const struct slot *const slot = &slots->slots[i];
+    if (slot->value == NULL || probe_distance(slots, i, slot->hash) < distance) {
+      return SIZE_MAX;
+    }
+    else if (slot->hash == hash && matches(slot->value, key)) {
+      return i;
+    }
+  }
+}
+
+
+static void *
+slots_remove_at(struct slots *const slots, size_t index) {
+  void *const value = slots->slots[index].value;
+
+  // Shift the following values back by one until reaching an empty slot or a value in its home.
+  for (size_t next = (index + 1) & slots->mask; ; index = next, next = (next + 1) & slots->mask) {
+    struct slot *const slot = &slots->slots[next];
+    if (slot->value == NULL || probe_distance(slots, next, slot->hash) == 0) {
+      break;
+    }
+    slots->slots[index] = *slot;
+  }
+  slots->slots[index].value = NULL;
+  --slots->nvalues;
+
+  return value;
+}
+
+
+static void
+migrate(struct hashtable *const table, size_t nsteps) {
+  struct slots *const previous = &table->previous;
+
+  if (previous->slots == NULL) {
+    return;
+  }
+
+  // Removing a value shifts the next value back into its slot, so only advance over empty slots.
+  for ( ; nsteps != 0 && previous->nvalues != 0; --nsteps) {
+    const struct slot *const slot = &previous->slots[table->migrate_upto];
+    if (slot->value == NULL) {
+      table->migrate_upto = (table->migrate_upto + 1) & previous->mask;
+      continue;
+    }
+    const uint64_t hash = slot->hash;
+    void *const value = slots_remove_at(previous, table->migrate_upto);
+    slots_insert(&table->current, hash, value);
+  }
+
+  if (previous->nvalues == 0) {
+    free(previous->slots);
+    memset(previous, 0, sizeof(struct slots));
+    table->migrate_upto = 0;
+  }
+}
+
+
+static enum status
+grow(struct hashtable *const table) {
+  struct slots slots;
+
+  // Finish off any previous growth before starting another.
+  migrate(table, SIZE_MAX);
+
+  const enum status status = slots_init(&slots, 2 * (table->current.mask + 1));
+  if (status != STATUS_OK) {
+    return status;
+  }
+  table->previous = table->current;
+  table->current = slots;
+  table->migrate_upto = 0;
+
+  // Start migrating from the beginning of a run, so that values which wrapped around the end of
+  // the array are not shifted back past `migrate_upto`.
+  while (table->previous.slots[table->migrate_upto].value != NULL) {
+    table->migrate_upto = (table->migrate_upto + 1) & table->previous.mask;
+  }
+
+  return STATUS_OK;
+}
+
+
+struct hashtable *
+hashtable_create(const hashtable_matches_t matches) {
+  if (matches == NULL) {
+    return NULL;
+  }
+
+  struct hashtable *const table = malloc(sizeof(struct hashtable));
+  if (table == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(table, 0, sizeof(struct hashtable));
+  table->matches = matches;
+  if (slots_init(&table->current, INITIAL_NSLOTS) != STATUS_OK) {
+    free(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+
+enum status
+hashtable_destroy(struct hashtable *const table) {
+  if (table == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  free(table->current.slots);
+  free(table->previous.slots);
+  free(table);
+
+  return STATUS_OK;
+}
+
+
+size_t
+hashtable_size(const struct hashtable *const table) {
+  return table->current.nvalues + table->previous.nvalues;
+}
+
+
+void *
+hashtable_find(const struct hashtable *const table, const uint64_t hash, const void *const key) {
+  size_t index = slots_find(&table->current, table->matches, hash, key);
+  if (index != SIZE_MAX) {
+    return table->current.slots[index].value;
+  }
+  index = slots_find(&table->previous, table->matches, hash, key);
+  if (index != SIZE_MAX) {
+    return table->previous.slots[index].value;
+  }
+  return NULL;
+}
+
+
+/**
+ * Inserts `value`, which must not already be in the table.
+ **/
+enum status
+hashtable_insert(struct hashtable *const table, const uint64_t hash, void *const value) {
+  if (table == NULL || value == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  migrate(table, MIGRATE_NSTEPS);
+
+  const size_t nslots = table->current.mask + 1;
+  if ((table->current.nvalues + 1) * MAX_LOAD_DENOMINATOR > nslots * MAX_LOAD_NUMERATOR) {
+    const enum status status = grow(table);
+    if (status != STATUS_OK) {
+      return status;
+    }
+  }
+
+  slots_insert(&table->current, hash, value);
+  return STATUS_OK;
+}
+
+
+/**
+ * Removes and returns the value identified by `key`, or NULL if there is no such value.
+ **/
+void *
+hashtable_remove(struct hashtable *const table, const uint64_t hash, const void *const key) {
+  void *value = NULL;
+
+  if (table == NULL) {
+    return NULL;
+  }
+
+  size_t index = slots_find(&table->current, table->matches, hash, key);
+  if (index != SIZE_MAX) {
+    value = slots_remove_at(&table->current, index);
+  }
+  else if ((index = slots_find(&table->previous, table->matches, hash, key)) != SIZE_MAX) {
+    value = slots_remove_at(&table->previous, index);
+  }
+
+  migrate(table, MIGRATE_NSTEPS);
+  return value;
+}
+
+
+/**
+ * Iterates over the values in the table. `*cursor` should start at 0, and NULL is returned once
+ * all of the values have been visited. The table must not be modified during the iteration.
+ **/
+void *
+hashtable_next(const struct hashtable *const table, size_t *const cursor) {
+  const size_t nprevious = (table->previous.slots == NULL) ? 0 : table->previous.mask + 1;
+  const size_t ncurrent = table->current.mask + 1;
+
+  while (*cursor < nprevious + ncurrent) {
+    const size_t i = (*cursor)++;
+    const struct slot *const slot = (i < nprevious) ? &table->previous.slots[i] : &table->current.slots[i - nprevious];
+    if (slot->value != NULL) {
+      return slot->value;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,27 @@
+/**
+ * An open-addressing (Robin Hood) hash table of pointers which grows incrementally. The caller
+ * supplies the hash of each value, which is stored alongside it so that probing rarely needs to
+ * call the `matches` function.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "status.h"
+
+// Forwards declaration.
+struct hashtable;
+
+// Returns whether or not the stored `value` is the one identified by `key`.
+typedef bool (*hashtable_matches_t)(const void *value, const void *key);
+
+
+struct hashtable *hashtable_create(hashtable_matches_t matches);
+enum status       hashtable_destroy(struct hashtable *table);
+size_t            hashtable_size(const struct hashtable *table);
+void *            hashtable_find(const struct hashtable *table, uint64_t hash, const void *key);
+enum status       hashtable_insert(struct hashtable *table, uint64_t hash, void *value);
+void *            hashtable_remove(struct hashtable *table, uint64_t hash, const void *key);
+void *            hashtable_next(const struct hashtable *table, size_t *cursor);
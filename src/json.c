@@ -605,38 +605,62 @@ json_value_set_nocopy(struct json_value *const object, char *const key, struct j
 
 enum status
 json_write_escape_string(struct evbuffer *const buffer, const char *const string) {
+  return json_write_escape_string_n(buffer, string, strlen(string));
+}
+
+
+/**
+ * Writes `nbytes` of `string` as a quoted JSON string. Runs of characters which don't need escaping
+ * are added in one go, so that a large message costs a handful of buffer operations rather than
+ * one per byte.
+ **/
+enum status
+json_write_escape_string_n(struct evbuffer *const buffer, const char *const string, const size_t nbytes) {
+  const uint8_t *const bytes = (const uint8_t *)string;
+  const char *escaped;
+  char control[7];
+  size_t run_start = 0;
   int ret = 0;
-  ret |= evbuffer_add_printf(buffer, "\"");
-  for (const uint8_t *c = (const uint8_t *)string; *c != '\0'; ++c) {
-    switch (*c) {
+
+  ret |= evbuffer_add(buffer, "\"", 1);
+  for (size_t i = 0; i != nbytes; ++i) {
+    switch (bytes[i]) {
     case '"':
-      ret |= evbuffer_add_printf(buffer, "\\\"");
+      escaped = "\\\"";
       break;
     case '\\':
-      ret |= evbuffer_add_printf(buffer, "\\\\");
+      escaped = "\\\\";
       break;
     case '/':
-      ret |= evbuffer_add_printf(buffer, "\\/");
+      escaped = "\\/";
       break;
     case '\b':
-      ret |= evbuffer_add_printf(buffer, "\\b");
+      escaped = "\\b";
       break;
     case '\f':
-      ret |= evbuffer_add_printf(buffer, "\\f");
+      escaped = "\\f";
       break;
     case '\n':
-      ret |= evbuffer_add_printf(buffer, "\\n");
+      escaped = "\\n";
       break;
     case '\r':
-      ret |= evbuffer_add_printf(buffer, "\\r");
+      escaped = "\\r";
       break;
     case '\t':
-      ret |= evbuffer_add_printf(buffer, "\\t");
+      escaped = "\\t";
       break;
     default:
-      ret |= evbuffer_add(buffer, c, 1);
+      if (bytes[i] >= 0x20) {
+        continue;
+      }
+      snprintf(control, sizeof(control), "\\u%04x", bytes[i]);
+      escaped = control;
     }
+    ret |= evbuffer_add(buffer, bytes + run_start, i - run_start);
+    ret |= evbuffer_add(buffer, escaped, strlen(escaped));
+    run_start = i + 1;
   }
-  ret |= evbuffer_add_printf(buffer, "\"");
+  ret |= evbuffer_add(buffer, bytes + run_start, nbytes - run_start);
+  ret |= evbuffer_add(buffer, "\"", 1);
   return (ret == 0) ? STATUS_OK : STATUS_BAD;
 }
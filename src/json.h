@@ -54,3 +54,4 @@ enum status        json_value_set(struct json_value *object, const char *key, st
 enum status        json_value_set_n(struct json_value *object, const char *key, size_t key_nbytes, struct json_value *value);
 enum status        json_value_set_nocopy(struct json_value *object, char *key, struct json_value *value);
 enum status        json_write_escape_string(struct evbuffer *buffer, const char *string);
+enum status        json_write_escape_string_n(struct evbuffer *buffer, const char *string, size_t nbytes);
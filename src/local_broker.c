@@ -0,0 +1,396 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "local_broker.h"
+#include "logging.h"
+#include "pattern_trie.h"
+#include "pubsub_manager.h"
+#include "pubsub_reply.h"
+#include "xxhash.h"
+
+
+// The managers which are interested in a channel or pattern.
+struct interest {
+  bool is_pattern;
+  uint64_t hash;
+  size_t ninterested;
+  bool *interested;  // Whether or not each manager has local subscribers.
+  size_t nbytes;
+  char name[];
+};
+
+
+// The key used to look up an interest.
+struct interest_key {
+  const char *name;
+  size_t nbytes;
+  bool is_pattern;
+};
+
+
+/**
+ * Publishing only reads the exchange, so any number of workers can publish at once. Each inbox has
+ * a lock of its own, which keeps its pushes down to one producer at a time.
+ **/
+struct local_exchange {
+  pthread_rwlock_t lock;
+  size_t nmanagers;
+  struct pubsub_manager *managers[LOCAL_EXCHANGE_MAX_MANAGERS];
+  pthread_mutex_t inbox_locks[LOCAL_EXCHANGE_MAX_MANAGERS];
+  struct hashtable *interests;    // { channel : interest }
+  struct pattern_trie *patterns;  // { pattern : interest }
+};
+
+
+struct local_broker {
+  struct broker base;
+  struct local_exchange *exchange;
+  size_t index;  // The index of the broker's manager within the exchange.
+
+  // The NUL-terminated names of the patterns, matched while publishing, with subscribers on the
+  // broker's own manager. The buffer is kept between publishes, and only grows.
+  char *own_patterns;
+  size_t own_patterns_nbytes;
+  size_t own_patterns_capacity;
+};
+
+
+// The state for handing a published message to the managers interested in the patterns it matches.
+struct match {
+  struct local_broker *local;
+  const char *channel;
+  size_t channel_nbytes;
+  struct pubsub_payload *payload;
+};
+
+
+static bool
+interest_matches(const void *const value, const void *const key) {
+  const struct interest *const interest = value;
+  const struct interest_key *const k = key;
+  return interest->is_pattern == k->is_pattern && interest->nbytes == k->nbytes && memcmp(interest->name, k->name, k->nbytes) == 0;
+}
+
+
+static inline uint64_t
+interest_hash(const struct interest_key *const key) {
+  return XXH64(key->name, key->nbytes, key->is_pattern);
+}
+
+
+static void
+interest_destroy(struct interest *const interest) {
+  free(interest->interested);
+  free(interest);
+}
+
+
+static void
+destroy_pattern_interest(void *const value, void *const arg) {
+  (void)arg;
+  interest_destroy(value);
+}
+
+
+static struct interest *
+interest_find(const struct local_exchange *const exchange, const struct interest_key *const key, const uint64_t hash) {
+  if (key->is_pattern) {
+    return pattern_trie_find(exchange->patterns, key->name, key->nbytes);
+  }
+  return hashtable_find(exchange->interests, hash, key);
+}
+
+
+static void
+deliver(struct local_exchange *const exchange, const size_t index, const char *const pattern, const char *const channel, const size_t channel_nbytes, struct pubsub_payload *const payload) {
+  pthread_mutex_lock(&exchange->inbox_locks[index]);
+  pubsub_manager_deliver(exchange->managers[index], pattern, channel, channel_nbytes, payload);
+  pthread_mutex_unlock(&exchange->inbox_locks[index]);
+}
+
+
+struct local_exchange *
+local_exchange_create(void) {
+  struct local_exchange *const exchange = malloc(sizeof(struct local_exchange));
+  if (exchange == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(exchange, 0, sizeof(struct local_exchange));
+  exchange->interests = hashtable_create(&interest_matches);
+  if (exchange->interests == NULL) {
+    free(exchange);
+    return NULL;
+  }
+  exchange->patterns = pattern_trie_create();
+  if (exchange->patterns == NULL) {
+    hashtable_destroy(exchange->interests);
+    free(exchange);
+    return NULL;
+  }
+  pthread_rwlock_init(&exchange->lock, NULL);
+  for (size_t i = 0; i != LOCAL_EXCHANGE_MAX_MANAGERS; ++i) {
+    pthread_mutex_init(&exchange->inbox_locks[i], NULL);
+  }
+  return exchange;
+}
+
+
+/**
+ * Destroys the exchange, which must outlive all of its brokers.
+ **/
+enum status
+local_exchange_destroy(struct local_exchange *const exchange) {
+  struct interest *interest;
+
+  if (exchange == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  for (size_t cursor = 0; (interest = hashtable_next(exchange->interests, &cursor)) != NULL; ) {
+    interest_destroy(interest);
+  }
+  hashtable_destroy(exchange->interests);
+  pattern_trie_destroy(exchange->patterns, &destroy_pattern_interest, NULL);
+  for (size_t i = 0; i != LOCAL_EXCHANGE_MAX_MANAGERS; ++i) {
+    pthread_mutex_destroy(&exchange->inbox_locks[i]);
+  }
+  pthread_rwlock_destroy(&exchange->lock);
+  free(exchange);
+
+  return STATUS_OK;
+}
+
+
+static enum status
+attach(struct broker *const broker, struct pubsub_manager *const mgr) {
+  struct local_broker *const local = (struct local_broker *)broker;
+  struct local_exchange *const exchange = local->exchange;
+  enum status status = STATUS_OK;
+
+  pthread_rwlock_wrlock(&exchange->lock);
+  if (exchange->nmanagers == LOCAL_EXCHANGE_MAX_MANAGERS) {
+    status = STATUS_BAD;
+  }
+  else {
+    local->index = exchange->nmanagers;
+    exchange->managers[exchange->nmanagers++] = mgr;
+  }
+  pthread_rwlock_unlock(&exchange->lock);
+
+  return status;
+}
+
+
+static enum status
+destroy(struct broker *const broker) {
+  struct local_broker *const local = (struct local_broker *)broker;
+  free(local->own_patterns);
+  free(local);
+  return STATUS_OK;
+}
+
+
+/**
+ * Hands the message to the other managers interested in a pattern that the channel matches, and
+ * notes the pattern down if the broker's own manager is interested too. Running out of memory for
+ * the note only loses this message for the pattern's local subscribers.
+ **/
+static void
+on_pattern_matched(void *const value, void *const arg) {
+  const struct interest *const pattern = value;
+  const struct match *const match = arg;
+  struct local_broker *const local = match->local;
+  struct local_exchange *const exchange = local->exchange;
+
+  for (size_t i = 0; i != exchange->nmanagers; ++i) {
+    if (!pattern->interested[i]) {
+      continue;
+    }
+    else if (i != local->index) {
+      deliver(exchange, i, pattern->name, match->channel, match->channel_nbytes, match->payload);
+    }
+    else {
+      const size_t nbytes = local->own_patterns_nbytes + pattern->nbytes + 1;
+      if (nbytes > local->own_patterns_capacity) {
+        const size_t capacity = (nbytes > 2 * local->own_patterns_capacity) ? nbytes : 2 * local->own_patterns_capacity;
+        char *const own_patterns = realloc(local->own_patterns, capacity);
+        if (own_patterns == NULL) {
+          ERROR0("realloc failed.\n");
+          continue;
+        }
+        local->own_patterns = own_patterns;
+        local->own_patterns_capacity = capacity;
+      }
+      memcpy(local->own_patterns + local->own_patterns_nbytes, pattern->name, pattern->nbytes + 1);
+      local->own_patterns_nbytes = nbytes;
+    }
+  }
+}
+
+
+/**
+ * Hands the message to every manager interested in the channel or a pattern that it matches. The
+ * publishing worker's own manager is handed the message directly once the lock is released, as
+ * sending it out may well lead to calls back into the broker.
+ **/
+static enum status
+publish(struct broker *const broker, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes, const uint64_t publisher) {
+  struct local_broker *const local = (struct local_broker *)broker;
+  struct local_exchange *const exchange = local->exchange;
+  bool is_own_channel = false;
+
+  struct pubsub_payload *const payload = pubsub_payload_create(message, message_nbytes);
+  if (payload == NULL) {
+    return STATUS_ENOMEM;
+  }
+  payload->publisher = publisher;
+
+  pthread_rwlock_rdlock(&exchange->lock);
+  const struct interest_key key = {.name = channel, .nbytes = channel_nbytes, .is_pattern = false};
+  const struct interest *const interest = hashtable_find(exchange->interests, interest_hash(&key), &key);
+  if (interest != NULL) {
+    for (size_t i = 0; i != exchange->nmanagers; ++i) {
+      if (!interest->interested[i]) {
+        continue;
+      }
+      else if (i == local->index) {
+        is_own_channel = true;
+      }
+      else {
+        deliver(exchange, i, NULL, channel, channel_nbytes, payload);
+      }
+    }
+  }
+
+  // Patterns are matched with the same glob-style syntax as redis.
+  struct match match = {.local = local, .channel = channel, .channel_nbytes = channel_nbytes, .payload = payload};
+  local->own_patterns_nbytes = 0;
+  pattern_trie_match(exchange->patterns, channel, channel_nbytes, &on_pattern_matched, &match);
+  pthread_rwlock_unlock(&exchange->lock);
+
+  // The own manager's patterns were copied, as sending one out may drop its interest in another.
+  // The channel goes last, as sending it out may drop the manager's interest in the channel.
+  for (size_t upto = 0; upto != local->own_patterns_nbytes; upto += strlen(local->own_patterns + upto) + 1) {
+    pubsub_manager_deliver_now(exchange->managers[local->index], local->own_patterns + upto, channel, channel_nbytes, payload);
+  }
+  if (is_own_channel) {
+    pubsub_manager_deliver_now(exchange->managers[local->index], NULL, channel, channel_nbytes, payload);
+  }
+  pubsub_payload_release(payload);
+
+  return STATUS_OK;
+}
+
+
+static enum status
+subscribe(struct broker *const broker, const char *const name, const bool is_pattern) {
+  const struct local_broker *const local = (const struct local_broker *)broker;
+  struct local_exchange *const exchange = local->exchange;
+  enum status status = STATUS_OK;
+
+  const struct interest_key key = {.name = name, .nbytes = strlen(name), .is_pattern = is_pattern};
+  const uint64_t hash = interest_hash(&key);
+
+  pthread_rwlock_wrlock(&exchange->lock);
+  struct interest *interest = interest_find(exchange, &key, hash);
+  if (interest == NULL) {
+    interest = malloc(sizeof(struct interest) + key.nbytes + 1);
+    if (interest == NULL) {
+      ERROR0("malloc failed.\n");
+      status = STATUS_ENOMEM;
+      goto done;
+    }
+    memset(interest, 0, sizeof(struct interest));
+    interest->is_pattern = is_pattern;
+    interest->hash = hash;
+    interest->nbytes = key.nbytes;
+    memcpy(interest->name, name, key.nbytes + 1);
+    interest->interested = calloc(exchange->nmanagers, sizeof(bool));
+    if (interest->interested == NULL) {
+      status = STATUS_ENOMEM;
+    }
+    else if (is_pattern) {
+      status = pattern_trie_insert(exchange->patterns, name, key.nbytes, interest);
+    }
+    else {
+      status = hashtable_insert(exchange->interests, hash, interest);
+    }
+    if (status != STATUS_OK) {
+      ERROR0("Failed to add the interest to the exchange.\n");
+      interest_destroy(interest);
+      goto done;
+    }
+  }
+  if (!interest->interested[local->index]) {
+    interest->interested[local->index] = true;
+    ++interest->ninterested;
+  }
+
+done:
+  pthread_rwlock_unlock(&exchange->lock);
+  return status;
+}
+
+
+static enum status
+unsubscribe(struct broker *const broker, const char *const name, const bool is_pattern) {
+  const struct local_broker *const local = (const struct local_broker *)broker;
+  struct local_exchange *const exchange = local->exchange;
+
+  const struct interest_key key = {.name = name, .nbytes = strlen(name), .is_pattern = is_pattern};
+  const uint64_t hash = interest_hash(&key);
+
+  pthread_rwlock_wrlock(&exchange->lock);
+  struct interest *const interest = interest_find(exchange, &key, hash);
+  if (interest != NULL && interest->interested[local->index]) {
+    interest->interested[local->index] = false;
+    if (--interest->ninterested == 0) {
+      if (is_pattern) {
+        pattern_trie_remove(exchange->patterns, name, key.nbytes);
+      }
+      else {
+        hashtable_remove(exchange->interests, hash, &key);
+      }
+      interest_destroy(interest);
+    }
+  }
+  pthread_rwlock_unlock(&exchange->lock);
+
+  return STATUS_OK;
+}
+
+
+static const struct broker_ops LOCAL_OPS = {
+  .attach = &attach,
+  .destroy = &destroy,
+  .publish = &publish,
+  .subscribe = &subscribe,
+  .unsubscribe = &unsubscribe,
+  .read_range = NULL,
+};
+
+
+/**
+ * Creates a broker for a worker. All of the workers' brokers must be attached to their managers
+ * before any subscriptions are made.
+ **/
+struct broker *
+local_broker_create(struct local_exchange *const exchange) {
+  if (exchange == NULL) {
+    return NULL;
+  }
+
+  struct local_broker *const local = malloc(sizeof(struct local_broker));
+  if (local == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(local, 0, sizeof(struct local_broker));
+  local->base.ops = &LOCAL_OPS;
+  local->base.has_patterns = true;
+  local->exchange = exchange;
+  return &local->base;
+}
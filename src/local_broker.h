@@ -0,0 +1,24 @@
+/**
+ * The in-process broker, for single node deployments which don't need redis. Publishing fans a
+ * message out to the publishing worker's own subscribers in the same event loop iteration, and
+ * hands it to the other workers' managers through their inboxes.
+ *
+ * The workers' brokers share a local exchange, which records which managers are interested in each
+ * channel and pattern, with the patterns in a trie so that a channel is only matched against the
+ * patterns which could match it. Workers publish under a shared read lock, and each inbox has a
+ * lock of its own so that it still only ever has one producer at a time.
+ **/
+#pragma once
+
+#include "broker.h"
+
+#define LOCAL_EXCHANGE_MAX_MANAGERS (256)
+
+// Forward declaration.
+struct local_exchange;
+
+
+struct local_exchange *local_exchange_create(void);
+enum status            local_exchange_destroy(struct local_exchange *exchange);
+
+struct broker *        local_broker_create(struct local_exchange *exchange);
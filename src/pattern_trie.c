@@ -0,0 +1,468 @@
+/**
+ * Each node holds one segment of a pattern, and its children are kept in a hashtable keyed by
+ * their segments, so that a node with many children (say, one per market) is still a single probe
+ * to step through. Nodes which no longer lead to a value are pruned as soon as they are left
+ * empty.
+ *
+ * Segments are split on the '.'s which aren't escaped or inside a [...] class, so a segment without
+ * any of `*?[\` is literal, and only ever matches the identical segment of a channel. The other
+ * segments are globs, which are also kept in a list on their parent node. A glob may match across
+ * the channel's '.'s, so the patterns which continue with one are each matched against the rest
+ * of the channel as a whole, with the same syntax as redis.
+ **/
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "logging.h"
+#include "pattern_trie.h"
+#include "xxhash.h"
+
+
+struct node {
+  struct node *parent;
+  struct hashtable *children;  // NULL until the node has had a child.
+  void *value;                 // NULL unless a pattern ends at this node.
+  char *pattern;               // A copy of the whole pattern which ends at this node, if any.
+  size_t pattern_nbytes;
+
+  // The children whose segments are globs, and the links for the node's place in its parent's list.
+  bool is_glob;
+  struct node *globs;
+  struct node *glob_next;
+  struct node **glob_pprev;
+
+  uint64_t hash;
+  size_t offset;  // Where the segment starts within every pattern which goes through the node.
+  size_t nbytes;
+  char segment[];
+};
+
+
+struct pattern_trie {
+  struct node *root;  // Holds the empty prefix, so never has a value.
+  size_t nvalues;
+};
+
+
+// The key used to look up a node amongst its siblings.
+struct segment {
+  const char *str;
+  size_t nbytes;
+};
+
+
+static bool
+node_matches(const void *const value, const void *const key) {
+  const struct node *const node = value;
+  const struct segment *const segment = key;
+  return node->nbytes == segment->nbytes && memcmp(node->segment, segment->str, segment->nbytes) == 0;
+}
+
+
+static inline uint64_t
+segment_hash(const struct segment *const segment) {
+  return XXH64(segment->str, segment->nbytes, 0);
+}
+
+
+// Returns the segment of `pattern` starting at `*upto`, and moves `*upto` past it and its '.'. A '.'
+// which is escaped or inside a [...] class is part of the segment.
+static struct segment
+next_segment(const char *const pattern, const size_t nbytes, size_t *const upto) {
+  bool is_in_class = false;
+  size_t end;
+
+  for (end = *upto; end != nbytes; ++end) {
+    if (pattern[end] == '\\' && end + 1 != nbytes) {
+      ++end;
+    }
+    else if (pattern[end] == '[') {
+      is_in_class = true;
+    }
+    else if (pattern[end] == ']') {
+      is_in_class = false;
+    }
+    else if (pattern[end] == '.' && !is_in_class) {
+      break;
+    }
+  }
+  const struct segment segment = {.str = pattern + *upto, .nbytes = end - *upto};
+  *upto = end + 1;
+  return segment;
+}
+
+
+static inline bool
+is_glob(const struct segment *const segment) {
+  for (size_t i = 0; i != segment->nbytes; ++i) {
+    if (segment->str[i] == '*' || segment->str[i] == '?' || segment->str[i] == '[' || segment->str[i] == '\\') {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+ * Returns whether the class starting just after the '[' at `pattern[*upto]` matches `c`, and moves
+ * `*upto` past the class's ']'. As with redis, a class which isn't closed runs to the end.
+ **/
+static bool
+class_matches(const char *const pattern, const size_t nbytes, size_t *const upto, const char c) {
+  size_t i = *upto + 1;
+  bool is_matched = false;
+
+  const bool is_negated = i != nbytes && pattern[i] == '^';
+  if (is_negated) {
+    ++i;
+  }
+  for (; i != nbytes && pattern[i] != ']'; ++i) {
+    if (pattern[i] == '\\' && i + 1 != nbytes) {
+      ++i;
+      is_matched |= pattern[i] == c;
+    }
+    else if (i + 2 < nbytes && pattern[i + 1] == '-') {
+      const unsigned char lo = (pattern[i] < pattern[i + 2]) ? pattern[i] : pattern[i + 2];
+      const unsigned char hi = (pattern[i] < pattern[i + 2]) ? pattern[i + 2] : pattern[i];
+      is_matched |= (unsigned char)c >= lo && (unsigned char)c <= hi;
+      i += 2;
+    }
+    else {
+      is_matched |= pattern[i] == c;
+    }
+  }
+  *upto = (i == nbytes) ? nbytes : i + 1;
+  return is_matched != is_negated;
+}
+
+
+/**
+ * Matches a redis glob-style pattern against the whole of `str`. Each '*' only needs to be retried
+ * from the latest one, as everything else matches exactly one character.
+ **/
+static bool
+glob_matches(const char *const pattern, const size_t pattern_nbytes, const char *const str, const size_t str_nbytes) {
+  size_t p = 0, s = 0, star_p = SIZE_MAX, star_s = 0;
+
+  while (s != str_nbytes) {
+    size_t next = p + 1;
+    bool is_matched = false;
+    if (p != pattern_nbytes) {
+      switch (pattern[p]) {
+      case '*':
+        star_p = p++;
+        star_s = s;
+        continue;
+      case '?':
+        is_matched = true;
+        break;
+      case '[':
+        next = p;
+        is_matched = class_matches(pattern, pattern_nbytes, &next, str[s]);
+        break;
+      case '\\':
+        if (p + 1 != pattern_nbytes) {
+          ++next;
+        }
+        is_matched = pattern[next - 1] == str[s];
+        break;
+      default:
+        is_matched = pattern[p] == str[s];
+        break;
+      }
+    }
+    if (is_matched) {
+      p = next;
+      ++s;
+    }
+    else if (star_p != SIZE_MAX) {
+      p = star_p + 1;
+      s = ++star_s;
+    }
+    else {
+      return false;
+    }
+  }
+  while (p != pattern_nbytes && pattern[p] == '*') {
+    ++p;
+  }
+  return p == pattern_nbytes;
+}
+
+
+static struct node *
+node_create(struct node *const parent, const struct segment *const segment, const uint64_t hash, const size_t offset) {
+  struct node *const node = malloc(sizeof(struct node) + segment->nbytes);
+  if (node == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(node, 0, sizeof(struct node));
+  node->parent = parent;
+  node->is_glob = is_glob(segment);
+  node->hash = hash;
+  node->offset = offset;
+  node->nbytes = segment->nbytes;
+  memcpy(node->segment, segment->str, segment->nbytes);
+  return node;
+}
+
+
+static void
+node_destroy(struct node *const node, const pattern_trie_destroy_value_t destroy_value, void *const arg) {
+  struct node *child;
+
+  if (node->children != NULL) {
+    for (size_t cursor = 0; (child = hashtable_next(node->children, &cursor)) != NULL; ) {
+      node_destroy(child, destroy_value, arg);
+    }
+    hashtable_destroy(node->children);
+  }
+  if (node->value != NULL && destroy_value != NULL) {
+    destroy_value(node->value, arg);
+  }
+  free(node->pattern);
+  free(node);
+}
+
+
+/**
+ * Removes `node` and then each of its ancestors, for as long as they don't lead to any values.
+ **/
+static void
+prune(struct pattern_trie *const trie, struct node *node) {
+  while (node != trie->root && node->value == NULL && (node->children == NULL || hashtable_size(node->children) == 0)) {
+    struct node *const parent = node->parent;
+    const struct segment segment = {.str = node->segment, .nbytes = node->nbytes};
+    hashtable_remove(parent->children, node->hash, &segment);
+    if (node->is_glob) {
+      *node->glob_pprev = node->glob_next;
+      if (node->glob_next != NULL) {
+        node->glob_next->glob_pprev = node->glob_pprev;
+      }
+    }
+    node_destroy(node, NULL, NULL);
+    node = parent;
+  }
+}
+
+
+static struct node *
+find_node(const struct pattern_trie *const trie, const char *const pattern, const size_t nbytes) {
+  struct node *node = trie->root;
+  size_t upto = 0;
+
+  // There is always at least one segment, even if it is empty.
+  do {
+    const struct segment segment = next_segment(pattern, nbytes, &upto);
+    if (node->children == NULL) {
+      return NULL;
+    }
+    node = hashtable_find(node->children, segment_hash(&segment), &segment);
+    if (node == NULL) {
+      return NULL;
+    }
+  } while (upto <= nbytes);
+
+  return node;
+}
+
+
+struct pattern_trie *
+pattern_trie_create(void) {
+  struct pattern_trie *const trie = malloc(sizeof(struct pattern_trie));
+  if (trie == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  const struct segment empty = {.str = "", .nbytes = 0};
+  trie->root = node_create(NULL, &empty, 0, 0);
+  if (trie->root == NULL) {
+    free(trie);
+    return NULL;
+  }
+  trie->nvalues = 0;
+  return trie;
+}
+
+
+/**
+ * Destroys the trie, calling `destroy_value` (if not NULL) on each of the values still in it.
+ **/
+enum status
+pattern_trie_destroy(struct pattern_trie *const trie, const pattern_trie_destroy_value_t destroy_value, void *const arg) {
+  if (trie == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  node_destroy(trie->root, destroy_value, arg);
+  free(trie);
+
+  return STATUS_OK;
+}
+
+
+size_t
+pattern_trie_size(const struct pattern_trie *const trie) {
+  return trie->nvalues;
+}
+
+
+void *
+pattern_trie_find(const struct pattern_trie *const trie, const char *const pattern, const size_t nbytes) {
+  if (trie == NULL || pattern == NULL) {
+    return NULL;
+  }
+  const struct node *const node = find_node(trie, pattern, nbytes);
+  return (node == NULL) ? NULL : node->value;
+}
+
+
+/**
+ * Inserts `value` for `pattern`, which must not already be in the trie.
+ **/
+enum status
+pattern_trie_insert(struct pattern_trie *const trie, const char *const pattern, const size_t nbytes, void *const value) {
+  struct node *node, *child;
+  size_t upto = 0;
+
+  if (trie == NULL || pattern == NULL || value == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  // Walk down the trie, adding whichever nodes are missing along the way.
+  node = trie->root;
+  do {
+    const size_t offset = upto;
+    const struct segment segment = next_segment(pattern, nbytes, &upto);
+    const uint64_t hash = segment_hash(&segment);
+    if (node->children == NULL) {
+      node->children = hashtable_create(&node_matches);
+      if (node->children == NULL) {
+        goto fail;
+      }
+    }
+    child = hashtable_find(node->children, hash, &segment);
+    if (child == NULL) {
+      child = node_create(node, &segment, hash, offset);
+      if (child == NULL) {
+        goto fail;
+      }
+      if (hashtable_insert(node->children, hash, child) != STATUS_OK) {
+        node_destroy(child, NULL, NULL);
+        goto fail;
+      }
+      if (child->is_glob) {
+        child->glob_next = node->globs;
+        child->glob_pprev = &node->globs;
+        if (node->globs != NULL) {
+          node->globs->glob_pprev = &child->glob_next;
+        }
+        node->globs = child;
+      }
+    }
+    node = child;
+  } while (upto <= nbytes);
+
+  if (node->value != NULL) {
+    return STATUS_EINVAL;
+  }
+  node->pattern = malloc(nbytes);
+  if (node->pattern == NULL && nbytes != 0) {
+    ERROR0("malloc failed.\n");
+    goto fail;
+  }
+  memcpy(node->pattern, pattern, nbytes);
+  node->pattern_nbytes = nbytes;
+  node->value = value;
+  ++trie->nvalues;
+  return STATUS_OK;
+
+fail:
+  prune(trie, node);
+  return STATUS_ENOMEM;
+}
+
+
+/**
+ * Removes and returns the value for `pattern`, or NULL if there is no such pattern.
+ **/
+void *
+pattern_trie_remove(struct pattern_trie *const trie, const char *const pattern, const size_t nbytes) {
+  if (trie == NULL || pattern == NULL) {
+    return NULL;
+  }
+
+  struct node *const node = find_node(trie, pattern, nbytes);
+  if (node == NULL || node->value == NULL) {
+    return NULL;
+  }
+  void *const value = node->value;
+  node->value = NULL;
+  free(node->pattern);
+  node->pattern = NULL;
+  --trie->nvalues;
+  prune(trie, node);
+
+  return value;
+}
+
+
+/**
+ * Calls `fn` with the value of every pattern in the subtree under `node`, a glob, which matches
+ * `rest`. `rest` is the part of the channel which is left for the patterns from `node` onwards.
+ **/
+static void
+match_glob(const struct node *const node, const size_t offset, const char *const rest, const size_t rest_nbytes, const pattern_trie_match_t fn, void *const arg) {
+  const struct node *child;
+
+  if (node->value != NULL && glob_matches(node->pattern + offset, node->pattern_nbytes - offset, rest, rest_nbytes)) {
+    fn(node->value, arg);
+  }
+  if (node->children != NULL) {
+    for (size_t cursor = 0; (child = hashtable_next(node->children, &cursor)) != NULL; ) {
+      match_glob(child, offset, rest, rest_nbytes, fn, arg);
+    }
+  }
+}
+
+
+/**
+ * Calls `fn` with the value of every pattern which matches `channel`, once each. The trie is only
+ * read, so any number of threads may match against it at once.
+ **/
+void
+pattern_trie_match(const struct pattern_trie *const trie, const char *const channel, const size_t nbytes, const pattern_trie_match_t fn, void *const arg) {
+  const struct node *node;
+  size_t upto = 0;
+
+  if (trie == NULL || channel == NULL || fn == NULL) {
+    return;
+  }
+  node = trie->root;
+
+  // Step down through the literal segments which match the channel's segments, and try every glob
+  // that branches off along the way against whatever is left of the channel.
+  do {
+    for (const struct node *glob = node->globs; glob != NULL; glob = glob->glob_next) {
+      match_glob(glob, glob->offset, channel + upto, nbytes - upto, fn, arg);
+    }
+    const char *const start = channel + upto;
+    const char *const dot = memchr(start, '.', nbytes - upto);
+    const struct segment segment = {.str = start, .nbytes = (dot == NULL) ? nbytes - upto : (size_t)(dot - start)};
+    upto += segment.nbytes + 1;
+    if (node->children == NULL) {
+      return;
+    }
+    node = hashtable_find(node->children, segment_hash(&segment), &segment);
+    if (node == NULL || node->is_glob) {
+      return;
+    }
+  } while (upto <= nbytes);
+
+  if (node->value != NULL) {
+    fn(node->value, arg);
+  }
+}
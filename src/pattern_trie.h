@@ -0,0 +1,31 @@
+/**
+ * A trie of '.' separated channel patterns, such as `market.BTC.*`, which maps each pattern to a
+ * value. Patterns which share leading segments share the nodes for them, so thousands of patterns
+ * under a handful of prefixes stay compact, and finding a pattern only looks at the children of
+ * the nodes along its own path.
+ *
+ * The trie can also find every pattern which matches a channel, with redis's glob-style syntax,
+ * without trying each pattern in turn.
+ **/
+#pragma once
+
+#include <stdlib.h>
+
+#include "status.h"
+
+// Forward declaration.
+struct pattern_trie;
+
+// Called on each value still in the trie when it is destroyed.
+typedef void (*pattern_trie_destroy_value_t)(void *value, void *arg);
+// Called with the value of each pattern which matches a channel.
+typedef void (*pattern_trie_match_t)(void *value, void *arg);
+
+
+struct pattern_trie *pattern_trie_create(void);
+enum status          pattern_trie_destroy(struct pattern_trie *trie, pattern_trie_destroy_value_t destroy_value, void *arg);
+size_t               pattern_trie_size(const struct pattern_trie *trie);
+void *               pattern_trie_find(const struct pattern_trie *trie, const char *pattern, size_t nbytes);
+enum status          pattern_trie_insert(struct pattern_trie *trie, const char *pattern, size_t nbytes, void *value);
+void *               pattern_trie_remove(struct pattern_trie *trie, const char *pattern, size_t nbytes);
+void                 pattern_trie_match(const struct pattern_trie *trie, const char *channel, size_t nbytes, pattern_trie_match_t fn, void *arg);
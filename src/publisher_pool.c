@@ -0,0 +1,708 @@
+/**
+ * Commands are passed to hiredis as pre-sized argument vectors, so no format string is parsed per
+ * PUBLISH. hiredis only appends each command to the connection's output buffer and asks libevent
+ * for a write event, so all of the PUBLISHes made on a connection during one event loop iteration
+ * go out together as a single pipelined write.
+ *
+ * Each connection reconnects with exponential backoff when it is lost. PUBLISHes made while a
+ * connection is down are kept in a bounded outbox, in order, and are sent once it is back.
+ *
+ * With the Streams backend, messages are XADDed to the channel's stream instead, trimmed to roughly
+ * STREAM_MAXLEN entries, and the pool also serves the XRANGE reads used to replay a stream.
+ *
+ * With the pubsub backend, the pool can drop PUBLISHes to channels which nobody is subscribed to.
+ * Receiver counts are read from the PUBLISH replies into a receiver cache, and the cache's empty
+ * channels are refreshed every TTL with a batched PUBSUB NUMSUB.
+ *
+ * With the Cluster backend, messages are SPUBLISHed to the primary which owns the channel's slot.
+ * Every reply is read, so that a `-MOVED` or `-ASK` error from a node which no longer owns the slot
+ * can be handed to the pool's redirect callback. The redirected message itself is not sent again.
+ **/
+#include <stdio.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+
+#include "backoff.h"
+#include "logging.h"
+#include "publisher_pool.h"
+#include "receiver_cache.h"
+#include "xxhash.h"
+
+#define OUTBOX_MAX_NBYTES (4 * 1024 * 1024)  // Per connection.
+#define MAX_NUMSUB_NCHANNELS (256)            // Bounds the size of a single PUBSUB NUMSUB command.
+
+static const char PUBLISH[] = "PUBLISH";
+static const char SPUBLISH[] = "SPUBLISH";
+static const char XADD[] = "XADD";
+static const char MAXLEN[] = "MAXLEN";
+static const char APPROXIMATELY[] = "~";
+static const char STREAM_MAXLEN[] = "100000";
+static const char AUTO_ID[] = "*";
+static const char DATA_FIELD[] = STREAM_DATA_FIELD;
+static const struct timeval RECONNECT_INITIAL_DELAY = {.tv_sec = 0, .tv_usec = 100000};
+static const struct timeval RECONNECT_MAX_DELAY = {.tv_sec = 10, .tv_usec = 0};
+
+
+// A PUBLISH waiting for its connection to come back. The channel and message are stored after the
+// struct.
+struct outbox_message {
+  struct outbox_message *next;
+  size_t channel_nbytes;
+  size_t message_nbytes;
+  char bytes[];
+};
+
+
+struct publisher {
+  struct publisher_pool *pool;
+  redisAsyncContext *ctx;  // NULL while there is no connection or connection attempt.
+  bool is_connected;
+  struct backoff reconnect_backoff;
+  struct event *reconnect_event;
+
+  // PUBLISHes made while disconnected.
+  struct outbox_message *outbox_head;
+  struct outbox_message *outbox_tail;
+  size_t outbox_nbytes;
+  size_t outbox_ndropped;
+};
+
+
+// A PUBLISH waiting for its reply, and the generation of the receiver count that it pinned.
+struct pinned_publish {
+  struct receiver_count *count;
+  uint64_t generation;
+};
+
+
+// An XRANGE waiting for its reply.
+struct range_read {
+  publisher_pool_range_t fn;
+  void *arg;
+};
+
+
+struct publisher_pool {
+  struct event_base *event_base;
+  enum redis_backend backend;
+  const char *redis_host;
+  uint16_t redis_port;
+  const char *redis_unix_path;
+  char *moved_host;  // The pool's own copy of `redis_host`, once the pool has been moved.
+  bool is_shutting_down;
+
+  // Receiver counts, if PUBLISHes to channels without subscribers are dropped.
+  struct receiver_cache *receivers;
+  struct event *refresh_event;
+
+  // Told about `-MOVED` and `-ASK` errors, with the Cluster backend.
+  publisher_pool_redirect_t on_redirect;
+  void *on_redirect_arg;
+
+  size_t npublishers;
+  struct publisher publishers[];
+};
+
+
+static void
+on_publish_reply(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  const struct publisher *const publisher = (const struct publisher *)ctx->data;
+  const redisReply *const reply = _reply;
+  struct timeval now;
+
+  // hiredis calls back without a reply if the connection goes away first.
+  if (reply != NULL && reply->type == REDIS_REPLY_ERROR && publisher->pool->on_redirect != NULL && (strncmp(reply->str, "MOVED ", 6) == 0 || strncmp(reply->str, "ASK ", 4) == 0)) {
+    publisher->pool->on_redirect(reply->str, reply->len, publisher->pool->on_redirect_arg);
+  }
+  if (privdata != NULL) {
+    struct pinned_publish *const pinned = privdata;
+    event_base_gettimeofday_cached(publisher->pool->event_base, &now);
+    const long long nreceivers = (reply != NULL && reply->type == REDIS_REPLY_INTEGER) ? reply->integer : -1;
+    receiver_cache_on_publish_reply(publisher->pool->receivers, pinned->count, pinned->generation, nreceivers, &now);
+    free(pinned);
+  }
+}
+
+
+/**
+ * Sends the PUBLISH, SPUBLISH or XADD. The reply to a PUBLISH is only read if `count` is not NULL,
+ * in which case the count is pinned until the reply comes back.
+ **/
+static enum status
+send_publish(struct publisher *const publisher, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes, struct receiver_count *const count) {
+  int status;
+
+  if (publisher->pool->backend == REDIS_BACKEND_STREAMS) {
+    const char *argv[8] = {XADD, channel, MAXLEN, APPROXIMATELY, STREAM_MAXLEN, AUTO_ID, DATA_FIELD, message};
+    const size_t argvlen[8] = {sizeof(XADD) - 1, channel_nbytes, sizeof(MAXLEN) - 1, sizeof(APPROXIMATELY) - 1, sizeof(STREAM_MAXLEN) - 1, sizeof(AUTO_ID) - 1, sizeof(DATA_FIELD) - 1, message_nbytes};
+    status = redisAsyncCommandArgv(publisher->ctx, NULL, NULL, 8, argv, argvlen);
+  }
+  else if (publisher->pool->backend == REDIS_BACKEND_CLUSTER) {
+    const char *argv[3] = {SPUBLISH, channel, message};
+    const size_t argvlen[3] = {sizeof(SPUBLISH) - 1, channel_nbytes, message_nbytes};
+    status = redisAsyncCommandArgv(publisher->ctx, &on_publish_reply, NULL, 3, argv, argvlen);
+  }
+  else {
+    const char *argv[3] = {PUBLISH, channel, message};
+    const size_t argvlen[3] = {sizeof(PUBLISH) - 1, channel_nbytes, message_nbytes};
+    struct pinned_publish *pinned = NULL;
+    if (count != NULL) {
+      pinned = malloc(sizeof(struct pinned_publish));
+      if (pinned == NULL) {
+        ERROR0("malloc failed.\n");
+      }
+      else {
+        pinned->count = count;
+      }
+    }
+    status = redisAsyncCommandArgv(publisher->ctx, (pinned == NULL) ? NULL : &on_publish_reply, pinned, 3, argv, argvlen);
+    if (status == REDIS_OK && pinned != NULL) {
+      pinned->generation = receiver_cache_pin(count);
+    }
+    else {
+      free(pinned);
+    }
+  }
+  if (status != REDIS_OK) {
+    ERROR("async `%s` command failed. status=%d\n", (publisher->pool->backend == REDIS_BACKEND_STREAMS) ? XADD : (publisher->pool->backend == REDIS_BACKEND_CLUSTER) ? SPUBLISH : PUBLISH, status);
+    return STATUS_BAD;
+  }
+  return STATUS_OK;
+}
+
+
+static enum status
+outbox_push(struct publisher *const publisher, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes) {
+  const size_t nbytes = sizeof(struct outbox_message) + channel_nbytes + message_nbytes;
+  if (publisher->outbox_nbytes + nbytes > OUTBOX_MAX_NBYTES) {
+    ++publisher->outbox_ndropped;
+    if ((publisher->outbox_ndropped & (publisher->outbox_ndropped - 1)) == 0) {
+      WARNING("Publish outbox full for publisher=%p. %zu messages dropped so far.\n", (void *)publisher, publisher->outbox_ndropped);
+    }
+    return STATUS_DISCONNECTED;
+  }
+
+  struct outbox_message *const node = malloc(nbytes);
+  if (node == NULL) {
+    ERROR0("malloc failed.\n");
+    return STATUS_ENOMEM;
+  }
+  node->next = NULL;
+  node->channel_nbytes = channel_nbytes;
+  node->message_nbytes = message_nbytes;
+  memcpy(node->bytes, channel, channel_nbytes);
+  memcpy(node->bytes + channel_nbytes, message, message_nbytes);
+  if (publisher->outbox_tail == NULL) {
+    publisher->outbox_head = node;
+  }
+  else {
+    publisher->outbox_tail->next = node;
+  }
+  publisher->outbox_tail = node;
+  publisher->outbox_nbytes += nbytes;
+
+  return STATUS_OK;
+}
+
+
+static void
+outbox_drain(struct publisher *const publisher) {
+  struct outbox_message *node, *next;
+  size_t nmessages = 0;
+
+  for (node = publisher->outbox_head; node != NULL; node = next) {
+    next = node->next;
+    send_publish(publisher, node->bytes, node->channel_nbytes, node->bytes + node->channel_nbytes, node->message_nbytes, NULL);
+    free(node);
+    ++nmessages;
+  }
+  publisher->outbox_head = NULL;
+  publisher->outbox_tail = NULL;
+  publisher->outbox_nbytes = 0;
+
+  if (nmessages != 0) {
+    INFO("Sent %zu publishes from the outbox. publisher=%p\n", nmessages, (void *)publisher);
+  }
+}
+
+
+static void
+outbox_clear(struct publisher *const publisher) {
+  struct outbox_message *node, *next;
+  for (node = publisher->outbox_head; node != NULL; node = next) {
+    next = node->next;
+    free(node);
+  }
+  publisher->outbox_head = NULL;
+  publisher->outbox_tail = NULL;
+  publisher->outbox_nbytes = 0;
+}
+
+
+static void
+schedule_reconnect(struct publisher *const publisher) {
+  struct timeval delay;
+
+  backoff_next(&publisher->reconnect_backoff, &delay);
+  INFO("Reconnecting to redis server in %ld.%06lds. publisher=%p\n", (long)delay.tv_sec, (long)delay.tv_usec, (void *)publisher);
+  if (event_add(publisher->reconnect_event, &delay) == -1) {
+    ERROR0("Failed to schedule the redis reconnection.\n");
+  }
+}
+
+
+static void
+on_connect(const redisAsyncContext *const ctx, const int status) {
+  struct publisher *const publisher = (struct publisher *)ctx->data;
+
+  if (status != REDIS_OK) {
+    ERROR("Error in on_connect redis callback. status=%d error=%s\n", status, ctx->errstr);
+    publisher->ctx = NULL;  // hiredis frees the context.
+    schedule_reconnect(publisher);
+    return;
+  }
+
+  INFO("Connected to redis server. publisher=%p\n", (void *)publisher);
+  publisher->is_connected = true;
+  backoff_reset(&publisher->reconnect_backoff);
+  outbox_drain(publisher);
+}
+
+
+static void
+on_disconnect(const redisAsyncContext *const ctx, const int status) {
+  struct publisher *const publisher = (struct publisher *)ctx->data;
+  publisher->is_connected = false;
+  publisher->ctx = NULL;  // hiredis frees the context.
+
+  if (status != REDIS_OK) {
+    ERROR("Error in on_disconnect redis callback. status=%d error=%s\n", status, ctx->errstr);
+  }
+  else {
+    INFO("Disconnected from redis server. publisher=%p\n", (void *)publisher);
+  }
+
+  if (!publisher->pool->is_shutting_down) {
+    schedule_reconnect(publisher);
+  }
+}
+
+
+static enum status
+publisher_connect(struct publisher *const publisher) {
+  const struct publisher_pool *const pool = publisher->pool;
+  int status;
+
+  // Connect to the redis server.
+  if (pool->redis_unix_path != NULL) {
+    publisher->ctx = redisAsyncConnectUnix(pool->redis_unix_path);
+  }
+  else {
+    publisher->ctx = redisAsyncConnect(pool->redis_host, pool->redis_port);
+  }
+  if (publisher->ctx == NULL) {
+    ERROR("Failed to connect to redis server %s:%d\n", (pool->redis_unix_path != NULL) ? pool->redis_unix_path : pool->redis_host, pool->redis_port);
+    return STATUS_BAD;
+  }
+  // Set the redis async context's user data attribute to be our publisher object.
+  publisher->ctx->data = publisher;
+
+  // Attach the redis async connection to the libevent event loop.
+  status = redisLibeventAttach(publisher->ctx, pool->event_base);
+  if (status != REDIS_OK) {
+    ERROR("Failed to `redisLibeventAttach`. status=%d\n", status);
+    goto fail;
+  }
+
+  // Setup the redis connect/disconnect callbacks.
+  status = redisAsyncSetConnectCallback(publisher->ctx, &on_connect);
+  if (status != REDIS_OK) {
+    ERROR("Failed to `redisAsyncSetConnectCallback`. status=%d\n", status);
+    goto fail;
+  }
+  status = redisAsyncSetDisconnectCallback(publisher->ctx, &on_disconnect);
+  if (status != REDIS_OK) {
+    ERROR("Failed to `redisAsyncSetDisconnectCallback`. status=%d\n", status);
+    goto fail;
+  }
+
+  return STATUS_OK;
+
+fail:
+  redisAsyncFree(publisher->ctx);
+  publisher->ctx = NULL;
+  return STATUS_BAD;
+}
+
+
+static void
+on_numsub_reply(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  const redisReply *const reply = _reply;
+  struct publisher_pool *const pool = privdata;
+  (void)ctx;
+
+  if (reply == NULL) {
+    return;
+  }
+  else if (reply->type != REDIS_REPLY_ARRAY) {
+    ERROR("Unexpected reply to `PUBSUB NUMSUB`. type=%d error=%s\n", reply->type, (reply->type == REDIS_REPLY_ERROR) ? reply->str : "");
+    return;
+  }
+
+  // The reply alternates between the channels and their numbers of subscribers.
+  for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+    const redisReply *const channel = reply->element[i];
+    const redisReply *const nsubscribers = reply->element[i + 1];
+    if (channel->type == REDIS_REPLY_STRING && nsubscribers->type == REDIS_REPLY_INTEGER) {
+      receiver_cache_on_numsub(pool->receivers, channel->str, channel->len, nsubscribers->integer);
+    }
+  }
+}
+
+
+/**
+ * Forgets the idle channels, and asks for the number of subscribers of the empty channels whose
+ * counts are older than the TTL, over any connection which is up.
+ **/
+static void
+on_refresh_timeout(const evutil_socket_t fd, const short events, void *const arg) {
+  struct publisher_pool *const pool = (struct publisher_pool *)arg;
+  const char *argv[2 + MAX_NUMSUB_NCHANNELS];
+  size_t argvlen[2 + MAX_NUMSUB_NCHANNELS];
+  struct timeval now;
+  (void)fd;
+  (void)events;
+
+  event_base_gettimeofday_cached(pool->event_base, &now);
+  receiver_cache_expire(pool->receivers, &now);
+
+  struct publisher *publisher = NULL;
+  for (size_t i = 0; i != pool->npublishers && publisher == NULL; ++i) {
+    if (pool->publishers[i].is_connected) {
+      publisher = &pool->publishers[i];
+    }
+  }
+  if (publisher == NULL) {
+    return;
+  }
+
+  argv[0] = "PUBSUB";
+  argv[1] = "NUMSUB";
+  argvlen[0] = 6;
+  argvlen[1] = 6;
+  size_t nchannels;
+  do {
+    nchannels = receiver_cache_stale(pool->receivers, &now, argv + 2, argvlen + 2, MAX_NUMSUB_NCHANNELS);
+    if (nchannels == 0) {
+      break;
+    }
+    const int status = redisAsyncCommandArgv(publisher->ctx, &on_numsub_reply, pool, (int)(2 + nchannels), argv, argvlen);
+    if (status != REDIS_OK) {
+      ERROR("async `PUBSUB NUMSUB` command failed. status=%d\n", status);
+      break;
+    }
+  } while (nchannels == MAX_NUMSUB_NCHANNELS);
+}
+
+
+static void
+on_reconnect_timeout(const evutil_socket_t fd, const short events, void *const arg) {
+  struct publisher *const publisher = (struct publisher *)arg;
+  (void)fd;
+  (void)events;
+
+  if (publisher_connect(publisher) != STATUS_OK) {
+    schedule_reconnect(publisher);
+  }
+}
+
+
+/**
+ * Creates a pool of `nconnections` connections to redis. The connections are made over the unix
+ * domain socket `redis_unix_path` if it is not NULL, or to `redis_host`:`redis_port` otherwise.
+ * The strings must outlive the pool, as they are used again when reconnecting.
+ **/
+struct publisher_pool *
+publisher_pool_create(struct event_base *const event_base, const enum redis_backend backend, const char *const redis_host, const uint16_t redis_port, const char *const redis_unix_path, const size_t nconnections) {
+  INFO("Using hiredis version %d.%d.%d\n", HIREDIS_MAJOR, HIREDIS_MINOR, HIREDIS_PATCH);
+
+  if (event_base == NULL || (redis_host == NULL && redis_unix_path == NULL) || nconnections == 0 || nconnections > PUBLISHER_POOL_MAX_CONNECTIONS) {
+    return NULL;
+  }
+
+  struct publisher_pool *const pool = malloc(sizeof(struct publisher_pool) + nconnections * sizeof(struct publisher));
+  if (pool == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(pool, 0, sizeof(struct publisher_pool) + nconnections * sizeof(struct publisher));
+  pool->event_base = event_base;
+  pool->backend = backend;
+  pool->redis_host = redis_host;
+  pool->redis_port = redis_port;
+  pool->redis_unix_path = redis_unix_path;
+  pool->npublishers = nconnections;
+  for (size_t i = 0; i != nconnections; ++i) {
+    struct publisher *const publisher = &pool->publishers[i];
+    publisher->pool = pool;
+    backoff_init(&publisher->reconnect_backoff, &RECONNECT_INITIAL_DELAY, &RECONNECT_MAX_DELAY);
+    publisher->reconnect_event = evtimer_new(event_base, &on_reconnect_timeout, publisher);
+    if (publisher->reconnect_event == NULL) {
+      ERROR0("event_new failed.\n");
+      publisher_pool_destroy(pool);
+      return NULL;
+    }
+    if (publisher_connect(publisher) != STATUS_OK) {
+      publisher_pool_destroy(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+
+enum status
+publisher_pool_destroy(struct publisher_pool *const pool) {
+  if (pool == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  // Freeing the contexts calls back the PUBLISHes waiting for their replies, which releases their
+  // receiver counts, so the receiver cache goes last.
+  pool->is_shutting_down = true;
+  for (size_t i = 0; i != pool->npublishers; ++i) {
+    struct publisher *const publisher = &pool->publishers[i];
+    // Freeing the context calls `on_disconnect` synchronously, before the pool goes away.
+    if (publisher->ctx != NULL) {
+      redisAsyncFree(publisher->ctx);
+    }
+    if (publisher->reconnect_event != NULL) {
+      event_free(publisher->reconnect_event);
+    }
+    outbox_clear(publisher);
+  }
+  if (pool->refresh_event != NULL) {
+    event_free(pool->refresh_event);
+  }
+  receiver_cache_destroy(pool->receivers);
+  free(pool->moved_host);
+  free(pool);
+
+  return STATUS_OK;
+}
+
+
+/**
+ * Turns on dropping PUBLISHes to channels which are known to have no subscribers. Empty channels
+ * are checked for new subscribers every `ttl`, and unless `probe_interval` is NULL, one PUBLISH
+ * per `probe_interval` to each empty channel is sent anyway. Only for the pubsub backend.
+ **/
+enum status
+publisher_pool_suppress_unsubscribed(struct publisher_pool *const pool, const struct timeval *const ttl, const struct timeval *const probe_interval) {
+  if (pool == NULL || ttl == NULL || pool->backend != REDIS_BACKEND_PUBSUB || pool->receivers != NULL) {
+    return STATUS_EINVAL;
+  }
+
+  pool->receivers = receiver_cache_create(ttl, probe_interval);
+  if (pool->receivers == NULL) {
+    return STATUS_ENOMEM;
+  }
+  pool->refresh_event = event_new(pool->event_base, -1, EV_PERSIST, &on_refresh_timeout, pool);
+  if (pool->refresh_event == NULL || event_add(pool->refresh_event, ttl) == -1) {
+    ERROR0("Failed to schedule the receiver count refresh.\n");
+    return STATUS_BAD;
+  }
+
+  return STATUS_OK;
+}
+
+
+/**
+ * Moves the pool over to the redis server at `host`:`port`, such as a newly promoted primary. Each
+ * connection is closed once the replies that it is waiting for have come back, and reconnects to
+ * the new server. The PUBLISHes made in the meantime wait in the outboxes. This must be called from
+ * the pool's thread.
+ **/
+enum status
+publisher_pool_move(struct publisher_pool *const pool, const char *const host, const uint16_t port) {
+  if (pool == NULL || host == NULL) {
+    return STATUS_EINVAL;
+  }
+  char *const copy = strdup(host);
+  if (copy == NULL) {
+    ERROR0("strdup failed.\n");
+    return STATUS_ENOMEM;
+  }
+  free(pool->moved_host);
+  pool->moved_host = copy;
+  pool->redis_host = copy;
+  pool->redis_port = port;
+  pool->redis_unix_path = NULL;
+
+  for (size_t i = 0; i != pool->npublishers; ++i) {
+    struct publisher *const publisher = &pool->publishers[i];
+    if (publisher->ctx == NULL) {
+      // Waiting to reconnect, which will be to the new server.
+      continue;
+    }
+    else if (publisher->is_connected) {
+      // `on_disconnect` reconnects once the connection has closed.
+      publisher->is_connected = false;
+      backoff_reset(&publisher->reconnect_backoff);
+      redisAsyncDisconnect(publisher->ctx);
+    }
+    else {
+      // hiredis doesn't call back a connection which was never made when it is freed.
+      redisAsyncFree(publisher->ctx);
+      publisher->ctx = NULL;
+      if (publisher_connect(publisher) != STATUS_OK) {
+        schedule_reconnect(publisher);
+      }
+    }
+  }
+  return STATUS_OK;
+}
+
+
+/**
+ * Sets the function which is called with each `-MOVED` or `-ASK` error replied to an SPUBLISH.
+ * Only for the Cluster backend.
+ **/
+enum status
+publisher_pool_on_redirect(struct publisher_pool *const pool, const publisher_pool_redirect_t fn, void *const arg) {
+  if (pool == NULL || pool->backend != REDIS_BACKEND_CLUSTER) {
+    return STATUS_EINVAL;
+  }
+  pool->on_redirect = fn;
+  pool->on_redirect_arg = arg;
+  return STATUS_OK;
+}
+
+
+/**
+ * Forgets what is known about the channel's subscribers, for when it has just gained one.
+ **/
+void
+publisher_pool_forget_receivers(struct publisher_pool *const pool, const char *const channel, const size_t channel_nbytes) {
+  if (pool != NULL && pool->receivers != NULL) {
+    receiver_cache_forget(pool->receivers, channel, channel_nbytes);
+  }
+}
+
+
+uint64_t
+publisher_pool_nsuppressed(const struct publisher_pool *const pool) {
+  return (pool == NULL || pool->receivers == NULL) ? 0 : receiver_cache_nsuppressed(pool->receivers);
+}
+
+
+/**
+ * PUBLISHes the message, or queues it in the connection's outbox if the connection is down.
+ * STATUS_DISCONNECTED is returned if the message had to be dropped because the outbox is full.
+ * Messages to channels known to have no subscribers are dropped without an error.
+ **/
+enum status
+publisher_pool_publish(struct publisher_pool *const pool, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes) {
+  struct receiver_count *count = NULL;
+
+  if (pool == NULL || channel == NULL || message == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  if (pool->receivers != NULL) {
+    struct timeval now;
+    event_base_gettimeofday_cached(pool->event_base, &now);
+    if (!receiver_cache_check(pool->receivers, channel, channel_nbytes, &now, &count)) {
+      return STATUS_OK;
+    }
+  }
+
+  // Always publish a channel over the same connection.
+  struct publisher *const publisher = &pool->publishers[XXH64(channel, channel_nbytes, 0) % pool->npublishers];
+  if (!publisher->is_connected) {
+    return outbox_push(publisher, channel, channel_nbytes, message, message_nbytes);
+  }
+  return send_publish(publisher, channel, channel_nbytes, message, message_nbytes, count);
+}
+
+
+static void
+on_range_reply(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  const redisReply *const reply = _reply;
+  struct range_read *const read = privdata;
+  struct stream_entry *entries = NULL;
+  size_t nentries = 0;
+  enum status status = STATUS_OK;
+  (void)ctx;
+
+  // hiredis calls back without a reply if the connection goes away first.
+  if (reply == NULL) {
+    status = STATUS_DISCONNECTED;
+  }
+  else if (reply->type != REDIS_REPLY_ARRAY) {
+    ERROR("Unexpected reply to `XRANGE`. type=%d error=%s\n", reply->type, (reply->type == REDIS_REPLY_ERROR) ? reply->str : "");
+    status = STATUS_BAD;
+  }
+  else if (reply->elements != 0) {
+    entries = malloc(reply->elements * sizeof(struct stream_entry));
+    if (entries == NULL) {
+      ERROR0("malloc failed.\n");
+      status = STATUS_ENOMEM;
+    }
+    else {
+      nentries = stream_entries_parse(reply, entries, reply->elements);
+    }
+  }
+
+  read->fn(entries, nentries, status, read->arg);
+  free(entries);
+  free(read);
+}
+
+
+/**
+ * Reads up to `max_nentries` entries after the ID `after` from the channel's stream, over the
+ * connection which the channel is published on. `fn` is always called exactly once with the
+ * entries, unless an error is returned straight away. The entries are only valid during the call.
+ **/
+enum status
+publisher_pool_read_range(struct publisher_pool *const pool, const char *const channel, const size_t channel_nbytes, const struct stream_id *const after, const size_t max_nentries, const publisher_pool_range_t fn, void *const arg) {
+  char start[STREAM_ID_MAX_NBYTES];
+  char count[24];
+  struct stream_id first;
+
+  if (pool == NULL || channel == NULL || after == NULL || fn == NULL || pool->backend != REDIS_BACKEND_STREAMS) {
+    return STATUS_EINVAL;
+  }
+
+  struct publisher *const publisher = &pool->publishers[XXH64(channel, channel_nbytes, 0) % pool->npublishers];
+  if (!publisher->is_connected) {
+    return STATUS_DISCONNECTED;
+  }
+  struct range_read *const read = malloc(sizeof(struct range_read));
+  if (read == NULL) {
+    ERROR0("malloc failed.\n");
+    return STATUS_ENOMEM;
+  }
+  read->fn = fn;
+  read->arg = arg;
+
+  // XRANGE is inclusive, so start from the ID just after `after`.
+  stream_id_next(after, &first);
+  const size_t start_nbytes = stream_id_format(&first, start);
+  const size_t count_nbytes = (size_t)snprintf(count, sizeof(count), "%zu", max_nentries);
+  const char *argv[6] = {"XRANGE", channel, start, "+", "COUNT", count};
+  const size_t argvlen[6] = {6, channel_nbytes, start_nbytes, 1, 5, count_nbytes};
+  const int status = redisAsyncCommandArgv(publisher->ctx, &on_range_reply, read, 6, argv, argvlen);
+  if (status != REDIS_OK) {
+    ERROR("async `XRANGE` command failed. status=%d\n", status);
+    free(read);
+    return STATUS_BAD;
+  }
+
+  return STATUS_OK;
+}
@@ -0,0 +1,35 @@
+/**
+ * A pool of redis connections used for PUBLISHing (or XADDing), all bound to the same libevent loop.
+ * Each channel is always published over the same connection, so per-channel ordering is kept.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <event2/event.h>
+
+#include "status.h"
+#include "streams.h"
+
+#define PUBLISHER_POOL_MAX_CONNECTIONS (64)
+
+// Forwards declaration.
+struct publisher_pool;
+
+// Called with the entries read by `publisher_pool_read_range`, which are only valid during the call.
+typedef void (*publisher_pool_range_t)(const struct stream_entry *entries, size_t nentries, enum status status, void *arg);
+// Called with a `-MOVED` or `-ASK` error, which is only valid during the call.
+typedef void (*publisher_pool_redirect_t)(const char *error, size_t error_nbytes, void *arg);
+
+
+struct publisher_pool *publisher_pool_create(struct event_base *event_base, enum redis_backend backend, const char *redis_host, uint16_t redis_port, const char *redis_unix_path, size_t nconnections);
+enum status            publisher_pool_destroy(struct publisher_pool *pool);
+enum status            publisher_pool_move(struct publisher_pool *pool, const char *host, uint16_t port);
+enum status            publisher_pool_on_redirect(struct publisher_pool *pool, publisher_pool_redirect_t fn, void *arg);
+enum status            publisher_pool_suppress_unsubscribed(struct publisher_pool *pool, const struct timeval *ttl, const struct timeval *probe_interval);
+void                   publisher_pool_forget_receivers(struct publisher_pool *pool, const char *channel, size_t channel_nbytes);
+uint64_t               publisher_pool_nsuppressed(const struct publisher_pool *pool);
+enum status            publisher_pool_publish(struct publisher_pool *pool, const char *channel, size_t channel_nbytes, const char *message, size_t message_nbytes);
+enum status            publisher_pool_read_range(struct publisher_pool *pool, const char *channel, size_t channel_nbytes, const struct stream_id *after, size_t max_nentries, publisher_pool_range_t fn, void *arg);
@@ -0,0 +1,2282 @@
+/**
+ * The pubsub hub owns the process-wide redis SUBSCRIBE connections, one per redis shard. Each
+ * worker thread's pubsub_manager refcounts its own subscribers, and only tells the hub when a
+ * channel gains its first local subscriber or loses its last one. The hub records which managers
+ * are interested in each channel. A channel is only SUBSCRIBEd to once per process, so the redis
+ * command volume scales with the number of distinct channels rather than the number of clients.
+ * Incoming messages are handed to the managers that are interested in the channel.
+ *
+ * When no manager is interested in a channel any more, the channel lingers for a while before it
+ * is UNSUBSCRIBEd from, so that clients which flap their connections don't churn the redis
+ * subscription. A lingering channel is revived for free if it is subscribed to again. Expired
+ * channels are UNSUBSCRIBEd from in batches, with one multi-channel UNSUBSCRIBE per tick.
+ * Likewise, new channels are SUBSCRIBEd to with one multi-channel SUBSCRIBE per batch of commands.
+ *
+ * Patterns are kept in the same table as channels, flagged as patterns, and go through exactly the
+ * same refcounting, lingering and batching with PSUBSCRIBE and PUNSUBSCRIBE. Each `pmessage` names
+ * the pattern that it matched, and is handed to the managers interested in that pattern.
+ *
+ * Channels are spread over the shards by a consistent hash ring (see shard_ring.h), and each
+ * channel is only SUBSCRIBEd to on its own shard. A PUBLISH only reaches the subscribers on the
+ * server that it was sent to, so patterns are PSUBSCRIBEd to on every shard. When a shard is added
+ * at runtime, the channels which now hash to it are SUBSCRIBEd to on it as soon as it connects,
+ * and their old subscriptions are kept for PUBSUB_HUB_MIGRATION_GRACE_S, so that messages from the
+ * publishers which haven't switched over yet still arrive. There is no handshake with the
+ * publishers: they are expected to switch well within the grace. Shards can't be removed.
+ *
+ * If the connection to a shard is lost, the hub reconnects to it with exponential backoff. The
+ * channel table is kept across the outage, and every channel on the shard is re-SUBSCRIBEd to in
+ * batches once the connection is back. Every connected shard is PINGed each PROBE_INTERVAL, and a
+ * connection whose last PING is still unanswered is dropped, so that a dead server is noticed even
+ * if it never closes the connection. The first shard can also be subscribed on its replicas, as
+ * redis propagates every PUBLISH to them. It reconnects to the next of its candidate servers each
+ * time, so losing a replica only costs one reconnection.
+ *
+ * With the Streams backend, each channel is a stream instead. A new channel starts from the last
+ * ID in its stream, found with XREVRANGE, and from then on all of a shard's channels are read by a
+ * single `XREAD BLOCK` which is re-issued as soon as it returns, so one connection carries every
+ * channel on the shard however many there are. The XREAD only blocks for READ_BLOCK_MS at most,
+ * which bounds how long the XREVRANGE of a new channel, queued behind it, has to wait. The hub
+ * remembers the last ID it has seen on each channel, so nothing is missed across a reconnection.
+ * A channel which moves to a new shard starts again from the end of its stream there, as stream
+ * history isn't moved between shards. Patterns are not supported.
+ *
+ * With the Cluster backend, each channel is a shard channel, placed by its hash slot rather than
+ * on the ring (see cluster_slots.h). The slot table is read with CLUSTER SHARDS over a short-lived
+ * connection, and every primary found is added as a shard. Channels are SSUBSCRIBEd to one per
+ * command, as a multi-channel SSUBSCRIBE must stay within one slot. A `-MOVED` error, or a
+ * `sunsubscribe` pushed by a node which has lost a slot, has the table read again, and the
+ * channels whose slots have moved are SSUBSCRIBEd to on their new owners. The workers' brokers
+ * copy the slot table whenever its generation changes. Patterns are not supported.
+ *
+ * With local delivery, a worker hands the messages that its clients publish straight to its own
+ * subscribers, and to the other workers through the hub, as well as PUBLISHing them with a tag
+ * naming this node. The hub then skips the `message` echo of its own node's messages, as they
+ * have already been delivered. `pmessage` echoes are still delivered, as pattern subscribers only
+ * get their messages from redis.
+ *
+ * Replies on the SUBSCRIBE connection are built by the functions in pubsub_reply.c, which read
+ * each message payload into a reference counted buffer. The same buffer is handed to every
+ * interested manager, so a message is never copied per worker.
+ *
+ * The hub runs its own event loop on a dedicated ingest thread which does nothing but read from
+ * redis, so redis never sees back-pressure from a busy worker. All of the redis state is only
+ * touched from the ingest thread. The worker threads talk to the hub through a locked command
+ * queue, and the hub hands messages to the workers through lock-free rings.
+ **/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+
+#include "backoff.h"
+#include "cluster_slots.h"
+#include "hashtable.h"
+#include "logging.h"
+#include "pubsub_hub.h"
+#include "pubsub_manager.h"
+#include "pubsub_reply.h"
+#include "shard_ring.h"
+#include "xxhash.h"
+
+#define MAX_COMMAND_NCHANNELS (1024)  // Bounds the size of a single SUBSCRIBE or UNSUBSCRIBE command.
+#define READ_COUNT (256)  // The most entries read from each stream by a single XREAD.
+#define READ_BLOCK_MS "100"
+
+static const struct timeval MAX_LINGER_TICK = {.tv_sec = 0, .tv_usec = 100000};
+static const struct timeval RECONNECT_INITIAL_DELAY = {.tv_sec = 0, .tv_usec = 100000};
+static const struct timeval RECONNECT_MAX_DELAY = {.tv_sec = 10, .tv_usec = 0};
+static const struct timeval READ_RETRY_DELAY = {.tv_sec = 1, .tv_usec = 0};
+static const struct timeval MIGRATION_GRACE = {.tv_sec = PUBSUB_HUB_MIGRATION_GRACE_S, .tv_usec = 0};
+static const struct timeval TOPOLOGY_REFRESH_INTERVAL = {.tv_sec = 30, .tv_usec = 0};
+static const struct timeval TOPOLOGY_MIN_INTERVAL = {.tv_sec = 0, .tv_usec = 100000};
+static const struct timeval PROBE_INTERVAL = {.tv_sec = 5, .tv_usec = 0};
+
+// hiredis only hands the reply to a PING on a subscribed connection to its callback from its 1.1
+// release. Before that, only the Streams backend's connections are probed.
+#define HAS_SUBSCRIBED_PING (HIREDIS_MAJOR > 1 || (HIREDIS_MAJOR == 1 && HIREDIS_MINOR >= 1))
+
+// Each slot's shard is kept in a byte.
+_Static_assert(SHARD_RING_MAX_SHARDS <= UINT8_MAX + 1, "too many shards for the slot table");
+
+
+enum command_type {
+  COMMAND_SUBSCRIBE,
+  COMMAND_UNSUBSCRIBE,
+  COMMAND_PSUBSCRIBE,
+  COMMAND_PUNSUBSCRIBE,
+  COMMAND_DELIVER,
+  COMMAND_ADD_SHARD,  // The shard's name is in place of the channel.
+  COMMAND_REDIRECT,   // A publisher's `-MOVED` error is in place of the channel.
+  COMMAND_MOVE_PRIMARY,  // The first shard's new "host:port" is in place of the channel.
+};
+
+
+struct command {
+  enum command_type type;
+  size_t index;                    // The index of the manager which issued the command.
+  struct pubsub_payload *payload;  // The message to deliver, for COMMAND_DELIVER only.
+  struct command *next;
+  size_t channel_nbytes;
+  char channel[];
+};
+
+
+struct channel {
+  uint64_t hash;  // Of the name and whether it's a pattern.
+  bool is_pattern;
+  size_t shard;        // The shard which the channel lives on. Patterns are subscribed to on every shard.
+  size_t ninterested;  // The number of managers with local subscribers.
+  bool *interested;    // Whether or not each manager has local subscribers.
+  struct channel *subscribe_next;  // Linked into the hub's pending SUBSCRIBE list.
+
+  // Linked into the hub's linger list, in order of expiry, while no manager is interested.
+  struct timeval linger_expiry;
+  struct channel *linger_next;
+  struct channel *linger_prev;
+
+  // Linked into the hub's reading list once the Streams backend knows where to read it from.
+  bool is_reading;
+  struct stream_id last_id;
+  struct channel *read_next;
+  struct channel *read_prev;
+  size_t name_nbytes;
+  char name[];
+};
+
+
+// Identifies a channel or pattern in the hub's table.
+struct channel_key {
+  const char *name;
+  size_t name_nbytes;
+  bool is_pattern;
+};
+
+
+// A redis server that a share of the channels live on, with its own SUBSCRIBE connection.
+// A primary address that the first shard has moved away from. It is kept, as
+// `pubsub_hub_shard_address` may have handed it out.
+struct stale_host {
+  struct stale_host *next;
+  char *host;
+};
+
+
+struct shard {
+  struct pubsub_hub *hub;
+  size_t index;
+  const char *host;  // The candidate in use.
+  uint16_t port;
+  atomic_bool is_connected;
+  redisAsyncContext *ctx;  // NULL while there is no connection or connection attempt.
+  struct backoff reconnect_backoff;
+  struct event *reconnect_event;
+  bool is_probe_pending;  // Whether the last health probe PING is still unanswered.
+
+  // The servers that the shard's channels can be subscribed on: the shard's primary, and any
+  // replicas. The shard fails over to the next one whenever its connection is lost.
+  size_t ncandidates;
+  size_t candidate;
+  char *candidate_hosts[PUBSUB_HUB_MAX_CANDIDATES];
+  uint16_t candidate_ports[PUBSUB_HUB_MAX_CANDIDATES];
+  struct stale_host *stale_hosts;
+  bool is_moving;  // Whether the connection is being dropped to reconnect to a moved primary.
+
+  // Channels which are being read with XREAD, for the Streams backend.
+  struct channel *read_head;
+  size_t nreading;
+  bool is_read_pending;  // Whether an XREAD is in flight.
+  struct event *read_retry_event;
+};
+
+
+// A subscription left on a channel's old shard after the channel moved to a new one, until the
+// publishers have all moved over too.
+struct retired_subscription {
+  struct retired_subscription *next;
+  size_t shard;
+  struct timeval expiry;
+  char name[];
+};
+
+
+struct pubsub_hub {
+  // Manage redis connection state.
+  enum redis_backend backend;
+  bool is_shutting_down;
+
+  // The shards, and the ring which maps channels to them.
+  struct shard_ring *ring;
+  atomic_size_t nshards;
+  struct shard *shards[SHARD_RING_MAX_SHARDS];
+  struct retired_subscription *retired_head;
+  struct retired_subscription *retired_tail;
+  struct event *retire_event;
+
+  // With the Cluster backend, the shards are the cluster's primaries, and each slot belongs to the
+  // shard in `slot_shards`. The workers copy the table whenever the generation changes. CLUSTER
+  // SHARDS is sent on a connection of its own, as the SUBSCRIBE connections can't send it.
+  pthread_mutex_t slots_lock;
+  uint8_t slot_shards[CLUSTER_NSLOTS];
+  atomic_uint_least64_t slots_generation;
+  bool is_slots_known;        // Whether CLUSTER SHARDS has been read yet.
+  struct event *slots_event;  // Moves the channels whose slots have changed owner.
+  redisAsyncContext *topology_ctx;
+  size_t topology_shard;      // The shard that CLUSTER SHARDS is next sent to.
+  bool is_topology_wanted;    // Whether to read CLUSTER SHARDS again as soon as possible.
+  struct backoff topology_backoff;
+  struct event *topology_event;
+
+  // PINGs every connected shard, to find servers which have gone away without closing the connection.
+  struct event *probe_event;
+
+  // The ingest thread and the libevent loop that the redis async connection is bound to.
+  struct event_base *event_base;
+  pthread_t thread;
+  bool is_running;
+
+  // Commands queued up by the worker threads.
+  pthread_mutex_t commands_lock;
+  struct command *commands_head;
+  struct command *commands_tail;
+  struct event *commands_event;
+
+  // Identifies this node's messages when local delivery is on, or 0.
+  uint64_t node_id;
+
+  // The registered per-worker managers.
+  size_t nmanagers;
+  struct pubsub_manager *managers[PUBSUB_HUB_MAX_MANAGERS];
+  pubsub_hub_subscribed_t subscribed_fns[PUBSUB_HUB_MAX_MANAGERS];
+  void *subscribed_args[PUBSUB_HUB_MAX_MANAGERS];
+
+  // Keep track of the subscribed channels.
+  struct hashtable *channels;  // Keyed by name and whether it's a pattern.
+  struct channel *pending_subscribes;  // New channels and patterns waiting to be (P)SUBSCRIBEd to.
+
+  // Channels which no manager is interested in, waiting to be UNSUBSCRIBEd from.
+  struct timeval linger;
+  struct timeval linger_tick;
+  struct event *linger_event;
+  struct channel *linger_head;
+  struct channel *linger_tail;
+};
+
+
+static void
+channel_destroy(struct channel *const channel) {
+  free(channel->interested);
+  free(channel);
+}
+
+
+static bool
+channel_matches(const void *const value, const void *const key) {
+  const struct channel *const channel = value;
+  const struct channel_key *const k = key;
+  return channel->is_pattern == k->is_pattern && channel->name_nbytes == k->name_nbytes && memcmp(channel->name, k->name, k->name_nbytes) == 0;
+}
+
+
+static inline uint64_t
+channel_hash(const char *const name, const size_t name_nbytes, const bool is_pattern) {
+  return XXH64(name, name_nbytes, is_pattern);
+}
+
+
+static struct channel *
+channel_find(struct pubsub_hub *const hub, const char *const name, const size_t name_nbytes, const bool is_pattern) {
+  const struct channel_key key = {.name = name, .name_nbytes = name_nbytes, .is_pattern = is_pattern};
+  return hashtable_find(hub->channels, channel_hash(name, name_nbytes, is_pattern), &key);
+}
+
+
+static void
+channel_forget(struct pubsub_hub *const hub, struct channel *const channel) {
+  const struct channel_key key = {.name = channel->name, .name_nbytes = channel->name_nbytes, .is_pattern = channel->is_pattern};
+  hashtable_remove(hub->channels, channel->hash, &key);
+}
+
+
+static void
+linger_list_append(struct pubsub_hub *const hub, struct channel *const channel) {
+  struct timeval now;
+
+  event_base_gettimeofday_cached(hub->event_base, &now);
+  evutil_timeradd(&now, &hub->linger, &channel->linger_expiry);
+  channel->linger_next = NULL;
+  channel->linger_prev = hub->linger_tail;
+  if (hub->linger_tail == NULL) {
+    hub->linger_head = channel;
+  }
+  else {
+    hub->linger_tail->linger_next = channel;
+  }
+  hub->linger_tail = channel;
+}
+
+
+static void
+linger_list_remove(struct pubsub_hub *const hub, struct channel *const channel) {
+  if (channel->linger_prev == NULL) {
+    hub->linger_head = channel->linger_next;
+  }
+  else {
+    channel->linger_prev->linger_next = channel->linger_next;
+  }
+  if (channel->linger_next == NULL) {
+    hub->linger_tail = channel->linger_prev;
+  }
+  else {
+    channel->linger_next->linger_prev = channel->linger_prev;
+  }
+  channel->linger_next = NULL;
+  channel->linger_prev = NULL;
+}
+
+
+static void
+reading_list_append(struct shard *const shard, struct channel *const channel) {
+  channel->is_reading = true;
+  channel->read_prev = NULL;
+  channel->read_next = shard->read_head;
+  if (shard->read_head != NULL) {
+    shard->read_head->read_prev = channel;
+  }
+  shard->read_head = channel;
+  ++shard->nreading;
+}
+
+
+static void
+reading_list_remove(struct pubsub_hub *const hub, struct channel *const channel) {
+  struct shard *const shard = hub->shards[channel->shard];
+  if (!channel->is_reading) {
+    return;
+  }
+  if (channel->read_prev == NULL) {
+    shard->read_head = channel->read_next;
+  }
+  else {
+    channel->read_prev->read_next = channel->read_next;
+  }
+  if (channel->read_next != NULL) {
+    channel->read_next->read_prev = channel->read_prev;
+  }
+  channel->is_reading = false;
+  channel->read_next = NULL;
+  channel->read_prev = NULL;
+  --shard->nreading;
+}
+
+
+// A multi-channel command for a shard which is built up a channel at a time, and sent whenever it
+// is full.
+struct channels_command {
+  struct shard *shard;
+  redisCallbackFn *fn;
+  size_t max_nchannels;
+  size_t argc;
+  const char *argv[1 + MAX_COMMAND_NCHANNELS];
+};
+
+
+static void
+send_channels_command(struct shard *const shard, redisCallbackFn *const fn, const size_t argc, const char **const argv) {
+  // While disconnected there is nothing to SUBSCRIBE or UNSUBSCRIBE from. The shard's part of the
+  // channel table is re-SUBSCRIBEd to on reconnection.
+  if (!atomic_load(&shard->is_connected)) {
+    return;
+  }
+
+  DEBUG("Sending %s for %zu channels to shard %zu\n", argv[0], argc - 1, shard->index);
+  const int status = redisAsyncCommandArgv(shard->ctx, fn, NULL, (int)argc, argv, NULL);
+  if (status != REDIS_OK) {
+    ERROR("async `%s` command for %zu channels failed. status=%d\n", argv[0], argc - 1, status);
+  }
+}
+
+
+static void
+channels_command_init(struct channels_command *const command, struct shard *const shard, const char *const name, redisCallbackFn *const fn) {
+  command->shard = shard;
+  command->fn = fn;
+  // All of the channels of an SSUBSCRIBE or SUNSUBSCRIBE must be in the same slot, so they are sent
+  // one at a time. They are still pipelined.
+  command->max_nchannels = (shard->hub->backend == REDIS_BACKEND_CLUSTER) ? 1 : MAX_COMMAND_NCHANNELS;
+  command->argv[0] = name;
+  command->argc = 1;
+}
+
+
+static void
+channels_command_flush(struct channels_command *const command) {
+  if (command->argc != 1) {
+    send_channels_command(command->shard, command->fn, command->argc, command->argv);
+    command->argc = 1;
+  }
+}
+
+
+static void
+channels_command_append(struct channels_command *const command, const char *const name) {
+  command->argv[command->argc++] = name;
+  if (command->argc == 1 + command->max_nchannels) {
+    channels_command_flush(command);
+  }
+}
+
+
+// The commands for channels. Sharded pubsub has its own, which only reach the slot's owner.
+static inline const char *
+subscribe_command(const struct pubsub_hub *const hub) {
+  return (hub->backend == REDIS_BACKEND_CLUSTER) ? "SSUBSCRIBE" : "SUBSCRIBE";
+}
+
+
+static inline const char *
+unsubscribe_command(const struct pubsub_hub *const hub) {
+  return (hub->backend == REDIS_BACKEND_CLUSTER) ? "SUNSUBSCRIBE" : "UNSUBSCRIBE";
+}
+
+
+// Returns the shard that a channel lives on, by its slot with the Cluster backend.
+static size_t
+channel_shard(const struct pubsub_hub *const hub, const char *const name, const size_t name_nbytes) {
+  if (hub->backend == REDIS_BACKEND_CLUSTER) {
+    return hub->slot_shards[cluster_key_slot(name, name_nbytes)];
+  }
+  return shard_ring_find(hub->ring, name, name_nbytes);
+}
+
+
+// Whether a channel or pattern is subscribed to on the shard.
+static inline bool
+is_on_shard(const struct channel *const channel, const struct shard *const shard) {
+  return channel->is_pattern || channel->shard == shard->index;
+}
+
+
+/**
+ * UNSUBSCRIBEs and PUNSUBSCRIBEs from all of the lingering channels and patterns which have
+ * expired, using as few commands as possible. With the Streams backend, the channels are simply
+ * left out of the next XREAD.
+ **/
+static void
+expire_lingering_channels(struct pubsub_hub *const hub) {
+  struct channel *channel, *expired;
+  struct channels_command unsubscribe, punsubscribe;
+  struct timeval now;
+  size_t nexpired;
+
+  event_base_gettimeofday_cached(hub->event_base, &now);
+  do {
+    // Take a batch of the expired channels off the linger list and out of the table. The batch is
+    // linked through `linger_next`, which is otherwise unused once off the linger list.
+    expired = NULL;
+    for (nexpired = 0; nexpired != MAX_COMMAND_NCHANNELS; ++nexpired) {
+      channel = hub->linger_head;
+      if (channel == NULL || evutil_timercmp(&channel->linger_expiry, &now, >)) {
+        break;
+      }
+      linger_list_remove(hub, channel);
+      channel_forget(hub, channel);
+      channel->linger_next = expired;
+      expired = channel;
+      if (hub->backend == REDIS_BACKEND_STREAMS) {
+        reading_list_remove(hub, channel);
+      }
+    }
+
+    // hiredis formats the commands straight away, so the channels can be freed afterwards.
+    for (size_t i = 0; i != hub->nshards && hub->backend != REDIS_BACKEND_STREAMS; ++i) {
+      channels_command_init(&unsubscribe, hub->shards[i], unsubscribe_command(hub), NULL);
+      channels_command_init(&punsubscribe, hub->shards[i], "PUNSUBSCRIBE", NULL);
+      for (channel = expired; channel != NULL; channel = channel->linger_next) {
+        if (is_on_shard(channel, hub->shards[i])) {
+          channels_command_append(channel->is_pattern ? &punsubscribe : &unsubscribe, channel->name);
+        }
+      }
+      channels_command_flush(&unsubscribe);
+      channels_command_flush(&punsubscribe);
+    }
+    for (channel = expired; channel != NULL; channel = expired) {
+      expired = channel->linger_next;
+      channel_destroy(channel);
+    }
+  } while (nexpired == MAX_COMMAND_NCHANNELS);
+}
+
+
+static void
+on_linger_tick(const evutil_socket_t fd, const short events, void *const arg) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)arg;
+  (void)fd;
+  (void)events;
+
+  expire_lingering_channels(hub);
+  if (hub->linger_head != NULL) {
+    event_add(hub->linger_event, &hub->linger_tick);
+  }
+}
+
+
+static void
+on_subscribed_reply_message(struct pubsub_hub *const hub, const redisReply *const pattern, const redisReply *const channel_name, struct pubsub_payload *const payload) {
+  const bool is_pattern = pattern != NULL;
+  const struct channel *const channel = is_pattern ? channel_find(hub, pattern->str, pattern->len, true) : channel_find(hub, channel_name->str, channel_name->len, false);
+  if (channel == NULL) {
+    return;
+  }
+
+  // This node's own channel messages have already been delivered locally.
+  if (!pubsub_payload_needs_delivery(payload, hub->node_id, is_pattern)) {
+    return;
+  }
+
+  // Hand a reference to the payload to each of the managers with local subscribers.
+  for (size_t i = 0; i != hub->nmanagers; ++i) {
+    if (channel->interested[i]) {
+      pubsub_manager_deliver(hub->managers[i], is_pattern ? pattern->str : NULL, channel_name->str, channel_name->len, payload);
+    }
+  }
+}
+
+
+// Forward declarations.
+static void apply_redirect(struct pubsub_hub *hub, const char *error, size_t error_nbytes);
+static void refresh_topology(struct pubsub_hub *hub);
+
+
+/**
+ * Handles a `subscribe` or `ssubscribe` acknowledgement from a shard. From now on, every PUBLISH to
+ * the channel counts the subscription, so each worker's publishers are told to stop trusting any
+ * count which said that the channel had no receivers. Telling them any earlier, say as soon as the
+ * SUBSCRIBE was queued, would let a PUBLISH which overtakes the SUBSCRIBE cache the channel as
+ * empty again.
+ **/
+static void
+on_subscribe_ack(struct shard *const shard, const redisReply *const name) {
+  struct pubsub_hub *const hub = shard->hub;
+  const struct channel *const channel = channel_find(hub, name->str, name->len, false);
+  if (channel == NULL || channel->shard != shard->index) {
+    return;
+  }
+  for (size_t i = 0; i != hub->nmanagers; ++i) {
+    if (hub->subscribed_fns[i] != NULL) {
+      hub->subscribed_fns[i](name->str, name->len, hub->subscribed_args[i]);
+    }
+  }
+}
+
+
+/**
+ * Handles an `sunsubscribe` from a shard. Unless the hub has already moved the channel elsewhere or
+ * forgotten it, the shard has given up the channel's slot and dropped the subscription itself, so
+ * the cluster's slots are read again.
+ **/
+static void
+on_sunsubscribe(struct shard *const shard, const redisReply *const name) {
+  const struct channel *const channel = channel_find(shard->hub, name->str, name->len, false);
+  if (channel != NULL && channel->shard == shard->index) {
+    INFO("Redis shard %s:%d dropped the subscription to channel '%s'\n", shard->host, shard->port, name->str);
+    refresh_topology(shard->hub);
+  }
+}
+
+
+static void
+on_subscribed_reply(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  struct shard *const shard = (struct shard *)ctx->data;
+  struct pubsub_hub *const hub = shard->hub;
+  const redisReply *const reply = _reply;
+  struct pubsub_payload *payload;
+  (void)privdata;
+
+  if (reply == NULL) {
+    return;
+  }
+  else if (reply->type == REDIS_REPLY_ERROR) {
+    // A shard which doesn't own a channel's slot redirects its SSUBSCRIBE.
+    WARNING("Error reply on subscription channel of redis shard %s:%d: %s\n", shard->host, shard->port, reply->str);
+    apply_redirect(hub, reply->str, reply->len);
+    return;
+  }
+
+  switch (pubsub_reply_kind(reply)) {
+  case PUBSUB_REPLY_MESSAGE:
+  case PUBSUB_REPLY_SMESSAGE:
+    payload = pubsub_reply_payload(reply);
+    if (payload != NULL) {
+      DEBUG("Received message on channel '%s' of %zu bytes\n", reply->element[1]->str, payload->nbytes);
+      on_subscribed_reply_message(hub, NULL, reply->element[1], payload);
+    }
+    break;
+  case PUBSUB_REPLY_PMESSAGE:
+    payload = pubsub_reply_payload(reply);
+    if (payload != NULL) {
+      DEBUG("Received message on channel '%s' via pattern '%s' of %zu bytes\n", reply->element[2]->str, reply->element[1]->str, payload->nbytes);
+      on_subscribed_reply_message(hub, reply->element[1], reply->element[2], payload);
+    }
+    break;
+  case PUBSUB_REPLY_SUNSUBSCRIBE:
+    on_sunsubscribe(shard, reply->element[1]);
+    break;
+  case PUBSUB_REPLY_SUBSCRIBE:
+  case PUBSUB_REPLY_SSUBSCRIBE:
+    on_subscribe_ack(shard, reply->element[1]);
+    break;
+  case PUBSUB_REPLY_UNSUBSCRIBE:
+  case PUBSUB_REPLY_PSUBSCRIBE:
+  case PUBSUB_REPLY_PUNSUBSCRIBE:
+    // Do nothing.
+    break;
+  default:
+    ERROR("Received unknown reply on subscription channel. type=%d elements=%zu\n", reply->type, (size_t)reply->elements);
+    break;
+  }
+}
+
+
+// Forward declaration.
+static void on_streams_read(redisAsyncContext *ctx, void *reply, void *privdata);
+
+
+/**
+ * XREADs from every channel being read, from the last ID seen on each, unless an XREAD is already
+ * in flight. The ID buffer is freed straight away, as hiredis formats the command as it is sent.
+ **/
+static void
+read_streams(struct shard *const shard) {
+  struct channel *channel;
+  char count[24];
+  size_t i;
+
+  if (shard->is_read_pending || shard->nreading == 0 || !atomic_load(&shard->is_connected)) {
+    return;
+  }
+
+  const size_t argc = 6 + 2 * shard->nreading;
+  const char **const argv = malloc(argc * sizeof(char *));
+  char *const ids = malloc(shard->nreading * STREAM_ID_MAX_NBYTES);
+  if (argv == NULL || ids == NULL) {
+    ERROR0("malloc failed.\n");
+    goto done;
+  }
+  snprintf(count, sizeof(count), "%d", READ_COUNT);
+  argv[0] = "XREAD";
+  argv[1] = "COUNT";
+  argv[2] = count;
+  argv[3] = "BLOCK";
+  argv[4] = READ_BLOCK_MS;
+  argv[5] = "STREAMS";
+  for (i = 0, channel = shard->read_head; channel != NULL; ++i, channel = channel->read_next) {
+    char *const id = ids + i * STREAM_ID_MAX_NBYTES;
+    stream_id_format(&channel->last_id, id);
+    argv[6 + i] = channel->name;
+    argv[6 + shard->nreading + i] = id;
+  }
+
+  const int status = redisAsyncCommandArgv(shard->ctx, &on_streams_read, NULL, (int)argc, argv, NULL);
+  if (status != REDIS_OK) {
+    ERROR("async `XREAD` command for %zu channels failed. status=%d\n", shard->nreading, status);
+    goto done;
+  }
+  shard->is_read_pending = true;
+
+done:
+  free(argv);
+  free(ids);
+}
+
+
+static void
+on_stream_entries(struct pubsub_hub *const hub, struct channel *const channel, const redisReply *const reply) {
+  struct stream_entry entries[READ_COUNT];
+
+  const size_t nentries = stream_entries_parse(reply, entries, READ_COUNT);
+  const size_t name_nbytes = strlen(channel->name);
+  for (size_t i = 0; i != nentries; ++i) {
+    if (stream_id_compare(&entries[i].id, &channel->last_id) <= 0) {
+      continue;
+    }
+    channel->last_id = entries[i].id;
+    if (channel->ninterested == 0) {
+      continue;
+    }
+
+    struct pubsub_payload *const payload = pubsub_payload_create(entries[i].data, entries[i].data_nbytes);
+    if (payload == NULL) {
+      continue;
+    }
+    payload->id = entries[i].id;
+    for (size_t j = 0; j != hub->nmanagers; ++j) {
+      if (channel->interested[j]) {
+        pubsub_manager_deliver(hub->managers[j], NULL, channel->name, name_nbytes, payload);
+      }
+    }
+    pubsub_payload_release(payload);
+  }
+}
+
+
+static void
+on_streams_read(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  struct shard *const shard = (struct shard *)ctx->data;
+  struct pubsub_hub *const hub = shard->hub;
+  const redisReply *const reply = _reply;
+  (void)privdata;
+
+  shard->is_read_pending = false;
+  if (reply == NULL) {
+    return;
+  }
+
+  // A nil reply means that the XREAD timed out without anything new.
+  if (reply->type == REDIS_REPLY_ARRAY) {
+    for (size_t i = 0; i != reply->elements; ++i) {
+      const redisReply *const stream = reply->element[i];
+      if (stream->type != REDIS_REPLY_ARRAY || stream->elements != 2 || stream->element[0]->type != REDIS_REPLY_STRING) {
+        continue;
+      }
+      // The channel may have expired, or moved to another shard, while the XREAD was in flight.
+      struct channel *const channel = channel_find(hub, stream->element[0]->str, stream->element[0]->len, false);
+      if (channel != NULL && channel->is_reading && channel->shard == shard->index) {
+        on_stream_entries(hub, channel, stream->element[1]);
+      }
+    }
+  }
+  else if (reply->type == REDIS_REPLY_ERROR) {
+    // Don't spin on an error that would only happen again, such as a key of the wrong type.
+    ERROR("Error reading streams. error=%s\n", reply->str);
+    event_add(shard->read_retry_event, &READ_RETRY_DELAY);
+    return;
+  }
+
+  read_streams(shard);
+}
+
+
+static void
+on_read_retry(const evutil_socket_t fd, const short events, void *const arg) {
+  (void)fd;
+  (void)events;
+  read_streams((struct shard *)arg);
+}
+
+
+/**
+ * Starts reading a channel from the last ID in its stream, or from the start if the stream is
+ * empty, so that nothing published after the XREVRANGE is missed.
+ **/
+static void
+on_stream_start(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  struct shard *const shard = (struct shard *)ctx->data;
+  struct pubsub_hub *const hub = shard->hub;
+  const redisReply *const reply = _reply;
+  char *const name = privdata;
+  struct stream_entry entry;
+
+  if (reply == NULL) {
+    goto done;
+  }
+  else if (reply->type != REDIS_REPLY_ARRAY) {
+    ERROR("Unexpected reply to `XREVRANGE` for channel '%s'. type=%d error=%s\n", name, reply->type, (reply->type == REDIS_REPLY_ERROR) ? reply->str : "");
+    goto done;
+  }
+
+  // The channel may have expired, already started, or moved to another shard, while the XREVRANGE
+  // was in flight.
+  struct channel *const channel = channel_find(hub, name, strlen(name), false);
+  if (channel == NULL || channel->is_reading || channel->shard != shard->index) {
+    goto done;
+  }
+  if (reply->elements == 0 || stream_entries_parse(reply, &entry, 1) == 0) {
+    channel->last_id.ms = 0;
+    channel->last_id.seq = 0;
+  }
+  else {
+    channel->last_id = entry.id;
+  }
+  reading_list_append(shard, channel);
+  read_streams(shard);
+
+done:
+  free(name);
+}
+
+
+/**
+ * Finds the last ID of each new channel's stream with an XREVRANGE, after which the channel joins
+ * the next XREAD.
+ **/
+static void
+start_pending_streams(struct pubsub_hub *const hub) {
+  for (struct channel *channel = hub->pending_subscribes; channel != NULL; channel = channel->subscribe_next) {
+    // Channels on a disconnected shard are started when it reconnects.
+    struct shard *const shard = hub->shards[channel->shard];
+    if (!atomic_load(&shard->is_connected)) {
+      continue;
+    }
+    char *const name = strdup(channel->name);
+    if (name == NULL) {
+      ERROR0("strdup failed.\n");
+      continue;
+    }
+    const char *argv[6] = {"XREVRANGE", name, "+", "-", "COUNT", "1"};
+    const int status = redisAsyncCommandArgv(shard->ctx, &on_stream_start, name, 6, argv, NULL);
+    if (status != REDIS_OK) {
+      ERROR("async `XREVRANGE` command failed. status=%d\n", status);
+      free(name);
+    }
+  }
+  hub->pending_subscribes = NULL;
+}
+
+
+/**
+ * SUBSCRIBEs to all of the new channels on their shards, and PSUBSCRIBEs to all of the new patterns
+ * on every shard, using as few commands as possible. hiredis routes the per-channel replies and
+ * messages of a multi-channel SUBSCRIBE to `on_subscribed_reply`.
+ **/
+static void
+flush_pending_subscribes(struct pubsub_hub *const hub) {
+  struct channels_command subscribe, psubscribe;
+
+  if (hub->backend == REDIS_BACKEND_STREAMS) {
+    start_pending_streams(hub);
+    return;
+  }
+  else if (hub->backend == REDIS_BACKEND_CLUSTER && !hub->is_slots_known) {
+    // Every channel is SSUBSCRIBEd to once the slots' owners are known.
+    hub->pending_subscribes = NULL;
+    return;
+  }
+
+  for (size_t i = 0; i != hub->nshards; ++i) {
+    struct shard *const shard = hub->shards[i];
+    channels_command_init(&subscribe, shard, subscribe_command(hub), &on_subscribed_reply);
+    channels_command_init(&psubscribe, shard, "PSUBSCRIBE", &on_subscribed_reply);
+    for (struct channel *channel = hub->pending_subscribes; channel != NULL; channel = channel->subscribe_next) {
+      if (is_on_shard(channel, shard)) {
+        channels_command_append(channel->is_pattern ? &psubscribe : &subscribe, channel->name);
+      }
+    }
+    channels_command_flush(&subscribe);
+    channels_command_flush(&psubscribe);
+  }
+  hub->pending_subscribes = NULL;
+}
+
+
+static void
+process_subscribe(struct pubsub_hub *const hub, const size_t index, const char *const name, const size_t name_nbytes, const bool is_pattern) {
+  if (is_pattern && hub->backend != REDIS_BACKEND_PUBSUB) {
+    WARNING("Ignoring subscription to pattern '%s', as patterns are only supported by the pubsub backend\n", name);
+    return;
+  }
+
+  struct channel *channel = channel_find(hub, name, name_nbytes, is_pattern);
+  if (channel == NULL) {
+    channel = malloc(sizeof(struct channel) + name_nbytes + 1);
+    if (channel == NULL) {
+      ERROR0("malloc failed.\n");
+      return;
+    }
+    memset(channel, 0, sizeof(struct channel));
+    channel->hash = channel_hash(name, name_nbytes, is_pattern);
+    channel->is_pattern = is_pattern;
+    if (!is_pattern) {
+      channel->shard = channel_shard(hub, name, name_nbytes);
+    }
+    channel->name_nbytes = name_nbytes;
+    memcpy(channel->name, name, name_nbytes + 1);
+    channel->interested = calloc(hub->nmanagers, sizeof(bool));
+    if (channel->interested == NULL) {
+      ERROR0("calloc failed.\n");
+      channel_destroy(channel);
+      return;
+    }
+    if (hashtable_insert(hub->channels, channel->hash, channel) != STATUS_OK) {
+      ERROR0("Failed to add the channel to the hub's table.\n");
+      channel_destroy(channel);
+      return;
+    }
+
+    // This is the first subscription to the channel within the process.
+    DEBUG("Subscribing to %s '%s'\n", is_pattern ? "pattern" : "channel", name);
+    channel->subscribe_next = hub->pending_subscribes;
+    hub->pending_subscribes = channel;
+  }
+  else if (channel->ninterested == 0) {
+    // Revive the lingering channel, which is still subscribed to.
+    DEBUG("Reviving lingering %s '%s'\n", is_pattern ? "pattern" : "channel", name);
+    linger_list_remove(hub, channel);
+  }
+
+  if (!channel->interested[index]) {
+    channel->interested[index] = true;
+    ++channel->ninterested;
+  }
+}
+
+
+static void
+process_unsubscribe(struct pubsub_hub *const hub, const size_t index, const char *const name, const size_t name_nbytes, const bool is_pattern) {
+  struct channel *const channel = channel_find(hub, name, name_nbytes, is_pattern);
+  if (channel == NULL || !channel->interested[index]) {
+    return;
+  }
+  channel->interested[index] = false;
+  --channel->ninterested;
+
+  // If there aren't any managers left which are interested, let the channel linger.
+  if (channel->ninterested == 0) {
+    linger_list_append(hub, channel);
+    if (evutil_timerisset(&hub->linger) && !event_pending(hub->linger_event, EV_TIMEOUT, NULL)) {
+      event_add(hub->linger_event, &hub->linger_tick);
+    }
+  }
+}
+
+
+/**
+ * Brings a shard's new connection up to date with the channel table. The shard's lingering
+ * channels are simply forgotten, as the new connection isn't subscribed to them, and all of its
+ * other channels, and every pattern, are re-(P)SUBSCRIBEd to in batches. With the Streams backend,
+ * the channels which were already being read carry on from their last IDs, so no messages are lost
+ * to the outage.
+ **/
+static void
+resubscribe_all(struct shard *const shard) {
+  struct pubsub_hub *const hub = shard->hub;
+  struct channel *channel, *next;
+  struct channels_command subscribe, psubscribe;
+
+  for (channel = hub->linger_head; channel != NULL; channel = next) {
+    next = channel->linger_next;
+    if (!channel->is_pattern && channel->shard == shard->index) {
+      linger_list_remove(hub, channel);
+      reading_list_remove(hub, channel);
+      channel_forget(hub, channel);
+      channel_destroy(channel);
+    }
+  }
+
+  // Only the shard's own channels are pending, as nothing else is pending outside of `on_commands`.
+  hub->pending_subscribes = NULL;
+  for (size_t cursor = 0; (channel = hashtable_next(hub->channels, &cursor)) != NULL; ) {
+    if (is_on_shard(channel, shard) && !channel->is_reading) {
+      channel->subscribe_next = hub->pending_subscribes;
+      hub->pending_subscribes = channel;
+    }
+  }
+  if (hub->backend == REDIS_BACKEND_STREAMS) {
+    start_pending_streams(hub);
+    shard->is_read_pending = false;
+    read_streams(shard);
+    return;
+  }
+  else if (hub->backend == REDIS_BACKEND_CLUSTER && !hub->is_slots_known) {
+    hub->pending_subscribes = NULL;
+    return;
+  }
+
+  channels_command_init(&subscribe, shard, subscribe_command(hub), &on_subscribed_reply);
+  channels_command_init(&psubscribe, shard, "PSUBSCRIBE", &on_subscribed_reply);
+  for (channel = hub->pending_subscribes; channel != NULL; channel = channel->subscribe_next) {
+    channels_command_append(channel->is_pattern ? &psubscribe : &subscribe, channel->name);
+  }
+  channels_command_flush(&subscribe);
+  channels_command_flush(&psubscribe);
+  hub->pending_subscribes = NULL;
+}
+
+
+static void
+schedule_reconnect(struct shard *const shard) {
+  struct timeval delay;
+
+  backoff_next(&shard->reconnect_backoff, &delay);
+  INFO("Reconnecting to redis server %s:%d in %ld.%06lds.\n", shard->host, shard->port, (long)delay.tv_sec, (long)delay.tv_usec);
+  if (event_add(shard->reconnect_event, &delay) == -1) {
+    ERROR0("Failed to schedule the redis reconnection.\n");
+  }
+}
+
+
+// Moves the shard on to its next candidate server, if it has more than one.
+static void
+fail_over(struct shard *const shard) {
+  if (shard->ncandidates == 1) {
+    return;
+  }
+  const char *const host = shard->host;
+  const uint16_t port = shard->port;
+  shard->candidate = (shard->candidate + 1) % shard->ncandidates;
+  shard->host = shard->candidate_hosts[shard->candidate];
+  shard->port = shard->candidate_ports[shard->candidate];
+  WARNING("Failing over shard %zu from redis server %s:%d to %s:%d\n", shard->index, host, port, shard->host, shard->port);
+}
+
+
+static void
+on_connect(const redisAsyncContext *const ctx, const int status) {
+  struct shard *const shard = (struct shard *)ctx->data;
+
+  if (status != REDIS_OK) {
+    ERROR("Error in on_connect redis callback. status=%d error=%s\n", status, ctx->errstr);
+    shard->ctx = NULL;  // hiredis frees the context.
+    fail_over(shard);
+    schedule_reconnect(shard);
+    return;
+  }
+
+  INFO("Connected to redis server %s:%d\n", shard->host, shard->port);
+  atomic_store(&shard->is_connected, true);
+  shard->is_probe_pending = false;
+  backoff_reset(&shard->reconnect_backoff);
+  resubscribe_all(shard);
+}
+
+
+static void
+on_disconnect(const redisAsyncContext *const ctx, const int status) {
+  struct shard *const shard = (struct shard *)ctx->data;
+  atomic_store(&shard->is_connected, false);
+  shard->ctx = NULL;  // hiredis frees the context.
+
+  if (status != REDIS_OK) {
+    ERROR("Error in on_disconnect redis callback. status=%d error=%s\n", status, ctx->errstr);
+  }
+  else {
+    INFO("Disconnected from redis server %s:%d\n", shard->host, shard->port);
+  }
+
+  if (shard->hub->is_shutting_down) {
+    return;
+  }
+  else if (shard->is_moving) {
+    shard->is_moving = false;  // Reconnect to the primary at its new address.
+  }
+  else {
+    fail_over(shard);
+  }
+  schedule_reconnect(shard);
+}
+
+
+static enum status
+shard_connect(struct shard *const shard) {
+  int status;
+
+  // Connect to the shard's redis server.
+  shard->ctx = redisAsyncConnect(shard->host, shard->port);
+  if (shard->ctx == NULL) {
+    ERROR("Failed to connect to redis server %s:%d\n", shard->host, shard->port);
+    return STATUS_BAD;
+  }
+  // Set the redis async context's user data attribute to be our shard object.
+  shard->ctx->data = shard;
+
+  // Read pubsub replies without the per-element allocations of the default reply objects.
+  if (shard->hub->backend != REDIS_BACKEND_STREAMS) {
+    shard->ctx->c.reader->fn = &PUBSUB_REPLY_FUNCTIONS;
+  }
+
+  // Attach the redis async connection to the libevent event loop.
+  status = redisLibeventAttach(shard->ctx, shard->hub->event_base);
+  if (status != REDIS_OK) {
+    ERROR("Failed to `redisLibeventAttach`. status=%d\n", status);
+    goto fail;
+  }
+
+  // Setup the redis connect/disconnect callbacks.
+  status = redisAsyncSetConnectCallback(shard->ctx, &on_connect);
+  if (status != REDIS_OK) {
+    ERROR("Failed to `redisAsyncSetConnectCallback`. status=%d\n", status);
+    goto fail;
+  }
+  status = redisAsyncSetDisconnectCallback(shard->ctx, &on_disconnect);
+  if (status != REDIS_OK) {
+    ERROR("Failed to `redisAsyncSetDisconnectCallback`. status=%d\n", status);
+    goto fail;
+  }
+
+  return STATUS_OK;
+
+fail:
+  redisAsyncFree(shard->ctx);
+  shard->ctx = NULL;
+  return STATUS_BAD;
+}
+
+
+static void
+on_reconnect_timeout(const evutil_socket_t fd, const short events, void *const arg) {
+  struct shard *const shard = (struct shard *)arg;
+  (void)fd;
+  (void)events;
+
+  if (shard_connect(shard) != STATUS_OK) {
+    schedule_reconnect(shard);
+  }
+}
+
+
+static void
+on_probe_reply(redisAsyncContext *const ctx, void *const reply, void *const privdata) {
+  struct shard *const shard = (struct shard *)ctx->data;
+  (void)reply;
+  (void)privdata;
+  shard->is_probe_pending = false;
+}
+
+
+/**
+ * PINGs each connected shard. A shard which hasn't answered the last PING by the next one is taken
+ * to be dead, and its connection is dropped so that it fails over, as a server which has gone away
+ * without closing the connection would otherwise never be noticed.
+ **/
+static void
+on_probe_tick(const evutil_socket_t fd, const short events, void *const arg) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)arg;
+  (void)fd;
+  (void)events;
+
+  for (size_t i = 0; i != hub->nshards; ++i) {
+    struct shard *const shard = hub->shards[i];
+    if (!atomic_load(&shard->is_connected)) {
+      continue;
+    }
+    else if (shard->is_probe_pending) {
+      WARNING("Redis server %s:%d didn't answer a PING within %lds\n", shard->host, shard->port, (long)PROBE_INTERVAL.tv_sec);
+      // Freeing the context calls `on_disconnect`, which fails over and reconnects.
+      redisAsyncFree(shard->ctx);
+      continue;
+    }
+    if (redisAsyncCommand(shard->ctx, &on_probe_reply, NULL, "PING") == REDIS_OK) {
+      shard->is_probe_pending = true;
+    }
+  }
+}
+
+
+static void
+shard_destroy(struct shard *const shard) {
+  if (shard == NULL) {
+    return;
+  }
+  if (shard->ctx != NULL) {
+    redisAsyncFree(shard->ctx);
+  }
+  if (shard->reconnect_event != NULL) {
+    event_free(shard->reconnect_event);
+  }
+  if (shard->read_retry_event != NULL) {
+    event_free(shard->read_retry_event);
+  }
+  for (size_t i = 0; i != shard->ncandidates; ++i) {
+    free(shard->candidate_hosts[i]);
+  }
+  for (struct stale_host *stale = shard->stale_hosts, *next; stale != NULL; stale = next) {
+    next = stale->next;
+    free(stale->host);
+    free(stale);
+  }
+  free(shard);
+}
+
+
+/**
+ * Creates the shard at `index`, without connecting to it yet.
+ **/
+static struct shard *
+shard_create(struct pubsub_hub *const hub, const size_t index, const char *const host, const uint16_t port) {
+  struct shard *const shard = malloc(sizeof(struct shard));
+  if (shard == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(shard, 0, sizeof(struct shard));
+  shard->hub = hub;
+  shard->index = index;
+  atomic_init(&shard->is_connected, false);
+  backoff_init(&shard->reconnect_backoff, &RECONNECT_INITIAL_DELAY, &RECONNECT_MAX_DELAY);
+  shard->candidate_hosts[0] = strdup(host);
+  shard->candidate_ports[0] = port;
+  shard->ncandidates = (shard->candidate_hosts[0] == NULL) ? 0 : 1;
+  shard->host = shard->candidate_hosts[0];
+  shard->port = port;
+  shard->reconnect_event = evtimer_new(hub->event_base, &on_reconnect_timeout, shard);
+  shard->read_retry_event = evtimer_new(hub->event_base, &on_read_retry, shard);
+  if (shard->host == NULL || shard->reconnect_event == NULL || shard->read_retry_event == NULL) {
+    ERROR0("Failed to create the shard.\n");
+    shard_destroy(shard);
+    return NULL;
+  }
+  return shard;
+}
+
+
+/**
+ * Adds a shard to the ring, and to the hub at the same index. The shard is named `ring_name` on the
+ * ring, or "host:port" if `ring_name` is NULL.
+ **/
+static enum status
+hub_add_shard(struct pubsub_hub *const hub, const char *const ring_name, const char *const host, const uint16_t port) {
+  char name[SHARD_RING_NAME_MAX_NBYTES];
+  size_t index;
+
+  if (ring_name != NULL) {
+    snprintf(name, sizeof(name), "%s", ring_name);
+  }
+  else {
+    snprintf(name, sizeof(name), "%s:%d", host, port);
+  }
+  struct shard *const shard = shard_create(hub, hub->nshards, host, port);
+  if (shard == NULL) {
+    return STATUS_ENOMEM;
+  }
+  const enum status status = shard_ring_add(hub->ring, name, &index);
+  if (status != STATUS_OK) {
+    ERROR("Failed to add shard %s to the ring. status=%d\n", name, status);
+    shard_destroy(shard);
+    return status;
+  }
+  hub->shards[index] = shard;
+  atomic_store(&hub->nshards, index + 1);
+  return STATUS_OK;
+}
+
+
+/**
+ * Leaves the channel's subscription on its old shard in place for MIGRATION_GRACE, so that
+ * messages from publishers which haven't moved over to the new shard yet are still received. With
+ * the Streams backend, the channel simply stops being read from the old shard.
+ **/
+static void
+retire_subscription(struct pubsub_hub *const hub, struct channel *const channel) {
+  struct timeval now;
+
+  if (hub->backend == REDIS_BACKEND_STREAMS) {
+    reading_list_remove(hub, channel);
+    return;
+  }
+
+  const size_t name_nbytes = strlen(channel->name);
+  struct retired_subscription *const retired = malloc(sizeof(struct retired_subscription) + name_nbytes + 1);
+  if (retired == NULL) {
+    ERROR0("malloc failed.\n");
+    return;
+  }
+  event_base_gettimeofday_cached(hub->event_base, &now);
+  evutil_timeradd(&now, &MIGRATION_GRACE, &retired->expiry);
+  retired->shard = channel->shard;
+  retired->next = NULL;
+  memcpy(retired->name, channel->name, name_nbytes + 1);
+  if (hub->retired_tail == NULL) {
+    hub->retired_head = retired;
+  }
+  else {
+    hub->retired_tail->next = retired;
+  }
+  hub->retired_tail = retired;
+  if (!event_pending(hub->retire_event, EV_TIMEOUT, NULL)) {
+    event_add(hub->retire_event, &MIGRATION_GRACE);
+  }
+}
+
+
+/**
+ * UNSUBSCRIBEs from the old shards of the migrated channels whose grace has run out.
+ **/
+static void
+on_retire_timeout(const evutil_socket_t fd, const short events, void *const arg) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)arg;
+  struct retired_subscription *retired, *expired = NULL, **expired_tail = &expired;
+  struct channels_command unsubscribe;
+  struct timeval now, delay;
+  (void)fd;
+  (void)events;
+
+  event_base_gettimeofday_cached(hub->event_base, &now);
+  while ((retired = hub->retired_head) != NULL && !evutil_timercmp(&now, &retired->expiry, <)) {
+    hub->retired_head = retired->next;
+    retired->next = NULL;
+    *expired_tail = retired;
+    expired_tail = &retired->next;
+  }
+  if (hub->retired_head == NULL) {
+    hub->retired_tail = NULL;
+  }
+  else {
+    evutil_timersub(&hub->retired_head->expiry, &now, &delay);
+    event_add(hub->retire_event, &delay);
+  }
+
+  for (size_t i = 0; i != hub->nshards; ++i) {
+    channels_command_init(&unsubscribe, hub->shards[i], unsubscribe_command(hub), NULL);
+    for (retired = expired; retired != NULL; retired = retired->next) {
+      if (retired->shard == i) {
+        channels_command_append(&unsubscribe, retired->name);
+      }
+    }
+    channels_command_flush(&unsubscribe);
+  }
+  for (retired = expired; retired != NULL; retired = expired) {
+    expired = retired->next;
+    free(retired);
+  }
+}
+
+
+/**
+ * Adds the shard named "host:port", and moves the channels which now hash to it over. The new shard
+ * SUBSCRIBEs to its channels once it has connected.
+ **/
+static void
+process_add_shard(struct pubsub_hub *const hub, const char *const name) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  uint16_t port;
+
+  if (hub->backend == REDIS_BACKEND_CLUSTER) {
+    WARNING("Ignoring redis shard '%s', as a redis cluster's shards are found from its slots\n", name);
+    return;
+  }
+  else if (shard_ring_parse_name(name, host, &port) != STATUS_OK) {
+    ERROR("Invalid redis shard '%s'\n", name);
+    return;
+  }
+
+  const size_t index = hub->nshards;
+  if (hub_add_shard(hub, NULL, host, port) != STATUS_OK) {
+    return;
+  }
+  INFO("Added redis shard %s as shard %zu\n", name, index);
+
+  size_t nmoved = 0;
+  struct channel *channel;
+  for (size_t cursor = 0; (channel = hashtable_next(hub->channels, &cursor)) != NULL; ) {
+    if (channel->is_pattern) {
+      continue;
+    }
+    const size_t shard = shard_ring_find(hub->ring, channel->name, channel->name_nbytes);
+    if (shard != channel->shard) {
+      retire_subscription(hub, channel);
+      channel->shard = shard;
+      ++nmoved;
+    }
+  }
+  INFO("Moved %zu channels to redis shard %s\n", nmoved, name);
+
+  if (shard_connect(hub->shards[index]) != STATUS_OK) {
+    schedule_reconnect(hub->shards[index]);
+  }
+}
+
+
+/**
+ * Moves the first shard's primary to "host:port", after a failover. If the shard's channels are
+ * subscribed on the primary, its connection is dropped and made again to the new address. A
+ * replica which the channels are subscribed on instead goes on receiving the new primary's
+ * messages once it has been repointed.
+ **/
+static void
+process_move_primary(struct pubsub_hub *const hub, const char *const name) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  uint16_t port;
+  struct shard *const shard = hub->shards[0];
+
+  if (hub->backend == REDIS_BACKEND_CLUSTER) {
+    WARNING("Ignoring the move of the redis primary to %s, as a redis cluster fails over by itself\n", name);
+    return;
+  }
+  else if (shard_ring_parse_name(name, host, &port) != STATUS_OK) {
+    ERROR("Invalid redis primary '%s'\n", name);
+    return;
+  }
+  else if (shard->candidate_ports[0] == port && strcmp(shard->candidate_hosts[0], host) == 0) {
+    return;
+  }
+
+  char *const copy = strdup(host);
+  struct stale_host *const stale = malloc(sizeof(struct stale_host));
+  if (copy == NULL || stale == NULL) {
+    ERROR0("malloc failed.\n");
+    free(copy);
+    free(stale);
+    return;
+  }
+  WARNING("Moving shard 0's primary from redis server %s:%d to %s:%d\n", shard->candidate_hosts[0], shard->candidate_ports[0], host, port);
+  stale->host = shard->candidate_hosts[0];
+  stale->next = shard->stale_hosts;
+  shard->stale_hosts = stale;
+  shard->candidate_hosts[0] = copy;
+  shard->candidate_ports[0] = port;
+  if (shard->candidate != 0) {
+    return;
+  }
+
+  shard->host = copy;
+  shard->port = port;
+  if (atomic_load(&shard->is_connected)) {
+    // Freeing the context calls `on_disconnect`, which reconnects to the new address.
+    shard->is_moving = true;
+    redisAsyncFree(shard->ctx);
+  }
+  else if (shard->ctx != NULL) {
+    // hiredis doesn't call `on_disconnect` for a connection which hasn't been made yet.
+    redisAsyncFree(shard->ctx);
+    shard->ctx = NULL;
+    if (shard_connect(shard) != STATUS_OK) {
+      schedule_reconnect(shard);
+    }
+  }
+  // Otherwise the pending reconnection goes to the new address.
+}
+
+
+/**
+ * Finds the shard for a cluster node, adding and connecting to it if it is new.
+ **/
+static bool
+find_or_add_shard(struct pubsub_hub *const hub, const char *const host, const uint16_t port, size_t *const index) {
+  for (size_t i = 0; i != hub->nshards; ++i) {
+    if (hub->shards[i]->port == port && strcmp(hub->shards[i]->host, host) == 0) {
+      *index = i;
+      return true;
+    }
+  }
+
+  if (hub_add_shard(hub, NULL, host, port) != STATUS_OK) {
+    return false;
+  }
+  *index = hub->nshards - 1;
+  INFO("Found redis cluster primary %s:%d. shard=%zu\n", host, port, *index);
+  if (shard_connect(hub->shards[*index]) != STATUS_OK) {
+    schedule_reconnect(hub->shards[*index]);
+  }
+  return true;
+}
+
+
+/**
+ * Moves the channels whose slots have changed owner over to their new shards. They are SUNSUBSCRIBEd
+ * from on their old shards, in case the old owners still have the subscriptions.
+ **/
+static void
+move_channels(struct pubsub_hub *const hub) {
+  struct channels_command sunsubscribe;
+  struct channel *channel;
+  size_t nmoved = 0;
+
+  hub->pending_subscribes = NULL;
+  for (size_t cursor = 0; (channel = hashtable_next(hub->channels, &cursor)) != NULL; ) {
+    const size_t shard = channel_shard(hub, channel->name, channel->name_nbytes);
+    if (channel->is_pattern || shard == channel->shard) {
+      continue;
+    }
+    channels_command_init(&sunsubscribe, hub->shards[channel->shard], unsubscribe_command(hub), NULL);
+    channels_command_append(&sunsubscribe, channel->name);
+    channel->shard = shard;
+    channel->subscribe_next = hub->pending_subscribes;
+    hub->pending_subscribes = channel;
+    ++nmoved;
+  }
+  if (nmoved != 0) {
+    INFO("Moved %zu channels to their slots' new owners\n", nmoved);
+  }
+  flush_pending_subscribes(hub);
+}
+
+
+static void
+on_slots_changed(const evutil_socket_t fd, const short events, void *const arg) {
+  (void)fd;
+  (void)events;
+  move_channels((struct pubsub_hub *)arg);
+}
+
+
+/**
+ * Records the new owner of a slot from a `-MOVED` error, and moves its channels over on the next
+ * loop iteration, so that a burst of redirections only moves the channels once. The rest of the
+ * cluster's slots are read again too, as a slot rarely moves on its own.
+ **/
+static void
+apply_redirect(struct pubsub_hub *const hub, const char *const error, const size_t error_nbytes) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  uint16_t slot, port;
+  size_t index;
+
+  // An `-ASK` redirection is only for the duration of a slot's migration, which ends in a `-MOVED`.
+  if (hub->backend != REDIS_BACKEND_CLUSTER || cluster_parse_redirect(error, error_nbytes, &slot, host, &port) != STATUS_OK || error[0] != 'M') {
+    return;
+  }
+  if (!find_or_add_shard(hub, host, port, &index)) {
+    return;
+  }
+
+  pthread_mutex_lock(&hub->slots_lock);
+  const bool is_changed = hub->slot_shards[slot] != index;
+  if (is_changed) {
+    hub->slot_shards[slot] = (uint8_t)index;
+    atomic_fetch_add(&hub->slots_generation, 1);
+  }
+  pthread_mutex_unlock(&hub->slots_lock);
+
+  if (is_changed) {
+    DEBUG("Slot %u moved to %s:%d\n", slot, host, port);
+    event_active(hub->slots_event, EV_TIMEOUT, 0);
+    refresh_topology(hub);
+  }
+}
+
+
+struct slots_update {
+  struct pubsub_hub *hub;
+  bool is_changed;
+};
+
+
+static void
+on_cluster_range(const uint16_t start, const uint16_t end, const char *const host, const uint16_t port, void *const arg) {
+  struct slots_update *const update = arg;
+  size_t index;
+
+  if (!find_or_add_shard(update->hub, host, port, &index)) {
+    return;
+  }
+  for (size_t slot = start; slot <= end; ++slot) {
+    if (update->hub->slot_shards[slot] != index) {
+      update->hub->slot_shards[slot] = (uint8_t)index;
+      update->is_changed = true;
+    }
+  }
+}
+
+
+/**
+ * Applies a CLUSTER SHARDS reply to the slot table. The first time, every channel is SSUBSCRIBEd
+ * to on its owner. After that, only the channels whose slots have moved are.
+ **/
+static enum status
+apply_cluster_shards(struct pubsub_hub *const hub, const redisReply *const reply) {
+  struct slots_update update = {.hub = hub, .is_changed = false};
+
+  pthread_mutex_lock(&hub->slots_lock);
+  const enum status status = cluster_parse_shards(reply, &on_cluster_range, &update);
+  if (status == STATUS_OK && (update.is_changed || !hub->is_slots_known)) {
+    atomic_fetch_add(&hub->slots_generation, 1);
+  }
+  pthread_mutex_unlock(&hub->slots_lock);
+  if (status != STATUS_OK) {
+    return status;
+  }
+
+  if (!hub->is_slots_known) {
+    hub->is_slots_known = true;
+    struct channel *channel;
+    for (size_t cursor = 0; (channel = hashtable_next(hub->channels, &cursor)) != NULL; ) {
+      channel->shard = channel_shard(hub, channel->name, channel->name_nbytes);
+    }
+    for (size_t i = 0; i != hub->nshards; ++i) {
+      if (atomic_load(&hub->shards[i]->is_connected)) {
+        resubscribe_all(hub->shards[i]);
+      }
+    }
+  }
+  else if (update.is_changed) {
+    move_channels(hub);
+  }
+  return STATUS_OK;
+}
+
+
+// Tries another shard for CLUSTER SHARDS after a backoff, in case the last one has gone away.
+static void
+schedule_topology_retry(struct pubsub_hub *const hub) {
+  struct timeval delay;
+
+  if (hub->is_shutting_down) {
+    return;
+  }
+  ++hub->topology_shard;
+  backoff_next(&hub->topology_backoff, &delay);
+  if (event_add(hub->topology_event, &delay) == -1) {
+    ERROR0("Failed to schedule the redis cluster slots refresh.\n");
+  }
+}
+
+
+static void
+on_cluster_shards(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)ctx->data;
+  const redisReply *const reply = _reply;
+  (void)privdata;
+
+  // hiredis calls back without a reply if the connection goes away first.
+  if (reply == NULL) {
+    WARNING("Failed to read the redis cluster's slots: %s\n", ctx->errstr);
+    schedule_topology_retry(hub);
+    return;
+  }
+  else if (reply->type == REDIS_REPLY_ERROR || apply_cluster_shards(hub, reply) != STATUS_OK) {
+    WARNING("Failed to read the redis cluster's slots: %s\n", (reply->type == REDIS_REPLY_ERROR) ? reply->str : "bad reply");
+    schedule_topology_retry(hub);
+  }
+  else {
+    backoff_reset(&hub->topology_backoff);
+    event_add(hub->topology_event, hub->is_topology_wanted ? &TOPOLOGY_MIN_INTERVAL : &TOPOLOGY_REFRESH_INTERVAL);
+  }
+  redisAsyncDisconnect(ctx);
+}
+
+
+static void
+on_topology_connect(const redisAsyncContext *const ctx, const int status) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)ctx->data;
+
+  // The CLUSTER SHARDS callback deals with the failure.
+  if (status != REDIS_OK) {
+    hub->topology_ctx = NULL;  // hiredis frees the context.
+  }
+}
+
+
+static void
+on_topology_disconnect(const redisAsyncContext *const ctx, const int status) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)ctx->data;
+  (void)status;
+  hub->topology_ctx = NULL;  // hiredis frees the context.
+}
+
+
+/**
+ * Reads the cluster's slots with CLUSTER SHARDS, over a short-lived connection to one of the
+ * shards, or as soon as the read in flight is done.
+ **/
+static void
+refresh_topology(struct pubsub_hub *const hub) {
+  if (hub->topology_ctx != NULL) {
+    hub->is_topology_wanted = true;
+    return;
+  }
+  hub->is_topology_wanted = false;
+
+  const struct shard *const shard = hub->shards[hub->topology_shard % hub->nshards];
+  redisAsyncContext *const ctx = redisAsyncConnect(shard->host, shard->port);
+  if (ctx == NULL) {
+    ERROR("Failed to connect to redis server %s:%d\n", shard->host, shard->port);
+    schedule_topology_retry(hub);
+    return;
+  }
+  ctx->data = hub;
+  if (redisLibeventAttach(ctx, hub->event_base) != REDIS_OK || redisAsyncSetConnectCallback(ctx, &on_topology_connect) != REDIS_OK || redisAsyncSetDisconnectCallback(ctx, &on_topology_disconnect) != REDIS_OK) {
+    ERROR0("Failed to set up the redis cluster slots connection.\n");
+    redisAsyncFree(ctx);
+    schedule_topology_retry(hub);
+    return;
+  }
+  // The command is sent once the connection is up, or called back without a reply if it fails.
+  if (redisAsyncCommand(ctx, &on_cluster_shards, NULL, "CLUSTER SHARDS") != REDIS_OK) {
+    ERROR0("async `CLUSTER SHARDS` command failed.\n");
+    redisAsyncFree(ctx);
+    schedule_topology_retry(hub);
+    return;
+  }
+  hub->topology_ctx = ctx;
+}
+
+
+static void
+on_topology_timeout(const evutil_socket_t fd, const short events, void *const arg) {
+  (void)fd;
+  (void)events;
+  refresh_topology((struct pubsub_hub *)arg);
+}
+
+
+/**
+ * Hands a message published on this node to the managers with local subscribers, other than the
+ * publishing manager, which has already delivered it.
+ **/
+static void
+process_deliver(struct pubsub_hub *const hub, const size_t index, const char *const name, const size_t name_nbytes, struct pubsub_payload *const payload) {
+  const struct channel *const channel = channel_find(hub, name, name_nbytes, false);
+  if (channel == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i != hub->nmanagers; ++i) {
+    if (channel->interested[i] && i != index) {
+      pubsub_manager_deliver(hub->managers[i], NULL, name, strlen(name), payload);
+    }
+  }
+}
+
+
+static void
+on_commands(const evutil_socket_t fd, const short events, void *const arg) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)arg;
+  struct command *command, *next;
+  (void)fd;
+  (void)events;
+
+  // Take ownership of all queued commands.
+  pthread_mutex_lock(&hub->commands_lock);
+  command = hub->commands_head;
+  hub->commands_head = NULL;
+  hub->commands_tail = NULL;
+  pthread_mutex_unlock(&hub->commands_lock);
+
+  for (; command != NULL; command = next) {
+    next = command->next;
+    switch (command->type) {
+    case COMMAND_SUBSCRIBE:
+      process_subscribe(hub, command->index, command->channel, command->channel_nbytes, false);
+      break;
+    case COMMAND_UNSUBSCRIBE:
+      process_unsubscribe(hub, command->index, command->channel, command->channel_nbytes, false);
+      break;
+    case COMMAND_PSUBSCRIBE:
+      process_subscribe(hub, command->index, command->channel, command->channel_nbytes, true);
+      break;
+    case COMMAND_PUNSUBSCRIBE:
+      process_unsubscribe(hub, command->index, command->channel, command->channel_nbytes, true);
+      break;
+    case COMMAND_DELIVER:
+      process_deliver(hub, command->index, command->channel, command->channel_nbytes, command->payload);
+      break;
+    case COMMAND_ADD_SHARD:
+      process_add_shard(hub, command->channel);
+      break;
+    case COMMAND_REDIRECT:
+      apply_redirect(hub, command->channel, command->channel_nbytes);
+      break;
+    case COMMAND_MOVE_PRIMARY:
+      process_move_primary(hub, command->channel);
+      break;
+    }
+    pubsub_payload_release(command->payload);
+    free(command);
+  }
+
+  // SUBSCRIBE to the new channels before any of them can be UNSUBSCRIBEd from. Without a linger
+  // time, channels are UNSUBSCRIBEd from as soon as the command batch is done.
+  flush_pending_subscribes(hub);
+  if (!evutil_timerisset(&hub->linger)) {
+    expire_lingering_channels(hub);
+  }
+}
+
+
+/**
+ * Queues a command for the hub's thread. The command takes its own reference to `payload`, which
+ * may be NULL.
+ **/
+static enum status
+enqueue_command(struct pubsub_hub *const hub, const enum command_type type, const size_t index, const char *const channel, struct pubsub_payload *const payload) {
+  if (hub == NULL || channel == NULL || (index >= hub->nmanagers && type != COMMAND_ADD_SHARD && type != COMMAND_REDIRECT && type != COMMAND_MOVE_PRIMARY)) {
+    return STATUS_EINVAL;
+  }
+
+  const size_t channel_nbytes = strlen(channel);
+  struct command *const command = malloc(sizeof(struct command) + channel_nbytes + 1);
+  if (command == NULL) {
+    ERROR0("malloc failed.\n");
+    return STATUS_ENOMEM;
+  }
+  command->type = type;
+  command->index = index;
+  command->payload = payload;
+  if (payload != NULL) {
+    pubsub_payload_retain(payload);
+  }
+  command->next = NULL;
+  command->channel_nbytes = channel_nbytes;
+  memcpy(command->channel, channel, channel_nbytes + 1);
+
+  pthread_mutex_lock(&hub->commands_lock);
+  const bool was_empty = hub->commands_tail == NULL;
+  if (was_empty) {
+    hub->commands_head = command;
+  }
+  else {
+    hub->commands_tail->next = command;
+  }
+  hub->commands_tail = command;
+  pthread_mutex_unlock(&hub->commands_lock);
+
+  // Wake up the hub's event loop, unless an earlier command in the batch already has.
+  if (was_empty) {
+    event_active(hub->commands_event, EV_READ, 0);
+  }
+
+  return STATUS_OK;
+}
+
+
+/**
+ * Creates the hub, with the redis server at `redis_host`:`redis_port` as its first shard. The first
+ * shard is named `ring_name` on the shard ring, or "host:port" if `ring_name` is NULL; a primary
+ * which may move needs a name of its own, so that its channels hash the same wherever it is.
+ * Channels which no manager is interested in any more linger for `linger` before they are
+ * UNSUBSCRIBEd from, or are UNSUBSCRIBEd from straight away if `linger` is NULL.
+ **/
+struct pubsub_hub *
+pubsub_hub_create(const char *const redis_host, const uint16_t redis_port, const char *const ring_name, const struct timeval *const linger, const enum redis_backend backend) {
+  if (redis_host == NULL) {
+    return NULL;
+  }
+
+  // Setup the pubsub hub.
+  struct pubsub_hub *const hub = malloc(sizeof(struct pubsub_hub));
+  if (hub == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(hub, 0, sizeof(struct pubsub_hub));
+  hub->backend = backend;
+  atomic_init(&hub->nshards, 0);
+  pthread_mutex_init(&hub->commands_lock, NULL);
+  hub->event_base = event_base_new();
+  if (hub->event_base == NULL) {
+    ERROR0("Failed to create libevent event loop for the pubsub hub\n");
+    goto fail;
+  }
+  hub->channels = hashtable_create(&channel_matches);
+  if (hub->channels == NULL) {
+    goto fail;
+  }
+  hub->commands_event = event_new(hub->event_base, -1, 0, &on_commands, hub);
+  hub->linger_event = evtimer_new(hub->event_base, &on_linger_tick, hub);
+  if (hub->commands_event == NULL || hub->linger_event == NULL) {
+    ERROR0("event_new failed.\n");
+    goto fail;
+  }
+  if (linger != NULL) {
+    hub->linger = *linger;
+    hub->linger_tick = evutil_timercmp(linger, &MAX_LINGER_TICK, <) ? *linger : MAX_LINGER_TICK;
+  }
+
+  hub->retire_event = evtimer_new(hub->event_base, &on_retire_timeout, hub);
+  hub->ring = shard_ring_create();
+  if (hub->retire_event == NULL || hub->ring == NULL) {
+    ERROR0("Failed to create the shard ring.\n");
+    goto fail;
+  }
+
+  pthread_mutex_init(&hub->slots_lock, NULL);
+  atomic_init(&hub->slots_generation, 0);
+  backoff_init(&hub->topology_backoff, &RECONNECT_INITIAL_DELAY, &RECONNECT_MAX_DELAY);
+  hub->slots_event = event_new(hub->event_base, -1, 0, &on_slots_changed, hub);
+  hub->topology_event = evtimer_new(hub->event_base, &on_topology_timeout, hub);
+  hub->probe_event = event_new(hub->event_base, -1, EV_PERSIST, &on_probe_tick, hub);
+  if (hub->slots_event == NULL || hub->topology_event == NULL || hub->probe_event == NULL) {
+    ERROR0("event_new failed.\n");
+    goto fail;
+  }
+  if ((backend == REDIS_BACKEND_STREAMS || HAS_SUBSCRIBED_PING) && event_add(hub->probe_event, &PROBE_INTERVAL) == -1) {
+    ERROR0("Failed to schedule the redis health probes.\n");
+    goto fail;
+  }
+
+  // Connect to the first shard. For a cluster, it is only the node that the slots are first read
+  // from, and the primaries which own the slots are added as they are found.
+  if (hub_add_shard(hub, ring_name, redis_host, redis_port) != STATUS_OK || shard_connect(hub->shards[0]) != STATUS_OK) {
+    goto fail;
+  }
+  if (backend == REDIS_BACKEND_CLUSTER) {
+    refresh_topology(hub);
+  }
+
+  return hub;
+
+fail:
+  shard_destroy(hub->shards[0]);
+  shard_ring_destroy(hub->ring);
+  if (hub->slots_event != NULL) {
+    event_free(hub->slots_event);
+  }
+  if (hub->topology_event != NULL) {
+    event_free(hub->topology_event);
+  }
+  if (hub->probe_event != NULL) {
+    event_free(hub->probe_event);
+  }
+  pthread_mutex_destroy(&hub->slots_lock);
+  if (hub->retire_event != NULL) {
+    event_free(hub->retire_event);
+  }
+  if (hub->commands_event != NULL) {
+    event_free(hub->commands_event);
+  }
+  if (hub->linger_event != NULL) {
+    event_free(hub->linger_event);
+  }
+  if (hub->channels != NULL) {
+    hashtable_destroy(hub->channels);
+  }
+  if (hub->event_base != NULL) {
+    event_base_free(hub->event_base);
+  }
+  pthread_mutex_destroy(&hub->commands_lock);
+  free(hub);
+  return NULL;
+}
+
+
+enum status
+pubsub_hub_destroy(struct pubsub_hub *const hub) {
+  struct channel *channel;
+  struct command *command, *next_command;
+  struct retired_subscription *retired, *next_retired;
+
+  if (hub == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  pubsub_hub_stop(hub);
+  hub->is_shutting_down = true;
+  if (hub->topology_ctx != NULL) {
+    redisAsyncFree(hub->topology_ctx);
+  }
+  for (size_t i = 0; i != hub->nshards; ++i) {
+    shard_destroy(hub->shards[i]);
+  }
+  shard_ring_destroy(hub->ring);
+  event_free(hub->slots_event);
+  event_free(hub->topology_event);
+  event_free(hub->probe_event);
+  pthread_mutex_destroy(&hub->slots_lock);
+  for (retired = hub->retired_head; retired != NULL; retired = next_retired) {
+    next_retired = retired->next;
+    free(retired);
+  }
+  event_free(hub->retire_event);
+  event_free(hub->commands_event);
+  event_free(hub->linger_event);
+  for (command = hub->commands_head; command != NULL; command = next_command) {
+    next_command = command->next;
+    pubsub_payload_release(command->payload);
+    free(command);
+  }
+  pthread_mutex_destroy(&hub->commands_lock);
+  for (size_t cursor = 0; (channel = hashtable_next(hub->channels, &cursor)) != NULL; ) {
+    channel_destroy(channel);
+  }
+  hashtable_destroy(hub->channels);
+  event_base_free(hub->event_base);
+  free(hub);
+
+  return STATUS_OK;
+}
+
+
+static void *
+run(void *const arg) {
+  struct pubsub_hub *const hub = (struct pubsub_hub *)arg;
+
+  INFO("Starting libevent event loop for the pubsub hub. hub=%p\n", (void *)hub);
+  if (event_base_dispatch(hub->event_base) == -1) {
+    ERROR0("Failed to run libevent event loop for the pubsub hub\n");
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Starts the hub's ingest thread. All managers must have been registered beforehand.
+ **/
+enum status
+pubsub_hub_start(struct pubsub_hub *const hub) {
+  if (hub == NULL || hub->is_running) {
+    return STATUS_EINVAL;
+  }
+
+  if (pthread_create(&hub->thread, NULL, &run, hub) != 0) {
+    ERROR0("Failed to start the pubsub hub thread\n");
+    return STATUS_BAD;
+  }
+  hub->is_running = true;
+
+  return STATUS_OK;
+}
+
+
+/**
+ * Stops the hub's ingest thread and waits for it to finish. Once this returns, no more messages
+ * are handed to the managers.
+ **/
+enum status
+pubsub_hub_stop(struct pubsub_hub *const hub) {
+  if (hub == NULL) {
+    return STATUS_EINVAL;
+  }
+  else if (!hub->is_running) {
+    return STATUS_OK;
+  }
+
+  if (event_base_loopexit(hub->event_base, NULL) == -1) {
+    ERROR0("Error shutting down the pubsub hub\n");
+  }
+  pthread_join(hub->thread, NULL);
+  hub->is_running = false;
+
+  return STATUS_OK;
+}
+
+
+/**
+ * Registers a manager with the hub. All managers must be registered before any subscriptions are
+ * made or any worker threads are started.
+ **/
+enum status
+pubsub_hub_add_manager(struct pubsub_hub *const hub, struct pubsub_manager *const mgr, size_t *const index) {
+  if (hub == NULL || mgr == NULL || index == NULL) {
+    return STATUS_EINVAL;
+  }
+  else if (hub->nmanagers == PUBSUB_HUB_MAX_MANAGERS) {
+    return STATUS_BAD;
+  }
+
+  *index = hub->nmanagers;
+  hub->managers[hub->nmanagers++] = mgr;
+  return STATUS_OK;
+}
+
+
+/**
+ * Has `fn` called, on the hub's thread, with each channel whose SUBSCRIBE has been acknowledged by
+ * its shard, including after a reconnection. This must be called before the hub is started.
+ **/
+enum status
+pubsub_hub_on_subscribed(struct pubsub_hub *const hub, const size_t index, const pubsub_hub_subscribed_t fn, void *const arg) {
+  if (hub == NULL || index >= hub->nmanagers || hub->is_running) {
+    return STATUS_EINVAL;
+  }
+
+  hub->subscribed_fns[index] = fn;
+  hub->subscribed_args[index] = arg;
+  return STATUS_OK;
+}
+
+
+enum redis_backend
+pubsub_hub_backend(const struct pubsub_hub *const hub) {
+  return hub->backend;
+}
+
+
+/**
+ * Turns on local delivery, with the ID which tags this node's messages. This must be called before
+ * the hub is started.
+ **/
+enum status
+pubsub_hub_set_node_id(struct pubsub_hub *const hub, const uint64_t node_id) {
+  if (hub == NULL || hub->is_running) {
+    return STATUS_EINVAL;
+  }
+  hub->node_id = node_id;
+  return STATUS_OK;
+}
+
+
+uint64_t
+pubsub_hub_node_id(const struct pubsub_hub *const hub) {
+  return hub->node_id;
+}
+
+
+/**
+ * Adds the redis server at `host`:`port` as a new shard, from any thread. About 1/N of the
+ * channels move over to it, and the subscriptions on their old shards are kept for
+ * PUBSUB_HUB_MIGRATION_GRACE_S seconds, so the publishers should switch over to the new shard
+ * well within that.
+ **/
+enum status
+pubsub_hub_add_shard(struct pubsub_hub *const hub, const char *const host, const uint16_t port) {
+  char name[SHARD_RING_NAME_MAX_NBYTES];
+  if (hub == NULL || host == NULL) {
+    return STATUS_EINVAL;
+  }
+  const int nbytes = snprintf(name, sizeof(name), "%s:%d", host, port);
+  if (nbytes < 0 || (size_t)nbytes >= sizeof(name)) {
+    return STATUS_EINVAL;
+  }
+  return enqueue_command(hub, COMMAND_ADD_SHARD, 0, name, NULL);
+}
+
+
+/**
+ * Adds another server that the first shard's channels can be subscribed on, such as one of its
+ * replicas, which receive every message PUBLISHed to the shard. The shard's channels are
+ * subscribed on the candidates in the order that they were added, failing over to the next one
+ * whenever the connection is lost or stops answering PINGs, and on the shard's primary if none of
+ * them are up. The primary is wherever `pubsub_hub_move_primary` last moved it to. Candidates must
+ * be added before the hub is started.
+ **/
+enum status
+pubsub_hub_add_candidate(struct pubsub_hub *const hub, const char *const host, const uint16_t port) {
+  if (hub == NULL || host == NULL || hub->is_running || hub->backend == REDIS_BACKEND_CLUSTER) {
+    return STATUS_EINVAL;
+  }
+  struct shard *const shard = hub->shards[0];
+  if (shard->ncandidates == PUBSUB_HUB_MAX_CANDIDATES) {
+    return STATUS_BAD;
+  }
+  char *const copy = strdup(host);
+  if (copy == NULL) {
+    ERROR0("strdup failed.\n");
+    return STATUS_ENOMEM;
+  }
+  shard->candidate_hosts[shard->ncandidates] = copy;
+  shard->candidate_ports[shard->ncandidates] = port;
+  ++shard->ncandidates;
+  INFO("Added redis server %s:%d as a subscription candidate for shard 0\n", host, port);
+
+  // Switch the connection which was started on the shard's primary over to the first candidate.
+  // The event loop isn't running yet, so the connection can't have been made.
+  if (shard->ncandidates == 2) {
+    if (shard->ctx != NULL) {
+      redisAsyncFree(shard->ctx);
+      shard->ctx = NULL;
+    }
+    fail_over(shard);
+    if (shard_connect(shard) != STATUS_OK) {
+      schedule_reconnect(shard);
+    }
+  }
+  return STATUS_OK;
+}
+
+
+/**
+ * Moves the first shard's primary to `host`:`port`, from any thread, such as after Sentinel has
+ * failed it over. The shard keeps its name on the ring, so its channels stay where they are.
+ **/
+enum status
+pubsub_hub_move_primary(struct pubsub_hub *const hub, const char *const host, const uint16_t port) {
+  char name[SHARD_RING_NAME_MAX_NBYTES];
+  if (hub == NULL || host == NULL) {
+    return STATUS_EINVAL;
+  }
+  const int nbytes = snprintf(name, sizeof(name), "%s:%d", host, port);
+  if (nbytes < 0 || (size_t)nbytes >= sizeof(name)) {
+    return STATUS_EINVAL;
+  }
+  return enqueue_command(hub, COMMAND_MOVE_PRIMARY, 0, name, NULL);
+}
+
+
+/**
+ * Hands a publisher's `-MOVED` or `-ASK` error to the hub, from any thread, so that the hub can
+ * correct its slot table and move the slot's channels over to their new owner.
+ **/
+enum status
+pubsub_hub_redirect(struct pubsub_hub *const hub, const char *const error) {
+  return enqueue_command(hub, COMMAND_REDIRECT, 0, error, NULL);
+}
+
+
+/**
+ * Returns the generation of the cluster's slot table, which changes whenever a slot changes owner.
+ **/
+uint64_t
+pubsub_hub_slots_generation(struct pubsub_hub *const hub) {
+  return atomic_load(&hub->slots_generation);
+}
+
+
+/**
+ * Copies the shard index of each of the cluster's CLUSTER_NSLOTS slots into `slots`, from any
+ * thread, along with the table's generation.
+ **/
+void
+pubsub_hub_copy_slots(struct pubsub_hub *const hub, uint8_t *const slots, uint64_t *const generation) {
+  pthread_mutex_lock(&hub->slots_lock);
+  memcpy(slots, hub->slot_shards, CLUSTER_NSLOTS);
+  *generation = atomic_load(&hub->slots_generation);
+  pthread_mutex_unlock(&hub->slots_lock);
+}
+
+
+/**
+ * Returns the address of a shard, from any thread. Shards are never removed, so `*host` stays valid
+ * for the life of the hub.
+ **/
+enum status
+pubsub_hub_shard_address(struct pubsub_hub *const hub, const size_t index, const char **const host, uint16_t *const port) {
+  if (hub == NULL || index >= atomic_load(&hub->nshards)) {
+    return STATUS_EINVAL;
+  }
+  *host = hub->shards[index]->host;
+  *port = hub->shards[index]->port;
+  return STATUS_OK;
+}
+
+
+/**
+ * Returns whether the hub is connected to every one of its shards.
+ **/
+bool
+pubsub_hub_is_connected(struct pubsub_hub *const hub) {
+  if (hub == NULL) {
+    return false;
+  }
+  const size_t nshards = atomic_load(&hub->nshards);
+  for (size_t i = 0; i != nshards; ++i) {
+    if (!atomic_load(&hub->shards[i]->is_connected)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+enum status
+pubsub_hub_subscribe(struct pubsub_hub *const hub, const size_t index, const char *const channel) {
+  return enqueue_command(hub, COMMAND_SUBSCRIBE, index, channel, NULL);
+}
+
+
+enum status
+pubsub_hub_unsubscribe(struct pubsub_hub *const hub, const size_t index, const char *const channel) {
+  return enqueue_command(hub, COMMAND_UNSUBSCRIBE, index, channel, NULL);
+}
+
+
+enum status
+pubsub_hub_psubscribe(struct pubsub_hub *const hub, const size_t index, const char *const pattern) {
+  return enqueue_command(hub, COMMAND_PSUBSCRIBE, index, pattern, NULL);
+}
+
+
+enum status
+pubsub_hub_punsubscribe(struct pubsub_hub *const hub, const size_t index, const char *const pattern) {
+  return enqueue_command(hub, COMMAND_PUNSUBSCRIBE, index, pattern, NULL);
+}
+
+
+/**
+ * Hands a message published by the manager at `index` to the other managers with subscribers to
+ * the channel, from the hub's thread.
+ **/
+enum status
+pubsub_hub_deliver(struct pubsub_hub *const hub, const size_t index, const char *const channel, struct pubsub_payload *const payload) {
+  if (payload == NULL) {
+    return STATUS_EINVAL;
+  }
+  return enqueue_command(hub, COMMAND_DELIVER, index, channel, payload);
+}
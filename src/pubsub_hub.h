@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "status.h"
+#include "streams.h"
+
+#define PUBSUB_HUB_MAX_MANAGERS (256)
+#define PUBSUB_HUB_MIGRATION_GRACE_S (10)  // How long a moved channel stays SUBSCRIBEd to on its old shard.
+#define PUBSUB_HUB_MAX_CANDIDATES (16)     // Bounds the servers that a shard can be subscribed on.
+
+// Forward declarations.
+struct pubsub_hub;
+struct pubsub_manager;
+struct pubsub_payload;
+
+// Called on the hub's thread with a channel once its shard has acknowledged the SUBSCRIBE.
+typedef void (*pubsub_hub_subscribed_t)(const char *channel, size_t channel_nbytes, void *arg);
+
+
+struct pubsub_hub *pubsub_hub_create(const char *redis_host, uint16_t redis_port, const char *ring_name, const struct timeval *linger, enum redis_backend backend);
+enum status        pubsub_hub_destroy(struct pubsub_hub *hub);
+enum status        pubsub_hub_start(struct pubsub_hub *hub);
+enum status        pubsub_hub_stop(struct pubsub_hub *hub);
+enum status        pubsub_hub_add_manager(struct pubsub_hub *hub, struct pubsub_manager *mgr, size_t *index);
+enum status        pubsub_hub_on_subscribed(struct pubsub_hub *hub, size_t index, pubsub_hub_subscribed_t fn, void *arg);
+enum redis_backend pubsub_hub_backend(const struct pubsub_hub *hub);
+enum status        pubsub_hub_set_node_id(struct pubsub_hub *hub, uint64_t node_id);
+uint64_t           pubsub_hub_node_id(const struct pubsub_hub *hub);
+enum status        pubsub_hub_add_shard(struct pubsub_hub *hub, const char *host, uint16_t port);
+enum status        pubsub_hub_add_candidate(struct pubsub_hub *hub, const char *host, uint16_t port);
+enum status        pubsub_hub_move_primary(struct pubsub_hub *hub, const char *host, uint16_t port);
+enum status        pubsub_hub_redirect(struct pubsub_hub *hub, const char *error);
+uint64_t           pubsub_hub_slots_generation(struct pubsub_hub *hub);
+void               pubsub_hub_copy_slots(struct pubsub_hub *hub, uint8_t *slots, uint64_t *generation);
+enum status        pubsub_hub_shard_address(struct pubsub_hub *hub, size_t index, const char **host, uint16_t *port);
+bool               pubsub_hub_is_connected(struct pubsub_hub *hub);
+enum status        pubsub_hub_subscribe(struct pubsub_hub *hub, size_t index, const char *channel);
+enum status        pubsub_hub_unsubscribe(struct pubsub_hub *hub, size_t index, const char *channel);
+enum status        pubsub_hub_psubscribe(struct pubsub_hub *hub, size_t index, const char *pattern);
+enum status        pubsub_hub_punsubscribe(struct pubsub_hub *hub, size_t index, const char *pattern);
+enum status        pubsub_hub_deliver(struct pubsub_hub *hub, size_t index, const char *channel, struct pubsub_payload *payload);
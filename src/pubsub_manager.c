@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,41 +7,131 @@
 #include <event2/buffer.h>
 #include <event2/event.h>
 
-#include <hiredis/hiredis.h>
-#include <hiredis/async.h>
-#include <hiredis/adapters/libevent.h>
-
+#include "broker.h"
+#include "compat_eventfd.h"
+#include "hashtable.h"
 #include "json.h"
 #include "logging.h"
+#include "pattern_trie.h"
 #include "pubsub_manager.h"
+#include "pubsub_reply.h"
+#include "spsc_ring.h"
 #include "string_pool.h"
 #include "websocket.h"
 #include "xxhash.h"
 
-#define HASHTABLE_NBUCKETS (2063)  // Arbitrary "large enough" prime.
+#define INBOX_CAPACITY (64 * 1024)
+#define CACHE_LINE_NBYTES (64)
+#define SUBSCRIBERS_INLINE_CAPACITY (4)
+#define FANOUT_PREFETCH_DISTANCE (8)
+#define REPLAY_BATCH_NENTRIES (128)
+#define HISTORY_INITIAL_CAPACITY (4)
+
+static const struct timeval HISTORY_SWEEP_INTERVAL = {.tv_sec = 1, .tv_usec = 0};
+
 
+// Forward declaration.
+struct replay;
 
-struct value_chain {
-  void *value;
-  struct value_chain *next;
+
+// A websocket's membership of a channel. It is reachable from both sides without searching: by its
+// position in the channel's subscriber arrays, and from the websocket's own list of subscriptions.
+struct subscription {
+  struct channel *channel;
+  struct websocket *ws;
+  size_t index;                   // The index of the websocket within the channel's subscriber arrays.
+  struct subscription *ws_next;   // The websocket's next subscription.
+  struct subscription **ws_pprev;
+  bool nolocal;                   // Whether to skip the websocket's own messages.
+
+  // While a subscription is resuming from a stream ID, live messages are held back until the replay
+  // of the stream has caught up, and then any which the replay already sent are skipped.
+  struct replay *replay;
+  struct stream_id after;
 };
 
 
-struct key_chain {
-  void *key;
-  struct value_chain *chain;
-  struct key_chain *next;
+// A replay of a stream for a resuming subscription. It outlives the subscription if the
+// subscription goes away while an XRANGE is in flight.
+struct replay {
+  struct pubsub_manager *mgr;
+  struct subscription *subscription;  // NULL once the subscription has gone away.
+  struct stream_id max_skipped;       // The newest live message held back during the replay.
 };
 
 
-struct pubsub_manager {
-  // Manage redis connection state.
-  bool pub_is_connected;
-  bool sub_is_connected;
-  redisAsyncContext *pub_ctx;
-  redisAsyncContext *sub_ctx;
+// The key used to look up the subscription of a websocket to a channel.
+struct subscription_key {
+  const struct websocket *ws;
+  const struct channel *channel;
+};
+
+
+// A message kept in a channel's history. The frame is the one that was sent to the subscribers.
+struct history_entry {
+  struct websocket_frame *frame;
+  struct timeval time;
+  size_t nbytes;  // What the entry counts towards the manager's history memory use.
+};
+
 
-  // Keep track of the libevent loop that the redis async connections are bound to.
+// A ring of a channel's most recent messages, oldest first from `head`. The ring starts small and
+// doubles in size up to the manager's per-channel limit, so quiet channels stay compact.
+struct history {
+  size_t head;
+  size_t count;
+  size_t capacity;
+  struct history_entry entries[];
+};
+
+
+// The subscribers of a channel are kept in contiguous arrays so that fan-out streams through memory.
+// Channels with only a few subscribers use the inline storage. `subscriptions[i]` is the
+// subscription of `websockets[i]`, which is needed to keep the back-indices up to date. Pattern
+// subscriptions use the same structure, indexed by the pattern trie instead of the channel table.
+struct channel {
+  const char *name;  // Canonical string from the string pool.
+  bool is_pattern;
+  size_t nresuming;  // The number of subscriptions which are resuming, so need checking on fan-out.
+  size_t nnolocal;   // The number of subscriptions which skip their own messages, likewise.
+  size_t nsubscribers;
+  size_t capacity;
+  struct websocket **websockets;
+  struct subscription **subscriptions;
+  struct websocket *inline_websockets[SUBSCRIBERS_INLINE_CAPACITY];
+  struct subscription *inline_subscriptions[SUBSCRIBERS_INLINE_CAPACITY];
+
+  // The channel's recent messages. A channel without subscribers is kept on the idle list for as
+  // long as it has history, so that it is still there for the next subscriber.
+  struct history *history;
+  bool is_idle;
+  struct channel *idle_next;
+  struct channel *idle_prev;
+};
+
+
+// The channel and pattern are copied in after the node, while the payload is shared with the other managers.
+struct inbox_message {
+  const char *pattern;  // The pattern that the message matched, or NULL for a channel message.
+  size_t channel_nbytes;
+  struct pubsub_payload *payload;
+  char channel[];
+};
+
+
+struct pubsub_manager {
+  // The worker's broker, which carries messages between publishers and subscribers.
+  struct broker *broker;
+
+  // Messages handed over by the broker from other threads, waiting to be sent out on this manager's
+  // event loop. The wakeup fd is only signalled when `inbox_wakeup_pending` was not already set.
+  struct spsc_ring *inbox;
+  struct compat_eventfd inbox_wakeup;
+  atomic_bool inbox_wakeup_pending;
+  struct event *inbox_event;
+  size_t inbox_ndropped;  // Only touched by the inbox's producer.
+
+  // Keep track of the libevent loop that the redis async connection is bound to.
   struct event_base *event_base;
   struct evbuffer *out_json_buffer;
 
@@ -48,249 +139,607 @@ struct pubsub_manager {
   struct string_pool *string_pool;
 
   // Keep track of the websocket <==> channel mappings.
-  struct key_chain *channel_buckets[HASHTABLE_NBUCKETS];    // { channel : [ websocket ] }
-  struct key_chain *websocket_buckets[HASHTABLE_NBUCKETS];  // { websocket : [ channel ] }
+  struct hashtable *channels;       // { channel : [ websocket ] }
+  struct hashtable *subscriptions;  // { (websocket, channel) : subscription }
+  struct pattern_trie *patterns;    // { pattern : [ websocket ] }
+
+  // Per-channel message history. Idle channels are evicted least recently used first whenever the
+  // history uses more than its share of memory.
+  struct pubsub_history_options history_options;
+  size_t history_nbytes;
+  size_t history_nchannels;
+  struct channel *idle_head;
+  struct channel *idle_tail;
+  struct event *history_sweep_event;
 };
 
 
 static void
-hashtable_destroy(struct key_chain **const table, struct string_pool *const string_pool, const bool key_in_string_pool) {
-  struct key_chain *key_chain, *next_key_chain;
-  struct value_chain *value_chain, *next_value_chain;
-
-  for (size_t i = 0; i != HASHTABLE_NBUCKETS; ++i) {
-    for (key_chain = table[i]; key_chain != NULL; ) {
-      next_key_chain = key_chain->next;
-      for (value_chain = key_chain->chain; value_chain != NULL; ) {
-        next_value_chain = value_chain->next;
-        if (!key_in_string_pool) {
-          string_pool_release(string_pool, (const char *)value_chain->value);
-        }
-        free(value_chain);
-        value_chain = next_value_chain;
-      }
-      if (key_in_string_pool) {
-        string_pool_release(string_pool, (const char *)key_chain->key);
-      }
-      free(key_chain);
-      key_chain = next_key_chain;
-    }
+history_drop_oldest(struct pubsub_manager *const mgr, struct history *const history) {
+  struct history_entry *const entry = &history->entries[history->head];
+  mgr->history_nbytes -= entry->nbytes;
+  websocket_frame_release(entry->frame);
+  history->head = (history->head + 1 == history->capacity) ? 0 : history->head + 1;
+  --history->count;
+}
+
+
+static void
+history_destroy(struct pubsub_manager *const mgr, struct history *const history) {
+  while (history->count != 0) {
+    history_drop_oldest(mgr, history);
   }
+  free(history);
+  --mgr->history_nchannels;
 }
 
 
+// Drops the messages which are older than the manager's history age limit, if it has one.
 static void
-on_connect(const redisAsyncContext *const ctx, const int status) {
-  struct pubsub_manager *const mgr = (struct pubsub_manager *)ctx->data;
+history_expire(struct pubsub_manager *const mgr, struct history *const history) {
+  struct timeval now, expiry;
 
-  if (status != REDIS_OK) {
-    ERROR("Error in on_connect redis callback. status=%d error=%s\n", status, ctx->errstr);
+  if (!evutil_timerisset(&mgr->history_options.max_age)) {
     return;
   }
+  event_base_gettimeofday_cached(mgr->event_base, &now);
+  while (history->count != 0) {
+    evutil_timeradd(&history->entries[history->head].time, &mgr->history_options.max_age, &expiry);
+    if (evutil_timercmp(&expiry, &now, >)) {
+      break;
+    }
+    history_drop_oldest(mgr, history);
+  }
+}
 
-  INFO("Connected to redis server. mgr=%p\n", (void *)mgr);
-  if (ctx == mgr->pub_ctx) {
-    mgr->pub_is_connected = true;
+
+static void
+channel_destroy(struct pubsub_manager *const mgr, struct channel *const channel) {
+  if (channel->history != NULL) {
+    history_destroy(mgr, channel->history);
   }
-  else {
-    mgr->sub_is_connected = true;
+  if (channel->websockets != channel->inline_websockets) {
+    free(channel->websockets);
+    free(channel->subscriptions);
   }
+  string_pool_release(mgr->string_pool, channel->name);
+  free(channel);
+}
+
+
+static void
+destroy_pattern(void *const value, void *const arg) {
+  channel_destroy(arg, value);
 }
 
 
 static void
-on_disconnect(const redisAsyncContext *const ctx, const int status) {
-  struct pubsub_manager *const mgr = (struct pubsub_manager *)ctx->data;
-  if (ctx == mgr->pub_ctx) {
-    mgr->pub_is_connected = false;
+hashtables_destroy(struct pubsub_manager *const mgr) {
+  struct channel *channel;
+  struct subscription *subscription;
+
+  if (mgr->subscriptions != NULL) {
+    for (size_t cursor = 0; (subscription = hashtable_next(mgr->subscriptions, &cursor)) != NULL; ) {
+      if (subscription->replay != NULL) {
+        subscription->replay->subscription = NULL;
+      }
+      free(subscription);
+    }
+    hashtable_destroy(mgr->subscriptions);
   }
-  else {
-    mgr->sub_is_connected = false;
+  if (mgr->channels != NULL) {
+    for (size_t cursor = 0; (channel = hashtable_next(mgr->channels, &cursor)) != NULL; ) {
+      channel_destroy(mgr, channel);
+    }
+    hashtable_destroy(mgr->channels);
   }
+  if (mgr->patterns != NULL) {
+    pattern_trie_destroy(mgr->patterns, &destroy_pattern, mgr);
+  }
+}
 
-  if (status != REDIS_OK) {
-    ERROR("Error in on_disconnect redis callback. status=%d error=%s\n", status, ctx->errstr);
-    return;
+
+static enum status
+channel_grow(struct channel *const channel) {
+  // Double the capacity, keeping the arrays cache line aligned.
+  const size_t capacity = 2 * channel->capacity;
+  struct websocket **const websockets = aligned_alloc(CACHE_LINE_NBYTES, capacity * sizeof(struct websocket *));
+  struct subscription **const subscriptions = aligned_alloc(CACHE_LINE_NBYTES, capacity * sizeof(struct subscription *));
+  if (websockets == NULL || subscriptions == NULL) {
+    ERROR0("aligned_alloc failed.\n");
+    free(websockets);
+    free(subscriptions);
+    return STATUS_ENOMEM;
+  }
+  memcpy(websockets, channel->websockets, channel->nsubscribers * sizeof(struct websocket *));
+  memcpy(subscriptions, channel->subscriptions, channel->nsubscribers * sizeof(struct subscription *));
+  if (channel->websockets != channel->inline_websockets) {
+    free(channel->websockets);
+    free(channel->subscriptions);
+  }
+  channel->websockets = websockets;
+  channel->subscriptions = subscriptions;
+  channel->capacity = capacity;
+
+  return STATUS_OK;
+}
+
+
+static bool
+channel_matches(const void *const value, const void *const key) {
+  return ((const struct channel *)value)->name == key;
+}
+
+
+static bool
+subscription_matches(const void *const value, const void *const key) {
+  const struct subscription *const subscription = value;
+  const struct subscription_key *const k = key;
+  return subscription->ws == k->ws && subscription->channel == k->channel;
+}
+
+
+static inline uint64_t
+channel_hash(const char *const canonical_channel) {
+  return string_pool_hash(canonical_channel);
+}
+
+
+static inline uint64_t
+subscription_hash(const struct websocket *const ws, const struct channel *const channel) {
+  return XXH64(&ws, sizeof(ws), channel_hash(channel->name));
+}
+
+
+static inline struct channel *
+find_channel(struct pubsub_manager *const mgr, const char *const canonical_channel) {
+  return hashtable_find(mgr->channels, channel_hash(canonical_channel), canonical_channel);
+}
+
+
+static inline struct channel *
+find_channel_or_pattern(struct pubsub_manager *const mgr, const char *const canonical_name, const bool is_pattern) {
+  if (is_pattern) {
+    return pattern_trie_find(mgr->patterns, canonical_name, string_pool_length(canonical_name));
   }
+  return find_channel(mgr, canonical_name);
+}
 
-  INFO("Disconnected from redis server. mgr=%p\n", (void *)mgr);
+
+static enum status
+channel_register(struct pubsub_manager *const mgr, struct channel *const channel) {
+  if (channel->is_pattern) {
+    return pattern_trie_insert(mgr->patterns, channel->name, string_pool_length(channel->name), channel);
+  }
+  return hashtable_insert(mgr->channels, channel_hash(channel->name), channel);
 }
 
 
 static void
-on_subscribed_reply_subscribe(struct pubsub_manager *const mgr, struct websocket *const ws, const char *const channel) {
-  struct key_chain *key_chain, *prev_key_chain;
-  struct value_chain *value_chain;
-  size_t bucket;
+channel_unregister(struct pubsub_manager *const mgr, const struct channel *const channel) {
+  if (channel->is_pattern) {
+    pattern_trie_remove(mgr->patterns, channel->name, string_pool_length(channel->name));
+  }
+  else {
+    hashtable_remove(mgr->channels, channel_hash(channel->name), channel->name);
+  }
+}
 
-  // Get a ref-counted canonical version of the channel string.
-  const char *canonical_channel = string_pool_get(mgr->string_pool, channel);
 
-  // Insert the websocket into the chain for the subscribed channel.
-  bucket = XXH64(canonical_channel, strlen(canonical_channel), 0) % HASHTABLE_NBUCKETS;
-  prev_key_chain = NULL;
-  for (key_chain = mgr->channel_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == canonical_channel) {
-      break;
-    }
-    prev_key_chain = key_chain;
+static inline enum status
+broker_subscribe(struct pubsub_manager *const mgr, const struct channel *const channel) {
+  return mgr->broker->ops->subscribe(mgr->broker, channel->name, channel->is_pattern);
+}
+
+
+static inline enum status
+broker_unsubscribe(struct pubsub_manager *const mgr, const struct channel *const channel) {
+  return mgr->broker->ops->unsubscribe(mgr->broker, channel->name, channel->is_pattern);
+}
+
+
+static void
+idle_list_append(struct pubsub_manager *const mgr, struct channel *const channel) {
+  channel->is_idle = true;
+  channel->idle_next = NULL;
+  channel->idle_prev = mgr->idle_tail;
+  if (mgr->idle_tail == NULL) {
+    mgr->idle_head = channel;
+  }
+  else {
+    mgr->idle_tail->idle_next = channel;
+  }
+  mgr->idle_tail = channel;
+}
+
+
+static void
+idle_list_remove(struct pubsub_manager *const mgr, struct channel *const channel) {
+  if (channel->idle_prev == NULL) {
+    mgr->idle_head = channel->idle_next;
+  }
+  else {
+    channel->idle_prev->idle_next = channel->idle_next;
   }
+  if (channel->idle_next == NULL) {
+    mgr->idle_tail = channel->idle_prev;
+  }
+  else {
+    channel->idle_next->idle_prev = channel->idle_prev;
+  }
+  channel->is_idle = false;
+  channel->idle_next = NULL;
+  channel->idle_prev = NULL;
+}
+
 
-  // Did we find a websocket chain for this channel?
-  if (key_chain == NULL) {
-    // Create the key chain node for the channel to websockets mapping.
-    key_chain = malloc(sizeof(struct key_chain));
-    if (key_chain == NULL) {
+// Forgets about an idle channel and its history, and lets the broker know.
+static void
+evict_idle_channel(struct pubsub_manager *const mgr, struct channel *const channel) {
+  DEBUG("Evicting the history of idle channel '%s'\n", channel->name);
+  idle_list_remove(mgr, channel);
+  broker_unsubscribe(mgr, channel);
+  channel_unregister(mgr, channel);
+  channel_destroy(mgr, channel);
+}
+
+
+/**
+ * Adds a message's frame to the channel's history, making room for it by dropping the oldest
+ * message once the ring is as big as it is allowed to get.
+ **/
+static enum status
+history_append(struct pubsub_manager *const mgr, struct channel *const channel, struct websocket_frame *const frame) {
+  struct history *history = channel->history;
+  const size_t max_nmessages = mgr->history_options.max_nmessages;
+
+  // Grow the ring, unwrapping it into the new allocation.
+  if (history == NULL || (history->count == history->capacity && history->capacity != max_nmessages)) {
+    size_t capacity = (history == NULL) ? HISTORY_INITIAL_CAPACITY : 2 * history->capacity;
+    if (capacity > max_nmessages) {
+      capacity = max_nmessages;
+    }
+    struct history *const grown = malloc(sizeof(struct history) + capacity * sizeof(struct history_entry));
+    if (grown == NULL) {
       ERROR0("malloc failed.\n");
-      string_pool_release(mgr->string_pool, canonical_channel);
-      free(key_chain);
-      return;
+      return STATUS_ENOMEM;
     }
-    memset(key_chain, 0, sizeof(struct key_chain));
-    key_chain->key = (void *)canonical_channel;
-    canonical_channel = string_pool_get(mgr->string_pool, canonical_channel);
-
-    // Insert it into the chain.
-    if (prev_key_chain == NULL) {
-      mgr->channel_buckets[bucket] = key_chain;
+    grown->head = 0;
+    grown->count = 0;
+    grown->capacity = capacity;
+    if (history == NULL) {
+      ++mgr->history_nchannels;
     }
     else {
-      prev_key_chain->next = key_chain;
+      for (; grown->count != history->count; ++grown->count) {
+        grown->entries[grown->count] = history->entries[(history->head + grown->count) % history->capacity];
+      }
+      free(history);
     }
+    channel->history = history = grown;
+  }
+  else if (history->count == history->capacity) {
+    history_drop_oldest(mgr, history);
   }
 
-  // Insert the websocket into the chain.
-  value_chain = malloc(sizeof(struct value_chain));
-  if (value_chain == NULL) {
-    ERROR0("malloc failed.\n");
-    string_pool_release(mgr->string_pool, canonical_channel);
+  struct history_entry *const entry = &history->entries[(history->head + history->count) % history->capacity];
+  websocket_frame_retain(frame);
+  entry->frame = frame;
+  event_base_gettimeofday_cached(mgr->event_base, &entry->time);
+  entry->nbytes = sizeof(struct history_entry) + websocket_frame_nbytes(frame);
+  ++history->count;
+  mgr->history_nbytes += entry->nbytes;
+
+  history_expire(mgr, history);
+  return STATUS_OK;
+}
+
+
+/**
+ * Brings the history back under its memory limit after a message was added to `channel`. The
+ * least recently used idle channels go first, and then the channel's own oldest messages.
+ **/
+static void
+history_enforce_limit(struct pubsub_manager *const mgr, struct channel *const channel) {
+  struct channel *idle, *next;
+
+  for (idle = mgr->idle_head; idle != NULL && mgr->history_nbytes > mgr->history_options.max_nbytes; idle = next) {
+    next = idle->idle_next;
+    if (idle != channel) {
+      evict_idle_channel(mgr, idle);
+    }
+  }
+  while (mgr->history_nbytes > mgr->history_options.max_nbytes && channel->history->count != 0) {
+    history_drop_oldest(mgr, channel->history);
+  }
+  if (channel->is_idle && channel->history->count == 0) {
+    evict_idle_channel(mgr, channel);
+  }
+}
+
+
+/**
+ * Sends up to `nmessages` of the channel's most recent messages to the websocket.
+ **/
+static void
+history_replay(struct pubsub_manager *const mgr, const struct channel *const channel, struct websocket *const ws, const size_t nmessages) {
+  struct history *const history = channel->history;
+  if (history == NULL) {
     return;
   }
-  value_chain->value = ws;
-  value_chain->next = key_chain->chain;
-  key_chain->chain = value_chain;
 
-  // Insert the channel into the chain for the websocket.
-  bucket = ((size_t)ws) % HASHTABLE_NBUCKETS;
-  prev_key_chain = NULL;
-  for (key_chain = mgr->websocket_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == ws) {
-      break;
-    }
-    prev_key_chain = key_chain;
+  history_expire(mgr, history);
+  const size_t n = (nmessages < history->count) ? nmessages : history->count;
+  for (size_t i = history->count - n; i != history->count; ++i) {
+    websocket_send_frame(ws, history->entries[(history->head + i) % history->capacity].frame);
   }
+}
 
-  // Did we find a channel chain for this websocket?
-  if (key_chain == NULL) {
-    // Create the key chain node for the channel to websockets mapping.
-    key_chain = malloc(sizeof(struct key_chain));
-    if (key_chain == NULL) {
-      ERROR0("malloc failed.\n");
-      free(key_chain);
-      return;
-    }
-    memset(key_chain, 0, sizeof(struct key_chain));
-    key_chain->key = (void *)ws;
 
-    // Insert it into the chain.
-    if (prev_key_chain == NULL) {
-      mgr->websocket_buckets[bucket] = key_chain;
-    }
-    else {
-      prev_key_chain->next = key_chain;
+static void
+on_history_sweep(const evutil_socket_t fd, const short events, void *const arg) {
+  struct pubsub_manager *const mgr = (struct pubsub_manager *)arg;
+  struct channel *channel, *next;
+  (void)fd;
+  (void)events;
+
+  // Idle channels don't get any more messages to expire their history, so sweep them.
+  for (channel = mgr->idle_head; channel != NULL; channel = next) {
+    next = channel->idle_next;
+    history_expire(mgr, channel->history);
+    if (channel->history->count == 0) {
+      evict_idle_channel(mgr, channel);
     }
   }
+}
 
-  // Insert the channel into the chain.
-  value_chain = malloc(sizeof(struct value_chain));
-  if (value_chain == NULL) {
-    ERROR0("malloc failed.\n");
-    return;
+
+static struct subscription *
+find_subscription(struct pubsub_manager *const mgr, const struct websocket *const ws, const char *const channel_name, const bool is_pattern) {
+  // Channels and patterns are only interned while they have subscribers.
+  const char *const canonical_channel = string_pool_find(mgr->string_pool, channel_name, strlen(channel_name));
+  if (canonical_channel == NULL) {
+    return NULL;
+  }
+  const struct channel *const channel = find_channel_or_pattern(mgr, canonical_channel, is_pattern);
+  if (channel == NULL) {
+    return NULL;
   }
-  value_chain->value = (void *)canonical_channel;
-  value_chain->next = key_chain->chain;
-  key_chain->chain = value_chain;
+  const struct subscription_key key = {.ws = ws, .channel = channel};
+  return hashtable_find(mgr->subscriptions, subscription_hash(ws, channel), &key);
 }
 
 
-static void
-on_subscribed_reply_message(struct pubsub_manager *const mgr, const char *const channel, const char *const message) {
-  struct key_chain *key_chain;
-  struct value_chain *value_chain;
-  struct websocket *ws;
+static enum status
+add_subscription(struct pubsub_manager *const mgr, struct websocket *const ws, const char *const channel_name, const bool is_pattern) {
+  struct subscription *subscription = NULL;
+  enum status status;
 
   // Get a ref-counted canonical version of the channel string.
-  const char *canonical_channel = string_pool_get(mgr->string_pool, channel);
+  const char *const canonical_channel = string_pool_get(mgr->string_pool, channel_name);
+  if (canonical_channel == NULL) {
+    return STATUS_ENOMEM;
+  }
 
-  // Find the chain of websockets subscribed to the channel.
-  const size_t bucket = XXH64(canonical_channel, strlen(canonical_channel), 0) % HASHTABLE_NBUCKETS;
-  for (key_chain = mgr->channel_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == canonical_channel) {
-      break;
+  // Find or create the channel. The channel holds on to the canonical string's reference. Only the
+  // first local subscriber to a channel needs to tell the broker about it, later subscribers are
+  // attached straight away.
+  struct channel *channel = find_channel_or_pattern(mgr, canonical_channel, is_pattern);
+  if (channel == NULL) {
+    channel = malloc(sizeof(struct channel));
+    if (channel == NULL) {
+      ERROR0("malloc failed.\n");
+      string_pool_release(mgr->string_pool, canonical_channel);
+      return STATUS_ENOMEM;
+    }
+    memset(channel, 0, sizeof(struct channel));
+    channel->name = canonical_channel;
+    channel->is_pattern = is_pattern;
+    channel->capacity = SUBSCRIBERS_INLINE_CAPACITY;
+    channel->websockets = channel->inline_websockets;
+    channel->subscriptions = channel->inline_subscriptions;
+    if (channel_register(mgr, channel) != STATUS_OK) {
+      channel_destroy(mgr, channel);
+      return STATUS_ENOMEM;
+    }
+    status = broker_subscribe(mgr, channel);
+    if (status != STATUS_OK) {
+      channel_unregister(mgr, channel);
+      channel_destroy(mgr, channel);
+      return status;
     }
   }
-  string_pool_release(mgr->string_pool, canonical_channel);
-  if (key_chain == NULL) {
-    return;
+  else {
+    string_pool_release(mgr->string_pool, canonical_channel);
+    if (channel->is_idle) {
+      idle_list_remove(mgr, channel);
+    }
+  }
+
+  // Make room for the websocket in the channel's subscriber arrays.
+  if (channel->nsubscribers == channel->capacity && channel_grow(channel) != STATUS_OK) {
+    goto fail;
+  }
+  subscription = malloc(sizeof(struct subscription));
+  if (subscription == NULL) {
+    ERROR0("malloc failed.\n");
+    goto fail;
+  }
+  memset(subscription, 0, sizeof(struct subscription));
+  subscription->channel = channel;
+  subscription->ws = ws;
+  subscription->index = channel->nsubscribers;
+  if (hashtable_insert(mgr->subscriptions, subscription_hash(ws, channel), subscription) != STATUS_OK) {
+    goto fail;
+  }
+
+  // Link the subscription into both the channel and the websocket.
+  channel->websockets[channel->nsubscribers] = ws;
+  channel->subscriptions[channel->nsubscribers] = subscription;
+  ++channel->nsubscribers;
+  subscription->ws_next = ws->subscriptions;
+  subscription->ws_pprev = &ws->subscriptions;
+  if (ws->subscriptions != NULL) {
+    ws->subscriptions->ws_pprev = &subscription->ws_next;
+  }
+  ws->subscriptions = subscription;
+
+  return STATUS_OK;
+
+fail:
+  free(subscription);
+  if (channel->nsubscribers == 0) {
+    broker_unsubscribe(mgr, channel);
+    channel_unregister(mgr, channel);
+    channel_destroy(mgr, channel);
   }
+  return STATUS_ENOMEM;
+}
+
+
+/**
+ * Wraps a message in its JSON container and encodes it as a websocket frame, which can be shared
+ * between any number of websockets.
+ **/
+static struct websocket_frame *
+create_message_frame(struct pubsub_manager *const mgr, const char *const pattern, const char *const channel_name, const size_t channel_nbytes, const char *const data, const size_t data_nbytes, const struct stream_id *const id) {
+  char id_str[STREAM_ID_MAX_NBYTES];
 
-  // Wrap the message in its JSON container.
   evbuffer_drain(mgr->out_json_buffer, evbuffer_get_length(mgr->out_json_buffer));
   evbuffer_add_printf(mgr->out_json_buffer, "{\"key\":");
-  json_write_escape_string(mgr->out_json_buffer, channel);
+  json_write_escape_string_n(mgr->out_json_buffer, channel_name, channel_nbytes);
+  if (pattern != NULL) {
+    evbuffer_add_printf(mgr->out_json_buffer, ",\"pattern\":");
+    json_write_escape_string(mgr->out_json_buffer, pattern);
+  }
+  if (id != NULL && stream_id_is_set(id)) {
+    stream_id_format(id, id_str);
+    evbuffer_add_printf(mgr->out_json_buffer, ",\"id\":\"%s\"", id_str);
+  }
   evbuffer_add_printf(mgr->out_json_buffer, ",\"data\":");
-  json_write_escape_string(mgr->out_json_buffer, message);
+  json_write_escape_string_n(mgr->out_json_buffer, data, data_nbytes);
   evbuffer_add_printf(mgr->out_json_buffer, "}");
 
-  // Make the output JSON buffer a contiguous stream of bytes.
-  const char *const out_json = (const char *)evbuffer_pullup(mgr->out_json_buffer, -1);
-  const size_t out_json_nbytes = evbuffer_get_length(mgr->out_json_buffer);
+  struct websocket_frame *const frame = websocket_frame_create_text(mgr->out_json_buffer);
+  if (frame == NULL) {
+    ERROR0("websocket_frame_create_text failed.\n");
+  }
+  return frame;
+}
+
 
-  // Write the JSON message to each of the websockets.
-  for (value_chain = key_chain->chain; value_chain != NULL; value_chain = value_chain->next) {
-    ws = (struct websocket *)value_chain->value;
-    DEBUG("Sending to ws=%p via channel '%s'\n", (void *)ws, channel);
-    websocket_send_text_bytes(ws, out_json, out_json_nbytes);
+/**
+ * Whether a live message should be sent to a resuming subscription. Messages are held back while
+ * the replay is running, and skipped if the replay has already sent them.
+ **/
+static bool
+resuming_wants(struct channel *const channel, struct subscription *const subscription, const struct stream_id *const id) {
+  if (subscription->replay != NULL) {
+    if (stream_id_compare(id, &subscription->replay->max_skipped) > 0) {
+      subscription->replay->max_skipped = *id;
+    }
+    return false;
+  }
+  else if (stream_id_is_set(&subscription->after)) {
+    if (stream_id_compare(id, &subscription->after) <= 0) {
+      return false;
+    }
+    // The subscription has caught up with the live messages.
+    subscription->after.ms = 0;
+    subscription->after.seq = 0;
+    --channel->nresuming;
+  }
+  return true;
+}
+
+
+/**
+ * Whether a message should be sent to a subscription, for channels where some subscriptions need
+ * a closer look.
+ **/
+static inline bool
+subscription_wants(struct channel *const channel, struct subscription *const subscription, const struct pubsub_payload *const payload) {
+  if (subscription->nolocal && payload->publisher != 0 && payload->publisher == subscription->ws->id) {
+    return false;
   }
+  return channel->nresuming == 0 || resuming_wants(channel, subscription, &payload->id);
 }
 
 
 static void
-on_subscribed_reply(redisAsyncContext *const ctx, void *const _reply, void *const privdata) {
-  struct pubsub_manager *const mgr = (struct pubsub_manager *)ctx->data;
-  const redisReply *const reply = _reply;
-  struct websocket *const ws = privdata;
+deliver_message(struct pubsub_manager *const mgr, const char *const pattern, const char *const channel_name, const size_t channel_nbytes, const struct pubsub_payload *const payload) {
+  struct channel *channel;
 
-  INFO("mgr=%p reply=%p ws=%p\n", (void *)mgr, (void *)reply, (void *)ws);
-  if (reply == NULL) {
-    return;
+  // Find the websockets subscribed to the pattern or channel. A pattern message names the pattern
+  // that it matched, so only the trie nodes along that pattern are visited.
+  if (pattern != NULL) {
+    channel = pattern_trie_find(mgr->patterns, pattern, strlen(pattern));
+  }
+  else {
+    // Channels are only interned while they have subscribers, so a channel which is not in the pool
+    // has nobody to deliver to.
+    const char *const canonical_channel = string_pool_find(mgr->string_pool, channel_name, channel_nbytes);
+    channel = (canonical_channel == NULL) ? NULL : find_channel(mgr, canonical_channel);
   }
-  else if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3) {
+  if (channel == NULL) {
     return;
   }
-  DEBUG("Received %s %s %s\n", reply->element[0]->str, reply->element[1]->str, reply->element[2]->str);
 
-  if (strcmp(reply->element[0]->str, "subscribe") == 0) {
-    on_subscribed_reply_subscribe(mgr, ws, reply->element[1]->str);
+  // Encode the websocket frame once and share it between all of the websockets.
+  struct websocket_frame *const frame = create_message_frame(mgr, pattern, channel_name, channel_nbytes, payload->bytes, payload->nbytes, &payload->id);
+  if (frame == NULL) {
+    return;
   }
-  else if (strcmp(reply->element[0]->str, "message") == 0) {
-    on_subscribed_reply_message(mgr, reply->element[1]->str, reply->element[2]->str);
+
+  // Write the JSON message to each of the websockets, prefetching the websockets further along.
+  // Only channels with resuming or nolocal subscriptions pay for looking at the subscriptions.
+  struct websocket *const *const websockets = channel->websockets;
+  const size_t nsubscribers = channel->nsubscribers;
+  for (size_t i = 0; i != nsubscribers; ++i) {
+    if (i + FANOUT_PREFETCH_DISTANCE < nsubscribers) {
+      __builtin_prefetch(websockets[i + FANOUT_PREFETCH_DISTANCE], 1);
+    }
+    if ((channel->nresuming != 0 || channel->nnolocal != 0) && !subscription_wants(channel, channel->subscriptions[i], payload)) {
+      continue;
+    }
+    DEBUG("Sending to ws=%p via channel '%s'\n", (void *)websockets[i], channel_name);
+    websocket_send_frame(websockets[i], frame);
   }
-  else if (strcmp(reply->element[0]->str, "unsubscribe") == 0) {
-    // Do nothing.
+
+  // Keep the frame for late joiners. This may evict the channel, so it comes last.
+  if (mgr->history_options.max_nmessages != 0 && !channel->is_pattern && history_append(mgr, channel, frame) == STATUS_OK) {
+    history_enforce_limit(mgr, channel);
   }
-  else {
-    ERROR("Received unknown message on subscription channel '%s' '%s' '%s'\n", reply->element[0]->str, reply->element[1]->str, reply->element[2]->str);
+  websocket_frame_release(frame);
+}
+
+
+static void
+on_inbox(const evutil_socket_t fd, const short events, void *const arg) {
+  struct pubsub_manager *const mgr = (struct pubsub_manager *)arg;
+  struct inbox_message *message;
+  (void)fd;
+  (void)events;
+
+  // Clear the pending flag before draining so that a message pushed after the drain signals again.
+  compat_eventfd_drain(&mgr->inbox_wakeup);
+  atomic_store(&mgr->inbox_wakeup_pending, false);
+
+  while ((message = spsc_ring_pop(mgr->inbox)) != NULL) {
+    deliver_message(mgr, message->pattern, message->channel, message->channel_nbytes, message->payload);
+    pubsub_payload_release(message->payload);
+    free(message);
   }
 }
 
 
+/**
+ * Creates a manager for a worker's event loop. The manager keeps a history of each channel's recent
+ * messages as set out by `history`, or none if `history` is NULL.
+ **/
 struct pubsub_manager *
-pubsub_manager_create(const char *const redis_host, const uint16_t redis_port, struct event_base *const event_base) {
-  INFO("Using hiredis version %d.%d.%d\n", HIREDIS_MAJOR, HIREDIS_MINOR, HIREDIS_PATCH);
-
-  int status;
-  if (redis_host == NULL) {
+pubsub_manager_create(struct event_base *const event_base, struct broker *const broker, const struct pubsub_history_options *const history) {
+  if (event_base == NULL || broker == NULL) {
     return NULL;
   }
 
@@ -302,68 +751,64 @@ pubsub_manager_create(const char *const redis_host, const uint16_t redis_port, s
   }
   memset(mgr, 0, sizeof(struct pubsub_manager));
   mgr->event_base = event_base;
+  mgr->broker = broker;
+  if (history != NULL) {
+    mgr->history_options = *history;
+  }
+  atomic_init(&mgr->inbox_wakeup_pending, false);
+  mgr->inbox_wakeup.read_fd = -1;
   mgr->out_json_buffer = evbuffer_new();
   mgr->string_pool = string_pool_create();
-  if (mgr->out_json_buffer == NULL || mgr->string_pool == NULL) {
-    string_pool_destroy(mgr->string_pool);
-    evbuffer_free(mgr->out_json_buffer);
-    free(mgr);
-    return NULL;
-  }
-
-  // Connect to the redis server.
-  mgr->pub_ctx = redisAsyncConnect(redis_host, redis_port);
-  mgr->sub_ctx = redisAsyncConnect(redis_host, redis_port);
-  if (mgr->pub_ctx == NULL || mgr->sub_ctx == NULL) {
-    ERROR("Failed to connect to redis server %s:%d\n", redis_host, redis_port);
+  mgr->channels = hashtable_create(&channel_matches);
+  mgr->subscriptions = hashtable_create(&subscription_matches);
+  mgr->patterns = pattern_trie_create();
+  mgr->inbox = spsc_ring_create(INBOX_CAPACITY);
+  if (mgr->out_json_buffer == NULL || mgr->string_pool == NULL || mgr->channels == NULL || mgr->subscriptions == NULL || mgr->patterns == NULL || mgr->inbox == NULL) {
     goto fail;
   }
-  // Set the redis async context's user data attribute to be our manager object.
-  mgr->pub_ctx->data = mgr;
-  mgr->sub_ctx->data = mgr;
 
-  // Attach the redis async connection to the libevent event loop.
-  status = redisLibeventAttach(mgr->pub_ctx, mgr->event_base);
-  if (status != REDIS_OK) {
-    ERROR("Failed to `redisLibeventAttach`. status=%d\n", status);
+  // Wake up the event loop whenever the broker hands over messages.
+  if (compat_eventfd_open(&mgr->inbox_wakeup) != STATUS_OK) {
     goto fail;
   }
-  status = redisLibeventAttach(mgr->sub_ctx, mgr->event_base);
-  if (status != REDIS_OK) {
-    ERROR("Failed to `redisLibeventAttach`. status=%d\n", status);
+  mgr->inbox_event = event_new(event_base, mgr->inbox_wakeup.read_fd, EV_READ | EV_PERSIST, &on_inbox, mgr);
+  if (mgr->inbox_event == NULL || event_add(mgr->inbox_event, NULL) == -1) {
+    ERROR0("Failed to schedule the inbox wakeup event.\n");
     goto fail;
   }
 
-  // Setup the redis connect/disconnect callbacks.
-  status = redisAsyncSetConnectCallback(mgr->pub_ctx, &on_connect);
-  if (status != REDIS_OK) {
-    ERROR("Failed to `redisAsyncSetConnectCallback`. status=%d\n", status);
-    goto fail;
-  }
-  status = redisAsyncSetDisconnectCallback(mgr->pub_ctx, &on_disconnect);
-  if (status != REDIS_OK) {
-    ERROR("Failed to `redisAsyncSetDisconnectCallback`. status=%d\n", status);
-    goto fail;
-  }
-  status = redisAsyncSetConnectCallback(mgr->sub_ctx, &on_connect);
-  if (status != REDIS_OK) {
-    ERROR("Failed to `redisAsyncSetConnectCallback`. status=%d\n", status);
-    goto fail;
+  // Idle channels are only kept for as long as their history is young enough.
+  if (mgr->history_options.max_nmessages != 0 && evutil_timerisset(&mgr->history_options.max_age)) {
+    mgr->history_sweep_event = event_new(event_base, -1, EV_PERSIST, &on_history_sweep, mgr);
+    if (mgr->history_sweep_event == NULL || event_add(mgr->history_sweep_event, &HISTORY_SWEEP_INTERVAL) == -1) {
+      ERROR0("Failed to schedule the history sweep event.\n");
+      goto fail;
+    }
   }
-  status = redisAsyncSetDisconnectCallback(mgr->sub_ctx, &on_disconnect);
-  if (status != REDIS_OK) {
-    ERROR("Failed to `redisAsyncSetDisconnectCallback`. status=%d\n", status);
+
+  // Attach to the broker so that it can hand over messages for our subscriptions.
+  if (broker->ops->attach(broker, mgr) != STATUS_OK) {
+    ERROR0("Failed to attach the manager to its broker.\n");
     goto fail;
   }
 
   return mgr;
 
 fail:
-  if (mgr->pub_ctx != NULL) {
-    redisAsyncDisconnect(mgr->pub_ctx);
+  if (mgr->history_sweep_event != NULL) {
+    event_free(mgr->history_sweep_event);
+  }
+  if (mgr->inbox_event != NULL) {
+    event_free(mgr->inbox_event);
   }
-  if (mgr->sub_ctx != NULL) {
-    redisAsyncDisconnect(mgr->sub_ctx);
+  if (mgr->inbox_wakeup.read_fd != -1) {
+    compat_eventfd_close(&mgr->inbox_wakeup);
+  }
+  spsc_ring_destroy(mgr->inbox);
+  hashtables_destroy(mgr);
+  string_pool_destroy(mgr->string_pool);
+  if (mgr->out_json_buffer != NULL) {
+    evbuffer_free(mgr->out_json_buffer);
   }
   free(mgr);
   return NULL;
@@ -372,26 +817,97 @@ fail:
 
 enum status
 pubsub_manager_destroy(struct pubsub_manager *const mgr) {
+  struct inbox_message *message;
+
   if (mgr == NULL) {
     return STATUS_EINVAL;
   }
 
-  if (mgr->pub_is_connected) {
-    redisAsyncDisconnect(mgr->pub_ctx);
+  if (mgr->history_sweep_event != NULL) {
+    event_free(mgr->history_sweep_event);
   }
-  if (mgr->sub_is_connected) {
-    redisAsyncDisconnect(mgr->sub_ctx);
+  event_free(mgr->inbox_event);
+  compat_eventfd_close(&mgr->inbox_wakeup);
+  while ((message = spsc_ring_pop(mgr->inbox)) != NULL) {
+    pubsub_payload_release(message->payload);
+    free(message);
   }
+  spsc_ring_destroy(mgr->inbox);
+  hashtables_destroy(mgr);
   string_pool_destroy(mgr->string_pool);
   evbuffer_free(mgr->out_json_buffer);
-  hashtable_destroy(mgr->channel_buckets, mgr->string_pool, true);
-  hashtable_destroy(mgr->websocket_buckets, mgr->string_pool, false);
   free(mgr);
 
   return STATUS_OK;
 }
 
 
+/**
+ * Hands a message over to the manager from another thread, such as the redis hub's ingest thread.
+ * The message is sent out to the subscribed websockets from the manager's own event loop. `pattern`
+ * is the pattern that the channel matched, or NULL for a channel message. The manager takes its own
+ * reference to the payload rather than copying it. The caller never waits on a slow manager: if the
+ * manager's inbox is full the message is dropped. Calls must not overlap, as the inbox only
+ * supports a single producer at a time.
+ **/
+enum status
+pubsub_manager_deliver(struct pubsub_manager *const mgr, const char *const pattern, const char *const channel, const size_t channel_nbytes, struct pubsub_payload *const payload) {
+  if (mgr == NULL || channel == NULL || payload == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  // Copy the channel and pattern into a single allocation alongside the inbox node.
+  const size_t pattern_nbytes = (pattern == NULL) ? 0 : strlen(pattern) + 1;
+  struct inbox_message *const node = malloc(sizeof(struct inbox_message) + channel_nbytes + 1 + pattern_nbytes);
+  if (node == NULL) {
+    ERROR0("malloc failed.\n");
+    return STATUS_ENOMEM;
+  }
+  memcpy(node->channel, channel, channel_nbytes);
+  node->channel[channel_nbytes] = '\0';
+  node->channel_nbytes = channel_nbytes;
+  node->pattern = NULL;
+  if (pattern != NULL) {
+    memcpy(node->channel + channel_nbytes + 1, pattern, pattern_nbytes);
+    node->pattern = node->channel + channel_nbytes + 1;
+  }
+  node->payload = payload;
+
+  // Take the reference before the node is visible to the manager's thread.
+  pubsub_payload_retain(payload);
+  if (!spsc_ring_push(mgr->inbox, node)) {
+    pubsub_payload_release(payload);
+    free(node);
+    ++mgr->inbox_ndropped;
+    if ((mgr->inbox_ndropped & (mgr->inbox_ndropped - 1)) == 0) {
+      WARNING("Inbox full for mgr=%p. %zu messages dropped so far.\n", (void *)mgr, mgr->inbox_ndropped);
+    }
+    return STATUS_ENOMEM;
+  }
+
+  // Wake up the manager's event loop if it isn't already going to wake up.
+  if (!atomic_exchange(&mgr->inbox_wakeup_pending, true)) {
+    compat_eventfd_signal(&mgr->inbox_wakeup);
+  }
+
+  return STATUS_OK;
+}
+
+
+/**
+ * Sends a message out to the subscribed websockets straight away. This must be called from the
+ * manager's own thread.
+ **/
+enum status
+pubsub_manager_deliver_now(struct pubsub_manager *const mgr, const char *const pattern, const char *const channel, const size_t channel_nbytes, struct pubsub_payload *const payload) {
+  if (mgr == NULL || channel == NULL || payload == NULL) {
+    return STATUS_EINVAL;
+  }
+  deliver_message(mgr, pattern, channel, channel_nbytes, payload);
+  return STATUS_OK;
+}
+
+
 enum status
 pubsub_manager_publish(struct pubsub_manager *const mgr, const char *const channel, const char *const message) {
   return pubsub_manager_publish_n(mgr, channel, message, strlen(message));
@@ -400,250 +916,339 @@ pubsub_manager_publish(struct pubsub_manager *const mgr, const char *const chann
 
 enum status
 pubsub_manager_publish_n(struct pubsub_manager *const mgr, const char *const channel, const char *const message, const size_t message_nbytes) {
-  int status;
-
   if (mgr == NULL || channel == NULL || message == NULL) {
     return STATUS_EINVAL;
   }
-  else if (!mgr->pub_is_connected) {
-    return STATUS_DISCONNECTED;
+  return mgr->broker->ops->publish(mgr->broker, channel, strlen(channel), message, message_nbytes, 0);
+}
+
+
+/**
+ * Publishes a message on behalf of a websocket, so that its own subscriptions can opt out of
+ * receiving it back.
+ **/
+enum status
+pubsub_manager_publish_from(struct pubsub_manager *const mgr, struct websocket *const ws, const char *const channel, const char *const message) {
+  if (mgr == NULL || ws == NULL || channel == NULL || message == NULL) {
+    return STATUS_EINVAL;
+  }
+  return mgr->broker->ops->publish(mgr->broker, channel, strlen(channel), message, strlen(message), ws->id);
+}
+
+
+static enum status
+subscribe(struct pubsub_manager *const mgr, const char *const name, struct websocket *const ws, const bool is_pattern) {
+  const char *const kind = is_pattern ? "pattern" : "channel";
+
+  if (mgr == NULL || name == NULL) {
+    return STATUS_EINVAL;
   }
 
-  status = redisAsyncCommand(mgr->pub_ctx, NULL, NULL, "PUBLISH %s %b", channel, message, message_nbytes);
-  if (status != REDIS_OK) {
-    ERROR("async `PUBLISH %s` command failed. status=%d\n", channel, status);
-    return STATUS_BAD;
+  // Has this websocket already subscribed to the channel or pattern?
+  if (find_subscription(mgr, ws, name, is_pattern) != NULL) {
+    DEBUG("Not re-subscribing to %s '%s'\n", kind, name);
+    return STATUS_OK;
   }
 
-  return STATUS_OK;
+  DEBUG("Subscribing to %s '%s'\n", kind, name);
+  return add_subscription(mgr, ws, name, is_pattern);
 }
 
 
 enum status
 pubsub_manager_subscribe(struct pubsub_manager *const mgr, const char *const channel, struct websocket *const ws) {
-  int status;
+  return subscribe(mgr, channel, ws, false);
+}
 
+
+/**
+ * Subscribes the websocket to a channel, straight away sending it up to `nmessages` of the
+ * channel's most recent messages from the manager's history. Nothing is replayed to a websocket
+ * which is already subscribed.
+ **/
+enum status
+pubsub_manager_subscribe_history(struct pubsub_manager *const mgr, const char *const channel, struct websocket *const ws, const size_t nmessages) {
   if (mgr == NULL || channel == NULL) {
     return STATUS_EINVAL;
   }
-  else if (!mgr->sub_is_connected) {
-    return STATUS_DISCONNECTED;
-  }
-
-  // Has this websocket already subscribed to the channel?
-  const size_t bucket = ((size_t)ws) % HASHTABLE_NBUCKETS;
-  for (const struct key_chain *key_chain = mgr->websocket_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == ws) {
-      // Get the canonical string for the channel name.
-      const char *const canonical_channel = string_pool_get(mgr->string_pool, channel);
-      for (struct value_chain *value_chain = key_chain->chain; value_chain != NULL; value_chain = value_chain->next) {
-        if (value_chain->value == canonical_channel) {
-          DEBUG("Not re-subscribing to channel '%s'\n", channel);
-          string_pool_release(mgr->string_pool, canonical_channel);
-          return STATUS_OK;
-        }
-      }
-      string_pool_release(mgr->string_pool, canonical_channel);
-      break;
-    }
+
+  if (find_subscription(mgr, ws, channel, false) != NULL) {
+    DEBUG("Not re-subscribing to channel '%s'\n", channel);
+    return STATUS_OK;
   }
 
-  DEBUG("Subscribing to channel '%s'\n", channel);
-  status = redisAsyncCommand(mgr->sub_ctx, &on_subscribed_reply, ws, "SUBSCRIBE %s", channel);
-  if (status != REDIS_OK) {
-    ERROR("async `SUBSCRIBE %s` command failed. status=%d\n", channel, status);
-    return STATUS_BAD;
+  DEBUG("Subscribing to channel '%s' with %zu messages of history\n", channel, nmessages);
+  const enum status status = add_subscription(mgr, ws, channel, false);
+  if (status != STATUS_OK) {
+    return status;
   }
+  history_replay(mgr, find_subscription(mgr, ws, channel, false)->channel, ws, nmessages);
 
   return STATUS_OK;
 }
 
 
+/**
+ * Subscribes the websocket to every channel which matches the redis glob-style `pattern`.
+ **/
 enum status
-remove_websocket_from_channel_chain(struct pubsub_manager *const mgr, const char *const canonical_channel, struct websocket *const ws) {
-  int redis_status;
-  struct key_chain *key_chain, *prev_key_chain, *next_key_chain;
-  struct value_chain *value_chain, *prev_value_chain, *next_value_chain;
-  enum status status = STATUS_OK;
+pubsub_manager_psubscribe(struct pubsub_manager *const mgr, const char *const pattern, struct websocket *const ws) {
+  if (mgr != NULL && !mgr->broker->has_patterns) {
+    return STATUS_EINVAL;
+  }
+  return subscribe(mgr, pattern, ws, true);
+}
 
-  // Remove the websocket from the channel_buckets chain.
-  const size_t bucket = XXH64(canonical_channel, strlen(canonical_channel), 0) % HASHTABLE_NBUCKETS;
-  prev_key_chain = NULL;
-  for (key_chain = mgr->channel_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == canonical_channel) {
-      break;
+
+static void
+replay_finish(struct replay *const replay) {
+  struct subscription *const subscription = replay->subscription;
+  if (subscription != NULL) {
+    subscription->replay = NULL;
+    if (!stream_id_is_set(&subscription->after)) {
+      --subscription->channel->nresuming;
     }
-    prev_key_chain = key_chain;
   }
-  assert(key_chain != NULL);  // If this happens, the two hash tables are in an inconsistent state.
+  free(replay);
+}
 
-  // Remove the websocket from the list of websockets listening to the channel.
-  prev_value_chain = NULL;
-  for (value_chain = key_chain->chain; value_chain != NULL; value_chain = value_chain->next) {
-    if (value_chain->value == ws) {
-      next_value_chain = value_chain->next;
 
-      free(value_chain);
+// Forward declaration.
+static void on_replay_range(const struct stream_entry *entries, size_t nentries, enum status status, void *arg);
 
-      if (prev_value_chain == NULL) {
-        key_chain->chain = next_value_chain;
-      }
-      else {
-        prev_value_chain->next = next_value_chain;
-      }
-      break;
+
+static enum status
+replay_read(struct replay *const replay) {
+  const struct subscription *const subscription = replay->subscription;
+  const char *const name = subscription->channel->name;
+  struct broker *const broker = replay->mgr->broker;
+  return broker->ops->read_range(broker, name, string_pool_length(name), &subscription->after, REPLAY_BATCH_NENTRIES, &on_replay_range, replay);
+}
+
+
+/**
+ * Sends the next batch of a replay to its websocket, and carries on reading until the replay has
+ * caught up with every live message that was held back while it ran.
+ **/
+static void
+on_replay_range(const struct stream_entry *const entries, const size_t nentries, const enum status status, void *const arg) {
+  struct replay *const replay = arg;
+  struct subscription *const subscription = replay->subscription;
+  enum status s;
+
+  if (subscription == NULL) {
+    free(replay);
+    return;
+  }
+  else if (status != STATUS_OK) {
+    WARNING("Failed to replay channel '%s' for ws=%p. status=%d\n", subscription->channel->name, (void *)subscription->ws, status);
+    replay_finish(replay);
+    return;
+  }
+
+  const char *const name = subscription->channel->name;
+  for (size_t i = 0; i != nentries; ++i) {
+    if (stream_id_compare(&entries[i].id, &subscription->after) <= 0) {
+      continue;
     }
-    prev_value_chain = value_chain;
+    struct websocket_frame *const frame = create_message_frame(replay->mgr, NULL, name, string_pool_length(name), entries[i].data, entries[i].data_nbytes, &entries[i].id);
+    if (frame != NULL) {
+      websocket_send_frame(subscription->ws, frame);
+      websocket_frame_release(frame);
+    }
+    subscription->after = entries[i].id;
   }
 
-  // If there aren't any websockets left that listen to the channel, remove it.
-  if (key_chain->chain == NULL) {
-    // Unsubscribe from the channel.
-    redis_status = redisAsyncCommand(mgr->sub_ctx, NULL, NULL, "UNSUBSCRIBE %s", canonical_channel);
-    if (redis_status != REDIS_OK) {
-      ERROR("async `UNSUBSCRIBE %s` command failed. status=%d\n", canonical_channel, redis_status);
-      status = STATUS_BAD;
+  if (nentries == REPLAY_BATCH_NENTRIES || stream_id_compare(&replay->max_skipped, &subscription->after) > 0) {
+    s = replay_read(replay);
+    if (s == STATUS_OK) {
+      return;
     }
+    WARNING("Failed to carry on replaying channel '%s' for ws=%p. status=%d\n", name, (void *)subscription->ws, s);
+  }
+  replay_finish(replay);
+}
 
-    // Remove it.
-    next_key_chain = key_chain->next;
 
-    string_pool_release(mgr->string_pool, (const char *)key_chain->key);
-    free(key_chain);
+static enum status
+remove_subscription(struct pubsub_manager *const mgr, struct subscription *const subscription) {
+  struct channel *const channel = subscription->channel;
 
-    if (prev_key_chain == NULL) {
-      mgr->channel_buckets[bucket] = next_key_chain;
-    }
-    else {
-      prev_key_chain->next = next_key_chain;
-    }
+  // An XRANGE may still be in flight for the replay, which will free it.
+  if (subscription->replay != NULL) {
+    subscription->replay->subscription = NULL;
+    --channel->nresuming;
+  }
+  else if (stream_id_is_set(&subscription->after)) {
+    --channel->nresuming;
+  }
+  if (subscription->nolocal) {
+    --channel->nnolocal;
+  }
+
+  // Swap-remove the websocket from the channel's subscriber arrays, fixing up the back-index of the
+  // subscription which was moved into its place.
+  const size_t last = channel->nsubscribers - 1;
+  if (subscription->index != last) {
+    channel->websockets[subscription->index] = channel->websockets[last];
+    channel->subscriptions[subscription->index] = channel->subscriptions[last];
+    channel->subscriptions[subscription->index]->index = subscription->index;
+  }
+  --channel->nsubscribers;
+
+  // Unlink the subscription from the websocket and forget about it.
+  *subscription->ws_pprev = subscription->ws_next;
+  if (subscription->ws_next != NULL) {
+    subscription->ws_next->ws_pprev = subscription->ws_pprev;
+  }
+  const struct subscription_key key = {.ws = subscription->ws, .channel = channel};
+  hashtable_remove(mgr->subscriptions, subscription_hash(subscription->ws, channel), &key);
+  free(subscription);
+
+  // If there aren't any websockets left that listen to the channel, let the broker know and remove it,
+  // unless it is being kept for its history.
+  enum status status = STATUS_OK;
+  if (channel->nsubscribers == 0 && channel->history != NULL && channel->history->count != 0) {
+    idle_list_append(mgr, channel);
+  }
+  else if (channel->nsubscribers == 0) {
+    status = broker_unsubscribe(mgr, channel);
+    channel_unregister(mgr, channel);
+    channel_destroy(mgr, channel);
   }
 
   return status;
 }
 
 
+/**
+ * Subscribes the websocket to a channel of the Streams backend, first replaying to it every message
+ * after the stream ID `since` which is still in the stream. Live messages are held back until the
+ * replay has caught up with them, so the websocket sees each message exactly once, in order.
+ **/
 enum status
-pubsub_manager_unsubscribe(struct pubsub_manager *const mgr, const char *const channel, struct websocket *const ws) {
-  struct key_chain *key_chain, *prev_key_chain, *next_key_chain;
-  struct value_chain *value_chain, *prev_value_chain, *next_value_chain;
-  size_t bucket;
+pubsub_manager_subscribe_since(struct pubsub_manager *const mgr, const char *const channel, struct websocket *const ws, const char *const since) {
+  struct stream_id after;
+  enum status status;
 
-  if (mgr == NULL || channel == NULL) {
+  if (mgr == NULL || channel == NULL || since == NULL || mgr->broker->ops->read_range == NULL) {
     return STATUS_EINVAL;
   }
-  else if (!mgr->sub_is_connected) {
-    return STATUS_DISCONNECTED;
+  else if (stream_id_parse(&after, since, strlen(since)) != STATUS_OK) {
+    return STATUS_EINVAL;
   }
 
-  // Get the canonical string for the channel name.
-  const char *const canonical_channel = string_pool_get(mgr->string_pool, channel);
+  // A websocket which is already subscribed is already up to date.
+  if (find_subscription(mgr, ws, channel, false) != NULL) {
+    DEBUG("Not re-subscribing to channel '%s'\n", channel);
+    return STATUS_OK;
+  }
 
-  // Remove the channel from the websocket_buckets chain.
-  bucket = ((size_t)ws) % HASHTABLE_NBUCKETS;
-  prev_key_chain = NULL;
-  for (key_chain = mgr->websocket_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == ws) {
-      break;
-    }
-    prev_key_chain = key_chain;
+  DEBUG("Subscribing to channel '%s' since '%s'\n", channel, since);
+  status = add_subscription(mgr, ws, channel, false);
+  if (status != STATUS_OK) {
+    return status;
   }
-  if (key_chain == NULL) {
-    string_pool_release(mgr->string_pool, canonical_channel);
-    return STATUS_OK;
+  struct subscription *const subscription = find_subscription(mgr, ws, channel, false);
+  struct replay *const replay = malloc(sizeof(struct replay));
+  if (replay == NULL) {
+    ERROR0("malloc failed.\n");
+    remove_subscription(mgr, subscription);
+    return STATUS_ENOMEM;
+  }
+  replay->mgr = mgr;
+  replay->subscription = subscription;
+  replay->max_skipped.ms = 0;
+  replay->max_skipped.seq = 0;
+  subscription->replay = replay;
+  subscription->after = after;
+  ++subscription->channel->nresuming;
+
+  status = replay_read(replay);
+  if (status != STATUS_OK) {
+    WARNING("Failed to replay channel '%s' for ws=%p. status=%d\n", channel, (void *)ws, status);
+    replay_finish(replay);
   }
 
-  // Remove the node from the websocket to channel chain list.
-  prev_value_chain = NULL;
-  for (value_chain = key_chain->chain; value_chain != NULL; value_chain = value_chain->next) {
-    if (value_chain->value == canonical_channel) {
-      next_value_chain = value_chain->next;
+  return STATUS_OK;
+}
 
-      string_pool_release(mgr->string_pool, (const char *)value_chain->value);
-      free(value_chain);
 
-      if (prev_value_chain == NULL) {
-        key_chain->chain = next_value_chain;
-      }
-      else {
-        prev_value_chain->next = next_value_chain;
-      }
-      break;
-    }
-    prev_value_chain = value_chain;
+static enum status
+unsubscribe(struct pubsub_manager *const mgr, const char *const name, struct websocket *const ws, const bool is_pattern) {
+  if (mgr == NULL || name == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  struct subscription *const subscription = find_subscription(mgr, ws, name, is_pattern);
+  if (subscription == NULL) {
+    return STATUS_OK;
   }
+  return remove_subscription(mgr, subscription);
+}
+
+
+enum status
+pubsub_manager_unsubscribe(struct pubsub_manager *const mgr, const char *const channel, struct websocket *const ws) {
+  return unsubscribe(mgr, channel, ws, false);
+}
 
-  // If there aren't any channels left that the websocket has subscribed to, remove it.
-  if (key_chain->chain == NULL) {
-    next_key_chain = key_chain->next;
 
-    free(key_chain);
+enum status
+pubsub_manager_punsubscribe(struct pubsub_manager *const mgr, const char *const pattern, struct websocket *const ws) {
+  return unsubscribe(mgr, pattern, ws, true);
+}
+
+
+/**
+ * Sets whether the websocket's subscription to a channel or pattern skips messages that the
+ * websocket published itself. Only messages published with `pubsub_manager_publish_from` are known
+ * to be the websocket's own, and only if the broker carries the publisher along.
+ **/
+enum status
+pubsub_manager_set_nolocal(struct pubsub_manager *const mgr, const char *const name, const bool is_pattern, struct websocket *const ws, const bool nolocal) {
+  if (mgr == NULL || name == NULL || ws == NULL) {
+    return STATUS_EINVAL;
+  }
 
-    if (prev_key_chain == NULL) {
-      mgr->websocket_buckets[bucket] = next_key_chain;
+  struct subscription *const subscription = find_subscription(mgr, ws, name, is_pattern);
+  if (subscription == NULL) {
+    return STATUS_EINVAL;
+  }
+  if (subscription->nolocal != nolocal) {
+    subscription->nolocal = nolocal;
+    if (nolocal) {
+      ++subscription->channel->nnolocal;
     }
     else {
-      prev_key_chain->next = next_key_chain;
+      --subscription->channel->nnolocal;
     }
   }
+  return STATUS_OK;
+}
 
-  // Remove the websocket from the channel_buckets chain.
-  const enum status status = remove_websocket_from_channel_chain(mgr, canonical_channel, ws);
 
-  string_pool_release(mgr->string_pool, canonical_channel);
-  return status;
+void
+pubsub_manager_get_history_stats(const struct pubsub_manager *const mgr, size_t *const nchannels, size_t *const nbytes) {
+  *nchannels = mgr->history_nchannels;
+  *nbytes = mgr->history_nbytes;
 }
 
 
 enum status
 pubsub_manager_unsubscribe_all(struct pubsub_manager *const mgr, struct websocket *const ws) {
-  struct key_chain *key_chain, *prev_key_chain;
-  struct value_chain *value_chain, *next_value_chain;
-
   if (mgr == NULL) {
     return STATUS_EINVAL;
   }
-  else if (!mgr->sub_is_connected) {
-    return STATUS_DISCONNECTED;
-  }
-
-  // Remove the channel from the websocket_buckets chain.
-  const size_t bucket = ((size_t)ws) % HASHTABLE_NBUCKETS;
-  prev_key_chain = NULL;
-  for (key_chain = mgr->websocket_buckets[bucket]; key_chain != NULL; key_chain = key_chain->next) {
-    if (key_chain->key == ws) {
-      break;
-    }
-    prev_key_chain = key_chain;
-  }
-  if (key_chain == NULL) {
-    return STATUS_OK;
-  }
 
-  // Remove the websocket from the channel_buckets chain.
+  // Remove the websocket from each of its channels.
   enum status status = STATUS_OK, s;
-  for (value_chain = key_chain->chain; value_chain != NULL; ) {
-    next_value_chain = value_chain->next;
-
-    s = remove_websocket_from_channel_chain(mgr, (const char *)value_chain->value, ws);
+  while (ws->subscriptions != NULL) {
+    s = remove_subscription(mgr, ws->subscriptions);
     if (s != STATUS_OK) {
       status = s;
     }
-
-    string_pool_release(mgr->string_pool, (const char *)value_chain->value);
-    free(value_chain);
-
-    value_chain = next_value_chain;
-  }
-
-  // Update the key chain list and free the current key chain.
-  if (prev_key_chain == NULL) {
-    mgr->websocket_buckets[bucket] = key_chain->next;
-  }
-  else {
-    prev_key_chain->next = key_chain->next;
   }
-  free(key_chain);
 
   return status;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -7,15 +8,36 @@
 
 #include "status.h"
 
+#define PUBSUB_MANAGER_MAX_HISTORY_NMESSAGES (65536)
+
 // Forward declarations.
+struct broker;
 struct pubsub_manager;
+struct pubsub_payload;
 struct websocket;
 
 
-struct pubsub_manager *pubsub_manager_create(const char *redis_host, uint16_t redis_port, struct event_base *event_base);
+// How much of each channel's recent history to keep for late joiners.
+struct pubsub_history_options {
+  size_t max_nmessages;    // The most messages kept per channel, or zero for no history.
+  struct timeval max_age;  // How long messages are kept for, or forever if zero.
+  size_t max_nbytes;       // The most memory used by the history across all of the channels.
+};
+
+
+struct pubsub_manager *pubsub_manager_create(struct event_base *event_base, struct broker *broker, const struct pubsub_history_options *history);
 enum status            pubsub_manager_destroy(struct pubsub_manager *mgr);
+enum status            pubsub_manager_deliver(struct pubsub_manager *mgr, const char *pattern, const char *channel, size_t channel_nbytes, struct pubsub_payload *payload);
+enum status            pubsub_manager_deliver_now(struct pubsub_manager *mgr, const char *pattern, const char *channel, size_t channel_nbytes, struct pubsub_payload *payload);
+void                   pubsub_manager_get_history_stats(const struct pubsub_manager *mgr, size_t *nchannels, size_t *nbytes);
 enum status            pubsub_manager_publish(struct pubsub_manager *mgr, const char *channel, const char *message);
 enum status            pubsub_manager_publish_n(struct pubsub_manager *mgr, const char *channel, const char *message, size_t message_nbytes);
+enum status            pubsub_manager_publish_from(struct pubsub_manager *mgr, struct websocket *ws, const char *channel, const char *message);
+enum status            pubsub_manager_psubscribe(struct pubsub_manager *mgr, const char *pattern, struct websocket *ws);
+enum status            pubsub_manager_punsubscribe(struct pubsub_manager *mgr, const char *pattern, struct websocket *ws);
+enum status            pubsub_manager_set_nolocal(struct pubsub_manager *mgr, const char *name, bool is_pattern, struct websocket *ws, bool nolocal);
 enum status            pubsub_manager_subscribe(struct pubsub_manager *mgr, const char *channel, struct websocket *ws);
+enum status            pubsub_manager_subscribe_history(struct pubsub_manager *mgr, const char *channel, struct websocket *ws, size_t nmessages);
+enum status            pubsub_manager_subscribe_since(struct pubsub_manager *mgr, const char *channel, struct websocket *ws, const char *since);
 enum status            pubsub_manager_unsubscribe(struct pubsub_manager *mgr, const char *channel, struct websocket *ws);
 enum status            pubsub_manager_unsubscribe_all(struct pubsub_manager *mgr, struct websocket *ws);
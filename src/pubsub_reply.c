@@ -0,0 +1,456 @@
+/**
+ * A top-level array of up to BLOCK_NELEMENTS elements, which covers every pubsub reply, is built
+ * in a single block along with its elements and their short strings. Anything else the reader
+ * comes across is built from individually allocated nodes, so that the functions work for any
+ * reply. Every redisReply handed to hiredis is embedded in a node, which records where its memory
+ * came from.
+ *
+ * hiredis compacts its read buffer once a reply is complete, so the payload cannot be left in
+ * place. It is copied exactly once, straight out of the read buffer into its own reference
+ * counted buffer, and from then on is only passed around by reference. Any node tag is stripped off
+ * as the payload is copied.
+ **/
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "logging.h"
+#include "pubsub_reply.h"
+#include "xxhash.h"
+
+#define BLOCK_NELEMENTS (4)
+#define BLOCK_NBYTES (128)  // Room for the short strings of a reply, such as its kind and channel.
+
+// The tag starts with its magic and version, and ends with its checksum.
+#define TAG_MAGIC ("\xff" "WSGW" "\x01")
+#define TAG_MAGIC_NBYTES (6)
+#define TAG_VERSION (1)
+#define TAG_CHECKSUM_OFFSET (PUBSUB_TAG_NBYTES - 4)
+
+// hiredis changed the type of the element count in its 1.0 release.
+#if HIREDIS_MAJOR >= 1
+typedef size_t array_nelements_t;
+#else
+typedef int array_nelements_t;
+#endif
+
+
+// Forward declaration.
+struct block;
+
+
+struct node {
+  struct block *block;             // The block that the node lives in, or NULL if allocated on its own.
+  struct pubsub_payload *payload;  // Set when `reply.str` is the bytes of a payload.
+  bool owns_str;                   // Whether `reply.str` was allocated on its own.
+  redisReply reply;
+};
+
+
+struct block {
+  struct node root;
+  enum pubsub_reply_kind kind;  // Recognised from the first element as it is read.
+  size_t nbytes_used;
+  redisReply *elements[BLOCK_NELEMENTS];
+  struct node children[BLOCK_NELEMENTS];
+  char bytes[BLOCK_NBYTES];
+};
+
+
+struct kind_name {
+  const char *name;
+  size_t nbytes;
+  enum pubsub_reply_kind kind;
+};
+
+#define KIND_NAME(name, kind) {name, sizeof(name) - 1, kind}
+static const struct kind_name KIND_NAMES[] = {
+  KIND_NAME("message", PUBSUB_REPLY_MESSAGE),
+  KIND_NAME("pmessage", PUBSUB_REPLY_PMESSAGE),
+  KIND_NAME("subscribe", PUBSUB_REPLY_SUBSCRIBE),
+  KIND_NAME("unsubscribe", PUBSUB_REPLY_UNSUBSCRIBE),
+  KIND_NAME("psubscribe", PUBSUB_REPLY_PSUBSCRIBE),
+  KIND_NAME("punsubscribe", PUBSUB_REPLY_PUNSUBSCRIBE),
+  KIND_NAME("smessage", PUBSUB_REPLY_SMESSAGE),
+  KIND_NAME("ssubscribe", PUBSUB_REPLY_SSUBSCRIBE),
+  KIND_NAME("sunsubscribe", PUBSUB_REPLY_SUNSUBSCRIBE),
+};
+#undef KIND_NAME
+
+
+static inline struct node *
+node_of(const redisReply *const reply) {
+  return (struct node *)((char *)reply - offsetof(struct node, reply));
+}
+
+
+static inline bool
+is_block_root(const struct node *const node) {
+  return node->block != NULL && node == &node->block->root;
+}
+
+
+static enum pubsub_reply_kind
+kind_of(const char *const str, const size_t len) {
+  for (size_t i = 0; i != sizeof(KIND_NAMES) / sizeof(KIND_NAMES[0]); ++i) {
+    if (KIND_NAMES[i].nbytes == len && memcmp(KIND_NAMES[i].name, str, len) == 0) {
+      return KIND_NAMES[i].kind;
+    }
+  }
+  return PUBSUB_REPLY_OTHER;
+}
+
+
+// Whether the element at `index` of the block's reply is the payload of a message.
+static bool
+is_payload(const struct block *const block, const size_t index) {
+  switch (block->kind) {
+  case PUBSUB_REPLY_MESSAGE:
+  case PUBSUB_REPLY_SMESSAGE:
+    return block->root.reply.elements == 3 && index == 2;
+  case PUBSUB_REPLY_PMESSAGE:
+    return block->root.reply.elements == 4 && index == 3;
+  default:
+    return false;
+  }
+}
+
+
+/**
+ * Creates the node for the reply that `task` is reading, and links it into its parent.
+ **/
+static struct node *
+node_create(const redisReadTask *const task, const bool is_array, const size_t nelements) {
+  struct node *node = NULL;
+
+  if (task->parent == NULL) {
+    if (is_array && nelements <= BLOCK_NELEMENTS) {
+      struct block *const block = calloc(1, sizeof(struct block));
+      if (block == NULL) {
+        ERROR0("calloc failed.\n");
+        return NULL;
+      }
+      node = &block->root;
+      node->block = block;
+      node->reply.element = block->elements;
+    }
+  }
+  else {
+    struct node *const parent = node_of(task->parent->obj);
+    if (is_block_root(parent)) {
+      node = &parent->block->children[task->idx];
+      node->block = parent->block;
+    }
+  }
+  if (node == NULL) {
+    node = calloc(1, sizeof(struct node));
+    if (node == NULL) {
+      ERROR0("calloc failed.\n");
+      return NULL;
+    }
+  }
+
+  // Arrays outside of a block's root get their own element storage.
+  if (is_array && !is_block_root(node) && nelements != 0) {
+    node->reply.element = calloc(nelements, sizeof(redisReply *));
+    if (node->reply.element == NULL) {
+      ERROR0("calloc failed.\n");
+      if (node->block == NULL) {
+        free(node);
+      }
+      return NULL;
+    }
+  }
+  node->reply.type = task->type;
+  if (is_array) {
+    node->reply.elements = nelements;
+  }
+
+  if (task->parent != NULL) {
+    redisReply *const parent = task->parent->obj;
+    parent->element[task->idx] = &node->reply;
+  }
+  return node;
+}
+
+
+static void
+node_free(struct node *const node) {
+  redisReply *const reply = &node->reply;
+
+  // Elements may be missing if the reader gave up part way through the reply.
+  if (reply->element != NULL) {
+    for (size_t i = 0; i != reply->elements; ++i) {
+      if (reply->element[i] != NULL) {
+        node_free(node_of(reply->element[i]));
+      }
+    }
+    if (!is_block_root(node)) {
+      free(reply->element);
+    }
+  }
+
+  if (node->payload != NULL) {
+    pubsub_payload_release(node->payload);
+  }
+  else if (node->owns_str) {
+    free(reply->str);
+  }
+
+  if (node->block == NULL) {
+    free(node);
+  }
+  else if (is_block_root(node)) {
+    free(node->block);
+  }
+}
+
+
+static uint64_t
+read_uint64(const char *const str) {
+  uint64_t value = 0;
+  for (size_t i = 0; i != 8; ++i) {
+    value = (value << 8) | (uint8_t)str[i];
+  }
+  return value;
+}
+
+
+static uint32_t
+read_uint32(const char *const str) {
+  uint32_t value = 0;
+  for (size_t i = 0; i != 4; ++i) {
+    value = (value << 8) | (uint8_t)str[i];
+  }
+  return value;
+}
+
+
+static inline uint32_t
+tag_checksum(const char *const tag) {
+  return XXH32(tag, TAG_CHECKSUM_OFFSET, TAG_VERSION);
+}
+
+
+// Whether the string starts with a whole tag, rather than just happening to start with 0xff.
+static bool
+is_tagged(const char *const str, const size_t len) {
+  return len >= PUBSUB_TAG_NBYTES && memcmp(str, TAG_MAGIC, TAG_MAGIC_NBYTES) == 0 &&
+         read_uint32(str + TAG_CHECKSUM_OFFSET) == tag_checksum(str);
+}
+
+
+static void *
+create_string(const redisReadTask *const task, char *const str, const size_t len) {
+  struct node *const node = node_create(task, false, 0);
+  if (node == NULL) {
+    return NULL;
+  }
+
+  // Find somewhere to copy the string to.
+  struct block *const block = node->block;
+  char *copy;
+  if (block != NULL && is_payload(block, (size_t)task->idx)) {
+    if (is_tagged(str, len)) {
+      node->payload = pubsub_payload_create(str + PUBSUB_TAG_NBYTES, len - PUBSUB_TAG_NBYTES);
+      if (node->payload == NULL) {
+        goto fail;
+      }
+      node->payload->node = read_uint64(str + TAG_MAGIC_NBYTES);
+      node->payload->publisher = read_uint64(str + TAG_MAGIC_NBYTES + 8);
+    }
+    else {
+      node->payload = pubsub_payload_create(str, len);
+      if (node->payload == NULL) {
+        goto fail;
+      }
+    }
+    node->reply.str = node->payload->bytes;
+    node->reply.len = node->payload->nbytes;
+    goto done;
+  }
+  else if (block != NULL && BLOCK_NBYTES - block->nbytes_used > len) {
+    copy = block->bytes + block->nbytes_used;
+    block->nbytes_used += len + 1;
+  }
+  else {
+    copy = malloc(len + 1);
+    if (copy == NULL) {
+      ERROR0("malloc failed.\n");
+      goto fail;
+    }
+    node->owns_str = true;
+  }
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  node->reply.str = copy;
+  node->reply.len = len;
+
+done:
+  // The first element of a pubsub reply says what kind of reply it is.
+  if (block != NULL && task->idx == 0) {
+    block->kind = kind_of(str, len);
+  }
+
+  return &node->reply;
+
+fail:
+  if (task->parent != NULL) {
+    ((redisReply *)task->parent->obj)->element[task->idx] = NULL;
+  }
+  if (block == NULL) {
+    free(node);
+  }
+  return NULL;
+}
+
+
+static void *
+create_array(const redisReadTask *const task, const array_nelements_t nelements) {
+  struct node *const node = node_create(task, true, (size_t)nelements);
+  return (node == NULL) ? NULL : &node->reply;
+}
+
+
+static void *
+create_integer(const redisReadTask *const task, const long long value) {
+  struct node *const node = node_create(task, false, 0);
+  if (node == NULL) {
+    return NULL;
+  }
+  node->reply.integer = value;
+  return &node->reply;
+}
+
+
+static void *
+create_nil(const redisReadTask *const task) {
+  struct node *const node = node_create(task, false, 0);
+  return (node == NULL) ? NULL : &node->reply;
+}
+
+
+static void
+free_object(void *const reply) {
+  if (reply != NULL) {
+    node_free(node_of(reply));
+  }
+}
+
+
+redisReplyObjectFunctions PUBSUB_REPLY_FUNCTIONS = {
+  .createString = &create_string,
+  .createArray = &create_array,
+  .createInteger = &create_integer,
+  .createNil = &create_nil,
+  .freeObject = &free_object,
+};
+
+
+/**
+ * Returns the kind of a reply built by PUBSUB_REPLY_FUNCTIONS, having checked that it has the
+ * right number of elements for its kind.
+ **/
+enum pubsub_reply_kind
+pubsub_reply_kind(const redisReply *const reply) {
+  if (reply == NULL || !is_block_root(node_of(reply))) {
+    return PUBSUB_REPLY_OTHER;
+  }
+
+  const enum pubsub_reply_kind kind = node_of(reply)->block->kind;
+  switch (kind) {
+  case PUBSUB_REPLY_OTHER:
+    return kind;
+  case PUBSUB_REPLY_PMESSAGE:
+    return (reply->elements == 4) ? kind : PUBSUB_REPLY_OTHER;
+  default:
+    return (reply->elements == 3) ? kind : PUBSUB_REPLY_OTHER;
+  }
+}
+
+
+/**
+ * Returns the payload of a message, pmessage or smessage reply, or NULL for any other reply. The
+ * payload belongs to the reply, so must be retained to keep it any longer than the reply.
+ **/
+struct pubsub_payload *
+pubsub_reply_payload(const redisReply *const reply) {
+  switch (pubsub_reply_kind(reply)) {
+  case PUBSUB_REPLY_MESSAGE:
+  case PUBSUB_REPLY_PMESSAGE:
+  case PUBSUB_REPLY_SMESSAGE:
+    return node_of(reply->element[reply->elements - 1])->payload;
+  default:
+    return NULL;
+  }
+}
+
+
+/**
+ * Creates a payload holding a copy of `bytes`, with a single reference owned by the caller.
+ **/
+struct pubsub_payload *
+pubsub_payload_create(const char *const bytes, const size_t nbytes) {
+  struct pubsub_payload *const payload = malloc(sizeof(struct pubsub_payload) + nbytes + 1);
+  if (payload == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  atomic_init(&payload->refcount, 1);
+  payload->id.ms = 0;
+  payload->id.seq = 0;
+  payload->node = 0;
+  payload->publisher = 0;
+  payload->nbytes = nbytes;
+  memcpy(payload->bytes, bytes, nbytes);
+  payload->bytes[nbytes] = '\0';
+  return payload;
+}
+
+
+void
+pubsub_payload_retain(struct pubsub_payload *const payload) {
+  atomic_fetch_add(&payload->refcount, 1);
+}
+
+
+void
+pubsub_payload_release(struct pubsub_payload *const payload) {
+  if (payload != NULL && atomic_fetch_sub(&payload->refcount, 1) == 1) {
+    free(payload);
+  }
+}
+
+
+/**
+ * Whether a message which redis sent back to the node `node_id`, or 0 without local delivery, still
+ * has to be delivered to the node's subscribers. The node's own channel messages were delivered
+ * when they were published, but its pattern subscribers only get them from redis. Publisher IDs
+ * only mean anything on the node which published the message, so they are cleared on the others.
+ **/
+bool
+pubsub_payload_needs_delivery(struct pubsub_payload *const payload, const uint64_t node_id, const bool is_pattern) {
+  if (payload->node != node_id) {
+    payload->publisher = 0;
+    return true;
+  }
+  return is_pattern || node_id == 0;
+}
+
+
+/**
+ * Writes the tag for a message published by `publisher` on `node` to `buffer`, which must hold
+ * PUBSUB_TAG_NBYTES.
+ **/
+void
+pubsub_tag_format(char *const buffer, const uint64_t node, const uint64_t publisher) {
+  memcpy(buffer, TAG_MAGIC, TAG_MAGIC_NBYTES);
+  for (size_t i = 0; i != 8; ++i) {
+    buffer[TAG_MAGIC_NBYTES + i] = (char)(node >> (56 - 8 * i));
+    buffer[TAG_MAGIC_NBYTES + 8 + i] = (char)(publisher >> (56 - 8 * i));
+  }
+  const uint32_t checksum = tag_checksum(buffer);
+  for (size_t i = 0; i != 4; ++i) {
+    buffer[TAG_CHECKSUM_OFFSET + i] = (char)(checksum >> (24 - 8 * i));
+  }
+}
@@ -0,0 +1,63 @@
+/**
+ * Reply object functions for the hiredis reader of the redis SUBSCRIBE connection, which receives
+ * a push message for every PUBLISH on every subscribed channel.
+ *
+ * The default hiredis functions make five or more allocations per message and leave the caller to
+ * strcmp the message type. These functions build a whole pubsub reply in a single block, with the
+ * type recognised once as it is read, and read the message payload into a reference counted
+ * buffer which the managers can hold on to instead of copying it.
+ **/
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <hiredis/hiredis.h>
+
+#include "streams.h"
+
+// Messages published with local delivery start with a tag: a 0xff byte, which can never start a
+// UTF-8 text message, "WSGW" and a version byte, then the big endian node ID and publisher ID, and
+// a checksum of everything before it. Only a payload whose tag checks out is stripped, so binary
+// payloads which merely start with 0xff are passed on whole.
+#define PUBSUB_TAG_NBYTES (26)
+
+
+enum pubsub_reply_kind {
+  PUBSUB_REPLY_OTHER,
+  PUBSUB_REPLY_MESSAGE,       // ["message", channel, payload]
+  PUBSUB_REPLY_PMESSAGE,      // ["pmessage", pattern, channel, payload]
+  PUBSUB_REPLY_SUBSCRIBE,     // ["subscribe", channel, count]
+  PUBSUB_REPLY_UNSUBSCRIBE,   // ["unsubscribe", channel, count]
+  PUBSUB_REPLY_PSUBSCRIBE,    // ["psubscribe", pattern, count]
+  PUBSUB_REPLY_PUNSUBSCRIBE,  // ["punsubscribe", pattern, count]
+  PUBSUB_REPLY_SMESSAGE,      // ["smessage", channel, payload]
+  PUBSUB_REPLY_SSUBSCRIBE,    // ["ssubscribe", channel, count]
+  PUBSUB_REPLY_SUNSUBSCRIBE,  // ["sunsubscribe", channel, count]
+};
+
+
+// The payload of a message. It may be shared between threads, so the refcount is atomic.
+struct pubsub_payload {
+  atomic_size_t refcount;
+  struct stream_id id;  // Only set by the Streams backend.
+  uint64_t node;        // The node which published the message, if it was tagged, or 0.
+  uint64_t publisher;   // The ID of the publishing websocket on that node, or 0.
+  size_t nbytes;
+  char bytes[];  // NUL terminated.
+};
+
+
+extern redisReplyObjectFunctions PUBSUB_REPLY_FUNCTIONS;
+
+enum pubsub_reply_kind  pubsub_reply_kind(const redisReply *reply);
+struct pubsub_payload * pubsub_reply_payload(const redisReply *reply);
+
+struct pubsub_payload * pubsub_payload_create(const char *bytes, size_t nbytes);
+void                    pubsub_payload_retain(struct pubsub_payload *payload);
+void                    pubsub_payload_release(struct pubsub_payload *payload);
+bool                    pubsub_payload_needs_delivery(struct pubsub_payload *payload, uint64_t node_id, bool is_pattern);
+
+void                    pubsub_tag_format(char *buffer, uint64_t node, uint64_t publisher);
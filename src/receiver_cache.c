@@ -0,0 +1,356 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "hashtable.h"
+#include "logging.h"
+#include "receiver_cache.h"
+#include "xxhash.h"
+
+#define IDLE_NTTLS (8)  // How many TTLs a channel is kept for after it was last published to.
+
+
+// A link in one of the cache's circular lists, each of which has a sentinel link as its head.
+struct link {
+  struct link *next;
+  struct link *prev;
+};
+
+
+struct receiver_count {
+  uint64_t hash;
+  size_t npinned;          // The number of PUBLISHes waiting for their reply.
+  uint64_t generation;     // Bumped whenever the count is forgotten.
+  bool is_known;           // Whether `nreceivers` has been learned from redis yet.
+  long long nreceivers;
+  struct timeval used;       // When the channel was last published to.
+  struct timeval refreshed;  // When `nreceivers` was last learned or asked for.
+  struct timeval probed;     // When a PUBLISH to the empty channel was last let through.
+  struct link lru;           // Linked in order of `used`.
+  struct link empty;         // Linked in order of `refreshed` while known to be empty.
+  size_t nbytes;
+  char channel[];
+};
+
+
+// The key used to look up a channel's count.
+struct receiver_key {
+  const char *channel;
+  size_t nbytes;
+};
+
+
+struct receiver_cache {
+  struct timeval ttl;
+  struct timeval idle_ttl;
+  struct timeval probe_interval;  // Zero if empty channels are never probed.
+  struct hashtable *counts;       // { channel : receiver_count }
+  struct link lru;
+  struct link empty;
+  uint64_t nsuppressed;
+};
+
+
+#define COUNT_OF(link, member) ((struct receiver_count *)((char *)(link) - offsetof(struct receiver_count, member)))
+
+
+static inline void
+list_init(struct link *const head) {
+  head->next = head;
+  head->prev = head;
+}
+
+
+static inline void
+list_append(struct link *const head, struct link *const link) {
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+
+static inline void
+list_remove(struct link *const link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->next = NULL;
+  link->prev = NULL;
+}
+
+
+static inline bool
+is_linked(const struct link *const link) {
+  return link->next != NULL;
+}
+
+
+static bool
+count_matches(const void *const value, const void *const key) {
+  const struct receiver_count *const count = value;
+  const struct receiver_key *const k = key;
+  return count->nbytes == k->nbytes && memcmp(count->channel, k->channel, k->nbytes) == 0;
+}
+
+
+static inline bool
+is_empty(const struct receiver_count *const count) {
+  return count->is_known && count->nreceivers == 0;
+}
+
+
+// Records a new count, keeping the count on the empty list exactly while it is known to be empty.
+static void
+set_nreceivers(struct receiver_cache *const cache, struct receiver_count *const count, const long long nreceivers, const struct timeval *const now) {
+  const bool was_empty = is_empty(count);
+  count->is_known = true;
+  count->nreceivers = nreceivers;
+  count->refreshed = *now;
+  if (was_empty) {
+    list_remove(&count->empty);
+  }
+  if (nreceivers == 0) {
+    list_append(&cache->empty, &count->empty);
+    if (!was_empty) {
+      count->probed = *now;
+    }
+  }
+}
+
+
+static void
+forget(struct receiver_count *const count) {
+  if (is_empty(count)) {
+    list_remove(&count->empty);
+  }
+  count->is_known = false;
+  ++count->generation;
+}
+
+
+static void
+count_destroy(struct receiver_cache *const cache, struct receiver_count *const count) {
+  const struct receiver_key key = {.channel = count->channel, .nbytes = count->nbytes};
+  forget(count);
+  list_remove(&count->lru);
+  hashtable_remove(cache->counts, count->hash, &key);
+  free(count);
+}
+
+
+/**
+ * Creates a cache whose empty channels are refreshed every `ttl`. Unless `probe_interval` is NULL
+ * or zero, one PUBLISH to each empty channel is let through every `probe_interval`.
+ **/
+struct receiver_cache *
+receiver_cache_create(const struct timeval *const ttl, const struct timeval *const probe_interval) {
+  if (ttl == NULL || !evutil_timerisset(ttl)) {
+    return NULL;
+  }
+
+  struct receiver_cache *const cache = malloc(sizeof(struct receiver_cache));
+  if (cache == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(cache, 0, sizeof(struct receiver_cache));
+  cache->counts = hashtable_create(&count_matches);
+  if (cache->counts == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->ttl = *ttl;
+  for (size_t i = 0; i != IDLE_NTTLS; ++i) {
+    evutil_timeradd(&cache->idle_ttl, ttl, &cache->idle_ttl);
+  }
+  if (probe_interval != NULL) {
+    cache->probe_interval = *probe_interval;
+  }
+  list_init(&cache->lru);
+  list_init(&cache->empty);
+  return cache;
+}
+
+
+/**
+ * Destroys the cache. Every pinned count must have been released with its PUBLISH reply first.
+ **/
+void
+receiver_cache_destroy(struct receiver_cache *const cache) {
+  if (cache == NULL) {
+    return;
+  }
+  while (cache->lru.next != &cache->lru) {
+    count_destroy(cache, COUNT_OF(cache->lru.next, lru));
+  }
+  hashtable_destroy(cache->counts);
+  free(cache);
+}
+
+
+/**
+ * Returns whether a message to the channel should be PUBLISHed, counting it as suppressed if not.
+ * `*count` is set to the channel's entry if the PUBLISH is to go ahead and there is room to cache
+ * the channel, or NULL otherwise. The entry should be pinned before the cache is next used, and
+ * released with the PUBLISH reply.
+ **/
+bool
+receiver_cache_check(struct receiver_cache *const cache, const char *const channel, const size_t channel_nbytes, const struct timeval *const now, struct receiver_count **const count) {
+  const struct receiver_key key = {.channel = channel, .nbytes = channel_nbytes};
+  const uint64_t hash = XXH64(channel, channel_nbytes, 0);
+  struct receiver_count *entry = hashtable_find(cache->counts, hash, &key);
+  *count = NULL;
+
+  if (entry == NULL) {
+    // Make room by forgetting the least recently published channel, unless it is still pinned.
+    if (hashtable_size(cache->counts) == RECEIVER_CACHE_MAX_NCHANNELS) {
+      struct receiver_count *const oldest = COUNT_OF(cache->lru.next, lru);
+      if (oldest->npinned != 0) {
+        return true;
+      }
+      count_destroy(cache, oldest);
+    }
+    entry = malloc(sizeof(struct receiver_count) + channel_nbytes);
+    if (entry == NULL) {
+      ERROR0("malloc failed.\n");
+      return true;
+    }
+    memset(entry, 0, sizeof(struct receiver_count));
+    entry->hash = hash;
+    entry->nbytes = channel_nbytes;
+    memcpy(entry->channel, channel, channel_nbytes);
+    if (hashtable_insert(cache->counts, hash, entry) != STATUS_OK) {
+      free(entry);
+      return true;
+    }
+  }
+  else {
+    list_remove(&entry->lru);
+  }
+  entry->used = *now;
+  list_append(&cache->lru, &entry->lru);
+
+  if (is_empty(entry)) {
+    struct timeval next_probe;
+    evutil_timeradd(&entry->probed, &cache->probe_interval, &next_probe);
+    if (!evutil_timerisset(&cache->probe_interval) || evutil_timercmp(now, &next_probe, <)) {
+      ++cache->nsuppressed;
+      return false;
+    }
+    entry->probed = *now;
+  }
+  *count = entry;
+  return true;
+}
+
+
+/**
+ * Pins the count for a PUBLISH, and returns the count's generation, which is to be handed back
+ * with the PUBLISH's reply.
+ **/
+uint64_t
+receiver_cache_pin(struct receiver_count *const count) {
+  ++count->npinned;
+  return count->generation;
+}
+
+
+/**
+ * Releases a count pinned for a PUBLISH, recording the number of receivers from its reply, or
+ * nothing if `nreceivers` is negative because there was no reply. Nothing is recorded either if
+ * the count has been forgotten since it was pinned, as the PUBLISH may have reached redis before
+ * the subscription which the count was forgotten for.
+ **/
+void
+receiver_cache_on_publish_reply(struct receiver_cache *const cache, struct receiver_count *const count, const uint64_t generation, const long long nreceivers, const struct timeval *const now) {
+  --count->npinned;
+  if (nreceivers >= 0 && generation == count->generation) {
+    set_nreceivers(cache, count, nreceivers, now);
+  }
+}
+
+
+/**
+ * Fills in up to `max_nchannels` of the empty channels whose count is older than the TTL, to be
+ * refreshed with PUBSUB NUMSUB, and returns how many there were. They count as refreshed from now,
+ * so they aren't asked for again until the TTL has passed, even if the reply never comes. The
+ * names are only valid until the cache is next changed.
+ **/
+size_t
+receiver_cache_stale(struct receiver_cache *const cache, const struct timeval *const now, const char **const channels, size_t *const channel_nbytes, const size_t max_nchannels) {
+  size_t nchannels = 0;
+  struct timeval expiry;
+
+  while (nchannels != max_nchannels && cache->empty.next != &cache->empty) {
+    struct receiver_count *const count = COUNT_OF(cache->empty.next, empty);
+    evutil_timeradd(&count->refreshed, &cache->ttl, &expiry);
+    if (evutil_timercmp(now, &expiry, <)) {
+      break;
+    }
+    count->refreshed = *now;
+    list_remove(&count->empty);
+    list_append(&cache->empty, &count->empty);
+    channels[nchannels] = count->channel;
+    channel_nbytes[nchannels] = count->nbytes;
+    ++nchannels;
+  }
+  return nchannels;
+}
+
+
+/**
+ * Records the number of channel subscribers from a PUBSUB NUMSUB reply. As pattern subscribers are
+ * not counted, this only ever marks an empty channel as having receivers.
+ **/
+void
+receiver_cache_on_numsub(struct receiver_cache *const cache, const char *const channel, const size_t channel_nbytes, const long long nsubscribers) {
+  const struct receiver_key key = {.channel = channel, .nbytes = channel_nbytes};
+  struct receiver_count *const count = hashtable_find(cache->counts, XXH64(channel, channel_nbytes, 0), &key);
+  if (count != NULL && is_empty(count) && nsubscribers > 0) {
+    set_nreceivers(cache, count, nsubscribers, &count->refreshed);
+  }
+}
+
+
+/**
+ * Forgets the channel's count, for when it is known to have gained a subscriber.
+ **/
+void
+receiver_cache_forget(struct receiver_cache *const cache, const char *const channel, const size_t channel_nbytes) {
+  const struct receiver_key key = {.channel = channel, .nbytes = channel_nbytes};
+  struct receiver_count *const count = hashtable_find(cache->counts, XXH64(channel, channel_nbytes, 0), &key);
+  if (count != NULL) {
+    forget(count);
+  }
+}
+
+
+/**
+ * Forgets the channels which haven't been published to for a while.
+ **/
+void
+receiver_cache_expire(struct receiver_cache *const cache, const struct timeval *const now) {
+  struct timeval expiry;
+
+  while (cache->lru.next != &cache->lru) {
+    struct receiver_count *const count = COUNT_OF(cache->lru.next, lru);
+    evutil_timeradd(&count->used, &cache->idle_ttl, &expiry);
+    if (evutil_timercmp(now, &expiry, <) || count->npinned != 0) {
+      break;
+    }
+    count_destroy(cache, count);
+  }
+}
+
+
+size_t
+receiver_cache_size(const struct receiver_cache *const cache) {
+  return hashtable_size(cache->counts);
+}
+
+
+uint64_t
+receiver_cache_nsuppressed(const struct receiver_cache *const cache) {
+  return cache->nsuppressed;
+}
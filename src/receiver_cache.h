@@ -0,0 +1,42 @@
+/**
+ * A cache of how many redis receivers each recently published channel has, so that PUBLISHes to
+ * channels which nobody is subscribed to can be dropped without going to redis at all.
+ *
+ * Counts are learned from the replies to PUBLISH, which count pattern subscribers as well as
+ * channel subscribers, so only a PUBLISH reply can show that a channel is empty. An empty channel's
+ * count is refreshed with PUBSUB NUMSUB once it is older than the TTL. NUMSUB doesn't count pattern
+ * subscribers, so it can only show that an empty channel has gained subscribers. Patterns which
+ * start matching an empty channel are only noticed by probing: with a probe interval, one PUBLISH
+ * per interval to each empty channel goes to redis anyway, and its reply updates the count.
+ *
+ * A PUBLISH waiting for its reply pins its channel's entry, so that the reply can be recorded
+ * without looking the channel up again. Forgetting a channel's count bumps its generation, and the
+ * replies to PUBLISHes pinned under an older generation are ignored, so that a reply which was
+ * already on its way can't undo the forgetting. Channels which haven't been published to for a
+ * while are forgotten, least recently published first.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define RECEIVER_CACHE_MAX_NCHANNELS (65536)
+
+// Forward declarations.
+struct receiver_cache;
+struct receiver_count;
+
+
+struct receiver_cache *receiver_cache_create(const struct timeval *ttl, const struct timeval *probe_interval);
+void                   receiver_cache_destroy(struct receiver_cache *cache);
+bool                   receiver_cache_check(struct receiver_cache *cache, const char *channel, size_t channel_nbytes, const struct timeval *now, struct receiver_count **count);
+uint64_t               receiver_cache_pin(struct receiver_count *count);
+void                   receiver_cache_on_publish_reply(struct receiver_cache *cache, struct receiver_count *count, uint64_t generation, long long nreceivers, const struct timeval *now);
+size_t                 receiver_cache_stale(struct receiver_cache *cache, const struct timeval *now, const char **channels, size_t *channel_nbytes, size_t max_nchannels);
+void                   receiver_cache_on_numsub(struct receiver_cache *cache, const char *channel, size_t channel_nbytes, long long nsubscribers);
+void                   receiver_cache_forget(struct receiver_cache *cache, const char *channel, size_t channel_nbytes);
+void                   receiver_cache_expire(struct receiver_cache *cache, const struct timeval *now);
+size_t                 receiver_cache_size(const struct receiver_cache *cache);
+uint64_t               receiver_cache_nsuppressed(const struct receiver_cache *cache);
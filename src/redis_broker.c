@@ -0,0 +1,414 @@
+#include <pthread.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "cluster_slots.h"
+#include "logging.h"
+#include "publisher_pool.h"
+#include "pubsub_hub.h"
+#include "pubsub_manager.h"
+#include "pubsub_reply.h"
+#include "redis_broker.h"
+#include "shard_ring.h"
+
+
+// A channel which redis has just acknowledged a SUBSCRIBE to, queued up by the hub's thread.
+struct forget {
+  struct forget *next;
+  size_t channel_nbytes;
+  char channel[];
+};
+
+
+struct redis_broker {
+  struct broker base;
+  struct pubsub_hub *hub;
+  size_t hub_index;
+  struct shard_ring *ring;
+  size_t nshards;
+  struct publisher_pool *publishers[SHARD_RING_MAX_SHARDS];  // The publisher pool of each shard.
+  struct pubsub_manager *mgr;
+  uint64_t node_id;  // Non-zero if messages are delivered locally.
+
+  // The channels whose cached receiver counts are to be forgotten on the worker's thread, as they
+  // have just been subscribed to. Only used by the pubsub backend.
+  pthread_mutex_t forgets_lock;
+  struct forget *forgets;
+  struct event *forgets_event;
+
+  // With the Cluster backend, the broker owns a publisher pool per primary, created on first use,
+  // and keeps a copy of the hub's slot table which is refreshed whenever the hub's changes.
+  struct event_base *event_base;
+  size_t nconnections;
+  uint8_t *slot_shards;
+  uint64_t slots_generation;
+};
+
+
+// Returns the publisher pool of the shard that the channel lives on.
+static struct publisher_pool *
+publishers_of(const struct redis_broker *const redis, const char *const channel, const size_t channel_nbytes) {
+  if (redis->nshards == 1) {
+    return redis->publishers[0];
+  }
+  return redis->publishers[shard_ring_find(redis->ring, channel, channel_nbytes)];
+}
+
+
+static void
+on_subscribed(const char *const channel, const size_t channel_nbytes, void *const arg) {
+  struct redis_broker *const redis = arg;
+
+  struct forget *const forget = malloc(sizeof(struct forget) + channel_nbytes + 1);
+  if (forget == NULL) {
+    ERROR0("malloc failed.\n");
+    return;
+  }
+  forget->channel_nbytes = channel_nbytes;
+  memcpy(forget->channel, channel, channel_nbytes + 1);
+
+  pthread_mutex_lock(&redis->forgets_lock);
+  const bool was_empty = redis->forgets == NULL;
+  forget->next = redis->forgets;
+  redis->forgets = forget;
+  pthread_mutex_unlock(&redis->forgets_lock);
+
+  // Wake up the worker's event loop, unless an earlier channel already has.
+  if (was_empty) {
+    event_active(redis->forgets_event, EV_READ, 0);
+  }
+}
+
+
+static void
+on_forgets(const evutil_socket_t fd, const short events, void *const arg) {
+  struct redis_broker *const redis = arg;
+  struct forget *forget, *next;
+  (void)fd;
+  (void)events;
+
+  pthread_mutex_lock(&redis->forgets_lock);
+  forget = redis->forgets;
+  redis->forgets = NULL;
+  pthread_mutex_unlock(&redis->forgets_lock);
+
+  for (; forget != NULL; forget = next) {
+    next = forget->next;
+    publisher_pool_forget_receivers(publishers_of(redis, forget->channel, forget->channel_nbytes), forget->channel, forget->channel_nbytes);
+    free(forget);
+  }
+}
+
+
+static enum status
+attach(struct broker *const broker, struct pubsub_manager *const mgr) {
+  struct redis_broker *const redis = (struct redis_broker *)broker;
+  redis->mgr = mgr;
+  const enum status status = pubsub_hub_add_manager(redis->hub, mgr, &redis->hub_index);
+  if (status != STATUS_OK || redis->forgets_event == NULL) {
+    return status;
+  }
+  return pubsub_hub_on_subscribed(redis->hub, redis->hub_index, &on_subscribed, redis);
+}
+
+
+static enum status
+destroy(struct broker *const broker) {
+  struct redis_broker *const redis = (struct redis_broker *)broker;
+  if (redis->slot_shards != NULL) {
+    for (size_t i = 0; i != SHARD_RING_MAX_SHARDS; ++i) {
+      publisher_pool_destroy(redis->publishers[i]);
+    }
+    free(redis->slot_shards);
+  }
+  if (redis->forgets_event != NULL) {
+    event_free(redis->forgets_event);
+    pthread_mutex_destroy(&redis->forgets_lock);
+  }
+  for (struct forget *forget = redis->forgets, *next; forget != NULL; forget = next) {
+    next = forget->next;
+    free(forget);
+  }
+  shard_ring_destroy(redis->ring);
+  free(redis);
+  return STATUS_OK;
+}
+
+
+static enum status
+publish(struct broker *const broker, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes, const uint64_t publisher) {
+  const struct redis_broker *const redis = (const struct redis_broker *)broker;
+  (void)publisher;
+  return publisher_pool_publish(publishers_of(redis, channel, channel_nbytes), channel, channel_nbytes, message, message_nbytes);
+}
+
+
+static void
+on_redirect(const char *const error, const size_t error_nbytes, void *const arg) {
+  const struct redis_broker *const redis = arg;
+  (void)error_nbytes;
+  pubsub_hub_redirect(redis->hub, error);
+}
+
+
+// Returns the publisher pool of the primary which owns the channel's slot, creating it if need be.
+static struct publisher_pool *
+cluster_publishers_of(struct redis_broker *const redis, const char *const channel, const size_t channel_nbytes) {
+  const char *host;
+  uint16_t port;
+
+  if (pubsub_hub_slots_generation(redis->hub) != redis->slots_generation) {
+    pubsub_hub_copy_slots(redis->hub, redis->slot_shards, &redis->slots_generation);
+  }
+  const size_t index = redis->slot_shards[cluster_key_slot(channel, channel_nbytes)];
+  if (redis->publishers[index] == NULL) {
+    if (pubsub_hub_shard_address(redis->hub, index, &host, &port) != STATUS_OK) {
+      return NULL;
+    }
+    INFO("Publishing to redis cluster primary %s:%d\n", host, port);
+    redis->publishers[index] = publisher_pool_create(redis->event_base, REDIS_BACKEND_CLUSTER, host, port, NULL, redis->nconnections);
+    if (redis->publishers[index] == NULL) {
+      return NULL;
+    }
+    publisher_pool_on_redirect(redis->publishers[index], &on_redirect, redis);
+  }
+  return redis->publishers[index];
+}
+
+
+/**
+ * SPUBLISHes the message to the primary which owns the channel's slot, as far as the broker knows.
+ * A `-MOVED` reply corrects the hub's slot table, and so the broker's copy.
+ **/
+static enum status
+publish_cluster(struct broker *const broker, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes, const uint64_t publisher) {
+  struct redis_broker *const redis = (struct redis_broker *)broker;
+  (void)publisher;
+  struct publisher_pool *const publishers = cluster_publishers_of(redis, channel, channel_nbytes);
+  if (publishers == NULL) {
+    return STATUS_DISCONNECTED;
+  }
+  return publisher_pool_publish(publishers, channel, channel_nbytes, message, message_nbytes);
+}
+
+
+static enum status
+subscribe_cluster(struct broker *const broker, const char *const name, const bool is_pattern) {
+  const struct redis_broker *const redis = (const struct redis_broker *)broker;
+  (void)is_pattern;
+  return pubsub_hub_subscribe(redis->hub, redis->hub_index, name);
+}
+
+
+/**
+ * Delivers the message to this node's subscribers, then PUBLISHes it with this node's tag. The
+ * other workers' subscribers are handed the message by the hub.
+ **/
+static enum status
+publish_local(struct broker *const broker, const char *const channel, const size_t channel_nbytes, const char *const message, const size_t message_nbytes, const uint64_t publisher) {
+  const struct redis_broker *const redis = (const struct redis_broker *)broker;
+  enum status status;
+
+  char *const tagged = malloc(PUBSUB_TAG_NBYTES + message_nbytes);
+  if (tagged == NULL) {
+    ERROR0("malloc failed.\n");
+    return STATUS_ENOMEM;
+  }
+  pubsub_tag_format(tagged, redis->node_id, publisher);
+  memcpy(tagged + PUBSUB_TAG_NBYTES, message, message_nbytes);
+  status = publisher_pool_publish(publishers_of(redis, channel, channel_nbytes), channel, channel_nbytes, tagged, PUBSUB_TAG_NBYTES + message_nbytes);
+  free(tagged);
+  if (status != STATUS_OK) {
+    return status;
+  }
+
+  struct pubsub_payload *const payload = pubsub_payload_create(message, message_nbytes);
+  if (payload == NULL) {
+    return STATUS_ENOMEM;
+  }
+  payload->node = redis->node_id;
+  payload->publisher = publisher;
+  status = pubsub_hub_deliver(redis->hub, redis->hub_index, channel, payload);
+  if (status != STATUS_OK) {
+    WARNING("Failed to deliver a message on channel '%s' to the other workers. status=%d\n", channel, status);
+  }
+  pubsub_manager_deliver_now(redis->mgr, NULL, channel, channel_nbytes, payload);
+  pubsub_payload_release(payload);
+  return STATUS_OK;
+}
+
+
+static enum status
+subscribe(struct broker *const broker, const char *const name, const bool is_pattern) {
+  const struct redis_broker *const redis = (const struct redis_broker *)broker;
+  if (is_pattern) {
+    return pubsub_hub_psubscribe(redis->hub, redis->hub_index, name);
+  }
+  // The channel is about to have a subscriber, even if the publishers thought that it had none. The
+  // count is forgotten again once redis acknowledges the SUBSCRIBE, as a PUBLISH which gets there
+  // first still finds no receivers.
+  const size_t name_nbytes = strlen(name);
+  publisher_pool_forget_receivers(publishers_of(redis, name, name_nbytes), name, name_nbytes);
+  return pubsub_hub_subscribe(redis->hub, redis->hub_index, name);
+}
+
+
+static enum status
+unsubscribe(struct broker *const broker, const char *const name, const bool is_pattern) {
+  const struct redis_broker *const redis = (const struct redis_broker *)broker;
+  if (is_pattern) {
+    return pubsub_hub_punsubscribe(redis->hub, redis->hub_index, name);
+  }
+  return pubsub_hub_unsubscribe(redis->hub, redis->hub_index, name);
+}
+
+
+static enum status
+read_range(struct broker *const broker, const char *const channel, const size_t channel_nbytes, const struct stream_id *const after, const size_t max_nentries, const broker_range_t fn, void *const arg) {
+  const struct redis_broker *const redis = (const struct redis_broker *)broker;
+  return publisher_pool_read_range(publishers_of(redis, channel, channel_nbytes), channel, channel_nbytes, after, max_nentries, fn, arg);
+}
+
+
+static const struct broker_ops PUBSUB_OPS = {
+  .attach = &attach,
+  .destroy = &destroy,
+  .publish = &publish,
+  .subscribe = &subscribe,
+  .unsubscribe = &unsubscribe,
+  .read_range = NULL,
+};
+
+
+static const struct broker_ops PUBSUB_LOCAL_OPS = {
+  .attach = &attach,
+  .destroy = &destroy,
+  .publish = &publish_local,
+  .subscribe = &subscribe,
+  .unsubscribe = &unsubscribe,
+  .read_range = NULL,
+};
+
+
+static const struct broker_ops CLUSTER_OPS = {
+  .attach = &attach,
+  .destroy = &destroy,
+  .publish = &publish_cluster,
+  .subscribe = &subscribe_cluster,
+  .unsubscribe = &unsubscribe,
+  .read_range = NULL,
+};
+
+
+static const struct broker_ops STREAMS_OPS = {
+  .attach = &attach,
+  .destroy = &destroy,
+  .publish = &publish,
+  .subscribe = &subscribe,
+  .unsubscribe = &unsubscribe,
+  .read_range = &read_range,
+};
+
+
+/**
+ * Creates a broker for a worker running `event_base`, which publishes to the first shard, named
+ * "host:port", over `publishers`. Neither the hub nor the publisher pools are owned by the broker.
+ **/
+struct broker *
+redis_broker_create(struct pubsub_hub *const hub, struct event_base *const event_base, const char *const shard, struct publisher_pool *const publishers) {
+  if (hub == NULL || event_base == NULL || shard == NULL || publishers == NULL) {
+    return NULL;
+  }
+
+  struct redis_broker *const redis = malloc(sizeof(struct redis_broker));
+  if (redis == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(redis, 0, sizeof(struct redis_broker));
+  redis->ring = shard_ring_create();
+  if (redis->ring == NULL || redis_broker_add_shard(&redis->base, shard, publishers) != STATUS_OK) {
+    shard_ring_destroy(redis->ring);
+    free(redis);
+    return NULL;
+  }
+
+  // Only the Streams backend can read back old messages, and it has no patterns. Local delivery is
+  // only for the pubsub backend, where the hub can recognise its own messages.
+  const bool is_streams = pubsub_hub_backend(hub) == REDIS_BACKEND_STREAMS;
+  if (is_streams) {
+    redis->base.ops = &STREAMS_OPS;
+  }
+  else {
+    redis->node_id = pubsub_hub_node_id(hub);
+    redis->base.ops = (redis->node_id != 0) ? &PUBSUB_LOCAL_OPS : &PUBSUB_OPS;
+    redis->forgets_event = event_new(event_base, -1, 0, &on_forgets, redis);
+    if (redis->forgets_event == NULL) {
+      ERROR0("event_new failed.\n");
+      shard_ring_destroy(redis->ring);
+      free(redis);
+      return NULL;
+    }
+    pthread_mutex_init(&redis->forgets_lock, NULL);
+  }
+  redis->base.has_patterns = !is_streams;
+  redis->hub = hub;
+  return &redis->base;
+}
+
+
+/**
+ * Creates a broker for a worker with the Cluster backend, which SPUBLISHes over `nconnections`
+ * connections to each of the cluster's primaries, as they are found by the hub. Sharded pubsub has
+ * no patterns.
+ **/
+struct broker *
+redis_broker_create_cluster(struct pubsub_hub *const hub, struct event_base *const event_base, const size_t nconnections) {
+  if (hub == NULL || event_base == NULL || pubsub_hub_backend(hub) != REDIS_BACKEND_CLUSTER) {
+    return NULL;
+  }
+
+  struct redis_broker *const redis = malloc(sizeof(struct redis_broker));
+  if (redis == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(redis, 0, sizeof(struct redis_broker));
+  redis->slot_shards = malloc(CLUSTER_NSLOTS);
+  if (redis->slot_shards == NULL) {
+    ERROR0("malloc failed.\n");
+    free(redis);
+    return NULL;
+  }
+  pubsub_hub_copy_slots(hub, redis->slot_shards, &redis->slots_generation);
+  redis->event_base = event_base;
+  redis->nconnections = nconnections;
+  redis->base.ops = &CLUSTER_OPS;
+  redis->base.has_patterns = false;
+  redis->hub = hub;
+  return &redis->base;
+}
+
+
+/**
+ * Adds a shard, named "host:port" as it was for the hub, which is published to over `publishers`.
+ * The channels which now hash to the new shard are PUBLISHed to there from now on. This must be
+ * called from the worker's thread.
+ **/
+enum status
+redis_broker_add_shard(struct broker *const broker, const char *const shard, struct publisher_pool *const publishers) {
+  struct redis_broker *const redis = (struct redis_broker *)broker;
+  size_t index;
+
+  if (broker == NULL || shard == NULL || publishers == NULL) {
+    return STATUS_EINVAL;
+  }
+  const enum status status = shard_ring_add(redis->ring, shard, &index);
+  if (status != STATUS_OK) {
+    return status;
+  }
+  redis->publishers[index] = publishers;
+  redis->nshards = index + 1;
+  return STATUS_OK;
+}
@@ -0,0 +1,32 @@
+/**
+ * The redis broker. Messages are published over the worker's publisher pool, and subscriptions go
+ * through the process-wide pubsub hub, which hands messages to the managers from its ingest thread.
+ *
+ * If the hub has a node ID, messages are also delivered locally as they are published: straight
+ * away to the worker's own subscribers, and through the hub to the other workers' subscribers.
+ * They are PUBLISHed with a tag so that the hub can skip their echo.
+ *
+ * Once redis has acknowledged the SUBSCRIBE to a channel, the hub tells every worker's broker, so
+ * that publishers which cached the channel as having no receivers stop dropping its messages.
+ *
+ * With several redis shards, the worker has a publisher pool per shard, and each message is
+ * PUBLISHed to the shard that its channel lives on. The broker keeps its own ring of the shards,
+ * which agrees with the hub's as the shards have the same names.
+ *
+ * With a redis Cluster, channels are placed by hash slot rather than on the ring. The broker
+ * SPUBLISHes each message to the primary which owns the channel's slot, using its copy of the hub's
+ * slot table.
+ **/
+#pragma once
+
+#include "broker.h"
+
+// Forward declarations.
+struct event_base;
+struct publisher_pool;
+struct pubsub_hub;
+
+
+struct broker *redis_broker_create(struct pubsub_hub *hub, struct event_base *event_base, const char *shard, struct publisher_pool *publishers);
+struct broker *redis_broker_create_cluster(struct pubsub_hub *hub, struct event_base *event_base, size_t nconnections);
+enum status    redis_broker_add_shard(struct broker *broker, const char *shard, struct publisher_pool *publishers);
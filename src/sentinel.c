@@ -0,0 +1,300 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+
+#include "logging.h"
+#include "sentinel.h"
+
+static const struct timeval SENTINEL_POLL_INTERVAL = {.tv_sec = 1, .tv_usec = 0};
+static const struct timeval LOOKUP_TIMEOUT = {.tv_sec = 1, .tv_usec = 0};
+
+
+struct sentinel {
+  struct event_base *event_base;
+  char *primary_name;
+  sentinel_primary_t fn;
+  void *arg;
+  bool is_shutting_down;
+
+  size_t nsentinels;
+  size_t current;  // The sentinel which is asked next.
+  char *hosts[SENTINEL_MAX_SENTINELS];
+  uint16_t ports[SENTINEL_MAX_SENTINELS];
+
+  redisAsyncContext *ctx;  // NULL while there is no connection or connection attempt.
+  bool is_query_pending;
+  struct event *poll_event;
+
+  // The last known address of the primary.
+  char primary_host[SENTINEL_HOST_MAX_NBYTES];
+  uint16_t primary_port;
+};
+
+
+/**
+ * Parses the reply to `SENTINEL get-master-addr-by-name`, which is the primary's host and port,
+ * or nil if the sentinel doesn't know of the primary. `host` must have room for
+ * SENTINEL_HOST_MAX_NBYTES bytes.
+ **/
+enum status
+sentinel_parse_primary(const struct redisReply *const reply, char *const host, uint16_t *const port) {
+  char *end;
+
+  if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 || reply->element[0]->type != REDIS_REPLY_STRING || reply->element[1]->type != REDIS_REPLY_STRING) {
+    return STATUS_BAD;
+  }
+  const redisReply *const host_reply = reply->element[0];
+  if (host_reply->len == 0 || host_reply->len >= SENTINEL_HOST_MAX_NBYTES) {
+    return STATUS_BAD;
+  }
+  const long value = strtol(reply->element[1]->str, &end, 10);
+  if (end == reply->element[1]->str || *end != '\0' || value <= 0 || value > 65535) {
+    return STATUS_BAD;
+  }
+  memcpy(host, host_reply->str, host_reply->len);
+  host[host_reply->len] = '\0';
+  *port = (uint16_t)value;
+  return STATUS_OK;
+}
+
+
+// Records the primary's address, and calls back if it has changed.
+static void
+set_primary(struct sentinel *const sentinel, const char *const host, const uint16_t port) {
+  if (port == sentinel->primary_port && strcmp(host, sentinel->primary_host) == 0) {
+    return;
+  }
+  if (sentinel->primary_port != 0) {
+    WARNING("Redis primary '%s' moved from %s:%d to %s:%d\n", sentinel->primary_name, sentinel->primary_host, sentinel->primary_port, host, port);
+  }
+  strcpy(sentinel->primary_host, host);
+  sentinel->primary_port = port;
+  sentinel->fn(host, port, sentinel->arg);
+}
+
+
+static void
+on_primary_reply(redisAsyncContext *const ctx, void *const reply, void *const privdata) {
+  struct sentinel *const sentinel = (struct sentinel *)ctx->data;
+  char host[SENTINEL_HOST_MAX_NBYTES];
+  uint16_t port;
+  (void)privdata;
+
+  // hiredis calls back without a reply if the connection goes away first.
+  sentinel->is_query_pending = false;
+  if (reply == NULL || sentinel->is_shutting_down) {
+    return;
+  }
+  if (sentinel_parse_primary(reply, host, &port) != STATUS_OK) {
+    // Ask another sentinel next time.
+    WARNING("Redis sentinel %s:%d doesn't know the primary '%s'\n", sentinel->hosts[sentinel->current], sentinel->ports[sentinel->current], sentinel->primary_name);
+    redisAsyncDisconnect(ctx);
+    return;
+  }
+  set_primary(sentinel, host, port);
+}
+
+
+static void
+on_connect(const redisAsyncContext *const ctx, const int status) {
+  struct sentinel *const sentinel = (struct sentinel *)ctx->data;
+
+  if (status != REDIS_OK) {
+    ERROR("Failed to connect to redis sentinel %s:%d. error=%s\n", sentinel->hosts[sentinel->current], sentinel->ports[sentinel->current], ctx->errstr);
+    sentinel->ctx = NULL;  // hiredis frees the context.
+    sentinel->current = (sentinel->current + 1) % sentinel->nsentinels;
+  }
+}
+
+
+static void
+on_disconnect(const redisAsyncContext *const ctx, const int status) {
+  struct sentinel *const sentinel = (struct sentinel *)ctx->data;
+  (void)status;
+
+  sentinel->ctx = NULL;  // hiredis frees the context.
+  if (!sentinel->is_shutting_down) {
+    INFO("Disconnected from redis sentinel %s:%d\n", sentinel->hosts[sentinel->current], sentinel->ports[sentinel->current]);
+    sentinel->current = (sentinel->current + 1) % sentinel->nsentinels;
+  }
+}
+
+
+static enum status
+sentinel_connect(struct sentinel *const sentinel) {
+  const char *const host = sentinel->hosts[sentinel->current];
+  const uint16_t port = sentinel->ports[sentinel->current];
+
+  sentinel->ctx = redisAsyncConnect(host, port);
+  if (sentinel->ctx == NULL) {
+    ERROR("Failed to connect to redis sentinel %s:%d\n", host, port);
+    return STATUS_BAD;
+  }
+  sentinel->ctx->data = sentinel;
+  if (redisLibeventAttach(sentinel->ctx, sentinel->event_base) != REDIS_OK || redisAsyncSetConnectCallback(sentinel->ctx, &on_connect) != REDIS_OK || redisAsyncSetDisconnectCallback(sentinel->ctx, &on_disconnect) != REDIS_OK) {
+    ERROR0("Failed to set up the redis sentinel connection.\n");
+    redisAsyncFree(sentinel->ctx);
+    sentinel->ctx = NULL;
+    return STATUS_BAD;
+  }
+  return STATUS_OK;
+}
+
+
+/**
+ * Asks the current sentinel for the primary's address. A sentinel which hasn't answered the last
+ * question by the next one is dropped for the next sentinel.
+ **/
+static void
+on_poll_tick(const evutil_socket_t fd, const short events, void *const arg) {
+  struct sentinel *const sentinel = (struct sentinel *)arg;
+  (void)fd;
+  (void)events;
+
+  if (sentinel->is_query_pending) {
+    WARNING("Redis sentinel %s:%d didn't answer within %lds\n", sentinel->hosts[sentinel->current], sentinel->ports[sentinel->current], (long)SENTINEL_POLL_INTERVAL.tv_sec);
+    // Freeing the context calls `on_disconnect` if it was connected, which moves on to the next sentinel.
+    redisAsyncFree(sentinel->ctx);
+    if (sentinel->ctx != NULL) {
+      sentinel->ctx = NULL;
+      sentinel->current = (sentinel->current + 1) % sentinel->nsentinels;
+    }
+    sentinel->is_query_pending = false;
+    return;
+  }
+  if (sentinel->ctx == NULL && sentinel_connect(sentinel) != STATUS_OK) {
+    sentinel->current = (sentinel->current + 1) % sentinel->nsentinels;
+    return;
+  }
+  // The command is sent once the connection is up, or called back without a reply if it fails.
+  if (redisAsyncCommand(sentinel->ctx, &on_primary_reply, NULL, "SENTINEL get-master-addr-by-name %s", sentinel->primary_name) == REDIS_OK) {
+    sentinel->is_query_pending = true;
+  }
+  else {
+    ERROR0("async `SENTINEL get-master-addr-by-name` command failed.\n");
+  }
+}
+
+
+/**
+ * Creates the sentinel client for the primary which the sentinels monitor as `primary_name`.
+ * `fn` is called with the primary's new address whenever it changes.
+ **/
+struct sentinel *
+sentinel_create(struct event_base *const event_base, const char *const primary_name, const sentinel_primary_t fn, void *const arg) {
+  if (event_base == NULL || primary_name == NULL || fn == NULL) {
+    return NULL;
+  }
+
+  struct sentinel *const sentinel = malloc(sizeof(struct sentinel));
+  if (sentinel == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  memset(sentinel, 0, sizeof(struct sentinel));
+  sentinel->event_base = event_base;
+  sentinel->fn = fn;
+  sentinel->arg = arg;
+  sentinel->primary_name = strdup(primary_name);
+  sentinel->poll_event = event_new(event_base, -1, EV_PERSIST, &on_poll_tick, sentinel);
+  if (sentinel->primary_name == NULL || sentinel->poll_event == NULL) {
+    ERROR0("Failed to create the sentinel client.\n");
+    sentinel_destroy(sentinel);
+    return NULL;
+  }
+  return sentinel;
+}
+
+
+void
+sentinel_destroy(struct sentinel *const sentinel) {
+  if (sentinel == NULL) {
+    return;
+  }
+  sentinel->is_shutting_down = true;
+  if (sentinel->ctx != NULL) {
+    redisAsyncFree(sentinel->ctx);
+  }
+  if (sentinel->poll_event != NULL) {
+    event_free(sentinel->poll_event);
+  }
+  for (size_t i = 0; i != sentinel->nsentinels; ++i) {
+    free(sentinel->hosts[i]);
+  }
+  free(sentinel->primary_name);
+  free(sentinel);
+}
+
+
+enum status
+sentinel_add(struct sentinel *const sentinel, const char *const host, const uint16_t port) {
+  if (sentinel == NULL || host == NULL) {
+    return STATUS_EINVAL;
+  }
+  else if (sentinel->nsentinels == SENTINEL_MAX_SENTINELS) {
+    return STATUS_BAD;
+  }
+  char *const copy = strdup(host);
+  if (copy == NULL) {
+    ERROR0("strdup failed.\n");
+    return STATUS_ENOMEM;
+  }
+  sentinel->hosts[sentinel->nsentinels] = copy;
+  sentinel->ports[sentinel->nsentinels] = port;
+  ++sentinel->nsentinels;
+  return STATUS_OK;
+}
+
+
+/**
+ * Asks each sentinel in turn for the primary's address, blocking for up to LOOKUP_TIMEOUT per
+ * sentinel, until one answers. For startup, before there is an event loop to wait on.
+ **/
+enum status
+sentinel_lookup(struct sentinel *const sentinel, char *const host, uint16_t *const port) {
+  if (sentinel == NULL || host == NULL || port == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  for (size_t i = 0; i != sentinel->nsentinels; ++i, sentinel->current = (sentinel->current + 1) % sentinel->nsentinels) {
+    const char *const sentinel_host = sentinel->hosts[sentinel->current];
+    const uint16_t sentinel_port = sentinel->ports[sentinel->current];
+    redisContext *const c = redisConnectWithTimeout(sentinel_host, sentinel_port, LOOKUP_TIMEOUT);
+    if (c == NULL || c->err) {
+      WARNING("Failed to connect to redis sentinel %s:%d. error=%s\n", sentinel_host, sentinel_port, (c == NULL) ? "?" : c->errstr);
+      redisFree(c);
+      continue;
+    }
+    redisReply *const reply = redisCommand(c, "SENTINEL get-master-addr-by-name %s", sentinel->primary_name);
+    const enum status status = sentinel_parse_primary(reply, host, port);
+    freeReplyObject(reply);
+    redisFree(c);
+    if (status == STATUS_OK) {
+      INFO("Redis sentinel %s:%d has primary '%s' at %s:%d\n", sentinel_host, sentinel_port, sentinel->primary_name, host, *port);
+      strcpy(sentinel->primary_host, host);
+      sentinel->primary_port = *port;
+      return STATUS_OK;
+    }
+    WARNING("Redis sentinel %s:%d doesn't know the primary '%s'\n", sentinel_host, sentinel_port, sentinel->primary_name);
+  }
+  return STATUS_DISCONNECTED;
+}
+
+
+/**
+ * Starts polling the sentinels for the primary's address.
+ **/
+enum status
+sentinel_start(struct sentinel *const sentinel) {
+  if (sentinel == NULL || sentinel->nsentinels == 0) {
+    return STATUS_EINVAL;
+  }
+  if (event_add(sentinel->poll_event, &SENTINEL_POLL_INTERVAL) == -1) {
+    ERROR0("Failed to schedule the redis sentinel polling.\n");
+    return STATUS_BAD;
+  }
+  return STATUS_OK;
+}
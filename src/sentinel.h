@@ -0,0 +1,33 @@
+/**
+ * Finds a redis primary through Redis Sentinel, so that publishes can follow the primary across a
+ * failover. The sentinels are asked for the primary's address with `SENTINEL
+ * get-master-addr-by-name`, once at startup, and then every SENTINEL_POLL_INTERVAL over a
+ * connection to one of them. A sentinel which fails to answer is swapped for the next one. The
+ * callback is called from the event loop whenever the primary's address changes.
+ **/
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <event2/event.h>
+
+#include "status.h"
+
+#define SENTINEL_MAX_SENTINELS (16)
+#define SENTINEL_HOST_MAX_NBYTES (256)  // Bounds a host name, including the NUL.
+
+// Forward declarations.
+struct redisReply;
+struct sentinel;
+
+// Called with the primary's new address, which is only valid during the call.
+typedef void (*sentinel_primary_t)(const char *host, uint16_t port, void *arg);
+
+
+struct sentinel *sentinel_create(struct event_base *event_base, const char *primary_name, sentinel_primary_t fn, void *arg);
+void             sentinel_destroy(struct sentinel *sentinel);
+enum status      sentinel_add(struct sentinel *sentinel, const char *host, uint16_t port);
+enum status      sentinel_lookup(struct sentinel *sentinel, char *host, uint16_t *port);
+enum status      sentinel_start(struct sentinel *sentinel);
+enum status      sentinel_parse_primary(const struct redisReply *reply, char *host, uint16_t *port);
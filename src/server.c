@@ -3,9 +3,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,6 +21,8 @@
 #include <event.h>
 #include <event2/buffer.h>
 #include <event2/event.h>
+#include <event2/thread.h>
+#include <event2/util.h>
 
 #include "client_connection.h"
 #include "compat_openssl.h"
@@ -25,22 +30,77 @@
 #include "logging.h"
 #include "http.h"
 #include "json.h"
+#include "local_broker.h"
+#include "publisher_pool.h"
+#include "pubsub_hub.h"
 #include "pubsub_manager.h"
+#include "redis_broker.h"
+#include "sentinel.h"
+#include "shard_ring.h"
 #include "websocket.h"
 
-#ifndef SA_RESTART
-#define SA_RESTART   0x10000000 /* Restart syscall on signal return.  */
-#endif
-
 
 static const char *bind_host = "0.0.0.0";
 static uint16_t bind_port = 9999;
 
 static const char *redis_host = "127.0.0.1";
 static uint16_t redis_port = 6379;
+static const char *redis_unix_socket = NULL;  // Publish over this unix domain socket if set.
+static unsigned int nredis_publishers = 1;    // The number of publishing connections per worker.
+
+// A file of more redis servers to spread the channels over, one "host:port" per line, alongside
+// redis_host:redis_port. It is read again on SIGHUP, and any new servers are added as shards.
+static const char *redis_shards_file = NULL;
+
+// Comma separated "host:port" lists. The channels are subscribed on the replicas, failing over
+// from one to the next and then to the primary, as redis propagates every PUBLISH to them. With
+// sentinels, the primary is found from them instead of redis_host:redis_port, and the publishers
+// and subscriptions follow it across failovers. Its shard is then named redis_primary_name on the
+// shard ring, so that the channels hash the same wherever the primary is.
+static const char *redis_replicas = NULL;
+static const char *redis_sentinels = NULL;
+static const char *redis_primary_name = "mymaster";
 
 static const char *log_path = "/dev/stderr";
 
+static unsigned int nthreads = 1;
+
+// How long to batch up outbound frames for before writing them. Negative flushes at the end of each
+// event loop iteration.
+static long flush_window_us = -1;
+
+// How long a channel without subscribers keeps its redis subscription for, in case it is subscribed
+// to again. Zero unsubscribes straight away.
+static long channel_linger_ms = 0;
+
+// Whether messages go through redis, or only between the workers of this process.
+static bool use_local_broker = false;
+
+// Whether messages published by clients are delivered to this process's subscribers straight away,
+// rather than when redis echoes them back. Only for the redis pubsub backend.
+static int use_local_delivery = 0;
+
+// How long a count of a channel's redis subscribers is trusted for, when dropping client publishes
+// to channels without subscribers, and how often a publish to such a channel is sent anyway to
+// check again. Publishes are never dropped if the first is zero, and always dropped if the second is.
+static long suppress_ttl_ms = 0;
+static long suppress_probe_ms = 0;
+
+// Whether channels are redis pubsub channels or redis streams.
+static enum redis_backend redis_backend = REDIS_BACKEND_PUBSUB;
+
+// How many of each channel's recent messages, or how many seconds of them, to keep in memory for
+// late joiners, and the memory cap across all of the workers. History is off unless either limit is set.
+static long history_nmessages = 0;
+static long history_seconds = 0;
+static long history_max_mb = 64;
+
+static const struct timeval STATS_INTERVAL = {.tv_sec = 60, .tv_usec = 0};
+
+// How long the workers wait before publishing to a new shard, so that the hub has SUBSCRIBEd to
+// its channels there by the time that messages arrive. It is well within the hub's migration grace.
+static const struct timeval SHARD_SWITCH_DELAY = {.tv_sec = 1, .tv_usec = 0};
+
 static int use_ssl = 0;
 static const char *ssl_certificate_chain_path = NULL;
 static const char *ssl_dh_params_path = NULL;
@@ -53,19 +113,71 @@ static const struct option ARGV_OPTIONS[] = {
   {"redis_host", required_argument, NULL, 'H'},
   {"redis_port", required_argument, NULL, 'P'},
   {"log", required_argument, NULL, 'l'},
+  {"threads", required_argument, NULL, 't'},
   {"use_ssl", no_argument, &use_ssl, 1000},
   {"ssl_certificate_chain", required_argument, NULL, 1001},
   {"ssl_dh_params", required_argument, NULL, 1002},
   {"ssl_private_key", required_argument, NULL, 1003},
   {"ssl_ciphers", required_argument, NULL, 1004},
+  {"flush_window_us", required_argument, NULL, 1005},
+  {"channel_linger_ms", required_argument, NULL, 1006},
+  {"redis_unix_socket", required_argument, NULL, 1007},
+  {"redis_publishers", required_argument, NULL, 1008},
+  {"redis_backend", required_argument, NULL, 1009},
+  {"history_messages", required_argument, NULL, 1010},
+  {"history_seconds", required_argument, NULL, 1011},
+  {"history_max_mb", required_argument, NULL, 1012},
+  {"broker", required_argument, NULL, 1013},
+  {"local_delivery", no_argument, &use_local_delivery, 1014},
+  {"suppress_unsubscribed_ms", required_argument, NULL, 1015},
+  {"suppress_probe_ms", required_argument, NULL, 1016},
+  {"redis_shards_file", required_argument, NULL, 1017},
+  {"redis_replicas", required_argument, NULL, 1018},
+  {"redis_sentinels", required_argument, NULL, 1019},
+  {"redis_primary_name", required_argument, NULL, 1020},
   {NULL, 0, NULL, 0},
 };
 
 
+// A redis server that a share of the channels live on. Shards are only ever added, by the main
+// thread, and live for as long as the process.
+struct redis_shard {
+  char *name;  // "host:port", the same for every process so that they agree on where channels live.
+  char *host;
+  uint16_t port;
+};
+
+
+// Each worker thread runs its own event loop with its own listening socket and clients.
+struct worker {
+  size_t index;
+  pthread_t thread;
+  struct event_base *event_base;
+  int listen_fd;
+  struct event *listen_event;
+  struct event *stats_event;
+  size_t nshards;
+  struct publisher_pool *publishers[SHARD_RING_MAX_SHARDS];  // The publisher pool of each shard.
+  struct broker *broker;
+  struct pubsub_manager *pubsub_mgr;
+  struct websocket_flusher *flusher;
+};
+
+
 // Server-level global singletons.
 static struct event_base *server_loop = NULL;
-static struct pubsub_manager *pubsub_mgr = NULL;
+static struct pubsub_hub *pubsub_hub = NULL;
+static struct local_exchange *local_exchange = NULL;
+static struct worker *workers = NULL;
 static SSL_CTX *ssl_ctx = NULL;
+static struct redis_shard redis_shards[SHARD_RING_MAX_SHARDS];
+static atomic_size_t nredis_shards;
+
+// The primary's address as last found from the sentinels, which the workers copy when it moves.
+static struct sentinel *sentinel = NULL;
+static pthread_mutex_t primary_lock = PTHREAD_MUTEX_INITIALIZER;
+static char primary_host[SENTINEL_HOST_MAX_NBYTES];
+static uint16_t primary_port;
 
 
 // ================================================================================================
@@ -99,7 +211,7 @@ static bool
 parse_argv(int argc, char *const *argv) {
   int index, c, tmp;
   while (true) {
-    c = getopt_long(argc, argv, "h:p:H:P:l:", ARGV_OPTIONS, &index);
+    c = getopt_long(argc, argv, "h:p:H:P:l:t:", ARGV_OPTIONS, &index);
     switch (c) {
     case -1:  // Finished processing.
       return true;
@@ -132,6 +244,15 @@ parse_argv(int argc, char *const *argv) {
     case 'l':
       log_path = optarg;
       break;
+    case 't':
+      tmp = atoi(optarg);
+      if (tmp < 1 || tmp > PUBSUB_HUB_MAX_MANAGERS) {
+        fprintf(stderr, "Invalid number of threads %d. Not in the range [1, %u]\n", tmp, PUBSUB_HUB_MAX_MANAGERS);
+        print_usage(stderr);
+        return false;
+      }
+      nthreads = (unsigned int)tmp;
+      break;
     case 1001:
       ssl_certificate_chain_path = optarg;
       break;
@@ -144,6 +265,115 @@ parse_argv(int argc, char *const *argv) {
     case 1004:
       ssl_ciphers = optarg;
       break;
+    case 1005:
+      flush_window_us = atol(optarg);
+      if (flush_window_us > 1000000) {
+        fprintf(stderr, "Invalid flush window %ld. Must be at most 1000000us\n", flush_window_us);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1006:
+      channel_linger_ms = atol(optarg);
+      if (channel_linger_ms < 0 || channel_linger_ms > 3600000) {
+        fprintf(stderr, "Invalid channel linger time %ld. Not in the range [0, 3600000]ms\n", channel_linger_ms);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1007:
+      redis_unix_socket = optarg;
+      break;
+    case 1008:
+      tmp = atoi(optarg);
+      if (tmp < 1 || tmp > PUBLISHER_POOL_MAX_CONNECTIONS) {
+        fprintf(stderr, "Invalid number of redis publishers %d. Not in the range [1, %u]\n", tmp, PUBLISHER_POOL_MAX_CONNECTIONS);
+        print_usage(stderr);
+        return false;
+      }
+      nredis_publishers = (unsigned int)tmp;
+      break;
+    case 1009:
+      if (strcmp(optarg, "pubsub") == 0) {
+        redis_backend = REDIS_BACKEND_PUBSUB;
+      }
+      else if (strcmp(optarg, "streams") == 0) {
+        redis_backend = REDIS_BACKEND_STREAMS;
+      }
+      else if (strcmp(optarg, "cluster") == 0) {
+        redis_backend = REDIS_BACKEND_CLUSTER;
+      }
+      else {
+        fprintf(stderr, "Invalid redis backend '%s'. Not one of 'pubsub', 'streams' or 'cluster'\n", optarg);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1010:
+      history_nmessages = atol(optarg);
+      if (history_nmessages < 0 || history_nmessages > PUBSUB_MANAGER_MAX_HISTORY_NMESSAGES) {
+        fprintf(stderr, "Invalid number of history messages %ld. Not in the range [0, %d]\n", history_nmessages, PUBSUB_MANAGER_MAX_HISTORY_NMESSAGES);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1011:
+      history_seconds = atol(optarg);
+      if (history_seconds < 0 || history_seconds > 86400) {
+        fprintf(stderr, "Invalid history time %ld. Not in the range [0, 86400]s\n", history_seconds);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1012:
+      history_max_mb = atol(optarg);
+      if (history_max_mb < 1 || history_max_mb > 1048576) {
+        fprintf(stderr, "Invalid history memory cap %ld. Not in the range [1, 1048576]MB\n", history_max_mb);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1013:
+      if (strcmp(optarg, "redis") == 0) {
+        use_local_broker = false;
+      }
+      else if (strcmp(optarg, "local") == 0) {
+        use_local_broker = true;
+      }
+      else {
+        fprintf(stderr, "Invalid broker '%s'. Not one of 'redis' or 'local'\n", optarg);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1015:
+      suppress_ttl_ms = atol(optarg);
+      if (suppress_ttl_ms < 0 || suppress_ttl_ms > 3600000) {
+        fprintf(stderr, "Invalid subscriber count TTL %ld. Not in the range [0, 3600000]ms\n", suppress_ttl_ms);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1016:
+      suppress_probe_ms = atol(optarg);
+      if (suppress_probe_ms < 0 || suppress_probe_ms > 3600000) {
+        fprintf(stderr, "Invalid probe interval %ld. Not in the range [0, 3600000]ms\n", suppress_probe_ms);
+        print_usage(stderr);
+        return false;
+      }
+      break;
+    case 1017:
+      redis_shards_file = optarg;
+      break;
+    case 1018:
+      redis_replicas = optarg;
+      break;
+    case 1019:
+      redis_sentinels = optarg;
+      break;
+    case 1020:
+      redis_primary_name = optarg;
+      break;
     case '?':  // Unknown option.
       print_usage(stderr);
       return false;
@@ -159,8 +389,16 @@ parse_argv(int argc, char *const *argv) {
 // Signal handling.
 // ================================================================================================
 static void
-sighandler(const int signal) {
+on_signal(const evutil_socket_t signal, const short events, void *const arg) {
+  (void)events;
+  (void)arg;
+
   INFO("Received signal %d. Shutting down...\n", signal);
+  for (unsigned int i = 0; i != nthreads; ++i) {
+    if (event_base_loopexit(workers[i].event_base, NULL) == -1) {
+      ERROR("Error shutting down worker %u\n", i);
+    }
+  }
   if (event_base_loopexit(server_loop, NULL) == -1) {
     ERROR0("Error shutting down server\n");
   }
@@ -187,40 +425,111 @@ set_nonblocking(const int fd) {
 }
 
 
+static void
+process_websocket_subscription(struct websocket *const ws, const bool is_subscribe, const bool is_pattern, const char *const channel, const char *const since, const size_t nhistory, const bool nolocal) {
+  enum status status;
+
+  if (is_subscribe && since != NULL) {
+    status = pubsub_manager_subscribe_since(ws->client->pubsub_mgr, channel, ws, since);
+    if (status == STATUS_EINVAL) {
+      WARNING("`since` '%s' invalid, or not supported by the redis backend.\n", since);
+    }
+    else if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
+      ERROR("pubsub_manager_subscribe_since failed. status=%d\n", status);
+    }
+  }
+  else if (is_subscribe && nhistory != 0) {
+    status = pubsub_manager_subscribe_history(ws->client->pubsub_mgr, channel, ws, nhistory);
+    if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
+      ERROR("pubsub_manager_subscribe_history failed. status=%d\n", status);
+    }
+  }
+  else if (is_subscribe) {
+    status = is_pattern ? pubsub_manager_psubscribe(ws->client->pubsub_mgr, channel, ws) : pubsub_manager_subscribe(ws->client->pubsub_mgr, channel, ws);
+    if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
+      ERROR("pubsub_manager_%ssubscribe failed. status=%d\n", is_pattern ? "p" : "", status);
+    }
+  }
+  else {
+    status = is_pattern ? pubsub_manager_punsubscribe(ws->client->pubsub_mgr, channel, ws) : pubsub_manager_unsubscribe(ws->client->pubsub_mgr, channel, ws);
+    if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
+      ERROR("pubsub_manager_%sunsubscribe failed. status=%d\n", is_pattern ? "p" : "", status);
+    }
+    return;
+  }
+
+  if (nolocal && status == STATUS_OK) {
+    status = pubsub_manager_set_nolocal(ws->client->pubsub_mgr, channel, is_pattern, ws, true);
+    if (status != STATUS_OK) {
+      ERROR("pubsub_manager_set_nolocal failed. status=%d\n", status);
+    }
+  }
+}
+
+
 static void
 process_websocket_message(struct websocket *const ws, const struct json_value *const msg) {
   enum status status;
-  struct json_value *action, *key, *data;
+  struct json_value *action, *key, *data, *since, *history, *nolocal;
 
-  // Ensure we have `action`, `key`, and `data` elements.
+  // Ensure we have `action` and `key` elements. `key` may be an array of keys for all actions but
+  // `pub`. The keys of `psub` and `punsub` are redis glob-style patterns. With the Streams backend,
+  // `sub` may also have a `since` stream ID to resume each of its channels from. `sub` may have a
+  // `history` count of each channel's most recent messages to be sent straight away. `sub` and `psub`
+  // may set `nolocal` to skip the websocket's own `pub`s.
   action = json_value_get(msg, "action");
   key = json_value_get(msg, "key");
-  if (action == NULL || key == NULL || action->type != JSON_VALUE_TYPE_STRING || key->type != JSON_VALUE_TYPE_STRING) {
+  if (action == NULL || key == NULL || action->type != JSON_VALUE_TYPE_STRING || (key->type != JSON_VALUE_TYPE_STRING && key->type != JSON_VALUE_TYPE_ARRAY)) {
     WARNING0("`action` or `key` invalid in JSON payload.\n");
     return;
   }
 
   if (strcmp(action->as.string, "pub") == 0) {
     data = json_value_get(msg, "data");
-    if (data == NULL || data->type != JSON_VALUE_TYPE_STRING) {
+    if (key->type != JSON_VALUE_TYPE_STRING) {
+      WARNING0("`key` invalid in JSON payload.\n");
+      return;
+    }
+    else if (data == NULL || data->type != JSON_VALUE_TYPE_STRING) {
       WARNING0("`data` invalid in JSON payload.\n");
       return;
     }
-    status = pubsub_manager_publish(pubsub_mgr, key->as.string, data->as.string);
+    status = pubsub_manager_publish_from(ws->client->pubsub_mgr, ws, key->as.string, data->as.string);
     if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
       ERROR("pubsub_manager_publish failed. status=%d\n", status);
     }
   }
-  else if (strcmp(action->as.string, "sub") == 0) {
-    status = pubsub_manager_subscribe(pubsub_mgr, key->as.string, ws);
-    if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
-      ERROR("pubsub_manager_subscribe failed. status=%d\n", status);
+  else if (strcmp(action->as.string, "sub") == 0 || strcmp(action->as.string, "unsub") == 0 || strcmp(action->as.string, "psub") == 0 || strcmp(action->as.string, "punsub") == 0) {
+    const bool is_pattern = action->as.string[0] == 'p';
+    const bool is_subscribe = strcmp(action->as.string, "sub") == 0 || strcmp(action->as.string, "psub") == 0;
+    since = (strcmp(action->as.string, "sub") == 0) ? json_value_get(msg, "since") : NULL;
+    if (since != NULL && since->type != JSON_VALUE_TYPE_STRING) {
+      WARNING0("`since` invalid in JSON payload.\n");
+      return;
     }
-  }
-  else if (strcmp(action->as.string, "unsub") == 0) {
-    status = pubsub_manager_unsubscribe(pubsub_mgr, key->as.string, ws);
-    if (status != STATUS_OK && status != STATUS_DISCONNECTED) {
-      ERROR("pubsub_manager_unsubscribe failed. status=%d\n", status);
+    history = (strcmp(action->as.string, "sub") == 0) ? json_value_get(msg, "history") : NULL;
+    if (history != NULL && (history->type != JSON_VALUE_TYPE_NUMBER || history->as.number < 0 || history->as.number > PUBSUB_MANAGER_MAX_HISTORY_NMESSAGES)) {
+      WARNING0("`history` invalid in JSON payload.\n");
+      return;
+    }
+    nolocal = is_subscribe ? json_value_get(msg, "nolocal") : NULL;
+    if (nolocal != NULL && nolocal->type != JSON_VALUE_TYPE_BOOLEAN) {
+      WARNING0("`nolocal` invalid in JSON payload.\n");
+      return;
+    }
+    const char *const since_id = (since == NULL) ? NULL : since->as.string;
+    const size_t nhistory = (history == NULL) ? 0 : (size_t)history->as.number;
+    const bool is_nolocal = nolocal != NULL && nolocal->as.boolean;
+    if (key->type == JSON_VALUE_TYPE_STRING) {
+      process_websocket_subscription(ws, is_subscribe, is_pattern, key->as.string, since_id, nhistory, is_nolocal);
+      return;
+    }
+    for (const struct json_value_list *element = key->as.pairs; element != NULL; element = element->next) {
+      if (element->value->type != JSON_VALUE_TYPE_STRING) {
+        WARNING0("`key` array element invalid in JSON payload.\n");
+        continue;
+      }
+      process_websocket_subscription(ws, is_subscribe, is_pattern, element->value->as.string, since_id, nhistory, is_nolocal);
     }
   }
   else {
@@ -255,7 +564,7 @@ handle_websocket_message(struct websocket *const ws) {
 
 
 static void
-setup_connection(const int fd) {
+setup_connection(struct worker *const worker, const int fd) {
   struct client_connection *client;
 
   if (set_nonblocking(fd) != 0) {
@@ -263,7 +572,7 @@ setup_connection(const int fd) {
     return;
   }
 
-  client = client_connection_create(server_loop, ssl_ctx, fd, pubsub_mgr, &handle_websocket_message);
+  client = client_connection_create(worker->event_base, worker->flusher, ssl_ctx, fd, worker->pubsub_mgr, &handle_websocket_message);
   if (client == NULL) {
     ERROR0("failed to create client connection object\n");
     return;
@@ -273,7 +582,7 @@ setup_connection(const int fd) {
 
 static void
 on_accept(const int listen_fd, const short events, void *const arg) {
-  (void)arg;
+  struct worker *const worker = (struct worker *)arg;
 
   // Ensure we have a read event.
   if (!(events & EV_READ)) {
@@ -294,21 +603,504 @@ on_accept(const int listen_fd, const short events, void *const arg) {
       break;
     }
 
-    INFO("Accepted child connection on fd %d\n", in_fd);
-    setup_connection(in_fd);
+    INFO("Accepted child connection on fd %d in worker %zu\n", in_fd, worker->index);
+    setup_connection(worker, in_fd);
+  }
+}
+
+
+static int
+create_listen_socket(const struct sockaddr_in *const bind_addr) {
+  int tmp;
+
+  // Create a socket connection to listen on.
+  const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
+    perror("Failed to create a socket");
+    return -1;
+  }
+
+  // Each worker binds its own listening socket to the same address and lets the kernel balance
+  // incoming connections between them.
+  tmp = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(tmp)) == -1) {
+    perror("Failed to enable socket address reuse on listening socket");
+    goto fail;
+  }
+  tmp = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof(tmp)) == -1) {
+    perror("Failed to enable socket port reuse on listening socket");
+    goto fail;
+  }
+  if (bind(listen_fd, (const struct sockaddr *)bind_addr, sizeof(*bind_addr)) == -1) {
+    perror("Failed to bind the listening socket to the address");
+    goto fail;
+  }
+
+  // Set the connection queue size.
+  if (listen(listen_fd, 8) == -1) {
+    perror("Failed to create a socket listening backlog queue");
+    goto fail;
+  }
+
+  // Set the socket to be non-blocking.
+  if (set_nonblocking(listen_fd) == -1) {
+    perror("Failed to set the listening socket to be non-blocking");
+    goto fail;
+  }
+
+  return listen_fd;
+
+fail:
+  close(listen_fd);
+  return -1;
+}
+
+
+// ================================================================================================
+// Worker threads.
+// ================================================================================================
+static void
+on_timeout_stats(const evutil_socket_t fd, const short events, void *const arg) {
+  const struct worker *const worker = (const struct worker *)arg;
+  uint64_t nframes, nflushes;
+  (void)fd;
+  (void)events;
+
+  websocket_flusher_get_stats(worker->flusher, &nframes, &nflushes);
+  INFO("worker %zu: %" PRIu64 " frames written in %" PRIu64 " flushes (%.2f frames per flush)\n", worker->index, nframes, nflushes, nflushes == 0 ? 0.0 : (double)nframes / (double)nflushes);
+  if (worker->pubsub_mgr != NULL && (history_nmessages != 0 || history_seconds != 0)) {
+    size_t nchannels, nbytes;
+    pubsub_manager_get_history_stats(worker->pubsub_mgr, &nchannels, &nbytes);
+    INFO("worker %zu: history of %zu channels using %zu bytes\n", worker->index, nchannels, nbytes);
+  }
+  if (worker->nshards != 0 && suppress_ttl_ms != 0) {
+    uint64_t nsuppressed = 0;
+    for (size_t i = 0; i != worker->nshards; ++i) {
+      nsuppressed += publisher_pool_nsuppressed(worker->publishers[i]);
+    }
+    INFO("worker %zu: %" PRIu64 " publishes to channels without subscribers dropped\n", worker->index, nsuppressed);
+  }
+}
+
+
+/**
+ * Connects the worker's publishers to the shard, and has the broker publish the shard's channels
+ * over them. The first shard creates the broker.
+ **/
+static bool
+worker_add_shard(struct worker *const worker, const struct redis_shard *const shard) {
+  // Only the first shard can be reached over the unix domain socket.
+  const bool is_first = worker->nshards == 0;
+  struct publisher_pool *const publishers = publisher_pool_create(worker->event_base, redis_backend, shard->host, shard->port, is_first ? redis_unix_socket : NULL, nredis_publishers);
+  if (publishers == NULL) {
+    ERROR("Failed to setup async connections to redis shard %s for worker %zu\n", shard->name, worker->index);
+    return false;
+  }
+  if (suppress_ttl_ms != 0 && redis_backend == REDIS_BACKEND_PUBSUB) {
+    const struct timeval ttl = {.tv_sec = suppress_ttl_ms / 1000, .tv_usec = (suppress_ttl_ms % 1000) * 1000};
+    const struct timeval probe_interval = {.tv_sec = suppress_probe_ms / 1000, .tv_usec = (suppress_probe_ms % 1000) * 1000};
+    if (publisher_pool_suppress_unsubscribed(publishers, &ttl, &probe_interval) != STATUS_OK) {
+      ERROR("Failed to set up publish suppression for worker %zu\n", worker->index);
+      publisher_pool_destroy(publishers);
+      return false;
+    }
+  }
+
+  if (is_first) {
+    worker->broker = redis_broker_create(pubsub_hub, worker->event_base, shard->name, publishers);
+  }
+  if ((is_first && worker->broker == NULL) || (!is_first && redis_broker_add_shard(worker->broker, shard->name, publishers) != STATUS_OK)) {
+    publisher_pool_destroy(publishers);
+    return false;
+  }
+  worker->publishers[worker->nshards++] = publishers;
+  return true;
+}
+
+
+/**
+ * Catches the worker up with the shards which the main thread has added.
+ **/
+static void
+on_add_shards(const evutil_socket_t fd, const short events, void *const arg) {
+  struct worker *const worker = (struct worker *)arg;
+  (void)fd;
+  (void)events;
+
+  const size_t nshards = atomic_load(&nredis_shards);
+  while (worker->nshards != nshards) {
+    if (!worker_add_shard(worker, &redis_shards[worker->nshards])) {
+      ERROR("Worker %zu is not publishing to redis shard %s\n", worker->index, redis_shards[worker->nshards].name);
+      break;
+    }
+    INFO("worker %zu: publishing to redis shard %s\n", worker->index, redis_shards[worker->nshards - 1].name);
+  }
+}
+
+
+/**
+ * Moves the worker's publishes to the first shard over to its new primary.
+ **/
+static void
+on_primary_moved(const evutil_socket_t fd, const short events, void *const arg) {
+  struct worker *const worker = (struct worker *)arg;
+  char host[SENTINEL_HOST_MAX_NBYTES];
+  (void)fd;
+  (void)events;
+
+  pthread_mutex_lock(&primary_lock);
+  memcpy(host, primary_host, sizeof(host));
+  const uint16_t port = primary_port;
+  pthread_mutex_unlock(&primary_lock);
+  if (worker->nshards != 0 && publisher_pool_move(worker->publishers[0], host, port) != STATUS_OK) {
+    ERROR("Worker %zu failed to move its publishers to redis primary %s:%d\n", worker->index, host, port);
+  }
+}
+
+
+static bool
+worker_init(struct worker *const worker, const size_t index, const struct sockaddr_in *const bind_addr) {
+  memset(worker, 0, sizeof(struct worker));
+  worker->index = index;
+  worker->listen_fd = -1;
+
+  // Create a libevent base object.
+  worker->event_base = event_base_new();
+  if (worker->event_base == NULL) {
+    ERROR("Failed to create libevent event loop for worker %zu\n", index);
+    return false;
+  }
+
+  // Create the worker's own listening socket.
+  worker->listen_fd = create_listen_socket(bind_addr);
+  if (worker->listen_fd == -1) {
+    return false;
+  }
+
+  // Bind callbacks to the libevent loop for activity on the listening socket's file descriptor.
+  worker->listen_event = event_new(worker->event_base, worker->listen_fd, EV_READ | EV_PERSIST, &on_accept, worker);
+  if (worker->listen_event == NULL || event_add(worker->listen_event, NULL) == -1) {
+    ERROR("Failed to schedule a socket listen into the event loop of worker %zu\n", index);
+    return false;
+  }
+
+  // Coalesce the writes of outbound frames.
+  if (flush_window_us < 0) {
+    worker->flusher = websocket_flusher_create(worker->event_base, NULL);
+  }
+  else {
+    const struct timeval window = {.tv_sec = flush_window_us / 1000000, .tv_usec = flush_window_us % 1000000};
+    worker->flusher = websocket_flusher_create(worker->event_base, &window);
+  }
+  if (worker->flusher == NULL) {
+    ERROR("Failed to create the websocket flusher for worker %zu\n", index);
+    return false;
+  }
+
+  // Periodically report the output statistics.
+  worker->stats_event = event_new(worker->event_base, -1, EV_PERSIST, &on_timeout_stats, worker);
+  if (worker->stats_event == NULL || event_add(worker->stats_event, &STATS_INTERVAL) == -1) {
+    ERROR("Failed to schedule the statistics event for worker %zu\n", index);
+    return false;
+  }
+
+  // Connect to redis for publishing and register with the hub for subscriptions, or just share
+  // messages with the other workers.
+  if (use_local_broker) {
+    worker->broker = local_broker_create(local_exchange);
+  }
+  else if (redis_backend == REDIS_BACKEND_CLUSTER) {
+    // The cluster's primaries are found by the hub, and published to as the broker needs them.
+    worker->broker = redis_broker_create_cluster(pubsub_hub, worker->event_base, nredis_publishers);
+  }
+  else {
+    const size_t nshards = atomic_load(&nredis_shards);
+    for (size_t i = 0; i != nshards; ++i) {
+      if (!worker_add_shard(worker, &redis_shards[i])) {
+        return false;
+      }
+    }
+  }
+  if (worker->broker == NULL) {
+    ERROR("Failed to create the broker for worker %zu\n", index);
+    return false;
+  }
+  // Split the history memory cap evenly between the workers, so each can evict on its own.
+  struct pubsub_history_options history = {
+    .max_nmessages = (size_t)history_nmessages,
+    .max_age = {.tv_sec = history_seconds, .tv_usec = 0},
+    .max_nbytes = (size_t)history_max_mb * 1024 * 1024 / nthreads,
+  };
+  if (history_nmessages == 0 && history_seconds != 0) {
+    history.max_nmessages = PUBSUB_MANAGER_MAX_HISTORY_NMESSAGES;
+  }
+  worker->pubsub_mgr = pubsub_manager_create(worker->event_base, worker->broker, &history);
+  if (worker->pubsub_mgr == NULL) {
+    ERROR("Failed to create the pubsub manager for worker %zu\n", index);
+    return false;
+  }
+
+  return true;
+}
+
+
+static void
+worker_destroy(struct worker *const worker) {
+  if (worker->pubsub_mgr != NULL) {
+    pubsub_manager_destroy(worker->pubsub_mgr);
+    worker->pubsub_mgr = NULL;
+  }
+  if (worker->broker != NULL) {
+    broker_destroy(worker->broker);
+  }
+  for (size_t i = 0; i != worker->nshards; ++i) {
+    publisher_pool_destroy(worker->publishers[i]);
+  }
+  if (worker->listen_event != NULL) {
+    event_free(worker->listen_event);
+  }
+  if (worker->stats_event != NULL) {
+    on_timeout_stats(-1, 0, worker);
+    event_free(worker->stats_event);
+  }
+  if (worker->flusher != NULL) {
+    websocket_flusher_destroy(worker->flusher);
+  }
+  if (worker->event_base != NULL) {
+    event_base_free(worker->event_base);
+  }
+  if (worker->listen_fd != -1 && close(worker->listen_fd) == -1) {
+    ERROR("close(listen_fd) failed: %s", strerror(errno));
+  }
+}
+
+
+static void *
+worker_run(void *const arg) {
+  struct worker *const worker = (struct worker *)arg;
+
+  // Run the worker's libevent event loop.
+  INFO("Starting libevent event loop for worker %zu\n", worker->index);
+  if (event_base_dispatch(worker->event_base) == -1) {
+    ERROR("Failed to run libevent event loop for worker %zu\n", worker->index);
+  }
+
+  // Free up the connections owned by this thread.
+  client_connection_destroy_all();
+
+  return NULL;
+}
+
+
+// ================================================================================================
+// Redis shards.
+// ================================================================================================
+/**
+ * Adds the shard at `host`:`port` which is named `name` on the shard ring, unless a shard of that
+ * name is already known, and sets `*index` to its index.
+ **/
+static bool
+add_named_redis_shard(const char *const name, const char *const host, const uint16_t port, size_t *const index) {
+  const size_t nshards = atomic_load(&nredis_shards);
+  for (size_t i = 0; i != nshards; ++i) {
+    if (strcmp(redis_shards[i].name, name) == 0) {
+      *index = i;
+      return true;
+    }
+  }
+  if (nshards == SHARD_RING_MAX_SHARDS) {
+    ERROR("Too many redis shards to add %s. The limit is %d\n", name, SHARD_RING_MAX_SHARDS);
+    return false;
+  }
+
+  struct redis_shard *const shard = &redis_shards[nshards];
+  shard->name = strdup(name);
+  shard->host = strdup(host);
+  shard->port = port;
+  if (shard->name == NULL || shard->host == NULL) {
+    ERROR0("strdup failed.\n");
+    free(shard->name);
+    free(shard->host);
+    return false;
+  }
+  atomic_store(&nredis_shards, nshards + 1);
+  *index = nshards;
+  return true;
+}
+
+
+/**
+ * Adds the shard named "host:port", unless it is already known, and sets `*index` to its index.
+ **/
+static bool
+add_redis_shard(const char *const name, size_t *const index) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  char canonical[SHARD_RING_NAME_MAX_NBYTES + 8];
+  uint16_t port;
+
+  if (shard_ring_parse_name(name, host, &port) != STATUS_OK) {
+    ERROR("Invalid redis shard '%s'. Not of the form host:port\n", name);
+    return false;
+  }
+  snprintf(canonical, sizeof(canonical), "%s:%d", host, port);
+  return add_named_redis_shard(canonical, host, port, index);
+}
+
+
+/**
+ * Reads the shards file, and adds the shards which are new to it. The hub starts SUBSCRIBEing to
+ * the moved channels on a new shard straight away, and the workers switch their publishes over to
+ * it after SHARD_SWITCH_DELAY. Shards can't be removed, so shards missing from the file are kept.
+ **/
+static void
+load_redis_shards(void) {
+  bool is_listed[SHARD_RING_MAX_SHARDS] = {false};
+  char line[1024];
+  size_t index;
+
+  FILE *const f = fopen(redis_shards_file, "r");
+  if (f == NULL) {
+    ERROR("Failed to open redis shards file %s: %s\n", redis_shards_file, strerror(errno));
+    return;
+  }
+  const size_t nbefore = atomic_load(&nredis_shards);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *start = line, *end = line + strlen(line);
+    while (isspace((unsigned char)*start)) {
+      ++start;
+    }
+    while (end != start && isspace((unsigned char)end[-1])) {
+      --end;
+    }
+    *end = '\0';
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+    if (add_redis_shard(start, &index)) {
+      is_listed[index] = true;
+    }
+  }
+  fclose(f);
+
+  for (size_t i = 1; i != nbefore; ++i) {
+    if (!is_listed[i]) {
+      WARNING("Redis shard %s is no longer listed, but shards can't be removed. Keeping it.\n", redis_shards[i].name);
+    }
+  }
+  const size_t nafter = atomic_load(&nredis_shards);
+  if (nafter == nbefore) {
+    return;
+  }
+  for (size_t i = nbefore; i != nafter; ++i) {
+    INFO("Adding redis shard %s\n", redis_shards[i].name);
+    if (pubsub_hub_add_shard(pubsub_hub, redis_shards[i].host, redis_shards[i].port) != STATUS_OK) {
+      ERROR("Failed to add redis shard %s to the pubsub hub\n", redis_shards[i].name);
+    }
+  }
+  // Workers which aren't running yet pick up all of the shards when they are set up.
+  for (unsigned int i = 0; workers != NULL && i != nthreads; ++i) {
+    if (event_base_once(workers[i].event_base, -1, EV_TIMEOUT, &on_add_shards, &workers[i], &SHARD_SWITCH_DELAY) == -1) {
+      ERROR("Failed to schedule the new redis shards for worker %u\n", i);
+    }
+  }
+}
+
+
+// ================================================================================================
+// Replicas and sentinels.
+// ================================================================================================
+/**
+ * Calls `fn` with each address of a comma separated list of "host:port"s.
+ **/
+static bool
+for_each_address(const char *const list, bool (*const fn)(const char *host, uint16_t port)) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  uint16_t port;
+  char *save;
+  bool is_ok = true;
+
+  char *const copy = strdup(list);
+  if (copy == NULL) {
+    ERROR0("strdup failed.\n");
+    return false;
+  }
+  for (char *address = strtok_r(copy, ",", &save); address != NULL && is_ok; address = strtok_r(NULL, ",", &save)) {
+    if (shard_ring_parse_name(address, host, &port) != STATUS_OK) {
+      ERROR("Invalid redis address '%s'. Not of the form host:port\n", address);
+      is_ok = false;
+    }
+    else {
+      is_ok = fn(host, port);
+    }
+  }
+  free(copy);
+  return is_ok;
+}
+
+
+static bool
+add_replica(const char *const host, const uint16_t port) {
+  if (pubsub_hub_add_candidate(pubsub_hub, host, port) != STATUS_OK) {
+    ERROR("Failed to add redis replica %s:%d\n", host, port);
+    return false;
+  }
+  return true;
+}
+
+
+static bool
+add_sentinel(const char *const host, const uint16_t port) {
+  if (sentinel_add(sentinel, host, port) != STATUS_OK) {
+    ERROR("Failed to add redis sentinel %s:%d\n", host, port);
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Called on the main thread when the sentinels report a new primary. The workers move their
+ * publishers over to it, and the hub its subscriptions.
+ **/
+static void
+on_sentinel_primary(const char *const host, const uint16_t port, void *const arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&primary_lock);
+  snprintf(primary_host, sizeof(primary_host), "%s", host);
+  primary_port = port;
+  pthread_mutex_unlock(&primary_lock);
+  if (pubsub_hub_move_primary(pubsub_hub, host, port) != STATUS_OK) {
+    ERROR("Failed to move the pubsub hub's subscriptions to the new redis primary %s:%d\n", host, port);
+  }
+  for (unsigned int i = 0; workers != NULL && i != nthreads; ++i) {
+    if (event_base_once(workers[i].event_base, -1, EV_TIMEOUT, &on_primary_moved, &workers[i], NULL) == -1) {
+      ERROR("Failed to schedule the move to the new redis primary for worker %u\n", i);
+    }
   }
 }
 
 
+static void
+on_sighup(const evutil_socket_t signal, const short events, void *const arg) {
+  (void)signal;
+  (void)events;
+  (void)arg;
+  INFO("Received SIGHUP. Reloading redis shards from %s\n", redis_shards_file);
+  load_redis_shards();
+}
+
+
 // ================================================================================================
 // main.
 // ================================================================================================
 int
 main(int argc, char **argv) {
-  struct event connect_event;
-  int listen_fd;
-  sigset_t sigset;
-  struct sigaction siginfo;
+  struct event *sigint_event, *sigterm_event, *sighup_event = NULL;
+  size_t index;
+  unsigned int ninitialised = 0, nstarted = 0;
+  int ret = 1;
 
   // Parse argv.
   if (!parse_argv(argc, argv)) {
@@ -318,25 +1110,19 @@ main(int argc, char **argv) {
   // Setup logging.
   logging_open(log_path);
 
-  // Ignore SIGPIPE and die gracefully on SIGINT and SIGTERM.
+  // Ignore SIGPIPE.
   if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
     perror("call to signal() failed");
     return 1;
   }
-  sigemptyset(&sigset);
-  siginfo.sa_handler = sighandler;
-  siginfo.sa_mask = sigset;
-  siginfo.sa_flags = SA_RESTART;
-  if (sigaction(SIGINT, &siginfo, NULL) == -1) {
-    perror("sigaction(SIGINT) failed");
-    return 1;
-  }
-  if (sigaction(SIGTERM, &siginfo, NULL) == -1) {
-    perror("sigaction(SIGTERM) failed");
+
+  // Make libevent safe to use across the main, hub and worker threads.
+  if (evthread_use_pthreads() == -1) {
+    ERROR0("Failed to enable libevent pthreads support\n");
     return 1;
   }
 
-  // Create a libevent base object.
+  // Create a libevent base object. The main thread's loop only handles signals.
   INFO("libevent version: %s\n", event_get_version());
   server_loop = event_base_new();
   if (server_loop == NULL) {
@@ -345,6 +1131,14 @@ main(int argc, char **argv) {
   }
   INFO("libevent is using %s for events.\n", event_base_get_method(server_loop));
 
+  // Die gracefully on SIGINT and SIGTERM.
+  sigint_event = evsignal_new(server_loop, SIGINT, &on_signal, NULL);
+  sigterm_event = evsignal_new(server_loop, SIGTERM, &on_signal, NULL);
+  if (sigint_event == NULL || sigterm_event == NULL || event_add(sigint_event, NULL) == -1 || event_add(sigterm_event, NULL) == -1) {
+    ERROR0("Failed to setup signal handling\n");
+    return 1;
+  }
+
   // Initialise and configure OpenSSL.
   if (use_ssl) {
     if (ssl_certificate_chain_path == NULL) {
@@ -375,70 +1169,155 @@ main(int argc, char **argv) {
     return 1;
   }
 
-  // Create a socket connection to listen on.
-  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_fd == -1) {
-    perror("Failed to create a socket");
-    return 1;
-  }
-  {
-    int tmp = 1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(tmp)) == -1) {
-      perror("Failed to enable socket address reuse on listening socket");
+  // Connect to redis for the shared subscriptions, or set up the exchange between the workers.
+  if (use_local_broker) {
+    local_exchange = local_exchange_create();
+    if (local_exchange == NULL) {
+      ERROR0("Failed to setup the local exchange.\n");
       return 1;
     }
   }
-  if (bind(listen_fd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) == -1) {
-    perror("Failed to bind the listening socket to the address");
-    return 1;
-  }
+  else {
+    // Find the primary from the sentinels, which then stands in for redis_host:redis_port.
+    if (redis_sentinels != NULL && redis_backend == REDIS_BACKEND_CLUSTER) {
+      WARNING0("A redis cluster fails over by itself, without sentinels. Ignoring the sentinels.\n");
+    }
+    else if (redis_sentinels != NULL) {
+      sentinel = sentinel_create(server_loop, redis_primary_name, &on_sentinel_primary, NULL);
+      if (sentinel == NULL || !for_each_address(redis_sentinels, &add_sentinel)) {
+        return 1;
+      }
+      if (sentinel_lookup(sentinel, primary_host, &primary_port) != STATUS_OK) {
+        ERROR("None of the redis sentinels know the primary '%s'\n", redis_primary_name);
+        return 1;
+      }
+      redis_host = primary_host;
+      redis_port = primary_port;
+      if (redis_unix_socket != NULL) {
+        WARNING0("The redis primary found by the sentinels can't be published to over a unix domain socket. Ignoring the socket.\n");
+        redis_unix_socket = NULL;
+      }
+    }
 
-  // Set the connection queue size.
-  if (listen(listen_fd, 8) == -1) {
-    perror("Failed to create a socket listening backlog queue");
-    return 1;
-  }
+    const struct timeval channel_linger = {.tv_sec = channel_linger_ms / 1000, .tv_usec = (channel_linger_ms % 1000) * 1000};
+    // The first shard is redis_host:redis_port, named after its address, or after the primary with
+    // sentinels, as its address changes on a failover.
+    char first_shard[SHARD_RING_NAME_MAX_NBYTES + 8];
+    snprintf(first_shard, sizeof(first_shard), "%s:%d", redis_host, redis_port);
+    const char *const first_shard_name = (sentinel != NULL) ? redis_primary_name : first_shard;
+    pubsub_hub = pubsub_hub_create(redis_host, redis_port, first_shard_name, (channel_linger_ms == 0) ? NULL : &channel_linger, redis_backend);
+    if (pubsub_hub == NULL) {
+      ERROR0("Failed to setup async connection to redis.\n");
+      return 1;
+    }
+    if (redis_replicas != NULL && redis_backend == REDIS_BACKEND_CLUSTER) {
+      WARNING0("A redis cluster's channels are subscribed on its primaries. Ignoring the replicas.\n");
+    }
+    else if (redis_replicas != NULL && !for_each_address(redis_replicas, &add_replica)) {
+      return 1;
+    }
 
-  // Set the socket to be non-blocking.
-  if (set_nonblocking(listen_fd) == -1) {
-    perror("Failed to set the listening socket to be non-blocking");
-    return 1;
+    // The hub has already added the first shard. Reload the rest of the shards on SIGHUP.
+    if (!add_named_redis_shard(first_shard_name, redis_host, redis_port, &index)) {
+      return 1;
+    }
+    if (redis_shards_file != NULL && redis_backend == REDIS_BACKEND_CLUSTER) {
+      WARNING0("A redis cluster's shards are found from its slots, not from a shards file. Ignoring.\n");
+    }
+    else if (redis_shards_file != NULL) {
+      load_redis_shards();
+      sighup_event = evsignal_new(server_loop, SIGHUP, &on_sighup, NULL);
+      if (sighup_event == NULL || event_add(sighup_event, NULL) == -1) {
+        ERROR0("Failed to setup SIGHUP handling\n");
+        return 1;
+      }
+    }
+    if (suppress_ttl_ms != 0 && redis_backend != REDIS_BACKEND_PUBSUB) {
+      WARNING0("Dropping publishes to channels without subscribers is only supported by the pubsub backend. Ignoring.\n");
+    }
+    if (use_local_delivery && redis_backend != REDIS_BACKEND_PUBSUB) {
+      WARNING0("Local delivery is only supported by the pubsub backend. Ignoring.\n");
+    }
+    else if (use_local_delivery) {
+      // The node ID tags this process's messages, so it needs to be unique among the processes
+      // sharing the redis server. Zero means local delivery is off.
+      uint64_t node_id = 0;
+      while (node_id == 0) {
+        evutil_secure_rng_get_bytes(&node_id, sizeof(node_id));
+      }
+      pubsub_hub_set_node_id(pubsub_hub, node_id);
+      INFO("Local delivery is on. node_id=%016" PRIx64 "\n", node_id);
+    }
   }
 
-  // Bind callbacks to the libevent loop for activity on the listening socket's file descriptor.
-  event_set(&connect_event, listen_fd, EV_READ | EV_PERSIST, on_accept, server_loop);
-  event_base_set(server_loop, &connect_event);
-  if (event_add(&connect_event, NULL) == -1) {
-    ERROR0("Failed to schedule a socket listen into the main event loop\n");
-    return 1;
+  // Setup each of the workers. All of them need to be attached to their brokers before any of them start.
+  workers = calloc(nthreads, sizeof(struct worker));
+  if (workers == NULL) {
+    ERROR0("calloc failed.\n");
+    goto cleanup;
+  }
+  for (; ninitialised != nthreads; ++ninitialised) {
+    if (!worker_init(&workers[ninitialised], ninitialised, &bind_addr)) {
+      worker_destroy(&workers[ninitialised]);
+      goto cleanup;
+    }
   }
 
-  // Connect to redis.
-  pubsub_mgr = pubsub_manager_create(redis_host, redis_port, server_loop);
-  if (pubsub_mgr == NULL) {
-    ERROR0("Failed to setup async connection to redis.\n");
-    return 1;
+  // Start the hub's ingest thread and the worker threads, and follow the primary.
+  if (pubsub_hub != NULL && pubsub_hub_start(pubsub_hub) != STATUS_OK) {
+    goto cleanup;
+  }
+  if (sentinel != NULL && sentinel_start(sentinel) != STATUS_OK) {
+    goto cleanup;
+  }
+  for (; nstarted != nthreads; ++nstarted) {
+    if (pthread_create(&workers[nstarted].thread, NULL, &worker_run, &workers[nstarted]) != 0) {
+      ERROR("Failed to start worker thread %u\n", nstarted);
+      on_signal(SIGTERM, 0, NULL);
+      goto cleanup;
+    }
   }
 
-  // Run the libevent event loop.
-  INFO("Starting libevent event loop, listening on %s:%u\n", bind_host, bind_port);
+  // Run the main libevent event loop until we're signalled to shut down.
+  INFO("Starting libevent event loop, listening on %s:%u with %u threads\n", bind_host, bind_port, nthreads);
   if (event_base_dispatch(server_loop) == -1) {
     ERROR0("Failed to run libevent event loop\n");
   }
+  ret = 0;
 
-  // Free up the connections.
-  client_connection_destroy_all();
+cleanup:
+  // Wait for the workers to finish, stop the hub handing them messages and free them up.
+  for (unsigned int i = 0; i != nstarted; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (pubsub_hub != NULL) {
+    pubsub_hub_stop(pubsub_hub);
+  }
+  for (unsigned int i = 0; i != ninitialised; ++i) {
+    worker_destroy(&workers[i]);
+  }
+  free(workers);
 
   // Disconnect from redis.
-  pubsub_manager_destroy(pubsub_mgr);
+  if (pubsub_hub != NULL) {
+    pubsub_hub_destroy(pubsub_hub);
+  }
+  if (local_exchange != NULL) {
+    local_exchange_destroy(local_exchange);
+  }
+  for (size_t i = 0; i != nredis_shards; ++i) {
+    free(redis_shards[i].name);
+    free(redis_shards[i].host);
+  }
 
   // Free up the libevent event loop.
-  event_base_free(server_loop);
-
-  // Close the main socket.
-  if (close(listen_fd) == -1) {
-    ERROR("close(listen_fd) failed: %s", strerror(errno));
+  sentinel_destroy(sentinel);
+  event_free(sigint_event);
+  event_free(sigterm_event);
+  if (sighup_event != NULL) {
+    event_free(sighup_event);
   }
+  event_base_free(server_loop);
 
   // Teardown OpenSSL.
   if (use_ssl) {
@@ -449,5 +1328,5 @@ main(int argc, char **argv) {
   // Teardown logging.
   logging_close();
 
-  return 0;
+  return ret;
 }
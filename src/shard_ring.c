@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "logging.h"
+#include "shard_ring.h"
+#include "xxhash.h"
+
+
+struct point {
+  uint64_t hash;
+  uint64_t tiebreak;  // A second hash of the shard's name, in case two points have the same hash.
+  size_t shard;
+};
+
+
+struct shard_ring {
+  size_t nshards;
+  char *names[SHARD_RING_MAX_SHARDS];
+  size_t npoints;
+  struct point points[SHARD_RING_MAX_SHARDS * SHARD_RING_NVNODES];
+};
+
+
+// Orders the points by hash, breaking the (vanishingly unlikely) ties by a hash of the shard's name
+// so that the order doesn't depend on the order that the shards were added in.
+static int
+point_compare(const void *const a, const void *const b) {
+  const struct point *const pa = a;
+  const struct point *const pb = b;
+  if (pa->hash != pb->hash) {
+    return (pa->hash < pb->hash) ? -1 : 1;
+  }
+  else if (pa->tiebreak != pb->tiebreak) {
+    return (pa->tiebreak < pb->tiebreak) ? -1 : 1;
+  }
+  return 0;
+}
+
+
+struct shard_ring *
+shard_ring_create(void) {
+  struct shard_ring *const ring = malloc(sizeof(struct shard_ring));
+  if (ring == NULL) {
+    ERROR0("malloc failed.\n");
+    return NULL;
+  }
+  ring->nshards = 0;
+  ring->npoints = 0;
+  return ring;
+}
+
+
+void
+shard_ring_destroy(struct shard_ring *const ring) {
+  if (ring == NULL) {
+    return;
+  }
+  for (size_t i = 0; i != ring->nshards; ++i) {
+    free(ring->names[i]);
+  }
+  free(ring);
+}
+
+
+/**
+ * Adds a shard to the ring, and sets `*index` to its index, which is the number of shards which
+ * were added before it. Adding a shard which is already on the ring is an error.
+ **/
+enum status
+shard_ring_add(struct shard_ring *const ring, const char *const name, size_t *const index) {
+  if (ring == NULL || name == NULL || index == NULL) {
+    return STATUS_EINVAL;
+  }
+  else if (ring->nshards == SHARD_RING_MAX_SHARDS) {
+    return STATUS_BAD;
+  }
+  for (size_t i = 0; i != ring->nshards; ++i) {
+    if (strcmp(ring->names[i], name) == 0) {
+      return STATUS_EINVAL;
+    }
+  }
+
+  char *const copy = strdup(name);
+  if (copy == NULL) {
+    ERROR0("strdup failed.\n");
+    return STATUS_ENOMEM;
+  }
+  const size_t shard = ring->nshards++;
+  ring->names[shard] = copy;
+  const size_t name_nbytes = strlen(name);
+  const uint64_t tiebreak = XXH64(name, name_nbytes, UINT64_MAX);
+  for (uint64_t i = 0; i != SHARD_RING_NVNODES; ++i) {
+    ring->points[ring->npoints].hash = XXH64(name, name_nbytes, i);
+    ring->points[ring->npoints].tiebreak = tiebreak;
+    ring->points[ring->npoints].shard = shard;
+    ++ring->npoints;
+  }
+
+  // Shards are only added rarely, so the ring is simply sorted again.
+  qsort(ring->points, ring->npoints, sizeof(struct point), &point_compare);
+
+  *index = shard;
+  return STATUS_OK;
+}
+
+
+/**
+ * Returns the index of the shard that the channel lives on. The ring must have at least one shard.
+ **/
+size_t
+shard_ring_find(const struct shard_ring *const ring, const char *const channel, const size_t channel_nbytes) {
+  const uint64_t hash = XXH64(channel, channel_nbytes, 0);
+
+  // Find the first point at or after the hash, wrapping around to the first point.
+  size_t low = 0, high = ring->npoints;
+  while (low != high) {
+    const size_t mid = low + (high - low) / 2;
+    if (ring->points[mid].hash < hash) {
+      low = mid + 1;
+    }
+    else {
+      high = mid;
+    }
+  }
+  return ring->points[(low == ring->npoints) ? 0 : low].shard;
+}
+
+
+size_t
+shard_ring_nshards(const struct shard_ring *const ring) {
+  return ring->nshards;
+}
+
+
+/**
+ * Splits a "host:port" shard name on its last colon, so that IPv6 hosts are allowed. `host` must
+ * have room for SHARD_RING_NAME_MAX_NBYTES bytes.
+ **/
+enum status
+shard_ring_parse_name(const char *const name, char *const host, uint16_t *const port) {
+  char *end;
+
+  const char *const colon = strrchr(name, ':');
+  if (colon == NULL || colon == name || (size_t)(colon - name) >= SHARD_RING_NAME_MAX_NBYTES) {
+    return STATUS_EINVAL;
+  }
+  const long value = strtol(colon + 1, &end, 10);
+  if (end == colon + 1 || *end != '\0' || value <= 0 || value > 65535) {
+    return STATUS_EINVAL;
+  }
+  memcpy(host, name, (size_t)(colon - name));
+  host[colon - name] = '\0';
+  *port = (uint16_t)value;
+  return STATUS_OK;
+}
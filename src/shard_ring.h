@@ -0,0 +1,30 @@
+/**
+ * A consistent hash ring which maps channels to the redis shards that they live on. Each shard is
+ * placed on the ring at SHARD_RING_NVNODES points hashed from its name, and a channel belongs to the
+ * shard of the first point at or after the channel's own hash. Adding a shard only moves the
+ * channels which now hash to its points, about 1/N of them, and moves them all to the new shard.
+ *
+ * Shards are placed by name rather than by index, so every process given the same set of shard
+ * names agrees on where each channel lives, whatever order the shards were added in.
+ **/
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "status.h"
+
+#define SHARD_RING_MAX_SHARDS (64)
+#define SHARD_RING_NVNODES (160)
+#define SHARD_RING_NAME_MAX_NBYTES (256)  // Bounds a shard's "host:port" name, including the NUL.
+
+// Forward declaration.
+struct shard_ring;
+
+
+struct shard_ring *shard_ring_create(void);
+void               shard_ring_destroy(struct shard_ring *ring);
+enum status        shard_ring_add(struct shard_ring *ring, const char *name, size_t *index);
+size_t             shard_ring_find(const struct shard_ring *ring, const char *channel, size_t channel_nbytes);
+size_t             shard_ring_nshards(const struct shard_ring *ring);
+enum status        shard_ring_parse_name(const char *name, char *host, uint16_t *port);
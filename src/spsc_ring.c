@@ -0,0 +1,107 @@
+/**
+ * The producer only ever writes `tail` and the consumer only ever writes `head`. Each side keeps a
+ * cached copy of the other side's index so that the shared cache lines are only touched when the
+ * ring looks full (for the producer) or empty (for the consumer).
+ **/
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "logging.h"
+#include "spsc_ring.h"
+
+#define CACHE_LINE_NBYTES (64)
+
+
+struct spsc_ring {
+  size_t mask;
+
+  // Consumer state.
+  alignas(CACHE_LINE_NBYTES) atomic_size_t head;
+  size_t cached_tail;
+
+  // Producer state.
+  alignas(CACHE_LINE_NBYTES) atomic_size_t tail;
+  size_t cached_head;
+
+  alignas(CACHE_LINE_NBYTES) void *slots[];
+};
+
+
+struct spsc_ring *
+spsc_ring_create(const size_t capacity) {
+  size_t nslots;
+
+  if (capacity == 0 || capacity > SIZE_MAX / 2) {
+    return NULL;
+  }
+
+  // Round the capacity up to a power of two so the slot index is a mask.
+  for (nslots = 1; nslots < capacity; nslots <<= 1) {
+  }
+
+  size_t nbytes = sizeof(struct spsc_ring) + nslots * sizeof(void *);
+  nbytes = (nbytes + CACHE_LINE_NBYTES - 1) & ~((size_t)CACHE_LINE_NBYTES - 1);
+  struct spsc_ring *const ring = aligned_alloc(CACHE_LINE_NBYTES, nbytes);
+  if (ring == NULL) {
+    ERROR0("aligned_alloc failed.\n");
+    return NULL;
+  }
+  memset(ring, 0, sizeof(struct spsc_ring));
+  ring->mask = nslots - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+
+  return ring;
+}
+
+
+enum status
+spsc_ring_destroy(struct spsc_ring *const ring) {
+  if (ring == NULL) {
+    return STATUS_EINVAL;
+  }
+  free(ring);
+  return STATUS_OK;
+}
+
+
+/**
+ * Pushes a value onto the ring. Must only be called from the producer thread. Returns false if the
+ * ring is full.
+ **/
+bool
+spsc_ring_push(struct spsc_ring *const ring, void *const value) {
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail - ring->cached_head > ring->mask) {
+    ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - ring->cached_head > ring->mask) {
+      return false;
+    }
+  }
+
+  ring->slots[tail & ring->mask] = value;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+
+/**
+ * Pops a value off the ring. Must only be called from the consumer thread. Returns NULL if the ring
+ * is empty.
+ **/
+void *
+spsc_ring_pop(struct spsc_ring *const ring) {
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head == ring->cached_tail) {
+    ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == ring->cached_tail) {
+      return NULL;
+    }
+  }
+
+  void *const value = ring->slots[head & ring->mask];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return value;
+}
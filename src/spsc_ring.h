@@ -0,0 +1,18 @@
+/**
+ * A bounded, lock-free, single-producer/single-consumer ring buffer of pointers.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "status.h"
+
+// Forwards declaration.
+struct spsc_ring;
+
+
+struct spsc_ring *spsc_ring_create(size_t capacity);
+enum status       spsc_ring_destroy(struct spsc_ring *ring);
+bool              spsc_ring_push(struct spsc_ring *ring, void *value);
+void *            spsc_ring_pop(struct spsc_ring *ring);
@@ -0,0 +1,127 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "streams.h"
+
+
+static const char *
+parse_uint64(const char *str, const char *const end, uint64_t *const value) {
+  const char *const start = str;
+  *value = 0;
+  for ( ; str != end && *str >= '0' && *str <= '9'; ++str) {
+    const uint64_t digit = (uint64_t)(*str - '0');
+    if (*value > (UINT64_MAX - digit) / 10) {
+      return NULL;
+    }
+    *value = 10 * *value + digit;
+  }
+  return (str == start) ? NULL : str;
+}
+
+
+/**
+ * Parses a stream ID of the form `<ms>-<seq>`, or just `<ms>` for the first ID of a millisecond.
+ **/
+enum status
+stream_id_parse(struct stream_id *const id, const char *const str, const size_t nbytes) {
+  const char *const end = str + nbytes;
+
+  if (id == NULL || str == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  const char *upto = parse_uint64(str, end, &id->ms);
+  if (upto == NULL) {
+    return STATUS_EINVAL;
+  }
+  id->seq = 0;
+  if (upto != end && *upto == '-') {
+    upto = parse_uint64(upto + 1, end, &id->seq);
+  }
+  return (upto == end) ? STATUS_OK : STATUS_EINVAL;
+}
+
+
+/**
+ * Writes the ID to `buffer`, which must hold STREAM_ID_MAX_NBYTES, and returns its length.
+ **/
+size_t
+stream_id_format(const struct stream_id *const id, char *const buffer) {
+  return (size_t)snprintf(buffer, STREAM_ID_MAX_NBYTES, "%" PRIu64 "-%" PRIu64, id->ms, id->seq);
+}
+
+
+int
+stream_id_compare(const struct stream_id *const a, const struct stream_id *const b) {
+  if (a->ms != b->ms) {
+    return (a->ms < b->ms) ? -1 : 1;
+  }
+  else if (a->seq != b->seq) {
+    return (a->seq < b->seq) ? -1 : 1;
+  }
+  return 0;
+}
+
+
+bool
+stream_id_is_set(const struct stream_id *const id) {
+  return id->ms != 0 || id->seq != 0;
+}
+
+
+/**
+ * Computes the smallest ID after `id`, for reading a range which excludes `id` itself.
+ **/
+void
+stream_id_next(const struct stream_id *const id, struct stream_id *const next) {
+  if (id->seq == UINT64_MAX) {
+    next->ms = id->ms + 1;
+    next->seq = 0;
+  }
+  else {
+    next->ms = id->ms;
+    next->seq = id->seq + 1;
+  }
+}
+
+
+/**
+ * Parses the entries of an XRANGE reply, or of a single stream within an XREAD reply, which are
+ * arrays of [id, [field, value, ...]]. Entries without a `data` field are skipped. Returns the
+ * number of entries written to `entries`.
+ **/
+size_t
+stream_entries_parse(const struct redisReply *const reply, struct stream_entry *const entries, const size_t max_nentries) {
+  size_t nentries = 0;
+
+  if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+    return 0;
+  }
+
+  for (size_t i = 0; i != reply->elements && nentries != max_nentries; ++i) {
+    const redisReply *const entry = reply->element[i];
+    if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2 || entry->element[0]->type != REDIS_REPLY_STRING || entry->element[1]->type != REDIS_REPLY_ARRAY) {
+      continue;
+    }
+    struct stream_entry *const out = &entries[nentries];
+    if (stream_id_parse(&out->id, entry->element[0]->str, entry->element[0]->len) != STATUS_OK) {
+      continue;
+    }
+    const redisReply *const fields = entry->element[1];
+    for (size_t j = 0; j + 1 < fields->elements; j += 2) {
+      const redisReply *const field = fields->element[j];
+      const redisReply *const value = fields->element[j + 1];
+      if (field->type == REDIS_REPLY_STRING && field->len == sizeof(STREAM_DATA_FIELD) - 1 && memcmp(field->str, STREAM_DATA_FIELD, field->len) == 0 && value->type == REDIS_REPLY_STRING) {
+        out->data = value->str;
+        out->data_nbytes = value->len;
+        ++nentries;
+        break;
+      }
+    }
+  }
+
+  return nentries;
+}
@@ -0,0 +1,48 @@
+/**
+ * Helpers for the redis Streams backend, in which each channel is a stream of the same name.
+ * Messages are XADDed with a single `data` field, and every message is identified by its stream ID
+ * so that a client can resume from the last message that it saw.
+ **/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "status.h"
+
+#define STREAM_ID_MAX_NBYTES (42)  // Two 20 digit numbers, the '-' and a NUL.
+#define STREAM_DATA_FIELD "data"
+
+// Forward declaration.
+struct redisReply;
+
+
+enum redis_backend {
+  REDIS_BACKEND_PUBSUB,   // PUBLISH and SUBSCRIBE.
+  REDIS_BACKEND_STREAMS,  // XADD and XREAD.
+  REDIS_BACKEND_CLUSTER,  // SPUBLISH and SSUBSCRIBE on a redis Cluster.
+};
+
+
+// A stream ID. The zero ID sorts before every real entry, so also stands for "no ID".
+struct stream_id {
+  uint64_t ms;
+  uint64_t seq;
+};
+
+
+// An entry of a stream reply. `data` points into the reply.
+struct stream_entry {
+  struct stream_id id;
+  const char *data;
+  size_t data_nbytes;
+};
+
+
+enum status stream_id_parse(struct stream_id *id, const char *str, size_t nbytes);
+size_t      stream_id_format(const struct stream_id *id, char *buffer);
+int         stream_id_compare(const struct stream_id *a, const struct stream_id *b);
+bool        stream_id_is_set(const struct stream_id *id);
+void        stream_id_next(const struct stream_id *id, struct stream_id *next);
+size_t      stream_entries_parse(const struct redisReply *reply, struct stream_entry *entries, size_t max_nentries);
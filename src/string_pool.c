@@ -1,25 +1,128 @@
+/**
+ * Interned strings are stored inline after their `struct node` header, so the header of a
+ * canonical string can always be recovered from the string pointer itself.
+ *
+ * Nodes are carved out of large slabs by size class, and released nodes are kept on a free list
+ * for their size class rather than being returned to the allocator. Strings too long for the
+ * largest size class are allocated individually.
+ **/
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "hashtable.h"
 #include "logging.h"
 #include "string_pool.h"
 #include "xxhash.h"
 
-#define HASHTABLE_NBUCKETS (2063)  // Arbitrary "large enough" prime.
+#define SLAB_NBYTES (64 * 1024)
+#define NSIZE_CLASSES (4)  // Node sizes of 32, 64, 128 and 256 bytes.
+#define SMALLEST_SIZE_CLASS_NBYTES (32)
 
 
 struct node {
-  char *str;
-  size_t refcount;
-  struct node *next;
+  uint64_t hash;
+  size_t nbytes;  // The length of `str`, excluding the NUL terminator.
+  union {
+    size_t refcount;         // While interned.
+    struct node *next_free;  // While on the size class's free list.
+  };
+  uint8_t size_class;  // NSIZE_CLASSES when the node was allocated individually.
+  char str[];
+};
+
+
+struct slab {
+  struct slab *next;
+  size_t nbytes_used;
+  alignas(max_align_t) char bytes[];
+};
+
+
+// The key used for lookups, as the string being looked up need not be NUL terminated.
+struct key {
+  const char *str;
+  size_t nbytes;
 };
 
 
 struct string_pool {
-  struct node *table[HASHTABLE_NBUCKETS];
+  struct hashtable *table;  // { string : node }
+  struct slab *slabs;       // The first slab is the one currently being carved up.
+  struct node *free_nodes[NSIZE_CLASSES];
 };
 
 
+static inline struct node *
+node_of(const char *const str) {
+  return (struct node *)(str - offsetof(struct node, str));
+}
+
+
+static bool
+node_matches(const void *const value, const void *const key) {
+  const struct node *const node = value;
+  const struct key *const k = key;
+  return node->str == k->str || (node->nbytes == k->nbytes && memcmp(node->str, k->str, k->nbytes) == 0);
+}
+
+
+static struct node *
+node_alloc(struct string_pool *const pool, const size_t nbytes) {
+  struct node *node;
+  uint8_t size_class;
+  size_t class_nbytes = SMALLEST_SIZE_CLASS_NBYTES;
+
+  // Find the smallest size class that fits the node.
+  const size_t node_nbytes = sizeof(struct node) + nbytes + 1;
+  for (size_class = 0; size_class != NSIZE_CLASSES && class_nbytes < node_nbytes; ++size_class) {
+    class_nbytes *= 2;
+  }
+
+  if (size_class == NSIZE_CLASSES) {
+    node = malloc(node_nbytes);
+    if (node == NULL) {
+      ERROR0("malloc failed.\n");
+      return NULL;
+    }
+  }
+  else if (pool->free_nodes[size_class] != NULL) {
+    node = pool->free_nodes[size_class];
+    pool->free_nodes[size_class] = node->next_free;
+  }
+  else {
+    if (pool->slabs == NULL || pool->slabs->nbytes_used + class_nbytes > SLAB_NBYTES) {
+      struct slab *const slab = malloc(sizeof(struct slab) + SLAB_NBYTES);
+      if (slab == NULL) {
+        ERROR0("malloc failed.\n");
+        return NULL;
+      }
+      slab->next = pool->slabs;
+      slab->nbytes_used = 0;
+      pool->slabs = slab;
+    }
+    node = (struct node *)(pool->slabs->bytes + pool->slabs->nbytes_used);
+    pool->slabs->nbytes_used += class_nbytes;
+  }
+
+  node->size_class = size_class;
+  return node;
+}
+
+
+static void
+node_free(struct string_pool *const pool, struct node *const node) {
+  if (node->size_class == NSIZE_CLASSES) {
+    free(node);
+  }
+  else {
+    node->next_free = pool->free_nodes[node->size_class];
+    pool->free_nodes[node->size_class] = node;
+  }
+}
+
+
 struct string_pool *
 string_pool_create(void) {
   struct string_pool *const pool = malloc(sizeof(struct string_pool));
@@ -28,69 +131,67 @@ string_pool_create(void) {
     return NULL;
   }
   memset(pool, 0, sizeof(struct string_pool));
+  pool->table = hashtable_create(&node_matches);
+  if (pool->table == NULL) {
+    free(pool);
+    return NULL;
+  }
   return pool;
 }
 
 
 enum status
 string_pool_destroy(struct string_pool *const pool) {
-  struct node *node, *next;
+  struct node *node;
+  struct slab *slab, *next_slab;
 
   if (pool == NULL) {
     return STATUS_EINVAL;
   }
 
-  for (size_t i = 0; i != HASHTABLE_NBUCKETS; ++i) {
-    for (node = pool->table[i]; node != NULL; ) {
-      next = node->next;
-      free(node->str);
+  for (size_t cursor = 0; (node = hashtable_next(pool->table, &cursor)) != NULL; ) {
+    if (node->size_class == NSIZE_CLASSES) {
       free(node);
-      node = next;
     }
   }
+  hashtable_destroy(pool->table);
+  for (slab = pool->slabs; slab != NULL; slab = next_slab) {
+    next_slab = slab->next;
+    free(slab);
+  }
   free(pool);
 
   return STATUS_OK;
 }
 
 
+/**
+ * Interns `lookup`, returning its canonical version with an incremented refcount.
+ **/
 const char *
 string_pool_get(struct string_pool *const pool, const char *const lookup) {
-  struct node *node, *prev;
-  char *str;
-
   if (pool == NULL || lookup == NULL) {
     return NULL;
   }
 
-  const size_t lookup_length = strlen(lookup);
-  const size_t bucket = XXH64(lookup, lookup_length, 0) % HASHTABLE_NBUCKETS;
-  prev = NULL;
-  for (node = pool->table[bucket]; node != NULL; node = node->next) {
-    if (strcmp(node->str, lookup) == 0) {
-      break;
-    }
-    prev = node;
-  }
+  const struct key key = {.str = lookup, .nbytes = strlen(lookup)};
+  const uint64_t hash = XXH64(key.str, key.nbytes, 0);
+  struct node *node = hashtable_find(pool->table, hash, &key);
 
   // Does the string not already exist in the pool?
   if (node == NULL) {
-    node = malloc(sizeof(struct node));
-    str = malloc(lookup_length + 1);
-    if (node == NULL || str == NULL) {
-      ERROR0("malloc failed.\n");
-      free(node);
-      free(str);
+    node = node_alloc(pool, key.nbytes);
+    if (node == NULL) {
       return NULL;
     }
-    memset(node, 0, sizeof(struct node));
-    node->str = strcpy(str, lookup);
-
-    if (prev == NULL) {
-      pool->table[bucket] = node;
-    }
-    else {
-      prev->next = node;
+    node->hash = hash;
+    node->nbytes = key.nbytes;
+    node->refcount = 0;
+    memcpy(node->str, key.str, key.nbytes);
+    node->str[key.nbytes] = '\0';
+    if (hashtable_insert(pool->table, hash, node) != STATUS_OK) {
+      node_free(pool, node);
+      return NULL;
     }
   }
 
@@ -100,33 +201,55 @@ string_pool_get(struct string_pool *const pool, const char *const lookup) {
 }
 
 
+/**
+ * Returns the canonical version of the `nbytes` long string `lookup` if it is currently interned,
+ * or NULL otherwise. This never allocates and does not change the refcount.
+ **/
+const char *
+string_pool_find(const struct string_pool *const pool, const char *const lookup, const size_t nbytes) {
+  if (pool == NULL || lookup == NULL) {
+    return NULL;
+  }
+
+  const struct key key = {.str = lookup, .nbytes = nbytes};
+  const struct node *const node = hashtable_find(pool->table, XXH64(lookup, nbytes, 0), &key);
+  return (node == NULL) ? NULL : node->str;
+}
+
+
 enum status
 string_pool_release(struct string_pool *const pool, const char *const str) {
-  struct node *node, *prev;
-
   if (pool == NULL || str == NULL) {
     return STATUS_EINVAL;
   }
 
-  const size_t bucket = XXH64(str, strlen(str), 0) % HASHTABLE_NBUCKETS;
-  prev = NULL;
-  for (node = pool->table[bucket]; node != NULL; node = node->next) {
-    if (node->str == str) {
-      --node->refcount;
-      if (node->refcount == 0) {
-        if (prev == NULL) {
-          pool->table[bucket] = node->next;
-        }
-        else {
-          prev->next = node->next;
-        }
-        free(node->str);
-        free(node);
-      }
-      return STATUS_OK;
+  struct node *const node = node_of(str);
+  --node->refcount;
+  if (node->refcount == 0) {
+    const struct key key = {.str = node->str, .nbytes = node->nbytes};
+    if (hashtable_remove(pool->table, node->hash, &key) != node) {
+      return STATUS_BAD;
     }
-    prev = node;
+    node_free(pool, node);
   }
 
-  return STATUS_BAD;
+  return STATUS_OK;
+}
+
+
+/**
+ * Returns the hash of a canonical string, as returned by `string_pool_get` or `string_pool_find`.
+ **/
+uint64_t
+string_pool_hash(const char *const str) {
+  return node_of(str)->hash;
+}
+
+
+/**
+ * Returns the length of a canonical string, as returned by `string_pool_get` or `string_pool_find`.
+ **/
+size_t
+string_pool_length(const char *const str) {
+  return node_of(str)->nbytes;
 }
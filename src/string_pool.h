@@ -1,5 +1,10 @@
+/**
+ * A ref-counted pool of interned strings. Each interned string keeps its length and hash alongside
+ * it, so callers holding a canonical pointer never need to rehash or re-measure it.
+ **/
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "status.h"
@@ -12,4 +17,7 @@ struct string_pool;
 struct string_pool *string_pool_create(void);
 enum status         string_pool_destroy(struct string_pool *pool);
 const char *        string_pool_get(struct string_pool *pool, const char *str);
+const char *        string_pool_find(const struct string_pool *pool, const char *str, size_t nbytes);
 enum status         string_pool_release(struct string_pool *pool, const char *str);
+uint64_t            string_pool_hash(const char *str);
+size_t              string_pool_length(const char *str);
@@ -0,0 +1,185 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "cluster_slots.h"
+#include "logging.h"
+#include "shard_ring.h"
+
+
+static bool
+test_key_slot(void) {
+  // The first two are the examples from the redis Cluster specification.
+  if (cluster_key_slot("123456789", 9) != (0x31c3 & (CLUSTER_NSLOTS - 1)) || cluster_key_slot("foo", 3) != 12182) {
+    ERROR0("slots are wrong\n");
+    return false;
+  }
+
+  // Only a non-empty hashtag is hashed, and only up to the first '}' after the first '{'.
+  static const char *const SAME[][2] = {
+    {"{user1000}.following", "{user1000}.followers"},
+    {"foo{bar}{zap}", "bar"},
+    {"foo{{bar}}zap", "{bar"},
+  };
+  for (size_t i = 0; i != sizeof(SAME) / sizeof(SAME[0]); ++i) {
+    if (cluster_key_slot(SAME[i][0], strlen(SAME[i][0])) != cluster_key_slot(SAME[i][1], strlen(SAME[i][1]))) {
+      ERROR("'%s' and '%s' are in different slots\n", SAME[i][0], SAME[i][1]);
+      return false;
+    }
+  }
+  if (cluster_key_slot("foo{}{bar}", 10) == cluster_key_slot("bar", 3) || cluster_key_slot("foo{bar", 7) == cluster_key_slot("bar", 3)) {
+    ERROR0("an empty or unclosed hashtag was hashed\n");
+    return false;
+  }
+  return true;
+}
+
+
+static bool
+test_parse_redirect(void) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  uint16_t slot, port;
+
+  static const char MOVED[] = "MOVED 3999 127.0.0.1:6381";
+  if (cluster_parse_redirect(MOVED, sizeof(MOVED) - 1, &slot, host, &port) != STATUS_OK || slot != 3999 || strcmp(host, "127.0.0.1") != 0 || port != 6381) {
+    ERROR0("failed to parse MOVED\n");
+    return false;
+  }
+  static const char ASK[] = "ASK 16383 redis-b:7000";
+  if (cluster_parse_redirect(ASK, sizeof(ASK) - 1, &slot, host, &port) != STATUS_OK || slot != 16383 || strcmp(host, "redis-b") != 0 || port != 7000) {
+    ERROR0("failed to parse ASK\n");
+    return false;
+  }
+
+  static const char *const INVALID[] = {"ERR unknown command", "MOVED 16384 a:1", "MOVED x a:1", "MOVED 1 a", "MOVED 1", "MOVED  1 a:1"};
+  for (size_t i = 0; i != sizeof(INVALID) / sizeof(INVALID[0]); ++i) {
+    if (cluster_parse_redirect(INVALID[i], strlen(INVALID[i]), &slot, host, &port) != STATUS_EINVAL) {
+      ERROR("parsed invalid redirect '%s'\n", INVALID[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+struct ranges {
+  size_t nranges;
+  uint16_t starts[4];
+  uint16_t ends[4];
+  char hosts[4][32];
+  uint16_t ports[4];
+};
+
+
+static void
+on_range(const uint16_t start, const uint16_t end, const char *const host, const uint16_t port, void *const arg) {
+  struct ranges *const ranges = arg;
+  if (ranges->nranges != 4) {
+    ranges->starts[ranges->nranges] = start;
+    ranges->ends[ranges->nranges] = end;
+    snprintf(ranges->hosts[ranges->nranges], 32, "%s", host);
+    ranges->ports[ranges->nranges] = port;
+  }
+  ++ranges->nranges;
+}
+
+
+#define STRING(s) {.type = REDIS_REPLY_STRING, .str = s, .len = sizeof(s) - 1}
+#define INTEGER(i) {.type = REDIS_REPLY_INTEGER, .integer = i}
+#define ARRAY(a) {.type = REDIS_REPLY_ARRAY, .elements = sizeof(a) / sizeof(a[0]), .element = a}
+
+static bool
+test_parse_shards(void) {
+  redisReply names[] = {STRING("slots"), STRING("nodes"), STRING("role"), STRING("health"), STRING("endpoint"), STRING("ip"), STRING("port")};
+  redisReply values[] = {STRING("master"), STRING("replica"), STRING("online"), STRING("?"), STRING("10.0.0.1"), STRING("10.0.0.2"), STRING("redis-c")};
+  redisReply integers[] = {INTEGER(0), INTEGER(5460), INTEGER(5461), INTEGER(10922), INTEGER(10923), INTEGER(16383), INTEGER(7000), INTEGER(7001), INTEGER(7002)};
+
+  // A shard whose primary only has an IP address, and a replica listed first.
+  redisReply *replica0_fields[] = {&names[6], &integers[7], &names[5], &values[5], &names[4], &values[5], &names[2], &values[1], &names[3], &values[2]};
+  redisReply *primary0_fields[] = {&names[6], &integers[6], &names[5], &values[4], &names[4], &values[3], &names[2], &values[0], &names[3], &values[2]};
+  redisReply nodes0[] = {ARRAY(replica0_fields), ARRAY(primary0_fields)};
+  redisReply *nodes0_elements[] = {&nodes0[0], &nodes0[1]};
+  redisReply *slots0_elements[] = {&integers[0], &integers[1], &integers[4], &integers[5]};
+  redisReply shard0_values[] = {ARRAY(slots0_elements), ARRAY(nodes0_elements)};
+  redisReply *shard0_fields[] = {&names[0], &shard0_values[0], &names[1], &shard0_values[1]};
+
+  // A shard with a hostname endpoint.
+  redisReply *primary1_fields[] = {&names[6], &integers[8], &names[5], &values[5], &names[4], &values[6], &names[2], &values[0], &names[3], &values[2]};
+  redisReply nodes1[] = {ARRAY(primary1_fields)};
+  redisReply *nodes1_elements[] = {&nodes1[0]};
+  redisReply *slots1_elements[] = {&integers[2], &integers[3]};
+  redisReply shard1_values[] = {ARRAY(slots1_elements), ARRAY(nodes1_elements)};
+  redisReply *shard1_fields[] = {&names[0], &shard1_values[0], &names[1], &shard1_values[1]};
+
+  redisReply shards[] = {ARRAY(shard0_fields), ARRAY(shard1_fields)};
+  redisReply *shards_elements[] = {&shards[0], &shards[1]};
+  const redisReply reply = ARRAY(shards_elements);
+
+  struct ranges ranges = {.nranges = 0};
+  if (cluster_parse_shards(&reply, &on_range, &ranges) != STATUS_OK || ranges.nranges != 3) {
+    ERROR("parsed %zu ranges\n", ranges.nranges);
+    return false;
+  }
+  static const uint16_t STARTS[] = {0, 10923, 5461}, ENDS[] = {5460, 16383, 10922}, PORTS[] = {7000, 7000, 7002};
+  static const char *const HOSTS[] = {"10.0.0.1", "10.0.0.1", "redis-c"};
+  for (size_t i = 0; i != 3; ++i) {
+    if (ranges.starts[i] != STARTS[i] || ranges.ends[i] != ENDS[i] || strcmp(ranges.hosts[i], HOSTS[i]) != 0 || ranges.ports[i] != PORTS[i]) {
+      ERROR("range %zu is %u-%u on %s:%u\n", i, ranges.starts[i], ranges.ends[i], ranges.hosts[i], ranges.ports[i]);
+      return false;
+    }
+  }
+
+  // A shard without an online primary is skipped.
+  primary1_fields[9] = &values[1];
+  ranges.nranges = 0;
+  if (cluster_parse_shards(&reply, &on_range, &ranges) != STATUS_OK || ranges.nranges != 2) {
+    ERROR("parsed %zu ranges without a primary\n", ranges.nranges);
+    return false;
+  }
+
+  // Slots which aren't in pairs are an error.
+  shard1_values[0].elements = 1;
+  if (cluster_parse_shards(&reply, &on_range, &ranges) != STATUS_BAD) {
+    ERROR0("parsed unpaired slots\n");
+    return false;
+  }
+  return true;
+}
+
+#undef STRING
+#undef INTEGER
+#undef ARRAY
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_key_slot,
+  &test_parse_redirect,
+  &test_parse_shards,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
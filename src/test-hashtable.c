@@ -0,0 +1,202 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hashtable.h"
+#include "logging.h"
+
+#define NVALUES (10000)
+
+
+// Values are the integers 1..NVALUES stored as pointers, and the key is the same integer.
+static bool
+matches(const void *const value, const void *const key) {
+  return value == key;
+}
+
+
+// A deliberately poor hash so that values collide and probe runs wrap around the slot array.
+static uint64_t
+hash(const uintptr_t value) {
+  return value / 3;
+}
+
+
+static bool
+test_empty(void) {
+  struct hashtable *const table = hashtable_create(&matches);
+  if (table == NULL) {
+    ERROR0("table is NULL\n");
+    return false;
+  }
+  if (hashtable_size(table) != 0) {
+    ERROR0("size of an empty table is not 0\n");
+    goto fail;
+  }
+  if (hashtable_find(table, hash(1), (void *)1) != NULL) {
+    ERROR0("find on an empty table did not return NULL\n");
+    goto fail;
+  }
+  if (hashtable_remove(table, hash(1), (void *)1) != NULL) {
+    ERROR0("remove on an empty table did not return NULL\n");
+    goto fail;
+  }
+  hashtable_destroy(table);
+  return true;
+
+fail:
+  hashtable_destroy(table);
+  return false;
+}
+
+
+static bool
+test_grow(void) {
+  struct hashtable *const table = hashtable_create(&matches);
+  if (table == NULL) {
+    ERROR0("table is NULL\n");
+    return false;
+  }
+
+  // Every value must stay findable while the table grows underneath it.
+  for (uintptr_t i = 1; i <= NVALUES; ++i) {
+    if (hashtable_insert(table, hash(i), (void *)i) != STATUS_OK) {
+      ERROR("insert %zu failed\n", (size_t)i);
+      goto fail;
+    }
+    for (uintptr_t j = (i > 64) ? i - 64 : 1; j <= i; ++j) {
+      if (hashtable_find(table, hash(j), (void *)j) != (void *)j) {
+        ERROR("find %zu failed after inserting %zu\n", (size_t)j, (size_t)i);
+        goto fail;
+      }
+    }
+  }
+  if (hashtable_size(table) != NVALUES) {
+    ERROR("size %zu != %d\n", hashtable_size(table), NVALUES);
+    goto fail;
+  }
+  for (uintptr_t i = 1; i <= NVALUES; ++i) {
+    if (hashtable_find(table, hash(i), (void *)i) != (void *)i) {
+      ERROR("find %zu failed\n", (size_t)i);
+      goto fail;
+    }
+  }
+  if (hashtable_find(table, hash(NVALUES + 1), (void *)(NVALUES + 1)) != NULL) {
+    ERROR0("find of a missing value did not return NULL\n");
+    goto fail;
+  }
+  hashtable_destroy(table);
+  return true;
+
+fail:
+  hashtable_destroy(table);
+  return false;
+}
+
+
+static bool
+test_remove(void) {
+  struct hashtable *const table = hashtable_create(&matches);
+  if (table == NULL) {
+    ERROR0("table is NULL\n");
+    return false;
+  }
+
+  // Interleave removals with inserts so that some of them land on the table being migrated from.
+  for (uintptr_t i = 1; i <= NVALUES; ++i) {
+    if (hashtable_insert(table, hash(i), (void *)i) != STATUS_OK) {
+      ERROR("insert %zu failed\n", (size_t)i);
+      goto fail;
+    }
+    if (i % 2 == 0 && hashtable_remove(table, hash(i / 2), (void *)(i / 2)) != (void *)(i / 2)) {
+      ERROR("remove %zu failed\n", (size_t)(i / 2));
+      goto fail;
+    }
+  }
+  if (hashtable_size(table) != NVALUES / 2) {
+    ERROR("size %zu != %d\n", hashtable_size(table), NVALUES / 2);
+    goto fail;
+  }
+  for (uintptr_t i = 1; i <= NVALUES; ++i) {
+    void *const expected = (i <= NVALUES / 2) ? NULL : (void *)i;
+    if (hashtable_find(table, hash(i), (void *)i) != expected) {
+      ERROR("find %zu returned the wrong value\n", (size_t)i);
+      goto fail;
+    }
+  }
+  hashtable_destroy(table);
+  return true;
+
+fail:
+  hashtable_destroy(table);
+  return false;
+}
+
+
+static bool
+test_next(void) {
+  struct hashtable *const table = hashtable_create(&matches);
+  if (table == NULL) {
+    ERROR0("table is NULL\n");
+    return false;
+  }
+  uintptr_t expected_sum = 0;
+  for (uintptr_t i = 1; i <= 100; ++i) {
+    if (hashtable_insert(table, hash(i), (void *)i) != STATUS_OK) {
+      ERROR("insert %zu failed\n", (size_t)i);
+      goto fail;
+    }
+    expected_sum += i;
+  }
+
+  // Each value must be visited exactly once, including those not yet migrated.
+  uintptr_t sum = 0;
+  size_t nvisited = 0;
+  void *value;
+  for (size_t cursor = 0; (value = hashtable_next(table, &cursor)) != NULL; ) {
+    sum += (uintptr_t)value;
+    ++nvisited;
+  }
+  if (nvisited != 100 || sum != expected_sum) {
+    ERROR("visited %zu values summing to %zu\n", nvisited, (size_t)sum);
+    goto fail;
+  }
+  hashtable_destroy(table);
+  return true;
+
+fail:
+  hashtable_destroy(table);
+  return false;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_empty,
+  &test_grow,
+  &test_remove,
+  &test_next,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
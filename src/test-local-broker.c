@@ -0,0 +1,269 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "broker.h"
+#include "client_connection.h"
+#include "local_broker.h"
+#include "logging.h"
+#include "pubsub_manager.h"
+#include "websocket.h"
+
+#define NMANAGERS (2)
+#define NCLIENTS (2)              // Per manager: one for channels, one for patterns.
+#define MAX_MESSAGE_NBYTES (125)  // The longest payload with a 7-bit frame length.
+
+
+// A websocket whose frames are written to one end of a bufferevent pair, and read from the other.
+struct client {
+  struct bufferevent *pair[2];
+  struct client_connection connection;
+  struct websocket *ws;
+};
+
+
+// Two workers' managers sharing an exchange. They share an event loop too, which is enough to
+// carry messages through the managers' inboxes.
+struct harness {
+  struct event_base *event_base;
+  struct local_exchange *exchange;
+  struct broker *brokers[NMANAGERS];
+  struct pubsub_manager *mgrs[NMANAGERS];
+  struct client clients[NMANAGERS][NCLIENTS];
+};
+
+static struct harness harness;
+
+
+static void
+on_message(struct websocket *const ws) {
+  (void)ws;
+}
+
+
+static bool
+harness_init(void) {
+  memset(&harness, 0, sizeof(harness));
+  harness.event_base = event_base_new();
+  harness.exchange = local_exchange_create();
+  if (harness.event_base == NULL || harness.exchange == NULL) {
+    ERROR0("failed to create the event loop or the exchange\n");
+    return false;
+  }
+
+  for (size_t i = 0; i != NMANAGERS; ++i) {
+    harness.brokers[i] = local_broker_create(harness.exchange);
+    harness.mgrs[i] = (harness.brokers[i] == NULL) ? NULL : pubsub_manager_create(harness.event_base, harness.brokers[i], NULL);
+    if (harness.mgrs[i] == NULL) {
+      ERROR("failed to create manager %zu\n", i);
+      return false;
+    }
+    for (size_t j = 0; j != NCLIENTS; ++j) {
+      struct client *const client = &harness.clients[i][j];
+      if (bufferevent_pair_new(harness.event_base, 0, client->pair) != 0) {
+        ERROR0("failed to create the bufferevent pair\n");
+        return false;
+      }
+      client->connection.fd = -1;
+      client->connection.event_loop = harness.event_base;
+      client->connection.bev = client->pair[0];
+      client->ws = websocket_init(&client->connection, &on_message);
+      if (client->ws == NULL) {
+        ERROR0("websocket_init failed\n");
+        return false;
+      }
+      client->connection.ws = client->ws;
+      client->ws->in_state = WS_OPEN;
+      bufferevent_enable(client->pair[0], EV_READ | EV_WRITE);
+      bufferevent_enable(client->pair[1], EV_READ | EV_WRITE);
+    }
+  }
+  return true;
+}
+
+
+static void
+harness_destroy(void) {
+  for (size_t i = 0; i != NMANAGERS; ++i) {
+    for (size_t j = 0; j != NCLIENTS; ++j) {
+      struct client *const client = &harness.clients[i][j];
+      if (client->ws != NULL) {
+        pubsub_manager_unsubscribe_all(harness.mgrs[i], client->ws);
+        websocket_destroy(client->ws);
+      }
+      for (size_t k = 0; k != 2; ++k) {
+        if (client->pair[k] != NULL) {
+          bufferevent_free(client->pair[k]);
+        }
+      }
+    }
+    if (harness.mgrs[i] != NULL) {
+      pubsub_manager_destroy(harness.mgrs[i]);
+    }
+    if (harness.brokers[i] != NULL) {
+      broker_destroy(harness.brokers[i]);
+    }
+  }
+  if (harness.exchange != NULL) {
+    local_exchange_destroy(harness.exchange);
+  }
+  if (harness.event_base != NULL) {
+    event_base_free(harness.event_base);
+  }
+}
+
+
+/**
+ * Publishes from manager `i`, and then runs the event loop so that the other manager sends out
+ * what was handed over to its inbox.
+ **/
+static void
+publish(const size_t i, const char *const channel, const char *const message) {
+  if (pubsub_manager_publish(harness.mgrs[i], channel, message) != STATUS_OK) {
+    ERROR("manager %zu failed to publish to '%s'\n", i, channel);
+  }
+  event_base_loop(harness.event_base, EVLOOP_NONBLOCK);
+}
+
+
+/**
+ * Reads the messages which client `j` of manager `i` has been sent since the last call, and checks
+ * that they are `expected`, in order.
+ **/
+static bool
+client_expect(const size_t i, const size_t j, const char *const *const expected, const size_t nexpected) {
+  struct evbuffer *const in = bufferevent_get_input(harness.clients[i][j].pair[1]);
+  char message[MAX_MESSAGE_NBYTES + 1];
+  uint8_t header[2];
+  size_t nmessages = 0;
+  bool is_ok = true;
+
+  while (evbuffer_copyout(in, header, sizeof(header)) == sizeof(header)) {
+    const size_t nbytes = header[1];
+    if (header[0] != 0x81 || nbytes > MAX_MESSAGE_NBYTES || evbuffer_get_length(in) < sizeof(header) + nbytes) {
+      ERROR("client %zu/%zu: unexpected frame header 0x%02x 0x%02x\n", i, j, header[0], header[1]);
+      return false;
+    }
+    evbuffer_drain(in, sizeof(header));
+    evbuffer_remove(in, message, nbytes);
+    message[nbytes] = '\0';
+    if (nmessages >= nexpected || strcmp(message, expected[nmessages]) != 0) {
+      ERROR("client %zu/%zu: message %zu is %s but expected %s\n", i, j, nmessages, message, (nmessages >= nexpected) ? "nothing" : expected[nmessages]);
+      is_ok = false;
+    }
+    ++nmessages;
+  }
+  if (nmessages != nexpected) {
+    ERROR("client %zu/%zu: received %zu messages but expected %zu\n", i, j, nmessages, nexpected);
+    is_ok = false;
+  }
+  return is_ok;
+}
+
+
+static bool
+test_fan_out(void) {
+  static const char *const CHANNEL[] = {"{\"key\":\"news.a\",\"data\":\"m0\"}", "{\"key\":\"news.a\",\"data\":\"m1\"}"};
+  static const char *const PATTERN[] = {
+    "{\"key\":\"news.a\",\"pattern\":\"n?ws.[a-c]*\",\"data\":\"m0\"}",
+    "{\"key\":\"news.a\",\"pattern\":\"n?ws.[a-c]*\",\"data\":\"m1\"}",
+  };
+  bool is_ok = false;
+
+  if (!harness_init()) {
+    goto done;
+  }
+  for (size_t i = 0; i != NMANAGERS; ++i) {
+    pubsub_manager_subscribe(harness.mgrs[i], "news.a", harness.clients[i][0].ws);
+    pubsub_manager_psubscribe(harness.mgrs[i], "n?ws.[a-c]*", harness.clients[i][1].ws);
+  }
+
+  // Every subscriber gets the message once, whichever manager it was published from.
+  for (size_t i = 0; i != NMANAGERS; ++i) {
+    publish(i, "news.a", (i == 0) ? "m0" : "m1");
+    for (size_t j = 0; j != NMANAGERS; ++j) {
+      if (!client_expect(j, 0, CHANNEL + i, 1) || !client_expect(j, 1, PATTERN + i, 1)) {
+        goto done;
+      }
+    }
+  }
+
+  // Channels which the pattern doesn't match don't get through.
+  publish(0, "news.d", "m2");
+  publish(1, "sports.a", "m2");
+  for (size_t j = 0; j != NMANAGERS; ++j) {
+    if (!client_expect(j, 0, NULL, 0) || !client_expect(j, 1, NULL, 0)) {
+      goto done;
+    }
+  }
+  is_ok = true;
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+static bool
+test_unsubscribe(void) {
+  static const char *const CHANNEL[] = {"{\"key\":\"news.b\",\"data\":\"m0\"}"};
+  static const char *const PATTERN[] = {"{\"key\":\"news.b\",\"pattern\":\"news.*\",\"data\":\"m0\"}"};
+  bool is_ok = false;
+
+  if (!harness_init()) {
+    goto done;
+  }
+  for (size_t i = 0; i != NMANAGERS; ++i) {
+    pubsub_manager_subscribe(harness.mgrs[i], "news.b", harness.clients[i][0].ws);
+    pubsub_manager_psubscribe(harness.mgrs[i], "news.*", harness.clients[i][1].ws);
+  }
+
+  // Once the other manager has lost interest, it's only handed the messages that it still wants.
+  pubsub_manager_unsubscribe(harness.mgrs[1], "news.b", harness.clients[1][0].ws);
+  publish(0, "news.b", "m0");
+  if (!client_expect(0, 0, CHANNEL, 1) || !client_expect(0, 1, PATTERN, 1) || !client_expect(1, 0, NULL, 0) || !client_expect(1, 1, PATTERN, 1)) {
+    goto done;
+  }
+  pubsub_manager_punsubscribe(harness.mgrs[1], "news.*", harness.clients[1][1].ws);
+  publish(0, "news.b", "m0");
+  is_ok = client_expect(0, 0, CHANNEL, 1) && client_expect(0, 1, PATTERN, 1) && client_expect(1, 0, NULL, 0) && client_expect(1, 1, NULL, 0);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_fan_out,
+  &test_unsubscribe,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "pattern_trie.h"
+
+#define NMARKETS (1000)
+
+static const char *const PATTERNS[] = {
+  "market.BTC.*",
+  "market.BTC.trades",
+  "market.*.trades",
+  "market",
+  "market.",
+  "",
+  "*",
+  NULL,
+};
+
+
+static bool
+test_find(void) {
+  struct pattern_trie *const trie = pattern_trie_create();
+  if (trie == NULL) {
+    ERROR0("trie is NULL\n");
+    return false;
+  }
+  for (uintptr_t i = 0; PATTERNS[i] != NULL; ++i) {
+    if (pattern_trie_insert(trie, PATTERNS[i], strlen(PATTERNS[i]), (void *)(i + 1)) != STATUS_OK) {
+      ERROR("insert '%s' failed\n", PATTERNS[i]);
+      goto fail;
+    }
+  }
+  if (pattern_trie_insert(trie, PATTERNS[0], strlen(PATTERNS[0]), (void *)1) != STATUS_EINVAL) {
+    ERROR0("inserting a duplicate pattern did not fail\n");
+    goto fail;
+  }
+
+  // Each pattern finds its own value, and prefixes of patterns find nothing.
+  for (uintptr_t i = 0; PATTERNS[i] != NULL; ++i) {
+    if (pattern_trie_find(trie, PATTERNS[i], strlen(PATTERNS[i])) != (void *)(i + 1)) {
+      ERROR("find '%s' failed\n", PATTERNS[i]);
+      goto fail;
+    }
+  }
+  if (pattern_trie_find(trie, "market.BTC", 10) != NULL || pattern_trie_find(trie, "market.ETH.trades", 17) != NULL) {
+    ERROR0("find of a missing pattern did not return NULL\n");
+    goto fail;
+  }
+  pattern_trie_destroy(trie, NULL, NULL);
+  return true;
+
+fail:
+  pattern_trie_destroy(trie, NULL, NULL);
+  return false;
+}
+
+
+static bool
+test_remove(void) {
+  char pattern[64];
+
+  struct pattern_trie *const trie = pattern_trie_create();
+  if (trie == NULL) {
+    ERROR0("trie is NULL\n");
+    return false;
+  }
+  for (uintptr_t i = 1; i <= NMARKETS; ++i) {
+    const int nbytes = snprintf(pattern, sizeof(pattern), "market.%zu.*", (size_t)i);
+    if (pattern_trie_insert(trie, pattern, (size_t)nbytes, (void *)i) != STATUS_OK) {
+      ERROR("insert '%s' failed\n", pattern);
+      goto fail;
+    }
+  }
+
+  // Removing the odd markets must leave the even ones, which share the `market` node, untouched.
+  for (uintptr_t i = 1; i <= NMARKETS; i += 2) {
+    const int nbytes = snprintf(pattern, sizeof(pattern), "market.%zu.*", (size_t)i);
+    if (pattern_trie_remove(trie, pattern, (size_t)nbytes) != (void *)i) {
+      ERROR("remove '%s' failed\n", pattern);
+      goto fail;
+    }
+    if (pattern_trie_remove(trie, pattern, (size_t)nbytes) != NULL) {
+      ERROR("second remove '%s' did not return NULL\n", pattern);
+      goto fail;
+    }
+  }
+  if (pattern_trie_size(trie) != NMARKETS / 2) {
+    ERROR("size %zu != %d\n", pattern_trie_size(trie), NMARKETS / 2);
+    goto fail;
+  }
+  for (uintptr_t i = 1; i <= NMARKETS; ++i) {
+    const int nbytes = snprintf(pattern, sizeof(pattern), "market.%zu.*", (size_t)i);
+    void *const expected = (i % 2 == 0) ? (void *)i : NULL;
+    if (pattern_trie_find(trie, pattern, (size_t)nbytes) != expected) {
+      ERROR("find '%s' returned the wrong value\n", pattern);
+      goto fail;
+    }
+  }
+  pattern_trie_destroy(trie, NULL, NULL);
+  return true;
+
+fail:
+  pattern_trie_destroy(trie, NULL, NULL);
+  return false;
+}
+
+
+static void
+count_value(void *const value, void *const arg) {
+  (void)value;
+  ++*(size_t *)arg;
+}
+
+
+static bool
+test_destroy(void) {
+  size_t ndestroyed = 0;
+
+  struct pattern_trie *const trie = pattern_trie_create();
+  if (trie == NULL) {
+    ERROR0("trie is NULL\n");
+    return false;
+  }
+  for (uintptr_t i = 0; PATTERNS[i] != NULL; ++i) {
+    if (pattern_trie_insert(trie, PATTERNS[i], strlen(PATTERNS[i]), (void *)(i + 1)) != STATUS_OK) {
+      ERROR("insert '%s' failed\n", PATTERNS[i]);
+      pattern_trie_destroy(trie, NULL, NULL);
+      return false;
+    }
+  }
+  pattern_trie_destroy(trie, &count_value, &ndestroyed);
+  if (ndestroyed != sizeof(PATTERNS) / sizeof(PATTERNS[0]) - 1) {
+    ERROR("%zu values destroyed\n", ndestroyed);
+    return false;
+  }
+  return true;
+}
+
+
+static const char *const GLOBS[] = {
+  "market.BTC.*",
+  "market.*.trades",
+  "market.?TC.trades",
+  "market.[A-C]*",
+  "market.[^A-C]*",
+  "market.\\*.trades",
+  "market.[.x]BTC",
+  "m*",
+  "market.BTC.trades",
+  "a..b",
+  "*.",
+  NULL,
+};
+
+static const struct {
+  const char *channel;
+  uint32_t matched;  // A bit for each of GLOBS which matches the channel.
+} MATCHES[] = {
+  {"market.BTC.trades", 0x0001 | 0x0002 | 0x0004 | 0x0008 | 0x0080 | 0x0100},
+  {"market.ETH.trades", 0x0002 | 0x0010 | 0x0080},
+  {"market.BTC.book.top", 0x0001 | 0x0008 | 0x0080},
+  {"market.*.trades", 0x0002 | 0x0010 | 0x0020 | 0x0080},
+  {"market.x.y.trades", 0x0002 | 0x0010 | 0x0080},
+  {"market..BTC", 0x0010 | 0x0040 | 0x0080},
+  {"market.xBTC", 0x0010 | 0x0040 | 0x0080},
+  {"market", 0x0080},
+  {"market.", 0x0080 | 0x0400},
+  {"a..b", 0x0200},
+  {"a.b", 0},
+  {"", 0},
+  {NULL, 0},
+};
+
+
+static void
+record_match(void *const value, void *const arg) {
+  uint32_t *const matched = arg;
+  const uint32_t bit = (uint32_t)1 << ((uintptr_t)value - 1);
+  // Each pattern must only be reported once, so a second report sets a bit no pattern has.
+  *matched |= (*matched & bit) ? 0x80000000 : bit;
+}
+
+
+static bool
+test_match(void) {
+  struct pattern_trie *const trie = pattern_trie_create();
+  if (trie == NULL) {
+    ERROR0("trie is NULL\n");
+    return false;
+  }
+  for (uintptr_t i = 0; GLOBS[i] != NULL; ++i) {
+    if (pattern_trie_insert(trie, GLOBS[i], strlen(GLOBS[i]), (void *)(i + 1)) != STATUS_OK) {
+      ERROR("insert '%s' failed\n", GLOBS[i]);
+      goto fail;
+    }
+  }
+  for (size_t i = 0; MATCHES[i].channel != NULL; ++i) {
+    uint32_t matched = 0;
+    pattern_trie_match(trie, MATCHES[i].channel, strlen(MATCHES[i].channel), &record_match, &matched);
+    if (matched != MATCHES[i].matched) {
+      ERROR("'%s' matched 0x%x not 0x%x\n", MATCHES[i].channel, matched, MATCHES[i].matched);
+      goto fail;
+    }
+  }
+
+  // Once the glob is removed, its channel no longer matches anything but the catch-alls.
+  pattern_trie_remove(trie, GLOBS[1], strlen(GLOBS[1]));
+  uint32_t matched = 0;
+  pattern_trie_match(trie, "market.ETH.trades", 17, &record_match, &matched);
+  if (matched != (0x0010 | 0x0080)) {
+    ERROR("'market.ETH.trades' matched 0x%x after removal\n", matched);
+    goto fail;
+  }
+  pattern_trie_destroy(trie, NULL, NULL);
+  return true;
+
+fail:
+  pattern_trie_destroy(trie, NULL, NULL);
+  return false;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_find,
+  &test_remove,
+  &test_destroy,
+  &test_match,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,484 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "broker.h"
+#include "client_connection.h"
+#include "local_broker.h"
+#include "logging.h"
+#include "pubsub_manager.h"
+#include "pubsub_reply.h"
+#include "websocket.h"
+
+#define NCLIENTS (4)
+#define MAX_MESSAGE_NBYTES (125)  // The longest payload with a 7-bit frame length.
+
+static const uint64_t NODE_ID = 0x1234;
+static const uint64_t OTHER_NODE_ID = 0x5678;
+
+
+// A websocket whose frames are written to one end of a bufferevent pair, and read from the other.
+struct client {
+  struct bufferevent *pair[2];
+  struct client_connection connection;
+  struct websocket *ws;
+};
+
+
+// A manager on the in-process broker, with a few clients to subscribe.
+struct harness {
+  struct event_base *event_base;
+  struct local_exchange *exchange;
+  struct broker *broker;
+  struct pubsub_manager *mgr;
+  struct client clients[NCLIENTS];
+};
+
+static struct harness harness;
+
+
+static void
+on_message(struct websocket *const ws) {
+  (void)ws;
+}
+
+
+static bool
+harness_init(const struct pubsub_history_options *const history) {
+  memset(&harness, 0, sizeof(harness));
+  harness.event_base = event_base_new();
+  harness.exchange = local_exchange_create();
+  if (harness.event_base == NULL || harness.exchange == NULL) {
+    ERROR0("failed to create the event loop or the exchange\n");
+    return false;
+  }
+  harness.broker = local_broker_create(harness.exchange);
+  harness.mgr = (harness.broker == NULL) ? NULL : pubsub_manager_create(harness.event_base, harness.broker, history);
+  if (harness.mgr == NULL) {
+    ERROR0("failed to create the manager\n");
+    return false;
+  }
+
+  for (size_t i = 0; i != NCLIENTS; ++i) {
+    struct client *const client = &harness.clients[i];
+    if (bufferevent_pair_new(harness.event_base, 0, client->pair) != 0) {
+      ERROR0("failed to create the bufferevent pair\n");
+      return false;
+    }
+    client->connection.fd = -1;
+    client->connection.event_loop = harness.event_base;
+    client->connection.bev = client->pair[0];
+    client->ws = websocket_init(&client->connection, &on_message);
+    if (client->ws == NULL) {
+      ERROR0("websocket_init failed\n");
+      return false;
+    }
+    client->connection.ws = client->ws;
+    client->ws->in_state = WS_OPEN;
+    bufferevent_enable(client->pair[0], EV_READ | EV_WRITE);
+    bufferevent_enable(client->pair[1], EV_READ | EV_WRITE);
+  }
+  return true;
+}
+
+
+static void
+harness_destroy(void) {
+  for (size_t i = 0; i != NCLIENTS; ++i) {
+    struct client *const client = &harness.clients[i];
+    if (client->ws != NULL) {
+      pubsub_manager_unsubscribe_all(harness.mgr, client->ws);
+      websocket_destroy(client->ws);
+    }
+    for (size_t j = 0; j != 2; ++j) {
+      if (client->pair[j] != NULL) {
+        bufferevent_free(client->pair[j]);
+      }
+    }
+  }
+  if (harness.mgr != NULL) {
+    pubsub_manager_destroy(harness.mgr);
+  }
+  if (harness.broker != NULL) {
+    broker_destroy(harness.broker);
+  }
+  if (harness.exchange != NULL) {
+    local_exchange_destroy(harness.exchange);
+  }
+  if (harness.event_base != NULL) {
+    event_base_free(harness.event_base);
+  }
+}
+
+
+// Runs the event loop for `ms` milliseconds, so that timers fire and the clock moves on.
+static void
+run_for(const long ms) {
+  const struct timeval delay = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+  event_base_loopexit(harness.event_base, &delay);
+  event_base_dispatch(harness.event_base);
+}
+
+
+/**
+ * Reads the messages which client `i` has been sent since the last call, and checks that they are
+ * `expected`, in order.
+ **/
+static bool
+client_expect(const size_t i, const char *const *const expected, const size_t nexpected) {
+  struct evbuffer *const in = bufferevent_get_input(harness.clients[i].pair[1]);
+  char message[MAX_MESSAGE_NBYTES + 1];
+  uint8_t header[2];
+  size_t nmessages = 0;
+  bool is_ok = true;
+
+  while (evbuffer_copyout(in, header, sizeof(header)) == sizeof(header)) {
+    const size_t nbytes = header[1];
+    if (header[0] != 0x81 || nbytes > MAX_MESSAGE_NBYTES || evbuffer_get_length(in) < sizeof(header) + nbytes) {
+      ERROR("client %zu: unexpected frame header 0x%02x 0x%02x\n", i, header[0], header[1]);
+      return false;
+    }
+    evbuffer_drain(in, sizeof(header));
+    evbuffer_remove(in, message, nbytes);
+    message[nbytes] = '\0';
+    if (nmessages >= nexpected || strcmp(message, expected[nmessages]) != 0) {
+      ERROR("client %zu: message %zu is %s but expected %s\n", i, nmessages, message, (nmessages >= nexpected) ? "nothing" : expected[nmessages]);
+      is_ok = false;
+    }
+    ++nmessages;
+  }
+  if (nmessages != nexpected) {
+    ERROR("client %zu: received %zu messages but expected %zu\n", i, nmessages, nexpected);
+    is_ok = false;
+  }
+  return is_ok;
+}
+
+
+static bool
+expect_history_stats(const size_t nchannels, const size_t nbytes) {
+  size_t actual_nchannels, actual_nbytes;
+  pubsub_manager_get_history_stats(harness.mgr, &actual_nchannels, &actual_nbytes);
+  if (actual_nchannels != nchannels || actual_nbytes != nbytes) {
+    ERROR("history has %zu channels in %zu bytes but expected %zu channels in %zu bytes\n", actual_nchannels, actual_nbytes, nchannels, nbytes);
+    return false;
+  }
+  return true;
+}
+
+
+// Publishes one message to `channel` with a subscriber, who then leaves the channel idle.
+static bool
+publish_then_leave(const char *const channel, const char *const message) {
+  struct websocket *const ws = harness.clients[0].ws;
+  return pubsub_manager_subscribe(harness.mgr, channel, ws) == STATUS_OK && pubsub_manager_publish(harness.mgr, channel, message) == STATUS_OK && pubsub_manager_unsubscribe(harness.mgr, channel, ws) == STATUS_OK;
+}
+
+
+static bool
+test_history_replay(void) {
+  static const char *const MESSAGES[] = {
+    "{\"key\":\"a\",\"data\":\"m0\"}",
+    "{\"key\":\"a\",\"data\":\"m1\"}",
+    "{\"key\":\"a\",\"data\":\"m2\"}",
+    "{\"key\":\"a\",\"data\":\"m3\"}",
+    "{\"key\":\"a\",\"data\":\"m4\"}",
+    "{\"key\":\"a\",\"data\":\"m5\"}",
+    "{\"key\":\"a\",\"data\":\"m6\"}",
+  };
+  const struct pubsub_history_options history = {.max_nmessages = 4, .max_nbytes = SIZE_MAX};
+  char message[8];
+  bool is_ok = false;
+
+  if (!harness_init(&history)) {
+    goto done;
+  }
+  pubsub_manager_subscribe(harness.mgr, "a", harness.clients[0].ws);
+  for (int i = 0; i != 6; ++i) {
+    snprintf(message, sizeof(message), "m%d", i);
+    pubsub_manager_publish(harness.mgr, "a", message);
+  }
+  if (!client_expect(0, MESSAGES, 6)) {
+    goto done;
+  }
+
+  // Late joiners get as much of the last four messages as they ask for, oldest first.
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[1].ws, 3);
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[2].ws, 10);
+  if (!client_expect(1, MESSAGES + 3, 3) || !client_expect(2, MESSAGES + 2, 4)) {
+    goto done;
+  }
+
+  // And then the live messages, without anything being replayed again.
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[1].ws, 3);
+  pubsub_manager_publish(harness.mgr, "a", "m6");
+  is_ok = client_expect(0, MESSAGES + 6, 1) && client_expect(1, MESSAGES + 6, 1) && client_expect(2, MESSAGES + 6, 1);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+static bool
+test_history_evicts_oldest_idle(void) {
+  static const char *const B[] = {"{\"key\":\"b\",\"data\":\"m0\"}"};
+  const struct pubsub_history_options unlimited = {.max_nmessages = 4, .max_nbytes = SIZE_MAX};
+  size_t nchannels, entry_nbytes;
+  bool is_ok = false;
+
+  // Find what a message takes up, as the limit is set in messages of the same size.
+  if (!harness_init(&unlimited) || !publish_then_leave("a", "m0")) {
+    goto done;
+  }
+  pubsub_manager_get_history_stats(harness.mgr, &nchannels, &entry_nbytes);
+  harness_destroy();
+
+  const struct pubsub_history_options history = {.max_nmessages = 4, .max_nbytes = 3 * entry_nbytes};
+  if (!harness_init(&history)) {
+    goto done;
+  }
+  if (!publish_then_leave("a", "m0") || !publish_then_leave("b", "m0") || !publish_then_leave("c", "m0") || !expect_history_stats(3, 3 * entry_nbytes)) {
+    goto done;
+  }
+
+  // A message to another channel goes over the limit, and pushes out the channel idle for longest.
+  if (!publish_then_leave("d", "m0") || !expect_history_stats(3, 3 * entry_nbytes)) {
+    goto done;
+  }
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[1].ws, 10);
+  if (!client_expect(1, NULL, 0)) {
+    goto done;
+  }
+
+  // A channel with subscribers again is no longer idle, so the next oldest goes instead.
+  pubsub_manager_subscribe_history(harness.mgr, "b", harness.clients[2].ws, 10);
+  if (!client_expect(2, B, 1) || !publish_then_leave("e", "m0")) {
+    goto done;
+  }
+  pubsub_manager_subscribe_history(harness.mgr, "c", harness.clients[3].ws, 10);
+  is_ok = client_expect(3, NULL, 0) && expect_history_stats(3, 3 * entry_nbytes);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+static bool
+test_history_expires(void) {
+  static const char *const MESSAGES[] = {
+    "{\"key\":\"a\",\"data\":\"m0\"}",
+    "{\"key\":\"a\",\"data\":\"m1\"}",
+  };
+  const struct pubsub_history_options history = {.max_nmessages = 4, .max_age = {.tv_sec = 0, .tv_usec = 50000}, .max_nbytes = SIZE_MAX};
+  size_t nchannels, nbytes;
+  bool is_ok = false;
+
+  if (!harness_init(&history)) {
+    goto done;
+  }
+  pubsub_manager_subscribe(harness.mgr, "a", harness.clients[0].ws);
+  pubsub_manager_publish(harness.mgr, "a", "m0");
+  run_for(100);
+  pubsub_manager_publish(harness.mgr, "a", "m1");
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[1].ws, 10);
+  if (!client_expect(0, MESSAGES, 2) || !client_expect(1, MESSAGES + 1, 1)) {
+    goto done;
+  }
+
+  // An idle channel doesn't get any more messages to push the old ones out, so it's swept up.
+  pubsub_manager_unsubscribe_all(harness.mgr, harness.clients[0].ws);
+  pubsub_manager_unsubscribe_all(harness.mgr, harness.clients[1].ws);
+  pubsub_manager_get_history_stats(harness.mgr, &nchannels, &nbytes);
+  if (nchannels != 1) {
+    ERROR("history has %zu channels but expected 1\n", nchannels);
+    goto done;
+  }
+  run_for(1200);
+  is_ok = expect_history_stats(0, 0);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+static bool
+test_history_revives_idle(void) {
+  static const char *const MESSAGES[] = {
+    "{\"key\":\"a\",\"data\":\"m0\"}",
+    "{\"key\":\"a\",\"data\":\"m1\"}",
+    "{\"key\":\"a\",\"data\":\"m2\"}",
+    "{\"key\":\"a\",\"data\":\"m3\"}",
+  };
+  const struct pubsub_history_options history = {.max_nmessages = 4, .max_nbytes = SIZE_MAX};
+  bool is_ok = false;
+
+  if (!harness_init(&history)) {
+    goto done;
+  }
+
+  // An idle channel stays subscribed, so it keeps its history up to date for the next subscriber.
+  if (!publish_then_leave("a", "m0") || pubsub_manager_publish(harness.mgr, "a", "m1") != STATUS_OK) {
+    goto done;
+  }
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[1].ws, 10);
+  pubsub_manager_publish(harness.mgr, "a", "m2");
+  if (!client_expect(0, MESSAGES, 1) || !client_expect(1, MESSAGES, 3)) {
+    goto done;
+  }
+
+  // Going idle again keeps the history, and a plain subscription picks up from the live messages.
+  pubsub_manager_unsubscribe(harness.mgr, "a", harness.clients[1].ws);
+  pubsub_manager_subscribe(harness.mgr, "a", harness.clients[2].ws);
+  pubsub_manager_publish(harness.mgr, "a", "m3");
+  if (!client_expect(2, MESSAGES + 3, 1)) {
+    goto done;
+  }
+  pubsub_manager_subscribe_history(harness.mgr, "a", harness.clients[3].ws, 10);
+  is_ok = client_expect(3, MESSAGES, 4);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+/**
+ * Hands the manager a message published on `node` by `publisher`, as the redis broker and hub do
+ * with local delivery on node NODE_ID: a message published on this node goes straight to the
+ * channel's subscribers, and then every message comes back from redis on its channel and on each
+ * of `patterns`, for the hub to decide whether it still needs delivering.
+ **/
+static void
+publish_through_redis(const uint64_t node, const uint64_t publisher, const char *const channel, const char *const message, const char *const *const patterns, const size_t npatterns) {
+  struct pubsub_payload *payload;
+  const size_t channel_nbytes = strlen(channel);
+
+  if (node == NODE_ID) {
+    payload = pubsub_payload_create(message, strlen(message));
+    payload->node = node;
+    payload->publisher = publisher;
+    pubsub_manager_deliver_now(harness.mgr, NULL, channel, channel_nbytes, payload);
+    pubsub_payload_release(payload);
+  }
+  for (size_t i = 0; i != npatterns + 1; ++i) {
+    const char *const pattern = (i == 0) ? NULL : patterns[i - 1];
+    payload = pubsub_payload_create(message, strlen(message));
+    payload->node = node;
+    payload->publisher = publisher;
+    if (pubsub_payload_needs_delivery(payload, NODE_ID, pattern != NULL)) {
+      pubsub_manager_deliver_now(harness.mgr, pattern, channel, channel_nbytes, payload);
+    }
+    pubsub_payload_release(payload);
+  }
+}
+
+
+static bool
+test_nolocal(void) {
+  static const char *const CHANNEL[] = {"{\"key\":\"a\",\"data\":\"m0\"}", "{\"key\":\"a\",\"data\":\"m1\"}"};
+  static const char *const PATTERN[] = {"{\"key\":\"a\",\"pattern\":\"a*\",\"data\":\"m0\"}", "{\"key\":\"a\",\"pattern\":\"a*\",\"data\":\"m1\"}"};
+  bool is_ok = false;
+
+  if (!harness_init(NULL)) {
+    goto done;
+  }
+  struct websocket *const ws = harness.clients[0].ws;
+  pubsub_manager_subscribe(harness.mgr, "a", ws);
+  pubsub_manager_psubscribe(harness.mgr, "a*", ws);
+  if (pubsub_manager_set_nolocal(harness.mgr, "a", false, ws, true) != STATUS_OK || pubsub_manager_set_nolocal(harness.mgr, "a*", true, ws, true) != STATUS_OK) {
+    ERROR0("pubsub_manager_set_nolocal failed\n");
+    goto done;
+  }
+  pubsub_manager_subscribe(harness.mgr, "a", harness.clients[1].ws);
+  pubsub_manager_psubscribe(harness.mgr, "a*", harness.clients[2].ws);
+
+  // The websocket doesn't get its own message back, while everybody else gets it once.
+  pubsub_manager_publish_from(harness.mgr, ws, "a", "m0");
+  if (!client_expect(0, NULL, 0) || !client_expect(1, CHANNEL, 1) || !client_expect(2, PATTERN, 1)) {
+    goto done;
+  }
+
+  // But it does get everybody else's, on both the channel and the pattern.
+  pubsub_manager_publish_from(harness.mgr, harness.clients[1].ws, "a", "m1");
+  const char *const both[] = {PATTERN[1], CHANNEL[1]};
+  is_ok = client_expect(0, both, 2) && client_expect(1, CHANNEL + 1, 1) && client_expect(2, PATTERN + 1, 1);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+static bool
+test_local_delivery_echo(void) {
+  static const char *const PATTERNS[] = {"a*"};
+  static const char *const CHANNEL[] = {"{\"key\":\"a\",\"data\":\"m0\"}"};
+  static const char *const PATTERN[] = {"{\"key\":\"a\",\"pattern\":\"a*\",\"data\":\"m0\"}"};
+  bool is_ok = false;
+
+  if (!harness_init(NULL)) {
+    goto done;
+  }
+  struct websocket *const ws = harness.clients[0].ws;
+  pubsub_manager_subscribe(harness.mgr, "a", ws);
+  pubsub_manager_set_nolocal(harness.mgr, "a", false, ws, true);
+  pubsub_manager_subscribe(harness.mgr, "a", harness.clients[1].ws);
+  pubsub_manager_psubscribe(harness.mgr, "a*", harness.clients[2].ws);
+
+  // The channel subscriber on the same worker gets the local delivery but not the echo, and the
+  // pattern subscriber only gets the echo.
+  publish_through_redis(NODE_ID, ws->id, "a", "m0", PATTERNS, 1);
+  if (!client_expect(0, NULL, 0) || !client_expect(1, CHANNEL, 1) || !client_expect(2, PATTERN, 1)) {
+    goto done;
+  }
+
+  // A websocket on another node may well have the same ID, which means nothing here.
+  publish_through_redis(OTHER_NODE_ID, ws->id, "a", "m0", PATTERNS, 1);
+  is_ok = client_expect(0, CHANNEL, 1) && client_expect(1, CHANNEL, 1) && client_expect(2, PATTERN, 1);
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_history_replay,
+  &test_history_evicts_oldest_idle,
+  &test_history_expires,
+  &test_history_revives_idle,
+  &test_nolocal,
+  &test_local_delivery_echo,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "logging.h"
+#include "pubsub_reply.h"
+
+
+// Feeds `input` to a reader using the pubsub reply functions and returns the first reply.
+static redisReply *
+read_reply(const char *const input, const size_t nbytes) {
+  void *reply = NULL;
+
+  redisReader *const reader = redisReaderCreate();
+  if (reader == NULL) {
+    ERROR0("redisReaderCreate failed\n");
+    return NULL;
+  }
+  reader->fn = &PUBSUB_REPLY_FUNCTIONS;
+  if (redisReaderFeed(reader, input, nbytes) != REDIS_OK || redisReaderGetReply(reader, &reply) != REDIS_OK) {
+    ERROR("reader failed: %s\n", reader->errstr);
+  }
+  redisReaderFree(reader);
+  return reply;
+}
+
+
+static bool
+test_message(void) {
+  static const char INPUT[] = "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$11\r\nhello\0world\r\n";
+  redisReply *const reply = read_reply(INPUT, sizeof(INPUT) - 1);
+  if (reply == NULL) {
+    ERROR0("reply is NULL\n");
+    return false;
+  }
+  if (pubsub_reply_kind(reply) != PUBSUB_REPLY_MESSAGE) {
+    ERROR("kind %d != PUBSUB_REPLY_MESSAGE\n", pubsub_reply_kind(reply));
+    goto fail;
+  }
+  if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 || strcmp(reply->element[0]->str, "message") != 0) {
+    ERROR0("reply is not a message array\n");
+    goto fail;
+  }
+  if (reply->element[1]->len != 3 || strcmp(reply->element[1]->str, "foo") != 0) {
+    ERROR("channel '%s' != 'foo'\n", reply->element[1]->str);
+    goto fail;
+  }
+
+  // The payload is binary safe and outlives the reply while it is retained.
+  struct pubsub_payload *const payload = pubsub_reply_payload(reply);
+  if (payload == NULL || payload->nbytes != 11 || memcmp(payload->bytes, "hello\0world", 12) != 0) {
+    ERROR0("payload is wrong\n");
+    goto fail;
+  }
+  if (reply->element[2]->str != payload->bytes) {
+    ERROR0("payload was copied into the reply\n");
+    goto fail;
+  }
+  pubsub_payload_retain(payload);
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  if (memcmp(payload->bytes, "hello\0world", 12) != 0) {
+    ERROR0("payload is wrong after freeing the reply\n");
+    pubsub_payload_release(payload);
+    return false;
+  }
+  pubsub_payload_release(payload);
+  return true;
+
+fail:
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return false;
+}
+
+
+static bool
+test_pmessage(void) {
+  static const char INPUT[] = "*4\r\n$8\r\npmessage\r\n$2\r\nf*\r\n$3\r\nfoo\r\n$3\r\nbar\r\n";
+  redisReply *const reply = read_reply(INPUT, sizeof(INPUT) - 1);
+  if (reply == NULL) {
+    ERROR0("reply is NULL\n");
+    return false;
+  }
+  const struct pubsub_payload *const payload = pubsub_reply_payload(reply);
+  if (pubsub_reply_kind(reply) != PUBSUB_REPLY_PMESSAGE || payload == NULL || strcmp(payload->bytes, "bar") != 0) {
+    ERROR0("pmessage was not recognised\n");
+    goto fail;
+  }
+  if (strcmp(reply->element[1]->str, "f*") != 0 || strcmp(reply->element[2]->str, "foo") != 0) {
+    ERROR0("pattern or channel is wrong\n");
+    goto fail;
+  }
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return true;
+
+fail:
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return false;
+}
+
+
+static bool
+test_smessage(void) {
+  static const char INPUT[] = "*3\r\n$8\r\nsmessage\r\n$3\r\nfoo\r\n$3\r\nbar\r\n";
+  redisReply *const reply = read_reply(INPUT, sizeof(INPUT) - 1);
+  if (reply == NULL) {
+    ERROR0("reply is NULL\n");
+    return false;
+  }
+  const struct pubsub_payload *const payload = pubsub_reply_payload(reply);
+  const bool ok = pubsub_reply_kind(reply) == PUBSUB_REPLY_SMESSAGE && payload != NULL && strcmp(payload->bytes, "bar") == 0 && strcmp(reply->element[1]->str, "foo") == 0;
+  if (!ok) {
+    ERROR0("smessage was not recognised\n");
+  }
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return ok;
+}
+
+
+static bool
+test_subscribe(void) {
+  static const char INPUT[] = "*3\r\n$9\r\nsubscribe\r\n$3\r\nfoo\r\n:1\r\n";
+  redisReply *const reply = read_reply(INPUT, sizeof(INPUT) - 1);
+  if (reply == NULL) {
+    ERROR0("reply is NULL\n");
+    return false;
+  }
+  if (pubsub_reply_kind(reply) != PUBSUB_REPLY_SUBSCRIBE || pubsub_reply_payload(reply) != NULL) {
+    ERROR0("subscribe was not recognised\n");
+    goto fail;
+  }
+  if (reply->element[2]->type != REDIS_REPLY_INTEGER || reply->element[2]->integer != 1) {
+    ERROR0("count is wrong\n");
+    goto fail;
+  }
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return true;
+
+fail:
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return false;
+}
+
+
+// A node's tag is stripped off the payload, and its node and publisher IDs are kept.
+static bool
+test_tagged_message(void) {
+  char input[128];
+  char tagged[PUBSUB_TAG_NBYTES + 5];
+
+  pubsub_tag_format(tagged, 0x0102030405060708, 42);
+  memcpy(tagged + PUBSUB_TAG_NBYTES, "hello", 5);
+  const int nbytes = snprintf(input, sizeof(input), "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$%zu\r\n", sizeof(tagged));
+  memcpy(input + nbytes, tagged, sizeof(tagged));
+  memcpy(input + nbytes + sizeof(tagged), "\r\n", 2);
+  redisReply *const reply = read_reply(input, (size_t)nbytes + sizeof(tagged) + 2);
+  if (reply == NULL) {
+    ERROR0("reply is NULL\n");
+    return false;
+  }
+
+  const struct pubsub_payload *const payload = pubsub_reply_payload(reply);
+  if (payload == NULL || payload->nbytes != 5 || strcmp(payload->bytes, "hello") != 0 || reply->element[2]->len != 5) {
+    ERROR0("tag was not stripped from the payload\n");
+    goto fail;
+  }
+  if (payload->node != 0x0102030405060708 || payload->publisher != 42) {
+    ERROR("tag is wrong: node=%" PRIx64 " publisher=%" PRIu64 "\n", payload->node, payload->publisher);
+    goto fail;
+  }
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return true;
+
+fail:
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return false;
+}
+
+
+// Binary payloads which start with 0xff, or with a tag which doesn't check out, are left whole.
+static bool
+test_untagged_binary(void) {
+  char input[128];
+  char payloads[3][PUBSUB_TAG_NBYTES + 5];
+
+  memset(payloads[0], 0xff, sizeof(payloads[0]));
+  pubsub_tag_format(payloads[1], 0x0102030405060708, 42);
+  memcpy(payloads[1] + PUBSUB_TAG_NBYTES, "hello", 5);
+  memcpy(payloads[2], payloads[1], sizeof(payloads[2]));
+  payloads[1][PUBSUB_TAG_NBYTES - 1] ^= 0x01;  // A corrupted checksum.
+  payloads[2][5] = 0x02;                       // An unknown version.
+
+  for (size_t i = 0; i != 3; ++i) {
+    const int nbytes = snprintf(input, sizeof(input), "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$%zu\r\n", sizeof(payloads[i]));
+    memcpy(input + nbytes, payloads[i], sizeof(payloads[i]));
+    memcpy(input + nbytes + sizeof(payloads[i]), "\r\n", 2);
+    redisReply *const reply = read_reply(input, (size_t)nbytes + sizeof(payloads[i]) + 2);
+    if (reply == NULL) {
+      ERROR0("reply is NULL\n");
+      return false;
+    }
+    const struct pubsub_payload *const payload = pubsub_reply_payload(reply);
+    if (payload == NULL || payload->nbytes != sizeof(payloads[i]) || memcmp(payload->bytes, payloads[i], sizeof(payloads[i])) != 0 || payload->node != 0) {
+      ERROR("payload %zu was stripped as if it were tagged\n", i);
+      PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+      return false;
+    }
+    PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  }
+  return true;
+}
+
+
+// Replies which don't fit in a block, including long strings and nested arrays, still work.
+static bool
+test_other(void) {
+  char input[512];
+  char long_string[200];
+
+  memset(long_string, 'x', sizeof(long_string));
+  const int nbytes = snprintf(input, sizeof(input), "*5\r\n$3\r\none\r\n$%zu\r\n%.*s\r\n*2\r\n:1\r\n$-1\r\n+OK\r\n-ERR\r\n",
+                              sizeof(long_string), (int)sizeof(long_string), long_string);
+  redisReply *const reply = read_reply(input, (size_t)nbytes);
+  if (reply == NULL) {
+    ERROR0("reply is NULL\n");
+    return false;
+  }
+  if (pubsub_reply_kind(reply) != PUBSUB_REPLY_OTHER || reply->elements != 5) {
+    ERROR0("reply was misrecognised\n");
+    goto fail;
+  }
+  if (reply->element[1]->len != sizeof(long_string) || reply->element[2]->elements != 2 || reply->element[2]->element[1]->type != REDIS_REPLY_NIL) {
+    ERROR0("reply elements are wrong\n");
+    goto fail;
+  }
+  if (strcmp(reply->element[3]->str, "OK") != 0 || reply->element[4]->type != REDIS_REPLY_ERROR) {
+    ERROR0("status or error element is wrong\n");
+    goto fail;
+  }
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return true;
+
+fail:
+  PUBSUB_REPLY_FUNCTIONS.freeObject(reply);
+  return false;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_message,
+  &test_pmessage,
+  &test_smessage,
+  &test_subscribe,
+  &test_tagged_message,
+  &test_untagged_binary,
+  &test_other,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
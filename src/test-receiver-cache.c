@@ -0,0 +1,267 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "logging.h"
+#include "receiver_cache.h"
+
+
+static const struct timeval TTL = {.tv_sec = 1, .tv_usec = 0};
+
+
+// Publishes to `channel` at `now`, replying with `nreceivers` straight away if the PUBLISH goes ahead.
+static bool
+publish(struct receiver_cache *const cache, const char *const channel, const struct timeval *const now, const long long nreceivers) {
+  struct receiver_count *count;
+  if (!receiver_cache_check(cache, channel, strlen(channel), now, &count)) {
+    return false;
+  }
+  if (count != NULL) {
+    const uint64_t generation = receiver_cache_pin(count);
+    receiver_cache_on_publish_reply(cache, count, generation, nreceivers, now);
+  }
+  return true;
+}
+
+
+static bool
+test_suppress(void) {
+  struct receiver_cache *const cache = receiver_cache_create(&TTL, NULL);
+  struct timeval now = {.tv_sec = 100, .tv_usec = 0};
+  bool ok = false;
+
+  // Channels are published to until they are known to be empty.
+  if (!publish(cache, "foo", &now, 0) || !publish(cache, "bar", &now, 2)) {
+    ERROR0("first publishes were suppressed\n");
+    goto done;
+  }
+  if (publish(cache, "foo", &now, 0) || publish(cache, "foo", &now, 0) || !publish(cache, "bar", &now, 2)) {
+    ERROR0("suppression is wrong\n");
+    goto done;
+  }
+  if (receiver_cache_nsuppressed(cache) != 2) {
+    ERROR("nsuppressed %" PRIu64 " != 2\n", receiver_cache_nsuppressed(cache));
+    goto done;
+  }
+
+  // Without a reply, nothing is learned.
+  struct receiver_count *count;
+  if (!receiver_cache_check(cache, "baz", 3, &now, &count) || count == NULL) {
+    ERROR0("baz was not cached\n");
+    goto done;
+  }
+  const uint64_t generation = receiver_cache_pin(count);
+  receiver_cache_on_publish_reply(cache, count, generation, -1, &now);
+  if (!publish(cache, "baz", &now, 1)) {
+    ERROR0("baz was suppressed without a reply\n");
+    goto done;
+  }
+
+  // Forgetting a channel lets publishes through again.
+  receiver_cache_forget(cache, "foo", 3);
+  ok = publish(cache, "foo", &now, 1);
+  if (!ok) {
+    ERROR0("forgotten channel was suppressed\n");
+  }
+
+done:
+  receiver_cache_destroy(cache);
+  return ok;
+}
+
+
+static bool
+test_refresh(void) {
+  struct receiver_cache *const cache = receiver_cache_create(&TTL, NULL);
+  struct timeval now = {.tv_sec = 100, .tv_usec = 0};
+  const char *channels[4];
+  size_t nbytes[4];
+  bool ok = false;
+
+  publish(cache, "foo", &now, 0);
+  publish(cache, "bar", &now, 3);
+  if (receiver_cache_stale(cache, &now, channels, nbytes, 4) != 0) {
+    ERROR0("fresh channels are stale\n");
+    goto done;
+  }
+
+  // Only empty channels are refreshed, and only once per TTL.
+  now.tv_sec += 1;
+  if (receiver_cache_stale(cache, &now, channels, nbytes, 4) != 1 || nbytes[0] != 3 || memcmp(channels[0], "foo", 3) != 0) {
+    ERROR0("empty channel was not stale\n");
+    goto done;
+  }
+  if (receiver_cache_stale(cache, &now, channels, nbytes, 4) != 0) {
+    ERROR0("channel was refreshed twice\n");
+    goto done;
+  }
+
+  // NUMSUB never marks a channel as empty, as it doesn't count pattern subscribers.
+  receiver_cache_on_numsub(cache, "bar", 3, 0);
+  if (!publish(cache, "bar", &now, 3)) {
+    ERROR0("NUMSUB emptied a channel\n");
+    goto done;
+  }
+  receiver_cache_on_numsub(cache, "foo", 3, 0);
+  if (publish(cache, "foo", &now, 0)) {
+    ERROR0("channel without subscribers was not suppressed\n");
+    goto done;
+  }
+  receiver_cache_on_numsub(cache, "foo", 3, 1);
+  ok = publish(cache, "foo", &now, 1);
+  if (!ok) {
+    ERROR0("channel with a new subscriber was suppressed\n");
+  }
+
+done:
+  receiver_cache_destroy(cache);
+  return ok;
+}
+
+
+static bool
+test_probe(void) {
+  const struct timeval probe_interval = {.tv_sec = 5, .tv_usec = 0};
+  struct receiver_cache *const cache = receiver_cache_create(&TTL, &probe_interval);
+  struct timeval now = {.tv_sec = 100, .tv_usec = 0};
+  bool ok = false;
+
+  publish(cache, "foo", &now, 0);
+  now.tv_sec += 4;
+  if (publish(cache, "foo", &now, 0)) {
+    ERROR0("probe was too early\n");
+    goto done;
+  }
+  now.tv_sec += 1;
+  if (!publish(cache, "foo", &now, 0)) {
+    ERROR0("probe was not let through\n");
+    goto done;
+  }
+  if (publish(cache, "foo", &now, 0)) {
+    ERROR0("more than one probe was let through\n");
+    goto done;
+  }
+
+  // A probe which finds receivers stops the suppression.
+  now.tv_sec += 5;
+  ok = publish(cache, "foo", &now, 1) && publish(cache, "foo", &now, 1);
+  if (!ok) {
+    ERROR0("channel was still suppressed after a probe found receivers\n");
+  }
+
+done:
+  receiver_cache_destroy(cache);
+  return ok;
+}
+
+
+static bool
+test_expire(void) {
+  struct receiver_cache *const cache = receiver_cache_create(&TTL, NULL);
+  struct timeval now = {.tv_sec = 100, .tv_usec = 0};
+  struct receiver_count *count;
+  bool ok = false;
+
+  publish(cache, "foo", &now, 0);
+  now.tv_sec += 1;
+  receiver_cache_check(cache, "bar", 3, &now, &count);
+  const uint64_t generation = receiver_cache_pin(count);
+
+  // Idle channels are forgotten, but not while a PUBLISH is waiting for its reply.
+  now.tv_sec += 60;
+  receiver_cache_expire(cache, &now);
+  if (receiver_cache_size(cache) != 1) {
+    ERROR("size %zu != 1\n", receiver_cache_size(cache));
+    goto done;
+  }
+  receiver_cache_on_publish_reply(cache, count, generation, 0, &now);
+  receiver_cache_expire(cache, &now);
+  if (receiver_cache_size(cache) != 0) {
+    ERROR("size %zu != 0\n", receiver_cache_size(cache));
+    goto done;
+  }
+  ok = publish(cache, "foo", &now, 0);
+  if (!ok) {
+    ERROR0("expired channel was suppressed\n");
+  }
+
+done:
+  receiver_cache_destroy(cache);
+  return ok;
+}
+
+
+// A PUBLISH which was already waiting for its reply when the channel gained a subscriber may have
+// reached redis first, so its count of no receivers is ignored.
+static bool
+test_forget_while_pinned(void) {
+  struct receiver_cache *const cache = receiver_cache_create(&TTL, NULL);
+  struct timeval now = {.tv_sec = 100, .tv_usec = 0};
+  struct receiver_count *before, *after;
+  bool ok = false;
+
+  if (!receiver_cache_check(cache, "foo", 3, &now, &before) || before == NULL) {
+    ERROR0("foo was not cached\n");
+    goto done;
+  }
+  const uint64_t before_generation = receiver_cache_pin(before);
+  receiver_cache_forget(cache, "foo", 3);
+  if (!receiver_cache_check(cache, "foo", 3, &now, &after) || after == NULL) {
+    ERROR0("foo was suppressed\n");
+    goto done;
+  }
+  const uint64_t after_generation = receiver_cache_pin(after);
+
+  // The reply from before the subscription is ignored, and the one from after it is recorded.
+  receiver_cache_on_publish_reply(cache, before, before_generation, 0, &now);
+  if (!publish(cache, "foo", &now, 1)) {
+    ERROR0("a reply from before the forget emptied the channel\n");
+    receiver_cache_on_publish_reply(cache, after, after_generation, 1, &now);
+    goto done;
+  }
+  receiver_cache_on_publish_reply(cache, after, after_generation, 0, &now);
+  ok = !publish(cache, "foo", &now, 0);
+  if (!ok) {
+    ERROR0("a reply from after the forget was ignored\n");
+  }
+
+done:
+  receiver_cache_destroy(cache);
+  return ok;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_suppress,
+  &test_refresh,
+  &test_probe,
+  &test_expire,
+  &test_forget_while_pinned,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
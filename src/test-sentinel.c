@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "logging.h"
+#include "sentinel.h"
+
+
+#define STRING(s) {.type = REDIS_REPLY_STRING, .str = s, .len = sizeof(s) - 1}
+#define ARRAY(a) {.type = REDIS_REPLY_ARRAY, .elements = sizeof(a) / sizeof(a[0]), .element = a}
+
+static bool
+test_parse_primary(void) {
+  char host[SENTINEL_HOST_MAX_NBYTES];
+  uint16_t port;
+
+  redisReply strings[] = {STRING("10.0.0.5"), STRING("6380"), STRING("0"), STRING("6380x"), STRING("")};
+  redisReply *address_elements[] = {&strings[0], &strings[1]};
+  const redisReply address = ARRAY(address_elements);
+  if (sentinel_parse_primary(&address, host, &port) != STATUS_OK || strcmp(host, "10.0.0.5") != 0 || port != 6380) {
+    ERROR0("failed to parse the primary's address\n");
+    return false;
+  }
+
+  // A sentinel which doesn't monitor the primary replies with nil.
+  const redisReply nil = {.type = REDIS_REPLY_NIL};
+  redisReply *zero_port_elements[] = {&strings[0], &strings[2]};
+  redisReply *bad_port_elements[] = {&strings[0], &strings[3]};
+  redisReply *empty_host_elements[] = {&strings[4], &strings[1]};
+  redisReply *short_elements[] = {&strings[0]};
+  const redisReply invalid[] = {ARRAY(zero_port_elements), ARRAY(bad_port_elements), ARRAY(empty_host_elements), ARRAY(short_elements), nil};
+  for (size_t i = 0; i != sizeof(invalid) / sizeof(invalid[0]); ++i) {
+    if (sentinel_parse_primary(&invalid[i], host, &port) != STATUS_BAD) {
+      ERROR("parsed invalid reply %zu\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+#undef STRING
+#undef ARRAY
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_parse_primary,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
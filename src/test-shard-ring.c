@@ -0,0 +1,171 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "shard_ring.h"
+
+#define NCHANNELS (20000)
+
+
+static size_t
+channel_name(const size_t i, char *const buffer) {
+  return (size_t)snprintf(buffer, 32, "channel:%zu", i);
+}
+
+
+static bool
+test_balance(void) {
+  static const char *const SHARDS[] = {"redis-a:6379", "redis-b:6379", "redis-c:6379", "redis-d:6379"};
+  size_t counts[4] = {0}, index;
+  char name[32];
+  bool ok = false;
+
+  struct shard_ring *const ring = shard_ring_create();
+  for (size_t i = 0; i != 4; ++i) {
+    if (shard_ring_add(ring, SHARDS[i], &index) != STATUS_OK || index != i) {
+      ERROR("failed to add shard %zu\n", i);
+      goto done;
+    }
+  }
+  if (shard_ring_add(ring, SHARDS[0], &index) != STATUS_EINVAL || shard_ring_nshards(ring) != 4) {
+    ERROR0("duplicate shard was added\n");
+    goto done;
+  }
+
+  for (size_t i = 0; i != NCHANNELS; ++i) {
+    ++counts[shard_ring_find(ring, name, channel_name(i, name))];
+  }
+  for (size_t i = 0; i != 4; ++i) {
+    if (counts[i] < NCHANNELS / 4 * 3 / 4 || counts[i] > NCHANNELS / 4 * 5 / 4) {
+      ERROR("shard %zu has %zu of %d channels\n", i, counts[i], NCHANNELS);
+      goto done;
+    }
+  }
+  ok = true;
+
+done:
+  shard_ring_destroy(ring);
+  return ok;
+}
+
+
+// Adding a fifth shard only moves channels to the new shard, and about a fifth of them.
+static bool
+test_add_moves_few(void) {
+  static const char *const SHARDS[] = {"redis-a:6379", "redis-b:6379", "redis-c:6379", "redis-d:6379", "redis-e:6379"};
+  size_t *const before = malloc(NCHANNELS * sizeof(size_t));
+  size_t index, nmoved = 0;
+  char name[32];
+  bool ok = false;
+
+  struct shard_ring *const ring = shard_ring_create();
+  for (size_t i = 0; i != 4; ++i) {
+    shard_ring_add(ring, SHARDS[i], &index);
+  }
+  for (size_t i = 0; i != NCHANNELS; ++i) {
+    before[i] = shard_ring_find(ring, name, channel_name(i, name));
+  }
+  shard_ring_add(ring, SHARDS[4], &index);
+  for (size_t i = 0; i != NCHANNELS; ++i) {
+    const size_t after = shard_ring_find(ring, name, channel_name(i, name));
+    if (after != before[i] && after != index) {
+      ERROR("channel %zu moved between old shards\n", i);
+      goto done;
+    }
+    nmoved += after != before[i];
+  }
+  if (nmoved < NCHANNELS / 5 * 3 / 4 || nmoved > NCHANNELS / 5 * 5 / 4) {
+    ERROR("%zu of %d channels moved\n", nmoved, NCHANNELS);
+    goto done;
+  }
+  ok = true;
+
+done:
+  free(before);
+  shard_ring_destroy(ring);
+  return ok;
+}
+
+
+// Rings with the same shards agree, whatever order the shards were added in.
+static bool
+test_order_independent(void) {
+  size_t index;
+  char name[32];
+  bool ok = true;
+
+  struct shard_ring *const forwards = shard_ring_create();
+  struct shard_ring *const backwards = shard_ring_create();
+  shard_ring_add(forwards, "redis-a:6379", &index);
+  shard_ring_add(forwards, "redis-b:6379", &index);
+  shard_ring_add(backwards, "redis-b:6379", &index);
+  shard_ring_add(backwards, "redis-a:6379", &index);
+  for (size_t i = 0; i != NCHANNELS && ok; ++i) {
+    const size_t nbytes = channel_name(i, name);
+    if (shard_ring_find(forwards, name, nbytes) != 1 - shard_ring_find(backwards, name, nbytes)) {
+      ERROR("rings disagree on channel %zu\n", i);
+      ok = false;
+    }
+  }
+  shard_ring_destroy(forwards);
+  shard_ring_destroy(backwards);
+  return ok;
+}
+
+
+static bool
+test_parse_name(void) {
+  char host[SHARD_RING_NAME_MAX_NBYTES];
+  uint16_t port;
+
+  if (shard_ring_parse_name("redis-a:6379", host, &port) != STATUS_OK || strcmp(host, "redis-a") != 0 || port != 6379) {
+    ERROR0("failed to parse a host name\n");
+    return false;
+  }
+  if (shard_ring_parse_name("::1:6380", host, &port) != STATUS_OK || strcmp(host, "::1") != 0 || port != 6380) {
+    ERROR0("failed to parse an IPv6 address\n");
+    return false;
+  }
+  static const char *const INVALID[] = {"redis-a", ":6379", "redis-a:", "redis-a:0", "redis-a:65536", "redis-a:63x"};
+  for (size_t i = 0; i != sizeof(INVALID) / sizeof(INVALID[0]); ++i) {
+    if (shard_ring_parse_name(INVALID[i], host, &port) != STATUS_EINVAL) {
+      ERROR("parsed invalid name '%s'\n", INVALID[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_balance,
+  &test_add_moves_few,
+  &test_order_independent,
+  &test_parse_name,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
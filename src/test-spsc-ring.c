@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "logging.h"
+#include "spsc_ring.h"
+
+#define NVALUES_THREADED (100000)
+
+
+static bool
+test_empty(void) {
+  struct spsc_ring *const ring = spsc_ring_create(4);
+  if (ring == NULL) {
+    ERROR0("ring is NULL\n");
+    return false;
+  }
+  if (spsc_ring_pop(ring) != NULL) {
+    ERROR0("pop on an empty ring did not return NULL\n");
+    goto fail;
+  }
+  spsc_ring_destroy(ring);
+  return true;
+
+fail:
+  spsc_ring_destroy(ring);
+  return false;
+}
+
+
+static bool
+test_full(void) {
+  struct spsc_ring *const ring = spsc_ring_create(3);  // Rounded up to 4.
+  if (ring == NULL) {
+    ERROR0("ring is NULL\n");
+    return false;
+  }
+  for (uintptr_t i = 1; i != 5; ++i) {
+    if (!spsc_ring_push(ring, (void *)i)) {
+      ERROR("push %zu failed\n", (size_t)i);
+      goto fail;
+    }
+  }
+  if (spsc_ring_push(ring, (void *)5)) {
+    ERROR0("push on a full ring succeeded\n");
+    goto fail;
+  }
+  for (uintptr_t i = 1; i != 5; ++i) {
+    const uintptr_t value = (uintptr_t)spsc_ring_pop(ring);
+    if (value != i) {
+      ERROR("popped %zu != %zu\n", (size_t)value, (size_t)i);
+      goto fail;
+    }
+  }
+  if (spsc_ring_pop(ring) != NULL) {
+    ERROR0("pop on an empty ring did not return NULL\n");
+    goto fail;
+  }
+  spsc_ring_destroy(ring);
+  return true;
+
+fail:
+  spsc_ring_destroy(ring);
+  return false;
+}
+
+
+static bool
+test_wrap_around(void) {
+  struct spsc_ring *const ring = spsc_ring_create(4);
+  if (ring == NULL) {
+    ERROR0("ring is NULL\n");
+    return false;
+  }
+  for (uintptr_t i = 1; i != 100; ++i) {
+    if (!spsc_ring_push(ring, (void *)i) || !spsc_ring_push(ring, (void *)(i + 1000))) {
+      ERROR("push %zu failed\n", (size_t)i);
+      goto fail;
+    }
+    if ((uintptr_t)spsc_ring_pop(ring) != i || (uintptr_t)spsc_ring_pop(ring) != i + 1000) {
+      ERROR("pop %zu returned the wrong value\n", (size_t)i);
+      goto fail;
+    }
+  }
+  spsc_ring_destroy(ring);
+  return true;
+
+fail:
+  spsc_ring_destroy(ring);
+  return false;
+}
+
+
+static void *
+produce(void *const arg) {
+  struct spsc_ring *const ring = arg;
+  for (uintptr_t i = 1; i <= NVALUES_THREADED; ) {
+    if (spsc_ring_push(ring, (void *)i)) {
+      ++i;
+    }
+    else {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+
+static bool
+test_threaded(void) {
+  pthread_t producer;
+  struct spsc_ring *const ring = spsc_ring_create(64);
+  if (ring == NULL) {
+    ERROR0("ring is NULL\n");
+    return false;
+  }
+  if (pthread_create(&producer, NULL, &produce, ring) != 0) {
+    ERROR0("pthread_create failed\n");
+    goto fail;
+  }
+
+  // Values must come out in order and none may be lost.
+  bool in_order = true;
+  for (uintptr_t expected = 1; expected <= NVALUES_THREADED; ) {
+    const uintptr_t value = (uintptr_t)spsc_ring_pop(ring);
+    if (value == 0) {
+      sched_yield();
+      continue;
+    }
+    if (value != expected) {
+      in_order = false;
+    }
+    ++expected;
+  }
+  pthread_join(producer, NULL);
+  if (!in_order) {
+    ERROR0("values were popped out of order\n");
+    goto fail;
+  }
+  spsc_ring_destroy(ring);
+  return true;
+
+fail:
+  spsc_ring_destroy(ring);
+  return false;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_empty,
+  &test_full,
+  &test_wrap_around,
+  &test_threaded,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "logging.h"
+#include "streams.h"
+
+
+static bool
+test_id_parse(void) {
+  struct stream_id id;
+
+  if (stream_id_parse(&id, "1526919030474-55", 16) != STATUS_OK || id.ms != 1526919030474 || id.seq != 55) {
+    ERROR0("parse of a full ID failed\n");
+    return false;
+  }
+  if (stream_id_parse(&id, "1526919030474", 13) != STATUS_OK || id.ms != 1526919030474 || id.seq != 0) {
+    ERROR0("parse of an ID without a sequence number failed\n");
+    return false;
+  }
+  if (stream_id_parse(&id, "18446744073709551615-18446744073709551615", 41) != STATUS_OK || id.ms != UINT64_MAX || id.seq != UINT64_MAX) {
+    ERROR0("parse of the largest ID failed\n");
+    return false;
+  }
+
+  static const char *const INVALID[] = {"", "-", "1-", "-1", "1-2-3", "1.2", "a-1", "18446744073709551616-0", NULL};
+  for (size_t i = 0; INVALID[i] != NULL; ++i) {
+    if (stream_id_parse(&id, INVALID[i], strlen(INVALID[i])) != STATUS_EINVAL) {
+      ERROR("parse of invalid ID '%s' did not fail\n", INVALID[i]);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+static bool
+test_id_format(void) {
+  char buffer[STREAM_ID_MAX_NBYTES];
+  struct stream_id id = {.ms = 1526919030474, .seq = 55};
+
+  if (stream_id_format(&id, buffer) != 16 || strcmp(buffer, "1526919030474-55") != 0) {
+    ERROR("format gave '%s'\n", buffer);
+    return false;
+  }
+  id.ms = UINT64_MAX;
+  id.seq = UINT64_MAX;
+  if (stream_id_format(&id, buffer) != 41 || strcmp(buffer, "18446744073709551615-18446744073709551615") != 0) {
+    ERROR("format of the largest ID gave '%s'\n", buffer);
+    return false;
+  }
+
+  return true;
+}
+
+
+static bool
+test_id_order(void) {
+  const struct stream_id zero = {.ms = 0, .seq = 0};
+  const struct stream_id a = {.ms = 5, .seq = UINT64_MAX};
+  const struct stream_id b = {.ms = 6, .seq = 0};
+  const struct stream_id c = {.ms = 6, .seq = 1};
+  struct stream_id next;
+
+  if (stream_id_is_set(&zero) || !stream_id_is_set(&a)) {
+    ERROR0("is_set is wrong\n");
+    return false;
+  }
+  if (stream_id_compare(&a, &b) >= 0 || stream_id_compare(&c, &b) <= 0 || stream_id_compare(&b, &b) != 0 || stream_id_compare(&zero, &a) >= 0) {
+    ERROR0("compare is wrong\n");
+    return false;
+  }
+  stream_id_next(&a, &next);
+  if (stream_id_compare(&next, &b) != 0) {
+    ERROR0("next of a full sequence did not move on to the next millisecond\n");
+    return false;
+  }
+  stream_id_next(&b, &next);
+  if (stream_id_compare(&next, &c) != 0) {
+    ERROR0("next did not increment the sequence\n");
+    return false;
+  }
+
+  return true;
+}
+
+
+static bool
+test_entries_parse(void) {
+  // [["1-1", ["data", "a"]], ["1-2", ["other", "x"]], ["2-0", ["other", "x", "data", "bc"]]]
+  redisReply strings[] = {
+    {.type = REDIS_REPLY_STRING, .str = "1-1", .len = 3},
+    {.type = REDIS_REPLY_STRING, .str = "data", .len = 4},
+    {.type = REDIS_REPLY_STRING, .str = "a", .len = 1},
+    {.type = REDIS_REPLY_STRING, .str = "1-2", .len = 3},
+    {.type = REDIS_REPLY_STRING, .str = "other", .len = 5},
+    {.type = REDIS_REPLY_STRING, .str = "x", .len = 1},
+    {.type = REDIS_REPLY_STRING, .str = "2-0", .len = 3},
+    {.type = REDIS_REPLY_STRING, .str = "bc", .len = 2},
+  };
+  redisReply *fields0[] = {&strings[1], &strings[2]};
+  redisReply *fields1[] = {&strings[4], &strings[5]};
+  redisReply *fields2[] = {&strings[4], &strings[5], &strings[1], &strings[7]};
+  redisReply field_arrays[] = {
+    {.type = REDIS_REPLY_ARRAY, .elements = 2, .element = fields0},
+    {.type = REDIS_REPLY_ARRAY, .elements = 2, .element = fields1},
+    {.type = REDIS_REPLY_ARRAY, .elements = 4, .element = fields2},
+  };
+  redisReply *entry0[] = {&strings[0], &field_arrays[0]};
+  redisReply *entry1[] = {&strings[3], &field_arrays[1]};
+  redisReply *entry2[] = {&strings[6], &field_arrays[2]};
+  redisReply entry_arrays[] = {
+    {.type = REDIS_REPLY_ARRAY, .elements = 2, .element = entry0},
+    {.type = REDIS_REPLY_ARRAY, .elements = 2, .element = entry1},
+    {.type = REDIS_REPLY_ARRAY, .elements = 2, .element = entry2},
+  };
+  redisReply *entries_elements[] = {&entry_arrays[0], &entry_arrays[1], &entry_arrays[2]};
+  const redisReply reply = {.type = REDIS_REPLY_ARRAY, .elements = 3, .element = entries_elements};
+  struct stream_entry entries[3];
+
+  // The entry without a `data` field is skipped.
+  const size_t nentries = stream_entries_parse(&reply, entries, 3);
+  if (nentries != 2) {
+    ERROR("parsed %zu entries\n", nentries);
+    return false;
+  }
+  if (entries[0].id.ms != 1 || entries[0].id.seq != 1 || entries[0].data_nbytes != 1 || memcmp(entries[0].data, "a", 1) != 0) {
+    ERROR0("first entry is wrong\n");
+    return false;
+  }
+  if (entries[1].id.ms != 2 || entries[1].id.seq != 0 || entries[1].data_nbytes != 2 || memcmp(entries[1].data, "bc", 2) != 0) {
+    ERROR0("second entry is wrong\n");
+    return false;
+  }
+  if (stream_entries_parse(&reply, entries, 1) != 1) {
+    ERROR0("parse did not stop at the maximum number of entries\n");
+    return false;
+  }
+
+  return true;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_id_parse,
+  &test_id_format,
+  &test_id_order,
+  &test_entries_parse,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "unmask.h"
+
+#define MAX_NBYTES (300)
+
+static const uint8_t MASKING_KEY[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+
+static bool
+test_rfc_example(void) {
+  // The masked "Hello" from https://tools.ietf.org/html/rfc6455#section-5.7
+  static const uint8_t MASKED[] = {0x7f, 0x9f, 0x4d, 0x51, 0x58};
+  uint8_t unmasked[sizeof(MASKED)];
+  unmask(unmasked, MASKED, sizeof(MASKED), MASKING_KEY, 0);
+  if (memcmp(unmasked, "Hello", 5) != 0) {
+    ERROR0("unmasked the RFC example incorrectly\n");
+    return false;
+  }
+  return true;
+}
+
+
+static bool
+test_matches_bytewise(void) {
+  uint8_t src[MAX_NBYTES + 32], dst[MAX_NBYTES + 32];
+  for (size_t i = 0; i != sizeof(src); ++i) {
+    src[i] = (uint8_t)(i * 131 + 7);
+  }
+
+  // Every length up to past the widest kernel's unrolled loop, from misaligned addresses, starting
+  // at every masking key byte.
+  for (size_t nbytes = 0; nbytes <= MAX_NBYTES; ++nbytes) {
+    for (size_t align = 0; align < 32; align += 7) {
+      for (size_t offset = 0; offset != 8; ++offset) {
+        unmask(dst + align, src + align, nbytes, MASKING_KEY, offset);
+        for (size_t i = 0; i != nbytes; ++i) {
+          if (dst[align + i] != (src[align + i] ^ MASKING_KEY[(offset + i) & 0x03])) {
+            ERROR("byte %zu of %zu is wrong with align=%zu offset=%zu using %s\n", i, nbytes, align, offset, unmask_kernel_name());
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+static bool
+test_in_place(void) {
+  uint8_t bytes[MAX_NBYTES];
+  for (size_t i = 0; i != sizeof(bytes); ++i) {
+    bytes[i] = (uint8_t)i;
+  }
+
+  // Masking is its own inverse, so unmasking twice in place gives back the original.
+  unmask(bytes, bytes, sizeof(bytes), MASKING_KEY, 3);
+  unmask(bytes, bytes, sizeof(bytes), MASKING_KEY, 3);
+  for (size_t i = 0; i != sizeof(bytes); ++i) {
+    if (bytes[i] != (uint8_t)i) {
+      ERROR("byte %zu changed after unmasking twice in place\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_rfc_example,
+  &test_matches_bytewise,
+  &test_in_place,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
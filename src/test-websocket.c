@@ -0,0 +1,433 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "client_connection.h"
+#include "logging.h"
+#include "websocket.h"
+
+#define MAX_NMESSAGES (8)
+#define MAX_HEADER_NBYTES (14)
+#define MAX_PAYLOAD_NBYTES (16 * 1024 * 1024)
+
+static const uint8_t MASKING_KEY[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+enum {
+  OPCODE_CONTINUATION = 0x0,
+  OPCODE_TEXT = 0x1,
+  OPCODE_BINARY = 0x2,
+  OPCODE_PING = 0x9,
+  OPCODE_PONG = 0xa,
+};
+
+
+// A websocket reading from one end of a bufferevent pair, as a client writes frames into the other.
+struct harness {
+  struct event_base *event_base;
+  struct bufferevent *pair[2];
+  struct client_connection client;
+  struct websocket *ws;
+
+  // The messages which were received, in order.
+  size_t nmessages;
+  bool is_binary[MAX_NMESSAGES];
+  struct evbuffer *messages[MAX_NMESSAGES];
+};
+
+static struct harness harness;
+
+
+static void
+on_message(struct websocket *const ws) {
+  if (harness.nmessages == MAX_NMESSAGES) {
+    ERROR0("too many messages\n");
+    return;
+  }
+  harness.is_binary[harness.nmessages] = ws->in_message_is_binary;
+  harness.messages[harness.nmessages] = evbuffer_new();
+  evbuffer_add_buffer(harness.messages[harness.nmessages], ws->in_message_buffer);
+  ++harness.nmessages;
+}
+
+
+static void
+on_read(struct bufferevent *const bev, void *const arg) {
+  (void)arg;
+  websocket_consume(harness.ws, bufferevent_get_input(bev));
+}
+
+
+static bool
+harness_init(void) {
+  memset(&harness, 0, sizeof(harness));
+  harness.event_base = event_base_new();
+  if (harness.event_base == NULL || bufferevent_pair_new(harness.event_base, 0, harness.pair) != 0) {
+    ERROR0("failed to create the bufferevent pair\n");
+    return false;
+  }
+  harness.client.fd = -1;
+  harness.client.event_loop = harness.event_base;
+  harness.client.bev = harness.pair[0];
+  harness.ws = websocket_init(&harness.client, &on_message);
+  if (harness.ws == NULL) {
+    ERROR0("websocket_init failed\n");
+    return false;
+  }
+  harness.client.ws = harness.ws;
+  harness.ws->in_state = WS_OPEN;
+  bufferevent_setcb(harness.pair[0], &on_read, NULL, NULL, NULL);
+  bufferevent_enable(harness.pair[0], EV_READ | EV_WRITE);
+  bufferevent_enable(harness.pair[1], EV_READ | EV_WRITE);
+  return true;
+}
+
+
+static void
+harness_destroy(void) {
+  for (size_t i = 0; i != harness.nmessages; ++i) {
+    evbuffer_free(harness.messages[i]);
+  }
+  if (harness.ws != NULL) {
+    websocket_destroy(harness.ws);
+  }
+  for (size_t i = 0; i != 2; ++i) {
+    if (harness.pair[i] != NULL) {
+      bufferevent_free(harness.pair[i]);
+    }
+  }
+  if (harness.event_base != NULL) {
+    event_base_free(harness.event_base);
+  }
+}
+
+
+// Writes bytes from the client's end of the pair, and runs the event loop until they're handled.
+static void
+client_write(const void *const bytes, const size_t nbytes) {
+  bufferevent_write(harness.pair[1], bytes, nbytes);
+  event_base_loop(harness.event_base, EVLOOP_NONBLOCK);
+}
+
+
+static void
+client_write_buffer(struct evbuffer *const buffer) {
+  bufferevent_write_buffer(harness.pair[1], buffer);
+  event_base_loop(harness.event_base, EVLOOP_NONBLOCK);
+}
+
+
+/**
+ * Writes a masked frame header to `header`, with a 7-bit length if `length_nbytes` is 0, or the
+ * 16-bit or 64-bit extended length if it's 2 or 8, and returns the header's length.
+ **/
+static size_t
+format_header(uint8_t *const header, const bool is_final, const uint8_t opcode, const uint64_t nbytes, const size_t length_nbytes) {
+  size_t upto = 2;
+  header[0] = (is_final ? 0x80 : 0x00) | opcode;
+  header[1] = 0x80 | ((length_nbytes == 0) ? (uint8_t)nbytes : (length_nbytes == 2) ? 126 : 127);
+  for (size_t i = 0; i != length_nbytes; ++i) {
+    header[upto++] = (uint8_t)(nbytes >> (8 * (length_nbytes - 1 - i)));
+  }
+  memcpy(header + upto, MASKING_KEY, sizeof(MASKING_KEY));
+  return upto + sizeof(MASKING_KEY);
+}
+
+
+// Adds a whole masked frame to `out`.
+static void
+add_frame(struct evbuffer *const out, const bool is_final, const uint8_t opcode, const void *const payload, const size_t nbytes, const size_t length_nbytes) {
+  uint8_t header[MAX_HEADER_NBYTES];
+  evbuffer_add(out, header, format_header(header, is_final, opcode, nbytes, length_nbytes));
+  for (size_t i = 0; i != nbytes; ++i) {
+    const uint8_t byte = ((const uint8_t *)payload)[i] ^ MASKING_KEY[i & 0x03];
+    evbuffer_add(out, &byte, 1);
+  }
+}
+
+
+static bool
+message_is(const size_t index, const bool is_binary, const void *const payload, const size_t nbytes) {
+  if (index >= harness.nmessages) {
+    ERROR("message %zu was not received\n", index);
+    return false;
+  }
+  struct evbuffer *const message = harness.messages[index];
+  if (harness.is_binary[index] != is_binary || evbuffer_get_length(message) != nbytes || (nbytes != 0 && memcmp(evbuffer_pullup(message, -1), payload, nbytes) != 0)) {
+    ERROR("message %zu is wrong: %zu bytes, is_binary=%d\n", index, evbuffer_get_length(message), harness.is_binary[index]);
+    return false;
+  }
+  return true;
+}
+
+
+// Several frames which arrive in a single read are all handled.
+static bool
+test_coalesced(void) {
+  bool is_ok = false;
+  if (!harness_init()) {
+    goto done;
+  }
+
+  struct evbuffer *const frames = evbuffer_new();
+  add_frame(frames, true, OPCODE_TEXT, "one", 3, 0);
+  add_frame(frames, true, OPCODE_BINARY, "two", 3, 0);
+  add_frame(frames, true, OPCODE_TEXT, "", 0, 0);
+  add_frame(frames, true, OPCODE_TEXT, "three", 5, 0);
+  client_write_buffer(frames);
+  evbuffer_free(frames);
+
+  if (harness.nmessages != 4) {
+    ERROR("%zu messages received\n", harness.nmessages);
+    goto done;
+  }
+  is_ok = message_is(0, false, "one", 3) && message_is(1, true, "two", 3) && message_is(2, false, "", 0) && message_is(3, false, "three", 5);
+  if (is_ok && evbuffer_get_length(bufferevent_get_input(harness.pair[0])) != 0) {
+    ERROR0("frames were left in the input buffer\n");
+    is_ok = false;
+  }
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+// A frame split anywhere in its header, with each length encoding, is handled once the rest arrives.
+static bool
+test_split_header(void) {
+  static const struct {
+    size_t nbytes;
+    size_t length_nbytes;
+  } FRAMES[] = {
+    {100, 0},
+    {300, 2},
+    {70000, 8},
+  };
+  static const size_t SPLITS[] = {1, 2, 4, 8, 13, 14};
+  bool is_ok = true;
+
+  uint8_t *const payload = malloc(FRAMES[2].nbytes);
+  if (payload == NULL) {
+    ERROR0("malloc failed\n");
+    return false;
+  }
+  for (size_t i = 0; i != FRAMES[2].nbytes; ++i) {
+    payload[i] = (uint8_t)(i * 131 + 7);
+  }
+
+  for (size_t f = 0; f != sizeof(FRAMES) / sizeof(FRAMES[0]) && is_ok; ++f) {
+    for (size_t s = 0; s != sizeof(SPLITS) / sizeof(SPLITS[0]) && is_ok; ++s) {
+      // The later splits are past the end of the shorter headers.
+      const size_t header_nbytes = 6 + FRAMES[f].length_nbytes;
+      if (SPLITS[s] > header_nbytes) {
+        continue;
+      }
+      is_ok = harness_init();
+      if (is_ok) {
+        struct evbuffer *const frame = evbuffer_new();
+        add_frame(frame, true, OPCODE_BINARY, payload, FRAMES[f].nbytes, FRAMES[f].length_nbytes);
+        uint8_t head[MAX_HEADER_NBYTES];
+        evbuffer_remove(frame, head, SPLITS[s]);
+        client_write(head, SPLITS[s]);
+        if (harness.nmessages != 0 || harness.ws->in_state != WS_OPEN) {
+          ERROR("the first %zu bytes of a %zu byte frame were handled as a frame\n", SPLITS[s], FRAMES[f].nbytes);
+          is_ok = false;
+        }
+        client_write_buffer(frame);
+        evbuffer_free(frame);
+        if (is_ok && !message_is(0, true, payload, FRAMES[f].nbytes)) {
+          ERROR("a %zu byte frame split after %zu bytes was misread\n", FRAMES[f].nbytes, SPLITS[s]);
+          is_ok = false;
+        }
+      }
+      harness_destroy();
+    }
+  }
+  free(payload);
+  return is_ok;
+}
+
+
+// A PING between the fragments of a message is answered, and the message is still put together.
+static bool
+test_fragmented_with_ping(void) {
+  uint8_t pong[2 + 5];
+  bool is_ok = false;
+  if (!harness_init()) {
+    goto done;
+  }
+
+  struct evbuffer *const frames = evbuffer_new();
+  add_frame(frames, false, OPCODE_TEXT, "Hel", 3, 0);
+  add_frame(frames, true, OPCODE_PING, "ping!", 5, 0);
+  add_frame(frames, false, OPCODE_CONTINUATION, "lo, ", 4, 0);
+  client_write_buffer(frames);
+  if (harness.nmessages != 0) {
+    ERROR0("an unfinished message was delivered\n");
+    evbuffer_free(frames);
+    goto done;
+  }
+  add_frame(frames, true, OPCODE_CONTINUATION, "world", 5, 2);
+  client_write_buffer(frames);
+  evbuffer_free(frames);
+
+  if (harness.nmessages != 1 || !message_is(0, false, "Hello, world", 12)) {
+    goto done;
+  }
+  websocket_flush_output(harness.ws);
+  event_base_loop(harness.event_base, EVLOOP_NONBLOCK);
+  struct evbuffer *const out = bufferevent_get_input(harness.pair[1]);
+  if (evbuffer_get_length(out) != sizeof(pong) || evbuffer_remove(out, pong, sizeof(pong)) != sizeof(pong) ||
+      pong[0] != (0x80 | OPCODE_PONG) || pong[1] != 5 || memcmp(pong + 2, "ping!", 5) != 0) {
+    ERROR0("the PING was not answered with a matching PONG\n");
+    goto done;
+  }
+  is_ok = true;
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+// A frame longer than the largest allowed payload closes the connection as soon as its header arrives.
+static bool
+test_oversize_frame(void) {
+  uint8_t header[MAX_HEADER_NBYTES];
+  bool is_ok = false;
+  if (!harness_init()) {
+    goto done;
+  }
+
+  client_write(header, format_header(header, true, OPCODE_BINARY, (uint64_t)MAX_PAYLOAD_NBYTES + 1, 8));
+  if (harness.ws->in_state != WS_CLOSED || harness.nmessages != 0) {
+    ERROR0("an oversize frame did not close the connection\n");
+    goto done;
+  }
+  is_ok = true;
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+// A fragmented control frame closes the connection without being answered.
+static bool
+test_fragmented_control_frame(void) {
+  bool is_ok = false;
+  if (!harness_init()) {
+    goto done;
+  }
+
+  struct evbuffer *const frames = evbuffer_new();
+  add_frame(frames, false, OPCODE_PING, "ping!", 5, 0);
+  add_frame(frames, true, OPCODE_TEXT, "after", 5, 0);
+  client_write_buffer(frames);
+  evbuffer_free(frames);
+  websocket_flush_output(harness.ws);
+  event_base_loop(harness.event_base, EVLOOP_NONBLOCK);
+
+  if (harness.ws->in_state != WS_CLOSED || harness.nmessages != 0) {
+    ERROR0("a fragmented control frame did not close the connection\n");
+    goto done;
+  }
+  if (evbuffer_get_length(bufferevent_get_input(harness.pair[1])) != 0) {
+    ERROR0("a fragmented control frame was answered\n");
+    goto done;
+  }
+  is_ok = true;
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+// Payloads spread over many more evbuffer chunks than are peeked at at once are unmasked whole.
+static bool
+test_chunked_payload(void) {
+  enum { NCHUNKS = 50, CHUNK_NBYTES = 7 };
+  uint8_t payload[NCHUNKS * CHUNK_NBYTES], masked[NCHUNKS * CHUNK_NBYTES], header[MAX_HEADER_NBYTES];
+  uint8_t pong[4 + NCHUNKS * CHUNK_NBYTES];
+  bool is_ok = false;
+  if (!harness_init()) {
+    goto done;
+  }
+
+  for (size_t i = 0; i != sizeof(payload); ++i) {
+    payload[i] = (uint8_t)(i * 131 + 7);
+    masked[i] = payload[i] ^ MASKING_KEY[i & 0x03];
+  }
+
+  // Each reference is a chunk of its own, and they're moved, not copied, through the pair.
+  struct evbuffer *const frame = evbuffer_new();
+  evbuffer_add(frame, header, format_header(header, true, OPCODE_TEXT, sizeof(payload), 2));
+  for (size_t i = 0; i != NCHUNKS; ++i) {
+    evbuffer_add_reference(frame, masked + i * CHUNK_NBYTES, CHUNK_NBYTES, NULL, NULL);
+  }
+  client_write_buffer(frame);
+  if (!message_is(0, false, payload, sizeof(payload))) {
+    evbuffer_free(frame);
+    goto done;
+  }
+
+  // And the same again for a control frame, whose payload is unmasked onto the stack.
+  evbuffer_add(frame, header, format_header(header, true, OPCODE_PING, 100, 0));
+  for (size_t i = 0; i != 100 / 5; ++i) {
+    evbuffer_add_reference(frame, masked + i * 5, 5, NULL, NULL);
+  }
+  client_write_buffer(frame);
+  evbuffer_free(frame);
+  websocket_flush_output(harness.ws);
+  event_base_loop(harness.event_base, EVLOOP_NONBLOCK);
+  struct evbuffer *const out = bufferevent_get_input(harness.pair[1]);
+  if (evbuffer_get_length(out) != 2 + 100 || evbuffer_remove(out, pong, 2 + 100) != 2 + 100 || memcmp(pong + 2, payload, 100) != 0) {
+    ERROR0("a chunked PING was not answered with a matching PONG\n");
+    goto done;
+  }
+  is_ok = true;
+
+done:
+  harness_destroy();
+  return is_ok;
+}
+
+
+typedef bool(*test_function_t)(void);
+static const test_function_t TEST_CASES[] = {
+  &test_coalesced,
+  &test_split_header,
+  &test_fragmented_with_ping,
+  &test_oversize_frame,
+  &test_fragmented_control_frame,
+  &test_chunked_payload,
+  NULL,
+};
+
+
+int
+main(void) {
+  unsigned int npassed = 0, nfailed = 0;
+  logging_open("/dev/stderr");
+  for (size_t i = 0; ; ++i) {
+    if (TEST_CASES[i] == NULL) {
+      break;
+    }
+    else if (TEST_CASES[i]()) {
+      ++npassed;
+    }
+    else {
+      ++nfailed;
+    }
+  }
+  printf("#passed: %d\n", npassed);
+  printf("#failed: %d\n", nfailed);
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+#include "unmask.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+
+// Spans shorter than this aren't worth the vector setup.
+#define MIN_VECTOR_NBYTES (32)
+
+
+static inline uint64_t
+rotated_mask(const uint8_t *const masking_key, const size_t offset) {
+  // The 8 mask bytes which line up with a span starting `offset` bytes into the payload, in memory
+  // order, so that loading 8 payload bytes and XORing them with this works on any endianness.
+  uint8_t bytes[8];
+  for (size_t i = 0; i != 8; ++i) {
+    bytes[i] = masking_key[(offset + i) & 0x03];
+  }
+  uint64_t mask;
+  memcpy(&mask, bytes, sizeof(mask));
+  return mask;
+}
+
+
+static size_t
+unmask_scalar(uint8_t *const dst, const uint8_t *const src, const size_t nbytes, const uint64_t mask) {
+  size_t i = 0;
+  for (; i + 8 <= nbytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, 8);
+    word ^= mask;
+    memcpy(dst + i, &word, 8);
+  }
+  return i;
+}
+
+
+#ifdef HAS_X86_DISPATCH
+__attribute__((target("sse2")))
+static size_t
+unmask_sse2(uint8_t *const dst, const uint8_t *const src, const size_t nbytes, const uint64_t mask) {
+  const __m128i vmask = _mm_set1_epi64x((long long)mask);
+  size_t i = 0;
+  for (; i + 64 <= nbytes; i += 64) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+    const __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+    const __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, vmask));
+    _mm_storeu_si128((__m128i *)(dst + i + 16), _mm_xor_si128(b, vmask));
+    _mm_storeu_si128((__m128i *)(dst + i + 32), _mm_xor_si128(c, vmask));
+    _mm_storeu_si128((__m128i *)(dst + i + 48), _mm_xor_si128(d, vmask));
+  }
+  for (; i + 16 <= nbytes; i += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, vmask));
+  }
+  return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+unmask_avx2(uint8_t *const dst, const uint8_t *const src, const size_t nbytes, const uint64_t mask) {
+  const __m256i vmask = _mm256_set1_epi64x((long long)mask);
+  size_t i = 0;
+  for (; i + 128 <= nbytes; i += 128) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+    const __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+    const __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, vmask));
+    _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_xor_si256(b, vmask));
+    _mm256_storeu_si256((__m256i *)(dst + i + 64), _mm256_xor_si256(c, vmask));
+    _mm256_storeu_si256((__m256i *)(dst + i + 96), _mm256_xor_si256(d, vmask));
+  }
+  for (; i + 32 <= nbytes; i += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, vmask));
+  }
+  return i;
+}
+#endif
+
+
+typedef size_t (*unmask_kernel_t)(uint8_t *dst, const uint8_t *src, size_t nbytes, uint64_t mask);
+
+static unmask_kernel_t
+pick_kernel(const char **const name) {
+#ifdef HAS_X86_DISPATCH
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return &unmask_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    *name = "sse2";
+    return &unmask_sse2;
+  }
+#endif
+  *name = "scalar";
+  return &unmask_scalar;
+}
+
+
+void
+unmask(uint8_t *const dst, const uint8_t *const src, const size_t nbytes, const uint8_t *const masking_key, const size_t offset) {
+  size_t i = 0;
+
+  // XOR whole vectors (or 64-bit words) at once. Every one of them starts a multiple of 4 bytes
+  // after `src`, so they all share the same mask, rotated for where `src` starts.
+  if (nbytes >= MIN_VECTOR_NBYTES) {
+    const char *name;
+    i = pick_kernel(&name)(dst, src, nbytes, rotated_mask(masking_key, offset));
+  }
+  i += unmask_scalar(dst + i, src + i, nbytes - i, rotated_mask(masking_key, offset + i));
+
+  // Then the tail, one byte at a time.
+  for (; i != nbytes; ++i) {
+    dst[i] = src[i] ^ masking_key[(offset + i) & 0x03];
+  }
+}
+
+
+const char *
+unmask_kernel_name(void) {
+  const char *name;
+  pick_kernel(&name);
+  return name;
+}
@@ -0,0 +1,15 @@
+/**
+ * Unmasking of the payloads of the frames which clients send, which are XORed with a 4 byte masking
+ * key. Whole spans are XORed at once with the widest instructions that the CPU supports, picked at
+ * runtime, falling back to 64 bits at a time.
+ **/
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+// Unmasks `nbytes` of `src` into `dst`, which may be the same. `offset` is where `src` starts within
+// the frame's payload, which selects the masking key byte to start from.
+void        unmask(uint8_t *dst, const uint8_t *src, size_t nbytes, const uint8_t *masking_key, size_t offset);
+const char *unmask_kernel_name(void);
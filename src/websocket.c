@@ -8,6 +8,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -19,6 +20,7 @@
 #include "compat_openssl.h"
 #include "http.h"
 #include "logging.h"
+#include "unmask.h"
 
 // From https://tools.ietf.org/html/rfc6455#section-4.2.2
 static const char *const SEC_WEBSOCKET_KEY_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -40,72 +42,175 @@ enum websocket_opcode {
 // ================================================================================================
 // Sending data across the WebSocket.
 // ================================================================================================
+// An immutable, fully encoded frame which is shared between many websockets' output buffers.
+struct websocket_frame {
+  size_t refcount;
+  size_t nbytes;
+  uint8_t bytes[];
+};
+
+
+#define MAX_FRAME_HEADER_NBYTES (10)
+
+// Websocket IDs start from 1, so that 0 can mean "no websocket".
+static atomic_uint_least64_t next_id = 1;
+
+
+// Coalesces the output of many frames into a single write per websocket. Websockets with queued
+// frames are linked into the dirty list and are all flushed together once per event loop iteration,
+// or once per window if one is configured.
+struct websocket_flusher {
+  struct event *flush_event;
+  bool has_window;
+  struct timeval window;
+  bool is_scheduled;
+  struct websocket *dirty;
+
+  // Statistics.
+  uint64_t nframes;
+  uint64_t nflushes;
+};
+
+
+static void
+on_flush(const evutil_socket_t fd, const short events, void *const arg) {
+  struct websocket_flusher *const flusher = (struct websocket_flusher *)arg;
+  struct websocket *ws;
+  (void)fd;
+  (void)events;
+
+  flusher->is_scheduled = false;
+  while ((ws = flusher->dirty) != NULL) {
+    flusher->dirty = ws->dirty_next;
+    if (ws->dirty_next != NULL) {
+      ws->dirty_next->dirty_pprev = &flusher->dirty;
+    }
+    ws->dirty_next = NULL;
+    ws->dirty_pprev = NULL;
+
+    websocket_flush_output(ws);
+    ++flusher->nflushes;
+  }
+}
+
+
+static void
+dirty_list_remove(struct websocket *const ws) {
+  if (ws->dirty_pprev == NULL) {
+    return;
+  }
+  *ws->dirty_pprev = ws->dirty_next;
+  if (ws->dirty_next != NULL) {
+    ws->dirty_next->dirty_pprev = ws->dirty_pprev;
+  }
+  ws->dirty_next = NULL;
+  ws->dirty_pprev = NULL;
+}
+
+
+/**
+ * Called once a frame has been queued in `ws->out`. Either flushes straight away, or marks the
+ * websocket as dirty so that it's flushed along with any other frames queued in the meantime.
+ **/
 static enum status
-send_frame(struct websocket *const ws, const enum websocket_opcode opcode, struct evbuffer *const payload) {
+queue_flush(struct websocket *const ws) {
+  struct websocket_flusher *const flusher = ws->client->flusher;
+  if (flusher == NULL) {
+    return websocket_flush_output(ws);
+  }
+
+  ++flusher->nframes;
+  if (ws->dirty_pprev == NULL) {
+    ws->dirty_next = flusher->dirty;
+    if (flusher->dirty != NULL) {
+      flusher->dirty->dirty_pprev = &ws->dirty_next;
+    }
+    ws->dirty_pprev = &flusher->dirty;
+    flusher->dirty = ws;
+  }
+
+  if (!flusher->is_scheduled) {
+    if (flusher->has_window) {
+      if (event_add(flusher->flush_event, &flusher->window) == -1) {
+        return STATUS_BAD;
+      }
+    }
+    else {
+      event_active(flusher->flush_event, EV_TIMEOUT, 0);
+    }
+    flusher->is_scheduled = true;
+  }
+
+  return STATUS_OK;
+}
+
+
+static size_t
+write_frame_header(uint8_t *const header, const enum websocket_opcode opcode, const uint64_t nbytes) {
   // Write the first two header bytes of the frame.
-  uint8_t prefix[2];
-  const uint64_t nbytes = evbuffer_get_length(payload);
+  header[0] = 0x80 | ((uint8_t)opcode);
   if (nbytes > UINT16_MAX) {
-    prefix[1] = 127;
+    header[1] = 127;
   }
   else if (nbytes > 125) {
-    prefix[1] = 126;
+    header[1] = 126;
   }
   else {
-    prefix[1] = nbytes;
+    header[1] = nbytes;
   }
-  prefix[0] = 0x80 | ((uint8_t)opcode);
-  evbuffer_add(ws->out, &prefix[0], 2);
 
   // Write an extended payload length if it's needed.
   if (nbytes > UINT16_MAX) {
-    uint64_t length = htobe64(nbytes);
-    evbuffer_add(ws->out, &length, 8);
+    const uint64_t length = htobe64(nbytes);
+    memcpy(&header[2], &length, 8);
+    return 10;
   }
   else if (nbytes > 125) {
-    uint16_t length = htobe16(nbytes);
-    evbuffer_add(ws->out, &length, 2);
+    const uint16_t length = htobe16(nbytes);
+    memcpy(&header[2], &length, 2);
+    return 4;
   }
+  return 2;
+}
+
+
+static enum status
+send_frame(struct websocket *const ws, const enum websocket_opcode opcode, struct evbuffer *const payload) {
+  uint8_t header[MAX_FRAME_HEADER_NBYTES];
+
+  // Write the frame header.
+  const size_t header_nbytes = write_frame_header(header, opcode, evbuffer_get_length(payload));
+  evbuffer_add(ws->out, header, header_nbytes);
 
   // Write the unmasked application data.
   evbuffer_add_buffer(ws->out, payload);
 
   // Flush the output buffer.
-  return websocket_flush_output(ws);
+  return queue_flush(ws);
 }
 
 
 static enum status
 send_frame_bytes(struct websocket *const ws, const enum websocket_opcode opcode, const void *const payload, const size_t nbytes) {
-  // Write the first two header bytes of the frame.
-  uint8_t prefix[2];
-  if (nbytes > UINT16_MAX) {
-    prefix[1] = 127;
-  }
-  else if (nbytes > 125) {
-    prefix[1] = 126;
-  }
-  else {
-    prefix[1] = nbytes;
-  }
-  prefix[0] = 0x80 | ((uint8_t)opcode);
-  evbuffer_add(ws->out, &prefix[0], 2);
+  uint8_t header[MAX_FRAME_HEADER_NBYTES];
 
-  // Write an extended payload length if it's needed.
-  if (nbytes > UINT16_MAX) {
-    uint64_t length = htobe64(nbytes);
-    evbuffer_add(ws->out, &length, 8);
-  }
-  else if (nbytes > 125) {
-    uint16_t length = htobe16(nbytes);
-    evbuffer_add(ws->out, &length, 2);
-  }
+  // Write the frame header.
+  const size_t header_nbytes = write_frame_header(header, opcode, nbytes);
+  evbuffer_add(ws->out, header, header_nbytes);
 
   // Write the unmasked application data.
   evbuffer_add(ws->out, payload, nbytes);
 
   // Flush the output buffer.
-  return websocket_flush_output(ws);
+  return queue_flush(ws);
+}
+
+
+static void
+on_frame_written(const void *const data, const size_t nbytes, void *const arg) {
+  (void)data;
+  (void)nbytes;
+  websocket_frame_release((struct websocket_frame *)arg);
 }
 
 
@@ -116,10 +221,10 @@ send_ping(struct websocket *const ws, struct evbuffer *const payload) {
 
 
 static enum status
-send_pong(struct websocket *const ws, struct evbuffer *const payload) {
+send_pong(struct websocket *const ws, const void *const payload, const size_t nbytes) {
   // "A Pong frame sent in response to a Ping frame must have identical "Application data" as
   // found in the message body of the Ping frame being replied to."
-  return send_frame(ws, WS_OPCODE_PONG, payload);
+  return send_frame_bytes(ws, WS_OPCODE_PONG, payload, nbytes);
 }
 
 
@@ -254,8 +359,9 @@ websocket_accept_http_request(struct websocket *const ws, struct http_response *
   }
 
   // The connection can now be upgraded to a websocket connection.
-  ws->in_state = WS_NEEDS_INITIAL;
-  bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
+  ws->in_state = WS_OPEN;
+  ws->in_needed_nbytes = 2;
+  bufferevent_setwatermark(ws->client->bev, EV_READ, ws->in_needed_nbytes, 0);
 
   // Setup a periodic PING event.
   ws->ping_event = event_new(ws->client->event_loop, ws->client->fd, EV_PERSIST, &on_timeout_sendping, ws);
@@ -270,251 +376,224 @@ websocket_accept_http_request(struct websocket *const ws, struct http_response *
 }
 
 
-static void
-consume_needs_initial(struct websocket *const ws, const uint8_t *const bytes, const size_t nbytes) {
-  assert(nbytes == 2);
-  ws->in_frame_is_final = (bytes[0] >> 7) & 0x01;
-  const uint8_t in_reserved = (bytes[0] >> 4) & 0x07;
-  ws->in_frame_opcode = bytes[0] & 0x0f;
-  const bool in_is_masked = (bytes[1] >> 7) & 0x01;
-  ws->in_frame_nbytes = bytes[1] & 0x7f;
-
-  // Validate the reserved bits and the masking flag.
-  // "MUST be 0 unless an extension is negotiated that defines meanings for non-zero values."
-  DEBUG("Received new frame header fin=%u reserved=%u opcode=%u is_masked=%u, length=%" PRIu64 "\n", ws->in_frame_is_final, in_reserved, ws->in_frame_opcode, in_is_masked, ws->in_frame_nbytes);
-  if (in_reserved != 0) {
-    ws->in_state = WS_CLOSED;
-    return;
-  }
-  // "All frames sent to the server have this bit set to 1."
-  if (!in_is_masked) {
-    ws->in_state = WS_CLOSED;
-    return;
-  }
+// "All control frames MUST have a payload length of 125 bytes or less and MUST NOT be fragmented."
+#define MAX_CONTROL_PAYLOAD_NBYTES (125)
+// A client's frame header, including the 64-bit extended payload length and the masking key.
+#define MAX_CLIENT_FRAME_HEADER_NBYTES (14)
+// The most payload chunks which are peeked at at once.
+#define MAX_PEEK_CHUNKS (8)
 
-  // Change state depending on how many more bytes of length data we need to read in.
-  if (ws->in_frame_nbytes == 126) {
-    ws->in_state = WS_NEEDS_LENGTH_16;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
-  }
-  else if (ws->in_frame_nbytes == 127) {
-    ws->in_state = WS_NEEDS_LENGTH_64;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 8, 8);
-  }
-  else {
-    ws->in_state = WS_NEEDS_MASKING_KEY;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 4, 4);
-  }
 
-  // Close the connection if required.
-  if (ws->in_frame_opcode == WS_OPCODE_CONNECTION_CLOSE) {
-    DEBUG("Closing client on fd=%d due to CLOSE opcode.\n", ws->client->fd);
-    ws->in_state = WS_CLOSED;
-    return;
+static void
+copy_unmasked(struct evbuffer *const in, const size_t offset, const size_t nbytes, const uint8_t *const masking_key, uint8_t *const dst) {
+  struct evbuffer_iovec chunks[MAX_PEEK_CHUNKS];
+  struct evbuffer_ptr ptr;
+  size_t ncopied = 0;
+
+  // Unmask the payload straight out of the input buffer's chunks, without first copying it out.
+  while (ncopied != nbytes) {
+    evbuffer_ptr_set(in, &ptr, offset + ncopied, EVBUFFER_PTR_SET);
+    int nchunks = evbuffer_peek(in, nbytes - ncopied, &ptr, chunks, MAX_PEEK_CHUNKS);
+    if (nchunks > MAX_PEEK_CHUNKS) {
+      nchunks = MAX_PEEK_CHUNKS;
+    }
+    assert(nchunks > 0);
+    for (int i = 0; i != nchunks && ncopied != nbytes; ++i) {
+      const size_t slice = (chunks[i].iov_len < nbytes - ncopied) ? chunks[i].iov_len : nbytes - ncopied;
+      unmask(dst + ncopied, chunks[i].iov_base, slice, masking_key, ncopied);
+      ncopied += slice;
+    }
   }
 }
 
 
 static void
-consume_needs_length_16(struct websocket *const ws, const uint8_t *const bytes, const size_t nbytes) {
-  // Update our length and fail the connection if the payload size is too large.
-  assert(nbytes == 2);
-  ws->in_frame_nbytes = ntohs(*((uint16_t *)bytes));
-  if (ws->in_frame_nbytes > MAX_PAYLOAD_LENGTH) {
-    ws->in_state = WS_CLOSED;
-    return;
-  }
+consume_control_frame(struct websocket *const ws, struct evbuffer *const in, const uint8_t opcode, const size_t header_nbytes, const size_t payload_nbytes, const uint8_t *const masking_key) {
+  uint8_t payload[MAX_CONTROL_PAYLOAD_NBYTES];
 
-  // Update our state.
-  ws->in_state = WS_NEEDS_MASKING_KEY;
-  bufferevent_setwatermark(ws->client->bev, EV_READ, 4, 4);
-}
+  switch (opcode) {
+  case WS_OPCODE_PING:
+    DEBUG("Received PING from fd=%d. Sending PONG.\n", ws->client->fd);
+    // "Upon receipt of a Ping frame, an endpoint MUST send a Pong frame in response, unless it
+    // already received a Close frame. It SHOULD respond with Pong frame as soon as is practical."
+    copy_unmasked(in, header_nbytes, payload_nbytes, masking_key, payload);
+    send_pong(ws, payload, payload_nbytes);
+    break;
 
+  case WS_OPCODE_PONG:
+    DEBUG("Received PONG from fd=%d. Doing nothing.\n", ws->client->fd);
+    // Don't do anything in response to receiving a pong frame.
+    break;
 
-static void
-consume_needs_length_64(struct websocket *const ws, const uint8_t *const bytes, const size_t nbytes) {
-  assert(nbytes == 8);
-  // Update our length and fail the connection if the payload size is too large.
-  ws->in_frame_nbytes = be64toh(*((uint64_t *)bytes));
-  if (ws->in_frame_nbytes > MAX_PAYLOAD_LENGTH) {
+  default:
+    // Close the connection since we received an unknown opcode.
+    ERROR("Unknown opcode %u\n", opcode);
     ws->in_state = WS_CLOSED;
-    return;
+    break;
   }
-
-  // Update our state.
-  ws->in_state = WS_NEEDS_MASKING_KEY;
-  bufferevent_setwatermark(ws->client->bev, EV_READ, 4, 4);
 }
 
 
 static void
-consume_needs_masking_key(struct websocket *const ws, const uint8_t *const bytes, const size_t nbytes) {
-  assert(nbytes == 4);
-  // Keep the masking key in network byte order as the de-masking algorithm requires network byte order.
-  ws->in_frame_masking_key = *((uint32_t *)bytes);
-
-  // Update our state.
-  ws->in_state = WS_NEEDS_PAYLOAD;
-  bufferevent_setwatermark(ws->client->bev, EV_READ, ws->in_frame_nbytes, ws->in_frame_nbytes);
-}
-
+consume_data_frame(struct websocket *const ws, struct evbuffer *const in, const uint8_t opcode, const bool is_final, const size_t header_nbytes, const size_t payload_nbytes, const uint8_t *const masking_key) {
+  struct evbuffer_iovec space;
 
-static void
-consume_needs_payload(struct websocket *const ws, const uint8_t *const bytes, const size_t nbytes) {
-  const uint8_t *upto;
-  uint32_t quad;
-  size_t slice, nbytes_remaining;
-  assert(nbytes == ws->in_frame_nbytes);
-
-  // Drain the unmasked frame buffer and reserve space for the new data.
-  evbuffer_drain(ws->in_frame_buffer, evbuffer_get_length(ws->in_frame_buffer));
-  evbuffer_expand(ws->in_frame_buffer, nbytes);
-
-  // Unmask the input data and copy it into the frame buffer.
-  nbytes_remaining = nbytes;
-  upto = bytes;
-  while (nbytes_remaining != 0) {
-    slice = (nbytes_remaining >= 4) ? 4 : nbytes_remaining;
-    memcpy(&quad, upto, slice);
-    quad ^= ws->in_frame_masking_key;
-    evbuffer_add(ws->in_frame_buffer, &quad, slice);
-    upto += slice;
-    nbytes_remaining -= slice;
-  }
-
-  // Update our state.
-  switch (ws->in_frame_opcode) {
+  switch (opcode) {
   case WS_OPCODE_CONTINUATION_FRAME:
-    DEBUG("Received CONTINUATION frame on fd=%d. is_final=%d\n", ws->client->fd, ws->in_frame_is_final);
+    DEBUG("Received CONTINUATION frame on fd=%d. is_final=%d\n", ws->client->fd, is_final);
     // Ensure we are expecting a continuation frame.
     if (!ws->in_message_is_continuing) {
       ERROR0("Unexpected continuation frame. Closing WebSocket connection.\n");
       ws->in_state = WS_CLOSED;
-      break;
-    }
-
-    // Copy the frame buffer into the message buffer.
-    evbuffer_remove_buffer(ws->in_frame_buffer, ws->in_message_buffer, evbuffer_get_length(ws->in_frame_buffer));
-    if (ws->in_frame_is_final) {
-      ws->in_message_is_continuing = false;
-      // Call the message callback.
-      ws->in_message_cb(ws);
-      // Drain the message buffer.
-      evbuffer_drain(ws->in_message_buffer, evbuffer_get_length(ws->in_message_buffer));
+      return;
     }
-
-    // Reset our state to waiting for a new frame.
-    ws->in_state = WS_NEEDS_INITIAL;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
     break;
 
   case WS_OPCODE_TEXT_FRAME:
-    DEBUG("Received TEXT frame on fd=%d. is_final=%d\n", ws->client->fd, ws->in_frame_is_final);
-    ws->in_message_is_binary = false;
-    if (ws->in_frame_is_final) {
-      ws->in_message_is_continuing = false;
-      // Move all data from the frame buffer into the message buffer.
-      evbuffer_add_buffer(ws->in_message_buffer, ws->in_frame_buffer);
-      // Call the message callback.
-      ws->in_message_cb(ws);
-      // Drain the message buffer.
-      evbuffer_drain(ws->in_message_buffer, evbuffer_get_length(ws->in_message_buffer));
-    }
-    else {
-      ws->in_message_is_continuing = true;
-      // Copy the frame buffer into the message buffer.
-      evbuffer_remove_buffer(ws->in_frame_buffer, ws->in_message_buffer, evbuffer_get_length(ws->in_frame_buffer));
-    }
-
-    // Reset our state to waiting for a new frame.
-    ws->in_state = WS_NEEDS_INITIAL;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
-    break;
-
   case WS_OPCODE_BINARY_FRAME:
-    DEBUG("Received BINARY frame on fd=%d. is_final=%d\n", ws->client->fd, ws->in_frame_is_final);
-    ws->in_message_is_binary = true;
-    if (ws->in_frame_is_final) {
-      ws->in_message_is_continuing = false;
-      // Move all data from the frame buffer into the message buffer.
-      evbuffer_add_buffer(ws->in_frame_buffer, ws->in_message_buffer);
-      // Call the message callback.
-      ws->in_message_cb(ws);
-      // Drain the message buffer.
-      evbuffer_drain(ws->in_message_buffer, evbuffer_get_length(ws->in_message_buffer));
-    }
-    else {
-      ws->in_message_is_continuing = true;
-      // Copy the frame buffer into the message buffer.
-      evbuffer_remove_buffer(ws->in_frame_buffer, ws->in_message_buffer, evbuffer_get_length(ws->in_frame_buffer));
-    }
-
-    // Reset our state to waiting for a new frame.
-    ws->in_state = WS_NEEDS_INITIAL;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
+    DEBUG("Received %s frame on fd=%d. is_final=%d\n", (opcode == WS_OPCODE_TEXT_FRAME) ? "TEXT" : "BINARY", ws->client->fd, is_final);
+    ws->in_message_is_binary = (opcode == WS_OPCODE_BINARY_FRAME);
     break;
 
-  case WS_OPCODE_CONNECTION_CLOSE:
-    DEBUG("Closing client on fd=%d due to CLOSE opcode.\n", ws->client->fd);
-    // Close the connection.
+  default:
+    // Close the connection since we received an unknown opcode.
+    ERROR("Unknown opcode %u\n", opcode);
     ws->in_state = WS_CLOSED;
-    break;
-
-  case WS_OPCODE_PING:
-    DEBUG("Received PING from fd=%d. Sending PONG.\n", ws->client->fd);
-    // "Upon receipt of a Ping frame, an endpoint MUST send a Pong frame in response, unless it
-    // already received a Close frame. It SHOULD respond with Pong frame as soon as is practical."
-    send_pong(ws, ws->in_frame_buffer);
+    return;
+  }
 
-    // Reset our state to waiting for a new frame.
-    ws->in_state = WS_NEEDS_INITIAL;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
-    break;
+  // Fail the connection if the fragmented message is too large.
+  if (evbuffer_get_length(ws->in_message_buffer) + payload_nbytes > MAX_PAYLOAD_LENGTH) {
+    WARNING("Message on fd=%d is too large. Closing WebSocket connection.\n", ws->client->fd);
+    ws->in_state = WS_CLOSED;
+    return;
+  }
 
-  case WS_OPCODE_PONG:
-    DEBUG("Received PONG from fd=%d. Doing nothing.\n", ws->client->fd);
-    // Don't do anything in response to receiving a pong frame.
-    // Reset our state to waiting for a new frame.
-    ws->in_state = WS_NEEDS_INITIAL;
-    bufferevent_setwatermark(ws->client->bev, EV_READ, 2, 2);
-    break;
+  // Unmask the payload directly into contiguous space at the end of the message buffer.
+  if (payload_nbytes != 0) {
+    if (evbuffer_reserve_space(ws->in_message_buffer, payload_nbytes, &space, 1) != 1) {
+      ERROR0("`evbuffer_reserve_space` failed. Closing WebSocket connection.\n");
+      ws->in_state = WS_CLOSED;
+      return;
+    }
+    copy_unmasked(in, header_nbytes, payload_nbytes, masking_key, space.iov_base);
+    space.iov_len = payload_nbytes;
+    evbuffer_commit_space(ws->in_message_buffer, &space, 1);
+  }
 
-  default:
-    // Close the connection since we received an unknown opcode.
-    ERROR("Unknown opcode %u\n", ws->in_frame_opcode);
-    ws->in_state = WS_CLOSED;
-    break;
+  ws->in_message_is_continuing = !is_final;
+  if (is_final) {
+    // Call the message callback.
+    ws->in_message_cb(ws);
+    // Drain the message buffer.
+    evbuffer_drain(ws->in_message_buffer, evbuffer_get_length(ws->in_message_buffer));
   }
 }
 
 
+/**
+ * Consumes every complete frame in `in`, draining each one once it has been handled. A trailing
+ * partial frame is left in `in`, and the read low watermark is raised to the size of the frame so
+ * that libevent only calls back again once all of it has arrived.
+ **/
 enum status
-websocket_consume(struct websocket *const ws, const uint8_t *const bytes, const size_t nbytes) {
-  switch (ws->in_state) {
-  case WS_NEEDS_INITIAL:
-    consume_needs_initial(ws, bytes, nbytes);
-    break;
+websocket_consume(struct websocket *const ws, struct evbuffer *const in) {
+  uint8_t header[MAX_CLIENT_FRAME_HEADER_NBYTES];
+  size_t nbytes, needed_nbytes = 2;
+
+  while (ws->in_state == WS_OPEN && (nbytes = evbuffer_get_length(in)) >= needed_nbytes) {
+    // Peek at as much of the frame header as has arrived.
+    const size_t header_peek_nbytes = (nbytes < sizeof(header)) ? nbytes : sizeof(header);
+    if (evbuffer_copyout(in, header, header_peek_nbytes) != (ev_ssize_t)header_peek_nbytes) {
+      ERROR0("`evbuffer_copyout` failed.\n");
+      ws->in_state = WS_CLOSED;
+      return STATUS_BAD;
+    }
 
-  case WS_NEEDS_LENGTH_16:
-    consume_needs_length_16(ws, bytes, nbytes);
-    break;
+    const bool is_final = (header[0] >> 7) & 0x01;
+    const uint8_t reserved = (header[0] >> 4) & 0x07;
+    const uint8_t opcode = header[0] & 0x0f;
+    const bool is_masked = (header[1] >> 7) & 0x01;
+    uint64_t payload_nbytes = header[1] & 0x7f;
 
-  case WS_NEEDS_LENGTH_64:
-    consume_needs_length_64(ws, bytes, nbytes);
-    break;
+    // Validate the reserved bits and the masking flag.
+    // "MUST be 0 unless an extension is negotiated that defines meanings for non-zero values."
+    DEBUG("Received new frame header fin=%u reserved=%u opcode=%u is_masked=%u, length=%" PRIu64 "\n", is_final, reserved, opcode, is_masked, payload_nbytes);
+    if (reserved != 0) {
+      ws->in_state = WS_CLOSED;
+      break;
+    }
+    // "All frames sent to the server have this bit set to 1."
+    if (!is_masked) {
+      ws->in_state = WS_CLOSED;
+      break;
+    }
+    // Close the connection if required.
+    if (opcode == WS_OPCODE_CONNECTION_CLOSE) {
+      DEBUG("Closing client on fd=%d due to CLOSE opcode.\n", ws->client->fd);
+      ws->in_state = WS_CLOSED;
+      break;
+    }
 
-  case WS_NEEDS_MASKING_KEY:
-    consume_needs_masking_key(ws, bytes, nbytes);
-    break;
+    // Wait for the rest of the header if it hasn't all arrived yet.
+    size_t header_nbytes = 2 + 4;
+    if (payload_nbytes == 126) {
+      header_nbytes += 2;
+    }
+    else if (payload_nbytes == 127) {
+      header_nbytes += 8;
+    }
+    if (nbytes < header_nbytes) {
+      needed_nbytes = header_nbytes;
+      break;
+    }
 
-  case WS_NEEDS_PAYLOAD:
-    consume_needs_payload(ws, bytes, nbytes);
-    break;
+    // Read the extended payload length and fail the connection if the payload size is too large.
+    if (payload_nbytes == 126) {
+      uint16_t length;
+      memcpy(&length, &header[2], 2);
+      payload_nbytes = be16toh(length);
+    }
+    else if (payload_nbytes == 127) {
+      uint64_t length;
+      memcpy(&length, &header[2], 8);
+      payload_nbytes = be64toh(length);
+    }
+    if (payload_nbytes > MAX_PAYLOAD_LENGTH) {
+      ws->in_state = WS_CLOSED;
+      break;
+    }
+    // Control frames are never fragmented, so they are checked here where they're told apart.
+    const bool is_control = (opcode & 0x08) != 0;
+    if (is_control && (!is_final || payload_nbytes > MAX_CONTROL_PAYLOAD_NBYTES)) {
+      WARNING("Invalid control frame on fd=%d. Closing WebSocket connection.\n", ws->client->fd);
+      ws->in_state = WS_CLOSED;
+      break;
+    }
 
-  default:
-    ERROR("Unknown websocket state %d\n", ws->in_state);
-    ws->in_state = WS_CLOSED;
-    break;
+    // Wait for the rest of the payload if it hasn't all arrived yet.
+    const size_t frame_nbytes = header_nbytes + payload_nbytes;
+    if (nbytes < frame_nbytes) {
+      needed_nbytes = frame_nbytes;
+      break;
+    }
+
+    // The masking key is the last 4 bytes of the header.
+    const uint8_t *const masking_key = &header[header_nbytes - 4];
+    if (is_control) {
+      consume_control_frame(ws, in, opcode, header_nbytes, payload_nbytes, masking_key);
+    }
+    else {
+      consume_data_frame(ws, in, opcode, is_final, header_nbytes, payload_nbytes, masking_key);
+    }
+    evbuffer_drain(in, frame_nbytes);
+    needed_nbytes = 2;
+  }
+
+  // Only wake up again once the next frame, or the next part of its header, has fully arrived.
+  if (ws->in_state == WS_OPEN && needed_nbytes != ws->in_needed_nbytes) {
+    bufferevent_setwatermark(ws->client->bev, EV_READ, needed_nbytes, 0);
+    ws->in_needed_nbytes = needed_nbytes;
   }
 
   return STATUS_OK;
@@ -533,16 +612,16 @@ websocket_init(struct client_connection *const client, websocket_message_callbac
   }
 
   memset(ws, 0, sizeof(struct websocket));
+  ws->id = atomic_fetch_add(&next_id, 1);
   ws->client = client;
   ws->out = evbuffer_new();
   ws->in_state = WS_NEEDS_HTTP_UPGRADE;
-  ws->in_frame_buffer = evbuffer_new();
   ws->in_message_buffer = evbuffer_new();
   ws->in_message_cb = in_message_cb;
   ws->ping_frame = evbuffer_new();
 
   // Configure the buffers.
-  if (ws->out == NULL || ws->in_frame_buffer == NULL || ws->in_message_buffer == NULL || ws->ping_frame == NULL) {
+  if (ws->out == NULL || ws->in_message_buffer == NULL || ws->ping_frame == NULL) {
     websocket_destroy(ws);
     return NULL;
   }
@@ -557,6 +636,7 @@ websocket_destroy(struct websocket *const ws) {
     return STATUS_EINVAL;
   }
 
+  dirty_list_remove(ws);
   if (ws->ping_event != NULL) {
     event_del(ws->ping_event);
     event_free(ws->ping_event);
@@ -564,9 +644,6 @@ websocket_destroy(struct websocket *const ws) {
   if (ws->out != NULL) {
     evbuffer_free(ws->out);
   }
-  if (ws->in_frame_buffer != NULL) {
-    evbuffer_free(ws->in_frame_buffer);
-  }
   if (ws->in_message_buffer != NULL) {
     evbuffer_free(ws->in_message_buffer);
   }
@@ -628,3 +705,127 @@ websocket_send_text_bytes(struct websocket *const ws, const void *const payload,
   }
   return send_frame_bytes(ws, WS_OPCODE_TEXT_FRAME, payload, nbytes);
 }
+
+
+/**
+ * Encodes a complete, unmasked text frame for the payload once so that it can be sent to any
+ * number of websockets without copying. The payload buffer is left untouched. The frame is
+ * reference counted and the caller owns the initial reference. Frames are not thread-safe and must
+ * only be used on the event loop which created them.
+ **/
+struct websocket_frame *
+websocket_frame_create_text(struct evbuffer *const payload) {
+  uint8_t header[MAX_FRAME_HEADER_NBYTES];
+
+  if (payload == NULL) {
+    return NULL;
+  }
+
+  const size_t payload_nbytes = evbuffer_get_length(payload);
+  const size_t header_nbytes = write_frame_header(header, WS_OPCODE_TEXT_FRAME, payload_nbytes);
+  struct websocket_frame *const frame = malloc(sizeof(struct websocket_frame) + header_nbytes + payload_nbytes);
+  if (frame == NULL) {
+    return NULL;
+  }
+  frame->refcount = 1;
+  frame->nbytes = header_nbytes + payload_nbytes;
+  memcpy(frame->bytes, header, header_nbytes);
+  if (evbuffer_copyout(payload, frame->bytes + header_nbytes, payload_nbytes) != (ev_ssize_t)payload_nbytes) {
+    free(frame);
+    return NULL;
+  }
+
+  return frame;
+}
+
+
+size_t
+websocket_frame_nbytes(const struct websocket_frame *const frame) {
+  return frame->nbytes;
+}
+
+
+void
+websocket_frame_release(struct websocket_frame *const frame) {
+  if (frame != NULL && --frame->refcount == 0) {
+    free(frame);
+  }
+}
+
+
+void
+websocket_frame_retain(struct websocket_frame *const frame) {
+  ++frame->refcount;
+}
+
+
+/**
+ * Queues a reference to the shared frame on the websocket. The frame's memory is only released
+ * once every websocket it was sent to has written it out (or been destroyed).
+ **/
+enum status
+websocket_send_frame(struct websocket *const ws, struct websocket_frame *const frame) {
+  if (ws == NULL || frame == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  ++frame->refcount;
+  if (evbuffer_add_reference(ws->out, frame->bytes, frame->nbytes, &on_frame_written, frame) == -1) {
+    --frame->refcount;
+    return STATUS_BAD;
+  }
+
+  return queue_flush(ws);
+}
+
+
+/**
+ * Creates a flusher for the websockets on an event loop. With a NULL window, websockets are flushed
+ * at the end of the event loop iteration in which their frames were queued. Otherwise frames are
+ * batched up for the window before being flushed, trading latency for fewer writes.
+ **/
+struct websocket_flusher *
+websocket_flusher_create(struct event_base *const event_base, const struct timeval *const window) {
+  if (event_base == NULL) {
+    return NULL;
+  }
+
+  struct websocket_flusher *const flusher = malloc(sizeof(struct websocket_flusher));
+  if (flusher == NULL) {
+    return NULL;
+  }
+  memset(flusher, 0, sizeof(struct websocket_flusher));
+  if (window != NULL) {
+    flusher->has_window = true;
+    flusher->window = *window;
+  }
+  flusher->flush_event = event_new(event_base, -1, 0, &on_flush, flusher);
+  if (flusher->flush_event == NULL) {
+    free(flusher);
+    return NULL;
+  }
+
+  return flusher;
+}
+
+
+enum status
+websocket_flusher_destroy(struct websocket_flusher *const flusher) {
+  if (flusher == NULL) {
+    return STATUS_EINVAL;
+  }
+
+  // Flush anything which is still pending.
+  on_flush(-1, 0, flusher);
+  event_free(flusher->flush_event);
+  free(flusher);
+
+  return STATUS_OK;
+}
+
+
+void
+websocket_flusher_get_stats(const struct websocket_flusher *const flusher, uint64_t *const nframes, uint64_t *const nflushes) {
+  *nframes = flusher->nframes;
+  *nflushes = flusher->nflushes;
+}
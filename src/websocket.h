@@ -19,7 +19,10 @@
 struct client_connection;
 struct http_request;
 struct http_response;
+struct subscription;
 struct websocket;
+struct websocket_flusher;
+struct websocket_frame;
 
 
 typedef void (*websocket_message_callback)(struct websocket *ws);
@@ -27,11 +30,7 @@ typedef void (*websocket_message_callback)(struct websocket *ws);
 enum websocket_state {
   WS_CLOSED,
   WS_NEEDS_HTTP_UPGRADE,
-  WS_NEEDS_INITIAL,
-  WS_NEEDS_LENGTH_16,
-  WS_NEEDS_LENGTH_64,
-  WS_NEEDS_MASKING_KEY,
-  WS_NEEDS_PAYLOAD,
+  WS_OPEN,
 };
 
 
@@ -45,28 +44,44 @@ struct websocket {
 
   // Input processing state.
   enum websocket_state in_state;  // The state of the websocket input processing.
-  uint8_t in_frame_is_final;
-  uint8_t in_frame_opcode;
   uint8_t in_message_is_binary;
   uint8_t in_message_is_continuing;
-  uint32_t in_frame_masking_key;
-  uint64_t in_frame_nbytes;
-  struct evbuffer *in_frame_buffer;    // The libevent unmasked input buffer for the current frame.
+  size_t in_needed_nbytes;             // The read low watermark, i.e. the size of the next frame once its header has arrived.
   struct evbuffer *in_message_buffer;  // The libevent unmasked input buffer for the current message.
   websocket_message_callback in_message_cb;
 
   // PING state.
   uint32_t ping_count;
   struct evbuffer *ping_frame;
+
+  // Output coalescing state. Linked into the flusher's dirty list while `out` has unflushed frames.
+  struct websocket *dirty_next;
+  struct websocket **dirty_pprev;
+
+  // The websocket's channel subscriptions. Owned and maintained by the pubsub manager.
+  struct subscription *subscriptions;
+
+  // Unique within the process, unlike the websocket's address, which may be reused.
+  uint64_t id;
 };
 
 
 struct websocket *websocket_init(struct client_connection *client, websocket_message_callback in_message_cb);
 enum status       websocket_destroy(struct websocket *ws);
 enum status       websocket_accept_http_request(struct websocket *ws, struct http_response *response, const struct http_request *req);
-enum status       websocket_consume(struct websocket *ws, const uint8_t *bytes, size_t nbytes);
+enum status       websocket_consume(struct websocket *ws, struct evbuffer *in);
 enum status       websocket_flush_output(struct websocket *ws);
 enum status       websocket_send_binary(struct websocket *ws, struct evbuffer *payload);
 enum status       websocket_send_binary_bytes(struct websocket *ws, const void *payload, size_t nbytes);
 enum status       websocket_send_text(struct websocket *ws, struct evbuffer *payload);
 enum status       websocket_send_text_bytes(struct websocket *ws, const void *payload, size_t nbytes);
+enum status       websocket_send_frame(struct websocket *ws, struct websocket_frame *frame);
+
+struct websocket_frame *websocket_frame_create_text(struct evbuffer *payload);
+size_t                  websocket_frame_nbytes(const struct websocket_frame *frame);
+void                    websocket_frame_release(struct websocket_frame *frame);
+void                    websocket_frame_retain(struct websocket_frame *frame);
+
+struct websocket_flusher *websocket_flusher_create(struct event_base *event_base, const struct timeval *window);
+enum status               websocket_flusher_destroy(struct websocket_flusher *flusher);
+void                      websocket_flusher_get_stats(const struct websocket_flusher *flusher, uint64_t *nframes, uint64_t *nflushes);